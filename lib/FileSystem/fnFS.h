@@ -19,6 +19,7 @@ enum fsType
     FSTYPE_SPIFFS = 0,
     FSTYPE_SDFAT,
     FSTYPE_TNFS,
+    FSTYPE_HTTP,
     FSTYPE_COUNT
 };
 
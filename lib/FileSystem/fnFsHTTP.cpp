@@ -0,0 +1,513 @@
+#include <cstring>
+#include <errno.h>
+#include <esp_heap_caps.h>
+
+#include "fnFsHTTP.h"
+#include "fnFsHTTPvfs.h"
+#include "../hardware/fnSystem.h"
+#include "../../include/debug.h"
+
+FileSystemHTTP::FileSystemHTTP()
+{
+}
+
+FileSystemHTTP::~FileSystemHTTP()
+{
+    if (_basepath[0] != '\0')
+        vfs_http_unregister(_basepath);
+
+    if (_block_data != nullptr)
+        free(_block_data);
+    if (_staging != nullptr)
+        free(_staging);
+}
+
+/*
+ Starts a mount of the server at baseurl ("http://host[:port][/path]" or "https://...").
+ Paths we're given are added to the end of it.
+*/
+bool FileSystemHTTP::start(const char *baseurl)
+{
+    if (_started)
+        return false;
+
+    if (baseurl == nullptr || (strncasecmp(baseurl, "http://", 7) != 0 && strncasecmp(baseurl, "https://", 8) != 0))
+        return false;
+
+    _baseurl = baseurl;
+    while (_baseurl.length() > 0 && _baseurl.back() == '/')
+        _baseurl.pop_back();
+
+    _block_data = (uint8_t *)heap_caps_malloc(HTTPFS_CACHE_BLOCKS * HTTPFS_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _staging = (uint8_t *)heap_caps_malloc(HTTPFS_READAHEAD_BLOCKS * HTTPFS_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_block_data == nullptr || _staging == nullptr)
+    {
+        Debug_println("FileSystemHTTP failed to allocate block cache");
+        return false;
+    }
+
+    // Register a new VFS driver to handle this mount
+    if (vfs_http_register(this, _basepath, sizeof(_basepath)) != 0)
+    {
+        Debug_println("Failed to register VFS driver!");
+        return false;
+    }
+
+    Debug_printf("HTTP mount \"%s\" (%u byte blocks, %u cached)\n", _baseurl.c_str(), HTTPFS_BLOCK_SIZE, HTTPFS_CACHE_BLOCKS);
+
+    _started = true;
+
+    return true;
+}
+
+FILE * FileSystemHTTP::file_open(const char* path, const char* mode)
+{
+    if (!_started || path == nullptr)
+        return nullptr;
+
+    char * fpath = _make_fullpath(path);
+    FILE * result = fopen(fpath, mode);
+    free(fpath);
+    return result;
+}
+
+bool FileSystemHTTP::exists(const char* path)
+{
+    uint32_t filesize;
+    return stat_file(path, &filesize) == 0;
+}
+
+/*
+ Requests length bytes of path starting at offset and stores them in dest.
+ The file's total size and ETag are stored in filesize and etag if they're given.
+ Returns the number of bytes read, or -1 (with errno set) on failure.
+*/
+int FileSystemHTTP::_fetch(const char *path, uint32_t offset, uint32_t length, uint8_t *dest, uint32_t *filesize, std::string *etag)
+{
+    const char *headers[] = {"ETag", "Content-Range"};
+
+    std::string url = _baseurl + (path[0] == '/' ? "" : "/") + path;
+    if (url != _client_url)
+    {
+        if (_client.begin(url) == false)
+        {
+            _client_url.clear();
+            errno = EIO;
+            return -1;
+        }
+        _client_url = url;
+    }
+
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%u-%u", offset, offset + length - 1);
+    _client.collect_headers(headers, 2);
+    _client.set_header("Range", range);
+
+    int status = _client.GET();
+    _stats.requests++;
+
+    // Content-Range looks like "bytes 0-4095/92160" (or "bytes */92160" for a 416)
+    uint32_t total = 0;
+    std::string content_range = _client.get_header("Content-Range");
+    size_t slash = content_range.find('/');
+    if (slash != std::string::npos && content_range[slash + 1] != '*')
+        total = strtoul(content_range.c_str() + slash + 1, nullptr, 10);
+
+    uint32_t skip = 0;
+    switch (status)
+    {
+    case 206:
+        break;
+    case 200:
+        // The server ignored our Range, so we get the whole file and have to skip to the part we want
+        Debug_printf("HTTPFS server doesn't support ranges for \"%s\"\n", path);
+        total = _client.available();
+        skip = offset;
+        break;
+    case 416:
+        // Nothing at that offset
+        if (filesize != nullptr)
+            *filesize = total;
+        errno = 0;
+        return 0;
+    default:
+        Debug_printf("HTTPFS request for \"%s\" failed with status %d\n", path, status);
+        _client.close();
+        errno = (status == 404 || status == 410) ? ENOENT : EIO;
+        return -1;
+    }
+
+    if (filesize != nullptr)
+        *filesize = total;
+    if (etag != nullptr)
+        *etag = _client.get_header("ETag");
+
+    while (skip > 0)
+    {
+        int chunk = skip > length ? length : skip;
+        if (_client.read(dest, chunk) != chunk)
+        {
+            _client.close();
+            errno = EIO;
+            return -1;
+        }
+        skip -= chunk;
+    }
+
+    int wanted = _client.available();
+    if (status == 200 || wanted > (int)length)
+        wanted = length;
+
+    int result = wanted > 0 ? _client.read(dest, wanted) : 0;
+
+    // Don't leave the rest of a whole-file response waiting on the connection
+    if (status == 200)
+        _client.close();
+
+    if (result < 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    _stats.bytes_fetched += result;
+    errno = 0;
+    return result;
+}
+
+// Returns the cache ID for path, recycling the least recently used closed file if needed
+int FileSystemHTTP::_cache_file(const char *path)
+{
+    int free_slot = HTTPFS_NO_FILE;
+    for (int i = 0; i < HTTPFS_CACHE_FILES; i++)
+    {
+        if (_files[i].in_use == false)
+        {
+            if (free_slot == HTTPFS_NO_FILE)
+                free_slot = i;
+        }
+        else if (_files[i].path == path)
+            return i;
+    }
+
+    if (free_slot == HTTPFS_NO_FILE)
+    {
+        for (int i = 0; i < HTTPFS_CACHE_FILES; i++)
+        {
+            if (_files[i].open_count == 0 &&
+                (free_slot == HTTPFS_NO_FILE || _files[i].last_used < _files[free_slot].last_used))
+                free_slot = i;
+        }
+        if (free_slot == HTTPFS_NO_FILE)
+            return HTTPFS_NO_FILE;
+        _drop_file_blocks(free_slot);
+    }
+
+    _files[free_slot] = httpFsCacheFile();
+    _files[free_slot].in_use = true;
+    _files[free_slot].path = path;
+    return free_slot;
+}
+
+void FileSystemHTTP::_drop_file_blocks(int file_id)
+{
+    for (int i = 0; i < HTTPFS_CACHE_BLOCKS; i++)
+        if (_blocks[i].file_id == file_id)
+            _blocks[i] = httpFsCacheBlock();
+}
+
+int FileSystemHTTP::_find_block(int file_id, uint32_t offset)
+{
+    for (int i = 0; i < HTTPFS_CACHE_BLOCKS; i++)
+        if (_blocks[i].file_id == file_id && _blocks[i].offset == offset)
+            return i;
+    return -1;
+}
+
+// Stores a block, replacing any existing copy or the least recently used block
+void FileSystemHTTP::_put_block(int file_id, uint32_t offset, const uint8_t *src, uint16_t length)
+{
+    int slot = _find_block(file_id, offset);
+    if (slot < 0)
+    {
+        for (int i = 0; i < HTTPFS_CACHE_BLOCKS; i++)
+        {
+            if (_blocks[i].file_id == HTTPFS_NO_FILE)
+            {
+                slot = i;
+                break;
+            }
+            if (slot < 0 || _blocks[i].last_used < _blocks[slot].last_used)
+                slot = i;
+        }
+    }
+
+    _blocks[slot].file_id = file_id;
+    _blocks[slot].offset = offset;
+    _blocks[slot].length = length;
+    _blocks[slot].last_used = ++_clock;
+    memcpy(_block_data + slot * HTTPFS_BLOCK_SIZE, src, length);
+}
+
+/*
+ Requests the block at offset, plus the few after it if the handle has been reading sequentially.
+ Returns TRUE if an error condition occurred.
+*/
+bool FileSystemHTTP::_load_blocks(httpFsHandle &h, uint32_t offset)
+{
+    httpFsCacheFile &f = _files[h.file_id];
+
+    if (h.last_miss != UINT32_MAX && offset == h.last_miss + HTTPFS_BLOCK_SIZE)
+    {
+        if (h.sequential < UINT8_MAX)
+            h.sequential++;
+    }
+    else
+        h.sequential = 0;
+    h.last_miss = offset;
+
+    uint32_t length = HTTPFS_BLOCK_SIZE;
+    if (h.sequential >= HTTPFS_READAHEAD_TRIGGER)
+        length = HTTPFS_READAHEAD_BLOCKS * HTTPFS_BLOCK_SIZE;
+    if (offset + length > f.filesize)
+        length = f.filesize - offset;
+
+    std::string etag;
+    unsigned long ms_start = fnSystem.millis();
+    int result = _fetch(f.path.c_str(), offset, length, _staging, nullptr, &etag);
+    if (result <= 0)
+        return true;
+
+    h.requests++;
+    h.bytes_fetched += result;
+    h.fetch_ms += fnSystem.millis() - ms_start;
+
+    // The file changed under us, so nothing else we hold for it can be trusted
+    if (etag.empty() == false && etag != f.etag)
+    {
+        Debug_printf("HTTPFS \"%s\" changed on server - dropping cached blocks\n", f.path.c_str());
+        _drop_file_blocks(h.file_id);
+        f.etag = etag;
+        _stats.revalidations++;
+    }
+
+    for (int i = 0; i < result; i += HTTPFS_BLOCK_SIZE)
+        _put_block(h.file_id, offset + i, _staging + i, (result - i) > HTTPFS_BLOCK_SIZE ? HTTPFS_BLOCK_SIZE : result - i);
+
+    if (result > HTTPFS_BLOCK_SIZE)
+        _stats.readahead_blocks += (result - 1) / HTTPFS_BLOCK_SIZE;
+
+    return false;
+}
+
+/*
+ Opens path for reading. The first block is requested right away, which gets us the file's
+ size and ETag; cached blocks from an earlier open are kept only if those haven't changed.
+*/
+int FileSystemHTTP::open_file(const char *path)
+{
+    int fd;
+    for (fd = 0; fd < HTTPFS_MAX_OPEN_FILES; fd++)
+        if (_handles[fd].file_id == HTTPFS_NO_FILE)
+            break;
+
+    if (fd == HTTPFS_MAX_OPEN_FILES)
+    {
+        errno = ENFILE;
+        return -1;
+    }
+
+    int file_id = _cache_file(path);
+    if (file_id == HTTPFS_NO_FILE)
+    {
+        errno = ENFILE;
+        return -1;
+    }
+
+    uint32_t filesize = 0;
+    std::string etag;
+    unsigned long ms_start = fnSystem.millis();
+    int result = _fetch(path, 0, HTTPFS_BLOCK_SIZE, _staging, &filesize, &etag);
+    if (result < 0)
+        return -1;
+
+    httpFsCacheFile &f = _files[file_id];
+    if (f.last_used != 0 && (f.etag != etag || f.filesize != filesize))
+    {
+        Debug_printf("HTTPFS \"%s\" changed on server - dropping cached blocks\n", path);
+        _drop_file_blocks(file_id);
+        _stats.revalidations++;
+    }
+    f.etag = etag;
+    f.filesize = filesize;
+    f.open_count++;
+    f.last_used = ++_clock;
+
+    if (result > 0)
+        _put_block(file_id, 0, _staging, result);
+
+    httpFsHandle &h = _handles[fd];
+    h = httpFsHandle();
+    h.file_id = file_id;
+    h.opened_ms = ms_start;
+    h.requests = 1;
+    h.bytes_fetched = result;
+    h.fetch_ms = fnSystem.millis() - ms_start;
+
+    Debug_printf("HTTPFS opened \"%s\" (%u bytes, ETag %s)\n", path, filesize, etag.empty() ? "none" : etag.c_str());
+
+    errno = 0;
+    return fd;
+}
+
+int FileSystemHTTP::close_file(int fd)
+{
+    if (fd < 0 || fd >= HTTPFS_MAX_OPEN_FILES || _handles[fd].file_id == HTTPFS_NO_FILE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    httpFsHandle &h = _handles[fd];
+    httpFsCacheFile &f = _files[h.file_id];
+
+#ifdef DEBUG
+    // Compare with what downloading the whole image would have cost at the rate we saw
+    uint32_t full_ms = h.bytes_fetched > 0 ? (uint32_t)((uint64_t)f.filesize * h.fetch_ms / h.bytes_fetched) : 0;
+    Debug_printf("HTTPFS closed \"%s\": fetched %u of %u bytes in %u requests (%u ms), whole file ~%u ms; open %lu ms\n",
+                 f.path.c_str(), h.bytes_fetched, f.filesize, h.requests, h.fetch_ms, full_ms, fnSystem.millis() - h.opened_ms);
+    Debug_printf("HTTPFS cache: %u hits, %u misses, %u read-ahead blocks, %u revalidations\n",
+                 _stats.hits, _stats.misses, _stats.readahead_blocks, _stats.revalidations);
+#endif
+
+    if (f.open_count > 0)
+        f.open_count--;
+    h = httpFsHandle();
+
+    errno = 0;
+    return 0;
+}
+
+int FileSystemHTTP::read_file(int fd, uint8_t *dest, uint32_t size)
+{
+    if (fd < 0 || fd >= HTTPFS_MAX_OPEN_FILES || _handles[fd].file_id == HTTPFS_NO_FILE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    httpFsHandle &h = _handles[fd];
+    httpFsCacheFile &f = _files[h.file_id];
+
+    if (h.position >= f.filesize)
+        return 0;
+    if (size > f.filesize - h.position)
+        size = f.filesize - h.position;
+
+    uint32_t copied = 0;
+    while (copied < size)
+    {
+        uint32_t block_offset = h.position - (h.position % HTTPFS_BLOCK_SIZE);
+
+        int i = _find_block(h.file_id, block_offset);
+        if (i < 0)
+        {
+            _stats.misses++;
+            if (_load_blocks(h, block_offset) || (i = _find_block(h.file_id, block_offset)) < 0)
+            {
+                if (copied > 0)
+                    break;
+                errno = EIO;
+                return -1;
+            }
+        }
+        else
+            _stats.hits++;
+
+        uint32_t in_block = h.position - block_offset;
+        if (in_block >= _blocks[i].length)
+            break; // Server gave us less than it said it had
+
+        uint32_t count = _blocks[i].length - in_block;
+        if (count > size - copied)
+            count = size - copied;
+
+        memcpy(dest + copied, _block_data + i * HTTPFS_BLOCK_SIZE + in_block, count);
+        _blocks[i].last_used = ++_clock;
+        copied += count;
+        h.position += count;
+    }
+
+    errno = 0;
+    return copied;
+}
+
+int FileSystemHTTP::seek_file(int fd, int32_t offset, int whence)
+{
+    if (fd < 0 || fd >= HTTPFS_MAX_OPEN_FILES || _handles[fd].file_id == HTTPFS_NO_FILE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    httpFsHandle &h = _handles[fd];
+    int64_t position;
+    switch (whence)
+    {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = (int64_t)h.position + offset;
+        break;
+    case SEEK_END:
+        position = (int64_t)_files[h.file_id].filesize + offset;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (position < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    h.position = position;
+    errno = 0;
+    return h.position;
+}
+
+// Gets the size of path, without a request if we have it open
+int FileSystemHTTP::stat_file(const char *path, uint32_t *filesize)
+{
+    for (int i = 0; i < HTTPFS_CACHE_FILES; i++)
+    {
+        if (_files[i].in_use && _files[i].open_count > 0 && _files[i].path == path)
+        {
+            *filesize = _files[i].filesize;
+            errno = 0;
+            return 0;
+        }
+    }
+
+    // Ask for a single byte, which gets us the size
+    if (_fetch(path, 0, 1, _staging, filesize, nullptr) < 0)
+        return -1;
+
+    return 0;
+}
+
+int FileSystemHTTP::stat_handle(int fd, uint32_t *filesize)
+{
+    if (fd < 0 || fd >= HTTPFS_MAX_OPEN_FILES || _handles[fd].file_id == HTTPFS_NO_FILE)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    *filesize = _files[_handles[fd].file_id].filesize;
+    errno = 0;
+    return 0;
+}
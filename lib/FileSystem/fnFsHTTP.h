@@ -0,0 +1,128 @@
+#ifndef _FN_FSHTTP_
+#define _FN_FSHTTP_
+
+#include <string>
+
+#include "fnFS.h"
+#include "../http/fnHttpClient.h"
+
+#define HTTPFS_BLOCK_SIZE 4096 // Size of the aligned ranges we request and cache
+#define HTTPFS_CACHE_BLOCKS 32 // Blocks (128KB) kept in PSRAM per mount
+#define HTTPFS_CACHE_FILES 8 // Max number of distinct files we'll hold blocks for
+#define HTTPFS_MAX_OPEN_FILES 4
+#define HTTPFS_READAHEAD_BLOCKS 4 // Blocks requested at once when sequential access is detected
+#define HTTPFS_READAHEAD_TRIGGER 2 // Number of back-to-back sequential misses before we start reading ahead
+
+#define HTTPFS_NO_FILE -1
+
+struct httpFsStats
+{
+    uint32_t requests = 0;
+    uint32_t bytes_fetched = 0;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t readahead_blocks = 0; // Extra blocks requested because we detected sequential access
+    uint32_t revalidations = 0; // Times a file's ETag or size changed and we threw out its blocks
+};
+
+// A file we're holding blocks for, remembered between opens so they can be revalidated
+struct httpFsCacheFile
+{
+    bool in_use = false;
+    uint8_t open_count = 0;
+    uint32_t filesize = 0;
+    uint32_t last_used = 0;
+    std::string path;
+    std::string etag;
+};
+
+// One cached block of a file
+struct httpFsCacheBlock
+{
+    int8_t file_id = HTTPFS_NO_FILE;
+    uint16_t length = 0;
+    uint32_t offset = 0; // Always a multiple of HTTPFS_BLOCK_SIZE
+    uint32_t last_used = 0;
+};
+
+// An open file handle
+struct httpFsHandle
+{
+    int8_t file_id = HTTPFS_NO_FILE; // HTTPFS_NO_FILE if the handle isn't in use
+    uint32_t position = 0;
+    uint32_t last_miss = UINT32_MAX; // Offset of the last block we had to request
+    uint8_t sequential = 0; // Back-to-back sequential misses so far
+    unsigned long opened_ms = 0;
+    uint32_t requests = 0;
+    uint32_t bytes_fetched = 0;
+    uint32_t fetch_ms = 0;
+};
+
+/*
+ Read-only access to files on an ordinary HTTP(S) server using Range requests.
+ Files are fetched in HTTPFS_BLOCK_SIZE aligned blocks that are kept in a PSRAM LRU cache,
+ so only the parts of an image that are actually read cross the network. Each open asks
+ for the first block, which also tells us the file's size and ETag; if the ETag or size
+ changed since we last saw the file, its cached blocks are thrown out.
+ There's no directory listing: images are opened by path.
+*/
+class FileSystemHTTP : public FileSystem
+{
+private:
+    std::string _baseurl;
+    fnHttpClient _client;
+    std::string _client_url;
+
+    httpFsCacheFile _files[HTTPFS_CACHE_FILES];
+    httpFsCacheBlock _blocks[HTTPFS_CACHE_BLOCKS];
+    httpFsHandle _handles[HTTPFS_MAX_OPEN_FILES];
+    uint8_t *_block_data = nullptr;
+    uint8_t *_staging = nullptr; // Room for HTTPFS_READAHEAD_BLOCKS blocks
+    uint32_t _clock = 0;
+
+    httpFsStats _stats;
+
+    int _fetch(const char *path, uint32_t offset, uint32_t length, uint8_t *dest, uint32_t *filesize, std::string *etag);
+    int _cache_file(const char *path);
+    void _drop_file_blocks(int file_id);
+    int _find_block(int file_id, uint32_t offset);
+    void _put_block(int file_id, uint32_t offset, const uint8_t *src, uint16_t length);
+    bool _load_blocks(httpFsHandle &h, uint32_t offset);
+
+public:
+    FileSystemHTTP();
+    ~FileSystemHTTP();
+
+    bool start(const char *baseurl);
+
+    fsType type() override { return FSTYPE_HTTP; };
+    const char * typestring() override { return type_to_string(FSTYPE_HTTP); };
+
+    FILE * file_open(const char* path, const char* mode = FILE_READ) override;
+
+    bool exists(const char* path) override;
+
+    bool remove(const char* path) override { return false; };
+
+    bool rename(const char* pathFrom, const char* pathTo) override { return false; };
+
+    bool dir_open(const char * path, const char *pattern, uint16_t diropts) override { return false; };
+    fsdir_entry *dir_read() override { return nullptr; };
+    void dir_close() override {};
+    uint16_t dir_tell() override { return FNFS_INVALID_DIRPOS; };
+    bool dir_seek(uint16_t) override { return false; };
+
+    // Used by our VFS driver. Each returns -1 and sets errno on failure.
+    int open_file(const char *path);
+    int close_file(int fd);
+    int read_file(int fd, uint8_t *dest, uint32_t size);
+    int seek_file(int fd, int32_t offset, int whence);
+    int stat_file(const char *path, uint32_t *filesize);
+    int stat_handle(int fd, uint32_t *filesize);
+
+    // Number of requests sent to the server on this mount
+    uint32_t round_trips() { return _stats.requests; };
+    const httpFsStats &stats() { return _stats; };
+};
+
+#endif // _FN_FSHTTP_
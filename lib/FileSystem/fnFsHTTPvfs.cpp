@@ -0,0 +1,126 @@
+/* These are the "driver" functions needed to register 
+    with the ESP-IDF VFS
+*/
+#include <sys/errno.h>
+
+#include "esp_vfs.h"
+#include "../../include/debug.h"
+#include "fnFsHTTP.h"
+#include "fnFsHTTPvfs.h"
+
+/*
+    Images on an HTTP host are read-only, so only these are registered:
+
+    int (*open_p)(void* ctx, const char * path, int flags, int mode);
+    int (*close_p)(void* ctx, int fd);
+    ssize_t (*read_p)(void* ctx, int fd, void * dst, size_t size);
+    ssize_t (*write_p)(void* p, int fd, const void * data, size_t size);
+    off_t (*lseek_p)(void* p, int fd, off_t size, int mode);
+    int (*stat_p)(void* ctx, const char * path, struct stat * st);
+    int (*fstat_p)(void* ctx, int fd, struct stat * st);
+*/
+
+int vfs_http_open(void* ctx, const char * path, int flags, int mode)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+
+    if((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC | O_APPEND)))
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    return fs->open_file(path);
+}
+
+int vfs_http_close(void* ctx, int fd)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+    return fs->close_file(fd);
+}
+
+ssize_t vfs_http_read(void* ctx, int fd, void * dst, size_t size)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+    return fs->read_file(fd, (uint8_t *)dst, size);
+}
+
+ssize_t vfs_http_write(void* ctx, int fd, const void * data, size_t size)
+{
+    errno = EROFS;
+    return -1;
+}
+
+off_t vfs_http_lseek(void* ctx, int fd, off_t size, int mode)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+    return fs->seek_file(fd, size, mode);
+}
+
+static void _vfs_http_fill_stat(struct stat * st, uint32_t filesize)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_size = filesize;
+    st->st_mode = S_IFREG;
+}
+
+int vfs_http_stat(void* ctx, const char * path, struct stat * st)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+
+    uint32_t filesize;
+    if(fs->stat_file(path, &filesize) != 0)
+        return -1;
+
+    _vfs_http_fill_stat(st, filesize);
+    errno = 0;
+    return 0;
+}
+
+int vfs_http_fstat(void* ctx, int fd, struct stat * st)
+{
+    FileSystemHTTP *fs = (FileSystemHTTP *)ctx;
+
+    uint32_t filesize;
+    if(fs->stat_handle(fd, &filesize) != 0)
+        return -1;
+
+    _vfs_http_fill_stat(st, filesize);
+    errno = 0;
+    return 0;
+}
+
+// Register our functions and use the FileSystemHTTP as our context
+// New basepath will be stored in basepath
+esp_err_t vfs_http_register(FileSystemHTTP *fs, char *basepath, int basepathlen)
+{
+    esp_vfs_t vfs;
+    memset(&vfs, 0, sizeof(vfs));
+    vfs.flags = ESP_VFS_FLAG_CONTEXT_PTR;
+    vfs.open_p = &vfs_http_open;
+    vfs.close_p = &vfs_http_close;
+    vfs.read_p = &vfs_http_read;
+    vfs.write_p = &vfs_http_write;
+    vfs.stat_p = &vfs_http_stat;
+    vfs.fstat_p = &vfs_http_fstat;
+    vfs.lseek_p = &vfs_http_lseek;
+
+    // The address of the FileSystemHTTP makes the base path unique
+    snprintf(basepath, basepathlen, "/http%p", fs);
+    esp_err_t e = esp_vfs_register(basepath, &vfs, fs);
+
+    Debug_printf("vfs_http_register \"%s\" @ %p = %d \"%s\"\n", basepath, fs, e, esp_err_to_name(e));
+
+    return e;
+}
+
+// Remove our driver from VFS
+esp_err_t vfs_http_unregister(const char * basepath)
+{
+    esp_err_t e = esp_vfs_unregister(basepath);
+
+    #ifdef DEBUG
+    Debug_printf("vfs_http_unregister \"%s\" = %d \"%s\"\n", basepath, e, esp_err_to_name(e));
+    #endif
+    return e;
+}
@@ -0,0 +1,11 @@
+#ifndef _FNFSHTTP_VFS_H
+#define _FNFSHTTP_VFS_H
+
+#include <esp_err.h>
+
+class FileSystemHTTP;
+
+esp_err_t vfs_http_register(FileSystemHTTP *fs, char * basepath, int basepathlen);
+esp_err_t vfs_http_unregister(const char * basepath);
+
+#endif // _FNFSHTTP_VFS_H
@@ -25,6 +25,14 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
 
     if(host == nullptr || host[0] == '\0')
         return false;
+
+    // A "tcp://" prefix asks for TNFS over TCP instead of UDP
+    _mountinfo.protocol = TNFS_PROTOCOL_UDP;
+    if(strncasecmp(host, "tcp://", 6) == 0)
+    {
+        _mountinfo.protocol = TNFS_PROTOCOL_TCP;
+        host += 6;
+    }
     
     strlcpy(_mountinfo.hostname, host, sizeof(_mountinfo.hostname));
 
@@ -56,7 +64,8 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
     else
         _mountinfo.password[0] = '\0';
 
-    Debug_printf("TNFS mount %s[%s]:%hu\n", _mountinfo.hostname, inet_ntoa(_mountinfo.host_ip), _mountinfo.port);
+    Debug_printf("TNFS mount %s[%s]:%hu (%s)\n", _mountinfo.hostname, inet_ntoa(_mountinfo.host_ip), _mountinfo.port,
+        _mountinfo.protocol == TNFS_PROTOCOL_TCP ? "TCP" : "UDP");
 
     int r = tnfs_mount(&_mountinfo);
     if (r != TNFS_RESULT_SUCCESS)
@@ -84,7 +93,7 @@ bool FileSystemTNFS::exists(const char* path)
 {
     tnfsStat tstat;
 
-    int result = tnfs_stat(&_mountinfo, &tstat, path);
+    int result = tnfs_stat_cached(&_mountinfo, &tstat, path);
 
     return result == TNFS_RESULT_SUCCESS;
 }
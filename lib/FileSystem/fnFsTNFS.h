@@ -34,6 +34,9 @@ public:
     void dir_close();
     uint16_t dir_tell() override;
     bool dir_seek(uint16_t) override;
+
+    // Number of requests sent to the server on this mount (including retries)
+    uint32_t round_trips() { return _mountinfo.transport_stats.transactions + _mountinfo.transport_stats.retries; };
 };
 
 #endif // _FN_FSTNFS_
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "esp_vfs.h"
 #include "../../include/debug.h"
 #include "../TNFSlib/tnfslib.h"
+#include "../hardware/fnSystem.h"
 
 /*
     These are the 23 functions that can be registered (not including 6 fucntions for select())
@@ -103,6 +104,92 @@ int vfs_tnfs_rename(void* ctx, const char *src, const char *dst)
     return 0;
 }
 
+/*
+    Read-only files closed through the VFS are left open on the server for up to
+    TNFS_IDLE_HANDLE_TTL milliseconds so they can be opened again without a round trip.
+    They're all closed as soon as we change anything on the server.
+*/
+void _vfs_tnfs_expire_idle_handles(tnfsMountInfo *mi, bool close_all = false)
+{
+    uint32_t now = fnSystem.millis();
+    for(int i = 0; i < TNFS_IDLE_HANDLES; i++)
+    {
+        tnfsIdleHandle &idle = mi->idle_handles[i];
+        if(idle.handle_id == TNFS_INVALID_HANDLE)
+            continue;
+        if(close_all || idle.change_count != mi->change_count || (now - idle.closed_ms) >= TNFS_IDLE_HANDLE_TTL)
+        {
+            tnfs_close(mi, idle.handle_id);
+            idle = tnfsIdleHandle();
+        }
+    }
+}
+
+// Returns an idle handle for path rewound to the start of the file, or TNFS_INVALID_HANDLE
+int16_t _vfs_tnfs_reopen_idle_handle(tnfsMountInfo *mi, const char *path)
+{
+    char fullpath[TNFS_MAX_FILELEN];
+    if(tnfs_fullpath(mi, path, fullpath, sizeof(fullpath)) < 0)
+        return TNFS_INVALID_HANDLE;
+
+    for(int i = 0; i < TNFS_IDLE_HANDLES; i++)
+    {
+        tnfsIdleHandle &idle = mi->idle_handles[i];
+        if(idle.handle_id == TNFS_INVALID_HANDLE)
+            continue;
+
+        const char *idle_path = tnfs_filepath(mi, idle.handle_id);
+        if(idle_path == nullptr || strcmp(idle_path, fullpath) != 0)
+            continue;
+
+        int16_t handle = idle.handle_id;
+        idle = tnfsIdleHandle();
+
+        // This is free if the file's in the block cache
+        if(tnfs_lseek(mi, handle, 0, SEEK_SET) == TNFS_RESULT_SUCCESS)
+        {
+            mi->metadata_stats.reopens++;
+            return handle;
+        }
+        tnfs_close(mi, handle);
+        break;
+    }
+    return TNFS_INVALID_HANDLE;
+}
+
+/*
+    Keeps a read-only handle open on the server instead of closing it, closing the oldest idle handle if needed.
+    Servers only give each session a few handles, so the file is closed for real if that would
+    leave us with more than TNFS_IDLE_HANDLE_MAX_OPEN handles open.
+    Returns the result of closing the handle, or TNFS_RESULT_SUCCESS if it was kept open.
+*/
+int _vfs_tnfs_park_handle(tnfsMountInfo *mi, int16_t handle)
+{
+    if(mi->filehandle_count() > TNFS_IDLE_HANDLE_MAX_OPEN)
+        return tnfs_close(mi, handle);
+
+    int slot = 0;
+    for(int i = 0; i < TNFS_IDLE_HANDLES; i++)
+    {
+        if(mi->idle_handles[i].handle_id == TNFS_INVALID_HANDLE)
+        {
+            slot = i;
+            break;
+        }
+        if(mi->idle_handles[i].closed_ms < mi->idle_handles[slot].closed_ms)
+            slot = i;
+    }
+
+    tnfsIdleHandle &idle = mi->idle_handles[slot];
+    if(idle.handle_id != TNFS_INVALID_HANDLE)
+        tnfs_close(mi, idle.handle_id);
+
+    idle.handle_id = handle;
+    idle.change_count = mi->change_count;
+    idle.closed_ms = fnSystem.millis();
+    return TNFS_RESULT_SUCCESS;
+}
+
 int vfs_tnfs_open(void* ctx, const char * path, int flags, int mode)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
@@ -122,7 +209,24 @@ int vfs_tnfs_open(void* ctx, const char * path, int flags, int mode)
         tflags |= (flags & O_EXCL) ? TNFS_OPENMODE_CREATE_EXCLUSIVE : 0;
     }
 
+    _vfs_tnfs_expire_idle_handles(mi);
+    if(tflags == TNFS_OPENMODE_READ)
+    {
+        handle = _vfs_tnfs_reopen_idle_handle(mi, path);
+        if(handle != TNFS_INVALID_HANDLE)
+        {
+            errno = 0;
+            return handle;
+        }
+    }
+
     int result = tnfs_open(mi, path, tflags, mode, &handle);
+    // Give up our idle handles if we need the room (servers report that in different ways)
+    if(result == TNFS_RESULT_TOO_MANY_FILES_OPEN || result == TNFS_RESULT_FILE_TABLE_OVERFLOW || result == TNFS_RESULT_OUT_OF_STREAMS)
+    {
+        _vfs_tnfs_expire_idle_handles(mi, true);
+        result = tnfs_open(mi, path, tflags, mode, &handle);
+    }
     if(result != TNFS_RESULT_SUCCESS)
     {
         #ifdef DEBUG
@@ -139,7 +243,14 @@ int vfs_tnfs_close(void* ctx, int fd)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
 
-    int result = tnfs_close(mi, fd);
+    _vfs_tnfs_expire_idle_handles(mi);
+
+    tnfsFileHandleInfo *pFileInf = mi->get_filehandleinfo(fd);
+    int result;
+    if(pFileInf != nullptr && pFileInf->open_mode == TNFS_OPENMODE_READ)
+        result = _vfs_tnfs_park_handle(mi, fd);
+    else
+        result = tnfs_close(mi, fd);
     if(result != TNFS_RESULT_SUCCESS)
     {
         errno = tnfs_code_to_errno(result);
@@ -153,6 +264,10 @@ ssize_t vfs_tnfs_read(void* ctx, int fd, void * dst, size_t size)
 {
     tnfsMountInfo *mi = (tnfsMountInfo *)ctx;
 
+    // tnfs_read takes care of splitting large requests into multiple TNFS READs
+    if(size > UINT16_MAX)
+        size = UINT16_MAX;
+
     uint16_t readcount;
     int result = tnfs_read(mi, fd, (uint8_t *)dst, size, &readcount);
 
@@ -209,7 +324,7 @@ int vfs_tnfs_stat(void* ctx, const char * path, struct stat * st)
 
     //Debug_printf("vfs_tnfs_stat: \"%s\"\n", path);
 
-    int result = tnfs_stat(mi, &tstat, path);
+    int result = tnfs_stat_cached(mi, &tstat, path);
     if(result != TNFS_RESULT_SUCCESS)
     {
         errno = tnfs_code_to_errno(result);
@@ -38,6 +38,23 @@ int tnfs_mount(tnfsMountInfo *m_info)
         tnfs_umount(m_info);
     m_info->session = TNFS_INVALID_SESSION; // In case tnfs_umount fails - throw out the current session ID
 
+    // We may be talking to a different server than before
+    m_info->block_cache.clear();
+    m_info->dir_cache.invalidate();
+    m_info->note_change();
+    m_info->dir_cache.close();
+    m_info->dir_handle = TNFS_INVALID_HANDLE;
+
+    // The server forgets any files we left open along with our old session
+    for (int i = 0; i < TNFS_IDLE_HANDLES; i++)
+    {
+        if (m_info->idle_handles[i].handle_id != TNFS_INVALID_HANDLE)
+            m_info->delete_filehandleinfo(m_info->idle_handles[i].handle_id);
+        m_info->idle_handles[i] = tnfsIdleHandle();
+    }
+    m_info->reset_rtt();
+    m_info->tcp_client.stop();
+
     tnfsPacket packet;
     packet.command = TNFS_CMD_MOUNT;
 
@@ -95,18 +112,41 @@ int tnfs_umount(tnfsMountInfo *m_info)
     if (m_info == nullptr)
         return -1;
 
+#ifdef DEBUG
+    if (m_info->block_cache.ready())
+    {
+        const tnfsBlockCacheStats &bcs = m_info->block_cache.stats();
+        Debug_printf("TNFS block cache: hits=%u, misses=%u, readahead=%u, evictions=%u, invalidations=%u\n",
+                     bcs.hits, bcs.misses, bcs.readahead_blocks, bcs.evictions, bcs.invalidations);
+    }
+    const tnfsDirCacheStats &dcs = m_info->dir_cache.stats();
+    Debug_printf("TNFS directory cache: hits=%u, misses=%u, revalidations=%u\n", dcs.hits, dcs.misses, dcs.revalidations);
+    const tnfsMetadataStats &ms = m_info->metadata_stats;
+    Debug_printf("TNFS metadata cache: stat hits=%u, stat misses=%u, reopens=%u\n", ms.stat_hits, ms.stat_misses, ms.reopens);
+    const tnfsTransportStats &ts = m_info->transport_stats;
+    Debug_printf("TNFS transport (%s): transactions=%u, retries=%u, timeouts=%u, try_again=%u, connects=%u, rtt p50<=%ums p90<=%ums p99<=%ums\n",
+                 m_info->protocol == TNFS_PROTOCOL_TCP ? "TCP" : "UDP",
+                 ts.transactions, ts.retries, ts.timeouts, ts.try_again, ts.connects,
+                 m_info->rtt_percentile(50), m_info->rtt_percentile(90), m_info->rtt_percentile(99));
+#endif
+
     tnfsPacket packet;
     packet.command = TNFS_CMD_UNMOUNT;
 
+    int result = -1;
     if (_tnfs_transaction(m_info, packet, 0))
     {
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
             m_info->session = TNFS_INVALID_SESSION;
         }
-        return packet.payload[0];
+        result = packet.payload[0];
     }
-    return -1;
+
+    // We don't need our connection any more either way
+    m_info->tcp_client.stop();
+
+    return result;
 }
 
 /* Open a file
@@ -131,7 +171,12 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
     // keep track of the file position.
     bool file_exists = false;
     tnfsStat tstat;
-    int rs = tnfs_stat(m_info, &tstat, filepath);
+    int rs;
+    // Don't trust remembered values if we're going to change the file
+    if (open_mode & TNFS_OPENMODE_WRITE)
+        rs = tnfs_stat(m_info, &tstat, filepath);
+    else
+        rs = tnfs_stat_cached(m_info, &tstat, filepath);
     // The only error we'll accept is TNFS_RESULT_FILE_NOT_FOUND, otherwise abort
     if (rs == TNFS_RESULT_SUCCESS)
     {
@@ -178,6 +223,14 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
             pFileInf->file_position = pFileInf->cached_pos = 0;
 
             *file_handle = pFileInf->handle_id;
+            pFileInf->open_mode = open_mode;
+
+            if (open_mode & TNFS_OPENMODE_WRITE)
+                m_info->note_change();
+
+            // A new file means any listing we have of its directory is out of date
+            if (file_exists == false)
+                m_info->dir_cache.invalidate();
 
             // Depending on the file mode and wether the file aready existed,
             // we need to do something different with the position of the file
@@ -188,6 +241,14 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
                 else if (open_mode & TNFS_OPENMODE_WRITE_TRUNCATE)
                     pFileInf->file_size = 0;
             }
+
+            // Share blocks read from this file with any other handle to it on this mount
+            if (m_info->block_cache.begin(m_info->block_cache_blocks))
+            {
+                bool truncated = file_exists == false || ((open_mode & TNFS_OPENMODE_WRITE) && (open_mode & TNFS_OPENMODE_WRITE_TRUNCATE));
+                pFileInf->cache_file_id = m_info->block_cache.open_file(pFileInf->filename, pFileInf->file_size,
+                                                                        file_exists ? tstat.m_time : 0, truncated);
+            }
             Debug_printf("File opened, handle ID: %hhd, size: %u, pos: %u\n", *file_handle, pFileInf->file_size, pFileInf->file_position);
         }
         result = packet.payload[0];
@@ -221,6 +282,7 @@ int tnfs_close(tnfsMountInfo *m_info, int16_t file_handle)
     if (_tnfs_transaction(m_info, packet, 1))
     {
         // We're going to go ahead and delete our info even though the server could reject it
+        m_info->block_cache.close_file(pFileInf->cache_file_id);
         m_info->delete_filehandleinfo(pFileInf);
         return packet.payload[0];
     }
@@ -409,16 +471,383 @@ int _tnfs_fill_cache(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
     return error;
 }
 
+/*
+ Moves the server's file pointer to an absolute position without touching
+ the position the client sees (cached_pos) or our internal cache
+ Returns: 0: success; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_server_seek(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint32_t position)
+{
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_LSEEK;
+    packet.payload[0] = pFHI->handle_id;
+    packet.payload[1] = SEEK_SET;
+    TNFS_UINT32_TO_LOHI_BYTEPTR(position, packet.payload + 2);
+
+    if (_tnfs_transaction(m_info, packet, 6))
+    {
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+            pFHI->file_position = position;
+        return packet.payload[0];
+    }
+    return -1;
+}
+
+// Keeps track of one READ request in flight during _tnfs_read_windowed
+struct tnfsReadSlot
+{
+    uint8_t sequence_num;
+    uint16_t requested;
+    uint16_t received;
+    uint8_t result;
+    bool answered;
+};
+
+/*
+ Reads bufflen bytes directly into dest starting at the server's current file position,
+ one READ transaction at a time.
+ Used over TCP, where the connection takes care of lost packets and servers expect
+ to see a single request per read from the socket, and as the fallback when a
+ windowed read over UDP can't be trusted.
+ Returns: 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_read_sequential(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint8_t *dest, uint16_t bufflen, uint16_t *dest_used)
+{
+    tnfsPacket packet;
+
+    while (*dest_used < bufflen)
+    {
+        uint16_t remaining = bufflen - *dest_used;
+        uint16_t bytes_to_read = remaining > TNFS_MAX_READWRITE_PAYLOAD ? TNFS_MAX_READWRITE_PAYLOAD : remaining;
+
+        packet.command = TNFS_CMD_READ;
+        packet.payload[0] = pFHI->handle_id;
+        packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(bytes_to_read);
+        packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(bytes_to_read);
+
+        if (false == _tnfs_transaction(m_info, packet, 3))
+            return -1;
+
+        if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+            return packet.payload[0];
+
+        uint16_t bytes_read = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
+        if (bytes_read > bytes_to_read)
+            bytes_read = bytes_to_read;
+
+        memcpy(dest + *dest_used, packet.payload + 3, bytes_read);
+        *dest_used += bytes_read;
+        pFHI->file_position += bytes_read;
+
+        // A short read means we've hit the end of the file
+        if (bytes_read < bytes_to_read)
+            return TNFS_RESULT_END_OF_FILE;
+    }
+
+    return 0;
+}
+
+/*
+ Reads bufflen bytes directly into dest starting at the server's current file position,
+ keeping up to m_info->read_window READ requests in flight at once.
+ TNFS READ has no offset, so the server hands out data in the order it processes our
+ requests. Replies are matched to their request by sequence number and only the leading
+ run of answered requests is accepted. If anything after that run went missing we don't
+ know where the server's file pointer ended up, so we LSEEK back to the end of the data
+ we kept and request only the remainder.
+ A reply arriving after one for a later request, a duplicate reply, or data following a
+ short reply means the server didn't see our requests in order. None of that window can
+ be trusted, so we LSEEK back to its start and read the rest one request at a time.
+ Returns: 0: success; TNFS_RESULT_END_OF_FILE: EOF; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_read_windowed(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI, uint8_t *dest, uint16_t bufflen, uint16_t *dest_used)
+{
+    if (m_info->protocol == TNFS_PROTOCOL_TCP)
+        return _tnfs_read_sequential(m_info, pFHI, dest, bufflen, dest_used);
+
+    fnUDP udp;
+    tnfsPacket packet;
+    tnfsReadSlot slots[TNFS_MAX_READ_WINDOW];
+
+    int window = m_info->read_window;
+    if (window < 1)
+        window = 1;
+    else if (window > TNFS_MAX_READ_WINDOW)
+        window = TNFS_MAX_READ_WINDOW;
+
+    packet.session_idl = TNFS_LOBYTE_FROM_UINT16(m_info->session);
+    packet.session_idh = TNFS_HIBYTE_FROM_UINT16(m_info->session);
+
+    int retry = 0;
+    int busy = 0; // Retries caused by TRY_AGAIN, which don't mean a packet was lost
+    while (*dest_used < bufflen && retry < m_info->max_retries)
+    {
+        uint16_t remaining = bufflen - *dest_used;
+        uint8_t *window_dest = dest + *dest_used;
+
+        // Send out as many requests as the window allows (or as we need)
+        int count = 0;
+        for (uint16_t offset = 0; count < window && offset < remaining; count++)
+        {
+            uint16_t bytes_to_read = (remaining - offset) > TNFS_MAX_READWRITE_PAYLOAD ? TNFS_MAX_READWRITE_PAYLOAD : (remaining - offset);
+
+            slots[count].sequence_num = m_info->current_sequence_num++;
+            slots[count].requested = bytes_to_read;
+            slots[count].received = 0;
+            slots[count].answered = false;
+            offset += bytes_to_read;
+
+            packet.sequence_num = slots[count].sequence_num;
+            packet.command = TNFS_CMD_READ;
+            packet.payload[0] = pFHI->handle_id;
+            packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(bytes_to_read);
+            packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(bytes_to_read);
+
+#ifdef DEBUG
+            _tnfs_debug_packet(packet, 3);
+#endif
+            bool sent;
+            if (m_info->host_ip != IPADDR_NONE)
+                sent = udp.beginPacket(m_info->host_ip, m_info->port);
+            else
+                sent = udp.beginPacket(m_info->hostname, m_info->port);
+            if (sent)
+            {
+                udp.write(packet.rawData, 3 + TNFS_HEADER_SIZE);
+                sent = udp.endPacket();
+            }
+            if (!sent)
+                Debug_println("_tnfs_read_windowed failed to send packet");
+        }
+
+        #ifdef VERBOSE_TNFS
+        Debug_printf("_tnfs_read_windowed fh=%d, %u bytes in %d requests\n", pFHI->handle_id, remaining, count);
+        #endif
+
+        // Collect replies until everything in the window is answered or we time out
+        int outstanding = count;
+        int next_reply = 0; // One past the latest request we've had a reply to
+        bool out_of_order = false;
+        uint16_t backoffms = 0;
+        uint32_t timeout = m_info->retransmit_timeout(retry - busy);
+        uint32_t ms_start = fnSystem.millis();
+        do
+        {
+            if (udp.parsePacket())
+            {
+                unsigned short l = udp.read(packet.rawData, sizeof(packet.rawData));
+#ifdef DEBUG
+                _tnfs_debug_packet(packet, l, true);
+#endif
+                uint8_t index = packet.sequence_num - slots[0].sequence_num;
+                if (l <= TNFS_HEADER_SIZE || packet.command != TNFS_CMD_READ || index >= count)
+                {
+                    Debug_println("_tnfs_read_windowed ignoring unexpected packet");
+                }
+                else if (slots[index].answered || index < next_reply)
+                {
+                    // The server saw a request twice or out of order, so its data went to the wrong slots
+                    out_of_order = true;
+                    break;
+                }
+                else if (packet.payload[0] == TNFS_RESULT_TRY_AGAIN)
+                {
+                    // Leave this one unanswered and back off before the next window
+                    backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
+                    if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                        backoffms = TNFS_MAX_BACKOFF_DELAY;
+                    m_info->transport_stats.try_again++;
+                    slots[index].answered = true;
+                    slots[index].result = TNFS_RESULT_TRY_AGAIN;
+                    outstanding--;
+                }
+                else
+                {
+                    slots[index].answered = true;
+                    slots[index].result = packet.payload[0];
+                    if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+                    {
+                        uint16_t bytes_read = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
+                        if (bytes_read > slots[index].requested)
+                            bytes_read = slots[index].requested;
+                        slots[index].received = bytes_read;
+                        // Every slot before this one asked for a full payload, so this is where its data belongs
+                        memcpy(window_dest + index * TNFS_MAX_READWRITE_PAYLOAD, packet.payload + 3, bytes_read);
+                    }
+                    outstanding--;
+                }
+                if (index >= next_reply)
+                    next_reply = index + 1;
+            }
+            else
+                fnSystem.yield();
+
+        } while (outstanding > 0 && (fnSystem.millis() - ms_start) < timeout);
+
+        // Accept the leading run of answered requests
+        int accepted = 0;
+        uint16_t accepted_bytes = 0;
+        int result = 0;
+        for (; accepted < count; accepted++)
+        {
+            tnfsReadSlot &slot = slots[accepted];
+            if (slot.answered == false || slot.result == TNFS_RESULT_TRY_AGAIN)
+                break;
+            if (slot.result != TNFS_RESULT_SUCCESS)
+            {
+                result = slot.result;
+                break;
+            }
+            accepted_bytes += slot.received;
+            // A short read means we've hit the end of the file, so nothing after it should have data
+            if (slot.received < slot.requested)
+            {
+                for (int later = accepted + 1; later < count; later++)
+                    if (slots[later].answered && slots[later].result == TNFS_RESULT_SUCCESS && slots[later].received > 0)
+                        out_of_order = true;
+                result = TNFS_RESULT_END_OF_FILE;
+                break;
+            }
+        }
+
+        if (out_of_order)
+        {
+            Debug_println("_tnfs_read_windowed got replies out of order, reading the rest serially");
+            m_info->transport_stats.retries += count;
+            result = _tnfs_server_seek(m_info, pFHI, pFHI->file_position);
+            if (result != 0)
+                return result;
+            return _tnfs_read_sequential(m_info, pFHI, dest, bufflen, dest_used);
+        }
+
+        *dest_used += accepted_bytes;
+        pFHI->file_position += accepted_bytes;
+        m_info->transport_stats.transactions += accepted;
+
+        if (result != 0)
+        {
+            #ifdef VERBOSE_TNFS
+            Debug_printf("_tnfs_read_windowed stopping with result %d after %u bytes\n", result, *dest_used);
+            #endif
+            return result;
+        }
+
+        if (accepted == count)
+        {
+            retry = 0;
+            continue;
+        }
+
+        Debug_printf("_tnfs_read_windowed got %d of %d replies in order, resending the rest\n", accepted, count);
+
+        // Put the server's file pointer back where our data ends before asking for the rest
+        m_info->transport_stats.retries += count - accepted;
+        if (backoffms > 0)
+            vTaskDelay(backoffms / portTICK_PERIOD_MS);
+
+        result = _tnfs_server_seek(m_info, pFHI, pFHI->file_position);
+        if (result != 0)
+            return result;
+
+        if (accepted == 0)
+        {
+            retry++;
+            if (slots[0].answered && slots[0].result == TNFS_RESULT_TRY_AGAIN)
+                busy++;
+        }
+        else
+            retry = busy = 0;
+    }
+
+    return *dest_used < bufflen ? -1 : 0;
+}
+
+/*
+ Loads the TNFS_BLOCK_SIZE-aligned block containing the client's current position into
+ the handle's internal cache, using the mount's tnfsBlockCache when possible.
+ On a miss we read from the server, loading TNFS_READAHEAD_BLOCKS blocks at once
+ if the last few loads were for consecutive blocks.
+ Returns: 0: success; TNFS_RESULT_END_OF_FILE: nothing left to read; -1: failed to deliver/receive packet; other: TNFS error result code
+*/
+int _tnfs_fill_block_cache(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
+{
+    tnfsBlockCache &bc = m_info->block_cache;
+    uint32_t block_start = pFHI->cached_pos - (pFHI->cached_pos % TNFS_BLOCK_SIZE);
+
+    // Reset the current cache values so it's invalid if we fail below
+    pFHI->cache_available = 0;
+
+    // Keep track of whether we're working our way through the file
+    if (block_start == pFHI->last_block + TNFS_BLOCK_SIZE)
+    {
+        if (pFHI->sequential_blocks < UINT8_MAX)
+            pFHI->sequential_blocks++;
+    }
+    else if (block_start != pFHI->last_block)
+        pFHI->sequential_blocks = 0;
+    pFHI->last_block = block_start;
+
+    uint16_t block_len;
+    if (bc.get(pFHI->cache_file_id, block_start, pFHI->cache, &block_len))
+    {
+        #ifdef VERBOSE_TNFS
+        Debug_printf("_tnfs_fill_block_cache hit fh=%d, block=%u\n", pFHI->handle_id, block_start);
+        #endif
+        pFHI->cache_start = block_start;
+        pFHI->cache_available = block_len;
+        return pFHI->cached_pos < block_start + block_len ? 0 : TNFS_RESULT_END_OF_FILE;
+    }
+
+    uint16_t blocks = 1;
+    if (pFHI->sequential_blocks >= TNFS_READAHEAD_TRIGGER)
+        blocks = TNFS_READAHEAD_BLOCKS;
+
+    #ifdef VERBOSE_TNFS
+    Debug_printf("_tnfs_fill_block_cache miss fh=%d, block=%u, loading %u\n", pFHI->handle_id, block_start, blocks);
+    #endif
+
+    if (pFHI->file_position != block_start)
+    {
+        int result = _tnfs_server_seek(m_info, pFHI, block_start);
+        if (result != 0)
+            return result;
+    }
+
+    uint16_t loaded = 0;
+    int result = _tnfs_read_windowed(m_info, pFHI, bc.staging(), blocks * TNFS_BLOCK_SIZE, &loaded);
+    if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
+        return result;
+
+    if (loaded == 0)
+        return TNFS_RESULT_END_OF_FILE;
+
+    for (uint16_t offset = 0; offset < loaded; offset += TNFS_BLOCK_SIZE)
+    {
+        uint16_t len = (loaded - offset) > TNFS_BLOCK_SIZE ? TNFS_BLOCK_SIZE : (loaded - offset);
+        bc.put(pFHI->cache_file_id, block_start + offset, bc.staging() + offset, len);
+    }
+    if (loaded > TNFS_BLOCK_SIZE)
+        bc.note_readahead((loaded - 1) / TNFS_BLOCK_SIZE);
+
+    pFHI->cache_start = block_start;
+    pFHI->cache_available = loaded > TNFS_BLOCK_SIZE ? TNFS_BLOCK_SIZE : loaded;
+    memcpy(pFHI->cache, bc.staging(), pFHI->cache_available);
+
+    // The server may know the file to be shorter than we do
+    return pFHI->cached_pos < block_start + pFHI->cache_available ? 0 : TNFS_RESULT_END_OF_FILE;
+}
+
 /*
  Reads from an open file.
- Max bufflen is TNFS_PAYLOAD_SIZE - 3; any larger size will return an error
+ Requests that don't fit in our internal cache bypass it and are read with
+ pipelined READ requests (see _tnfs_read_windowed)
  Bytes actually read will be placed in resultlen
  Returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
  */
 int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen)
 {
     if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(file_handle) ||
-        buffer == nullptr || bufflen > (TNFS_PAYLOAD_SIZE - 3) || resultlen == nullptr)
+        buffer == nullptr || resultlen == nullptr)
         return -1;
 
     *resultlen = 0;
@@ -432,17 +861,38 @@ int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint1
     Debug_printf("tnfs_read fh=%d, len=%d\n", file_handle, bufflen);
     #endif
 
-    int result = 0;
-    // Try to fulfill the request using our internal cache
-    while ((result = _tnfs_read_from_cache(pFileInf, buffer, bufflen, resultlen)) != 0 && result != TNFS_RESULT_END_OF_FILE)
+    // Use whatever we have in our internal cache first
+    int result = _tnfs_read_from_cache(pFileInf, buffer, bufflen, resultlen);
+
+    // If what's left won't fit in the cache anyway, read it straight into the caller's buffer
+    if (result == -1 && (bufflen - *resultlen) > TNFS_FILE_CACHE_SIZE)
+    {
+        pFileInf->cache_available = 0;
+        if (pFileInf->cached_pos != pFileInf->file_position)
+        {
+            result = _tnfs_server_seek(m_info, pFileInf, pFileInf->cached_pos);
+            if (result != 0)
+                return result;
+        }
+        result = _tnfs_read_windowed(m_info, pFileInf, buffer, bufflen, resultlen);
+        pFileInf->cached_pos = pFileInf->file_position;
+        return result;
+    }
+
+    // Try to fulfill the rest of the request using our internal cache
+    while (result != 0 && result != TNFS_RESULT_END_OF_FILE)
     {
         // Reload the cache if we couldn't fulfill the request
-        result = _tnfs_fill_cache(m_info, pFileInf);
+        if (pFileInf->cache_file_id != TNFS_BLOCK_CACHE_NO_FILE)
+            result = _tnfs_fill_block_cache(m_info, pFileInf);
+        else
+            result = _tnfs_fill_cache(m_info, pFileInf);
         if (result != 0)
         {
             Debug_printf("tnfs_read cache fill failed (%u) - aborting", result);
             break;
         }
+        result = _tnfs_read_from_cache(pFileInf, buffer, bufflen, resultlen);
     }
 
     return result;
@@ -493,10 +943,18 @@ int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
             *resultlen = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 1);
+
+            // Anything we've cached for the range we just wrote is now stale
+            m_info->block_cache.invalidate(pFileInf->cache_file_id, pFileInf->file_position, *resultlen);
+            m_info->invalidate_filehandle_caches(pFileInf->cache_file_id, pFileInf->file_position, *resultlen);
+            m_info->note_change();
+
             // Keep track of our file position
             uint32_t new_pos = pFileInf->file_position + *resultlen;
             // Debug_printf("tnfs_write prev_pos: %u, read: %u, new_pos: %u\n", pFileInf->file_position, *resultlen, new_pos);
             pFileInf->file_position = pFileInf->cached_pos = new_pos;
+            if (new_pos > pFileInf->file_size)
+                pFileInf->file_size = new_pos;
         }
         return packet.payload[0];
     }
@@ -564,6 +1022,27 @@ int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uin
             *new_position = pFileInf->cached_pos;
         return 0;
     }
+
+    // Files using the block cache only move the server's file pointer when they next
+    // need to read or write, and only if the data isn't already in the block cache
+    if (skip_cache == false && pFileInf->cache_file_id != TNFS_BLOCK_CACHE_NO_FILE)
+    {
+        int64_t destination_pos;
+        if (type == SEEK_SET)
+            destination_pos = position;
+        else if (type == SEEK_CUR)
+            destination_pos = (int64_t)pFileInf->cached_pos + position;
+        else
+            destination_pos = (int64_t)pFileInf->file_size + position;
+
+        if (destination_pos < 0 || destination_pos > UINT32_MAX)
+            return TNFS_RESULT_INVALID_ARGUMENT;
+
+        pFileInf->cached_pos = destination_pos;
+        if(new_position != nullptr)
+            *new_position = pFileInf->cached_pos;
+        return 0;
+    }
     // Cache seek failed - invalidate the internal cache
     pFileInf->cache_available = 0;
 
@@ -590,6 +1069,10 @@ int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uin
 
             if(new_position != nullptr)
                 *new_position = pFileInf->file_position;
+            // Over TCP the response position isn't read (see _tnfs_tcp_read_response)
+            if (m_info->protocol == TNFS_PROTOCOL_TCP)
+                return packet.payload[0];
+
             uint32_t response_pos = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);    
             Debug_printf("tnfs_lseek success, new pos=%u, response pos=%u\n", pFileInf->file_position, response_pos);
 
@@ -606,64 +1089,281 @@ int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uin
 }
 
 /*
-    Opens directory and stores directory handle in tnfsMountInfo.dir_handle
-    sortopts = zero or more TNFS_DIRSORT flags
-    diropts = zero or more TNFS_DIROPT flags
-    pattern = zero-terminated wildcard pattern string
-    maxresults = max number of results to return or zero for unlimited
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+    Closes the server's handle to the directory we're loading, if there is one
 */
-int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults)
+void _tnfs_close_server_dir(tnfsMountInfo *m_info)
 {
-    if (m_info == nullptr || directory == nullptr)
-        return -1;
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+        return;
 
-#define OFFSET_OPENDIRX_DIROPT 0
-#define OFFSET_OPENDIRX_SORTOPT 1
-#define OFFSET_OPENDIRX_MAXRESULTS 2
-#define OFFSET_OPENDIRX_PATTERN 4
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_CLOSEDIR;
+    packet.payload[0] = m_info->dir_handle;
 
-// Number of bytes before the two null-terminated strings start
-#define OPENDIRX_HEADERBYTES 4
+    if (_tnfs_transaction(m_info, packet, 1) && packet.payload[0] != TNFS_RESULT_SUCCESS)
+        Debug_printf("TNFS closedir failed: %u\n", packet.payload[0]);
 
-    // Throw out any existing cached directory entries
-    m_info->empty_dircache();
+    // Nothing useful we can do with the handle if the server didn't want to close it
+    m_info->dir_handle = TNFS_INVALID_HANDLE;
+}
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_OPENDIRX;
+/*
+    Reads every entry from the directory handle in tnfsMountInfo.dir_handle into
+    the current directory cache listing, as many as will fit in each READDIRX response.
+    If the listing fills up (TNFS_MAX_DIRCACHE_ENTRIES or out of memory) first, it's marked
+    as paged and next_dirpos is set to the first entry that didn't fit.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int _tnfs_load_dir_listing(tnfsMountInfo *m_info)
+{
+#define OFFSET_READDIRX_FLAGS 0
+#define OFFSET_READDIRX_SIZE 1
+#define OFFSET_READDIRX_MTIME 5
+#define OFFSET_READDIRX_CTIME 9
+#define OFFSET_READDIRX_PATH 13
 
-    packet.payload[OFFSET_OPENDIRX_DIROPT] = diropts;
-    packet.payload[OFFSET_OPENDIRX_SORTOPT] = sortopts;
+    tnfsDirListing *pListing = m_info->dir_cache.current();
+    tnfsPacket packet;
+    int requests = 0;
 
-    packet.payload[OFFSET_OPENDIRX_MAXRESULTS] = TNFS_LOBYTE_FROM_UINT16(maxresults);
-    packet.payload[OFFSET_OPENDIRX_MAXRESULTS + 1] = TNFS_HIBYTE_FROM_UINT16(maxresults);
+    while (true)
+    {
+        packet.command = TNFS_CMD_READDIRX;
+        packet.payload[0] = m_info->dir_handle;
+        // Number of responses to read
+        packet.payload[1] = TNFS_READDIRX_COUNT;
 
-    // Copy the pattern or an empty string
-    strlcpy((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN),
-        pattern == nullptr ? "" : pattern,
-        sizeof(packet.payload) - OPENDIRX_HEADERBYTES - 1);
+        if (false == _tnfs_transaction(m_info, packet, 2))
+            return -1;
+        requests++;
 
-    // Calculate the new offset to the path taking the pattern string into account
-    int pathoffset = strlen((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN)) + OPENDIRX_HEADERBYTES + 1;
+        // Some servers just tell us we're at the end of the directory
+        if (packet.payload[0] == TNFS_RESULT_END_OF_FILE)
+            break;
+        if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+            return packet.payload[0];
 
-    // Copy the directory into the right spot in the packet and get its string len
-    int pathlen = _tnfs_adjust_with_full_path(m_info, 
-        (char *)(packet.payload + pathoffset), directory, sizeof(packet.payload) - pathoffset);
+        uint8_t response_count = packet.payload[1];
+        uint8_t response_status = packet.payload[2];
+        uint16_t dirpos = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 3);
 
-    Debug_printf("TNFS open directory: sortopts=0x%02x diropts=0x%02x maxresults=0x%04x pattern=\"%s\" path=\"%s\"\n",
-     sortopts, diropts, maxresults, (char *)(packet.payload + OFFSET_OPENDIRX_PATTERN), (char *)(packet.payload + pathoffset));
+        #ifdef VERBOSE_TNFS
+        Debug_printf("_tnfs_load_dir_listing resp_count=%hu, dirpos=%hu, status=%hu\n", response_count, dirpos, response_status);
+        #endif
 
-    if (_tnfs_transaction(m_info, packet, pathoffset + pathlen + 1))
-    {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
+        // Add the returned values to our listing
+        int current_offset = 5;
+        for (int i = 0; i < response_count; i++)
         {
-            m_info->dir_handle = packet.payload[1];
-            m_info->dir_entries = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 2);
-            Debug_printf("Directory opened, handle ID: %hhd, entries: %u\n", m_info->dir_handle, m_info->dir_entries);
+            const char *name = (char *)packet.payload + current_offset + OFFSET_READDIRX_PATH;
+            tnfsDirCacheEntry *pEntry = m_info->dir_cache.add_entry(
+                dirpos + i,
+                packet.payload[current_offset + OFFSET_READDIRX_FLAGS],
+                TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_SIZE),
+                TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_MTIME),
+                TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_CTIME),
+                name);
+
+            if (pEntry == nullptr)
+            {
+                if (pListing->count == 0)
+                    return TNFS_RESULT_OUT_OF_MEMORY;
+                Debug_printf("_tnfs_load_dir_listing stopping after %u entries (limit or out of memory), reading the rest in pages\n", pListing->count);
+                pListing->paged = true;
+                pListing->last_page = false;
+                pListing->next_dirpos = dirpos + i;
+                return 0;
+            }
+
+            /*
+             Adjust our offset to point to the next entry within the packet
+             flags (1) + size (4) + mtime (4) + ctime (4) + null (1) = 14
+            */
+            current_offset += 14 + strlen(name);
         }
-        return packet.payload[0];
+
+        // Stop if the server tells us there's no more after this
+        if ((response_status & TNFS_READDIRX_STATUS_EOF) || response_count == 0)
+            break;
     }
-    return -1;
+
+    Debug_printf("_tnfs_load_dir_listing loaded %u entries in %d requests\n", pListing->count, requests);
+    pListing->last_page = true;
+    return 0;
+}
+
+/*
+    Replaces the current listing, which must be paged, with the page of the directory
+    starting at the given server position, read from the server handle we kept open
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int _tnfs_load_dir_page(tnfsMountInfo *m_info, uint16_t position)
+{
+    if (false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+        return -1;
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_SEEKDIR;
+    packet.payload[0] = m_info->dir_handle;
+    uint32_t pos = position;
+    TNFS_UINT32_TO_LOHI_BYTEPTR(pos, packet.payload + 1);
+
+    if (false == _tnfs_transaction(m_info, packet, 5))
+        return -1;
+    if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+        return packet.payload[0];
+
+    m_info->dir_cache.clear_current();
+    int result = _tnfs_load_dir_listing(m_info);
+    m_info->dir_entries = m_info->dir_cache.current()->count;
+    return result;
+}
+
+/*
+    Closes the directory we're reading, along with the server's handle if we kept it
+    open to page through a listing that didn't fit in the cache
+*/
+void _tnfs_close_dir_listing(tnfsMountInfo *m_info)
+{
+    tnfsDirListing *pListing = m_info->dir_cache.current();
+    if (pListing != nullptr && pListing->paged)
+    {
+        _tnfs_close_server_dir(m_info);
+        m_info->dir_cache.drop_current();
+    }
+    m_info->dir_cache.close();
+    m_info->dir_entries = 0;
+}
+
+/*
+    Opens directory for reading with tnfs_readdirx.
+    The whole listing is loaded into tnfsMountInfo.dir_cache and the server's handle
+    is closed again before we return. If we already have a listing for the same
+    directory and options that's younger than TNFS_DIRCACHE_TTL, or the directory's
+    modified time hasn't changed since we loaded it, no OPENDIRX is sent at all.
+    A directory too big for the cache keeps its server handle open and is read a
+    page at a time; those listings aren't kept once the directory is closed.
+    sortopts = zero or more TNFS_DIRSORT flags
+    diropts = zero or more TNFS_DIROPT flags
+    pattern = zero-terminated wildcard pattern string
+    maxresults = max number of results to return or zero for unlimited
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts, uint8_t diropts, const char *pattern, uint16_t maxresults)
+{
+    if (m_info == nullptr || directory == nullptr)
+        return -1;
+
+    if (pattern == nullptr)
+        pattern = "";
+
+#define OFFSET_OPENDIRX_DIROPT 0
+#define OFFSET_OPENDIRX_SORTOPT 1
+#define OFFSET_OPENDIRX_MAXRESULTS 2
+#define OFFSET_OPENDIRX_PATTERN 4
+
+// Number of bytes before the two null-terminated strings start
+#define OPENDIRX_HEADERBYTES 4
+
+    // Close whatever directory was open before
+    _tnfs_close_dir_listing(m_info);
+
+    char fullpath[TNFS_MAX_FILELEN];
+    _tnfs_adjust_with_full_path(m_info, fullpath, directory, sizeof(fullpath));
+
+    // Directory's modified time, which we only know once we've had to check a listing
+    uint32_t dir_mtime = 0;
+
+    // See if we can get away with the listing we already have
+    if (m_info->dir_cache.find(fullpath, pattern, sortopts, diropts, maxresults))
+    {
+        tnfsDirListing *pListing = m_info->dir_cache.current();
+        bool fresh = (fnSystem.millis() - pListing->validated_ms) < TNFS_DIRCACHE_TTL;
+        bool revalidated = false;
+
+        if (fresh == false)
+        {
+            // Remember the modified time so the listing we load instead can be revalidated next time
+            tnfsStat tstat;
+            if (tnfs_stat(m_info, &tstat, directory) == TNFS_RESULT_SUCCESS)
+            {
+                dir_mtime = tstat.m_time;
+                if (pListing->dir_mtime != 0 && tstat.m_time == pListing->dir_mtime)
+                {
+                    m_info->dir_cache.validated(fnSystem.millis());
+                    fresh = revalidated = true;
+                }
+            }
+        }
+
+        if (fresh)
+        {
+            m_info->dir_cache.note_hit(revalidated);
+            m_info->dir_entries = pListing->count;
+            Debug_printf("TNFS open directory \"%s\" from cache, entries: %u\n", fullpath, m_info->dir_entries);
+            return TNFS_RESULT_SUCCESS;
+        }
+
+        Debug_printf("TNFS cached listing of \"%s\" is out of date\n", fullpath);
+        m_info->dir_cache.drop_current();
+    }
+    m_info->dir_cache.note_miss();
+
+    tnfsPacket packet;
+    packet.command = TNFS_CMD_OPENDIRX;
+
+    packet.payload[OFFSET_OPENDIRX_DIROPT] = diropts;
+    packet.payload[OFFSET_OPENDIRX_SORTOPT] = sortopts;
+
+    packet.payload[OFFSET_OPENDIRX_MAXRESULTS] = TNFS_LOBYTE_FROM_UINT16(maxresults);
+    packet.payload[OFFSET_OPENDIRX_MAXRESULTS + 1] = TNFS_HIBYTE_FROM_UINT16(maxresults);
+
+    // Copy the pattern or an empty string
+    strlcpy((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN),
+        pattern,
+        sizeof(packet.payload) - OPENDIRX_HEADERBYTES - 1);
+
+    // Calculate the new offset to the path taking the pattern string into account
+    int pathoffset = strlen((char *)(packet.payload + OFFSET_OPENDIRX_PATTERN)) + OPENDIRX_HEADERBYTES + 1;
+
+    // Copy the directory into the right spot in the packet and get its string len
+    int pathlen = _tnfs_adjust_with_full_path(m_info, 
+        (char *)(packet.payload + pathoffset), directory, sizeof(packet.payload) - pathoffset);
+
+    Debug_printf("TNFS open directory: sortopts=0x%02x diropts=0x%02x maxresults=0x%04x pattern=\"%s\" path=\"%s\"\n",
+     sortopts, diropts, maxresults, (char *)(packet.payload + OFFSET_OPENDIRX_PATTERN), (char *)(packet.payload + pathoffset));
+
+    if (false == _tnfs_transaction(m_info, packet, pathoffset + pathlen + 1))
+        return -1;
+
+    if (packet.payload[0] != TNFS_RESULT_SUCCESS)
+        return packet.payload[0];
+
+    m_info->dir_handle = packet.payload[1];
+    Debug_printf("Directory opened, handle ID: %hhd, entries: %u\n", m_info->dir_handle, TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 2));
+
+    if (false == m_info->dir_cache.create(fullpath, pattern, sortopts, diropts, maxresults, dir_mtime))
+    {
+        _tnfs_close_server_dir(m_info);
+        return TNFS_RESULT_OUT_OF_MEMORY;
+    }
+    m_info->dir_cache.validated(fnSystem.millis());
+
+    int result = _tnfs_load_dir_listing(m_info);
+
+    if (result != TNFS_RESULT_SUCCESS)
+    {
+        _tnfs_close_server_dir(m_info);
+        m_info->dir_cache.drop_current();
+        return result;
+    }
+
+    // We've got everything we need from the server's handle unless we have to page through the directory
+    if (m_info->dir_cache.current()->paged == false)
+        _tnfs_close_server_dir(m_info);
+
+    m_info->dir_entries = m_info->dir_cache.current()->count;
+    return TNFS_RESULT_SUCCESS;
 }
 
 void _readdirx_fill_response(tnfsDirCacheEntry *pCached, tnfsStat *filestat, char *dir_entry, int dir_entry_len)
@@ -676,7 +1376,7 @@ void _readdirx_fill_response(tnfsDirCacheEntry *pCached, tnfsStat *filestat, cha
 
     strlcpy(dir_entry, pCached->entryname, dir_entry_len);
 
-#ifdef DEBUG
+#ifdef VERBOSE_TNFS
     {
         char t_m[80];
         char t_c[80];
@@ -693,189 +1393,85 @@ void _readdirx_fill_response(tnfsDirCacheEntry *pCached, tnfsStat *filestat, cha
 }
 
 /*
-    Reads next available file using open directory handle specified in
-    tnfsMountInfo.dir_handle
+    Reads next entry from the directory opened with tnfs_opendirx
     dir_entry filled with filename up to dir_entry_len
- returns: 0: success, -1: failed to deliver/receive packet, other: TNFS error result code
+ returns: 0: success, -1: no open directory, TNFS_RESULT_END_OF_FILE: no more entries
 */
 int tnfs_readdirx(tnfsMountInfo *m_info, tnfsStat *filestat, char *dir_entry, int dir_entry_len)
 {
-    // Check for a valid open handle ID
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+    if (m_info == nullptr || false == m_info->dir_cache.is_open())
         return -1;
 
-    // See if we have an entry in our directory cache to return first
-    tnfsDirCacheEntry *pCached = m_info->next_dircache_entry();
-    if(pCached != nullptr)
+    tnfsDirCacheEntry *pCached = m_info->dir_cache.next_entry();
+    if (pCached == nullptr)
     {
-        Debug_print("tnfs_readdirx responding from cached entry\n");
-        _readdirx_fill_response(pCached, filestat, dir_entry, dir_entry_len);
-        return 0;
-    }
-    
-    // If the cache was empty and the EOF flag was set, just respond with an EOF error
-    if(m_info->get_dircache_eof() == true)
-    {
-        Debug_print("tnfs_readdirx returning EOF based on cached value\n");
-        return TNFS_RESULT_END_OF_FILE;
-    }
-
-    // Invalidate the cache before loading more
-    m_info->empty_dircache();
-
-#define OFFSET_READDIRX_FLAGS 0
-#define OFFSET_READDIRX_SIZE 1
-#define OFFSET_READDIRX_MTIME 5
-#define OFFSET_READDIRX_CTIME 9
-#define OFFSET_READDIRX_PATH 13
+        tnfsDirListing *pListing = m_info->dir_cache.current();
+        if (pListing->paged == false || pListing->last_page)
+            return TNFS_RESULT_END_OF_FILE;
 
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_READDIRX;
-    packet.payload[0] = m_info->dir_handle;
-    // Number of responses to read
-    packet.payload[1] = TNFS_MAX_DIRCACHE_ENTRIES;
-
-    if (_tnfs_transaction(m_info, packet, 2))
-    {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-            uint8_t response_count = packet.payload[1];
-            uint8_t response_status = packet.payload[2];
-            uint16_t dirpos = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 3);
-
-            // Set our EOF flag if the server tells us there's no more after this
-            if(response_status & TNFS_READDIRX_STATUS_EOF)
-                m_info->set_dircache_eof();
-
-            Debug_printf("tnfs_readdirx resp_count=%hu, dirpos=%hu, status=%hu\n", response_count, dirpos, response_status);
-
-            // Fill our directory cache using the returned values
-            int current_offset = 5;
-            for(int i = 0; i < response_count; i++)
-            {
-                tnfsDirCacheEntry *pEntry = m_info->new_dircache_entry();
-                if(pEntry != nullptr)
-                {
-                    pEntry->dirpos = dirpos + i;
-                    pEntry->flags = 
-                        packet.payload[current_offset + OFFSET_READDIRX_FLAGS];
-                    pEntry->filesize = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_SIZE);
-                    pEntry->m_time = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_MTIME);
-                    pEntry->c_time = 
-                        TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + current_offset + OFFSET_READDIRX_CTIME);
-
-                    int name_len = strlcpy(pEntry->entryname, 
-                        (char *)packet.payload + current_offset + OFFSET_READDIRX_PATH, sizeof(pEntry->entryname));
-
-                    /*
-                     Adjust our offset to point to the next entry within the packet
-                     flags (1) + size (4) + mtime (4) + ctime (4) + null (1) = 14
-                    */ 
-                    current_offset += 14 + name_len;
-                }
-                else
-                {
-                    Debug_print("tnfs_readdirx Failed to allocate new dircache entry!\n");
-                    break;
-                }
-            }
-
-            int loaded = m_info->count_dircache();
-            Debug_printf("tnfs_readdirx cached %d entries\n", loaded);
-            // Now that we've cached our entries, return the first one
-            if(loaded > 0)
-                _readdirx_fill_response(m_info->next_dircache_entry(), filestat, dir_entry, dir_entry_len);
+        int result = _tnfs_load_dir_page(m_info, pListing->next_dirpos);
+        if (result != TNFS_RESULT_SUCCESS)
+            return result;
 
-        }
-        return packet.payload[0];
+        pCached = m_info->dir_cache.next_entry();
+        if (pCached == nullptr)
+            return TNFS_RESULT_END_OF_FILE;
     }
-    return -1;
+
+    _readdirx_fill_response(pCached, filestat, dir_entry, dir_entry_len);
+    return 0;
 }
 
 /*
     TELLDIR
+    Answered from our cached listing
 */
 int tnfs_telldir(tnfsMountInfo *m_info, uint16_t *position)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+    if (m_info == nullptr || false == m_info->dir_cache.is_open())
         return -1;
 
     if(position == nullptr)
         return -1;
 
-    // First see if we're pointing at a currently-cached directory entry and return that
-    int cached = m_info->tell_dircache_entry();
-    if (cached > -1)
-    {
-        *position = cached;
-        return 0;
-    }
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_TELLDIR;
-    packet.payload[0] = m_info->dir_handle;
-
-    if (_tnfs_transaction(m_info, packet, 1))
-    {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-            *position = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + 1);
-        }
-        return packet.payload[0];
-    }
-    return -1;
+    *position = m_info->dir_cache.tell();
+    return 0;
 }
 
 /*
     SEEKDIR
+    Answered from our cached listing, unless it's a page that doesn't hold the position
 */
 int tnfs_seekdir(tnfsMountInfo *m_info, uint16_t position)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+    if (m_info == nullptr || false == m_info->dir_cache.is_open())
         return -1;
 
-    // A SEEKDIR will always invalidate our directory cache
-    m_info->empty_dircache();
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_SEEKDIR;
-    packet.payload[0] = m_info->dir_handle;
-    uint32_t pos = position;
-    TNFS_UINT32_TO_LOHI_BYTEPTR(pos, packet.payload + 1);
-
-    if (_tnfs_transaction(m_info, packet, 5))
-        return packet.payload[0];
+    tnfsDirListing *pListing = m_info->dir_cache.current();
+    if (pListing->paged)
+    {
+        uint16_t first = pListing->count > 0 ? ((tnfsDirCacheEntry *)(pListing->data + pListing->offsets[0]))->dirpos : 0;
+        if (position < first || (pListing->last_page == false && position >= pListing->next_dirpos))
+            return _tnfs_load_dir_page(m_info, position);
+    }
 
-    return -1;
+    m_info->dir_cache.seek(position);
+    return 0;
 }
 
 /*
-    Closes current directory handle specificed in tnfsMountInfo
-    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+    Closes the directory opened with tnfs_opendirx.
+    The listing stays in our cache for the next time the directory is opened
+    (unless it was too big and we were paging through it).
+    Returns: 0: success, -1: no open directory
 */
 int tnfs_closedir(tnfsMountInfo *m_info)
 {
-    if (m_info == nullptr || false == TNFS_VALID_AS_UINT8(m_info->dir_handle))
+    if (m_info == nullptr || false == m_info->dir_cache.is_open())
         return -1;
 
-    // Throw out any existing cached directory entries
-    m_info->empty_dircache();
-
-    tnfsPacket packet;
-    packet.command = TNFS_CMD_CLOSEDIR;
-    packet.payload[0] = m_info->dir_handle;
-
-    if (_tnfs_transaction(m_info, packet, 1))
-    {
-        if (packet.payload[0] == TNFS_RESULT_SUCCESS)
-        {
-            m_info->dir_handle = TNFS_INVALID_HANDLE;
-        }
-        return packet.payload[0];
-    }
-    return -1;
+    _tnfs_close_dir_listing(m_info);
+    return 0;
 }
 
 /*
@@ -894,6 +1490,9 @@ int tnfs_mkdir(tnfsMountInfo *m_info, const char *directory)
 
     Debug_printf("TNFS make directory: \"%s\"\n", (char *)packet.payload);
 
+    m_info->dir_cache.invalidate();
+    m_info->note_change();
+
     if (_tnfs_transaction(m_info, packet, len + 1))
     {
         return packet.payload[0];
@@ -917,6 +1516,9 @@ int tnfs_rmdir(tnfsMountInfo *m_info, const char *directory)
 
     Debug_printf("TNFS remove directory: \"%s\"\n", (char *)packet.payload);
 
+    m_info->dir_cache.invalidate();
+    m_info->note_change();
+
     if (_tnfs_transaction(m_info, packet, len + 1))
     {
         return packet.payload[0];
@@ -936,7 +1538,10 @@ int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
     tnfsPacket packet;
     packet.command = TNFS_CMD_STAT;
 
-    int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
+    // Keep a copy of the full path so we can remember the result
+    char fullpath[TNFS_MAX_FILELEN];
+    int len = _tnfs_adjust_with_full_path(m_info, fullpath, filepath, sizeof(fullpath));
+    strlcpy((char *)packet.payload, fullpath, sizeof(packet.payload));
 
     // Debug_printf("TNFS stat: \"%s\"\n", (char *)packet.payload);
 
@@ -973,11 +1578,40 @@ int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
             */
         }
         __END_IGNORE_UNUSEDVARS
+        if (packet.payload[0] == TNFS_RESULT_SUCCESS || packet.payload[0] == TNFS_RESULT_FILE_NOT_FOUND)
+            m_info->store_stat(fullpath, packet.payload[0], packet.payload[0] == TNFS_RESULT_SUCCESS ? filestat : nullptr, fnSystem.millis());
         return packet.payload[0];
     }
     return -1;
 }
 
+/*
+    Returns file information filled in tnfsStat, answering from the mount's stat cache
+    if we've asked about the same path in the last TNFS_STATCACHE_TTL milliseconds.
+    "Not found" responses are remembered too.
+    Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
+*/
+int tnfs_stat_cached(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
+{
+    if (m_info == nullptr || filepath == nullptr || filestat == nullptr)
+        return -1;
+
+    char fullpath[TNFS_MAX_FILELEN];
+    _tnfs_adjust_with_full_path(m_info, fullpath, filepath, sizeof(fullpath));
+
+    tnfsStatCacheEntry *pCached = m_info->find_stat(fullpath, fnSystem.millis());
+    if (pCached == nullptr)
+    {
+        m_info->metadata_stats.stat_misses++;
+        return tnfs_stat(m_info, filestat, filepath);
+    }
+
+    m_info->metadata_stats.stat_hits++;
+    if (pCached->result == TNFS_RESULT_SUCCESS)
+        *filestat = pCached->filestat;
+    return pCached->result;
+}
+
 /*
     Deletes file.
     Returns: 0: success, -1: failed to send/receive packet, other: TNFS server response
@@ -994,6 +1628,10 @@ int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath)
 
     Debug_printf("TNFS unlink file: \"%s\"\n", (char *)packet.payload);
 
+    m_info->block_cache.forget_file((char *)packet.payload);
+    m_info->dir_cache.invalidate();
+    m_info->note_change();
+
     if (_tnfs_transaction(m_info, packet, len + 1))
     {
         return packet.payload[0];
@@ -1019,6 +1657,11 @@ int tnfs_rename(tnfsMountInfo *m_info, const char *old_filepath, const char *new
 
     Debug_printf("TNFS rename file: \"%s\" -> \"%s\"\n", (char *)packet.payload, (char *)(packet.payload + l1));
 
+    m_info->block_cache.forget_file((char *)packet.payload);
+    m_info->block_cache.forget_file((char *)(packet.payload + l1));
+    m_info->dir_cache.invalidate();
+    m_info->note_change();
+
     if (_tnfs_transaction(m_info, packet, l1 + l2))
     {
         return packet.payload[0];
@@ -1105,6 +1748,19 @@ int tnfs_free(tnfsMountInfo *m_info, uint32_t *size)
 // HELPER TNFS FUNCTIONS (Aren't actual TNFSD commands)
 // ------------------------------------------------
 
+/*
+ Fills buffer with the full path on the server for the given path,
+ relative to our current working directory
+ Returns length of the full path or -1 on failure
+*/
+int tnfs_fullpath(tnfsMountInfo *m_info, const char *filepath, char *buffer, int bufflen)
+{
+    if (m_info == nullptr || filepath == nullptr)
+        return -1;
+
+    return _tnfs_adjust_with_full_path(m_info, buffer, filepath, bufflen);
+}
+
 /*
  Returns the filepath associated with an open filehandle
 */
@@ -1169,13 +1825,268 @@ const char *tnfs_getcwd(tnfsMountInfo *m_info)
 // INTERNAL UTILITY FUNCTIONS
 // ------------------------------------------------
 
+/*
+ Opens our TCP connection to the server if we don't already have one
+*/
+bool _tnfs_tcp_connect(tnfsMountInfo *m_info)
+{
+    if (m_info->tcp_client.connected())
+        return true;
+
+    m_info->tcp_client.stop();
+
+    int result;
+    if (m_info->host_ip != IPADDR_NONE)
+        result = m_info->tcp_client.connect(m_info->host_ip, m_info->port, TNFS_TCP_TIMEOUT);
+    else
+        result = m_info->tcp_client.connect(m_info->hostname, m_info->port, TNFS_TCP_TIMEOUT);
+
+    if (result == 0)
+    {
+        Debug_printf("TNFS failed to connect to %s:%hu over TCP\n", m_info->hostname, m_info->port);
+        return false;
+    }
+
+    // Every request waits for its reply, so don't let Nagle hold them back
+    m_info->tcp_client.setNoDelay(true);
+    m_info->transport_stats.connects++;
+
+    return true;
+}
+
+/*
+ Reads exactly len bytes from our TCP connection into dest
+ Returns false if the connection dropped or timeout_ms passed since ms_start first
+*/
+bool _tnfs_tcp_read(tnfsMountInfo *m_info, uint8_t *dest, uint16_t len, uint32_t ms_start)
+{
+    uint16_t got = 0;
+    while (got < len)
+    {
+        if (m_info->tcp_client.available() > 0)
+        {
+            int result = m_info->tcp_client.read(dest + got, len - got);
+            if (result > 0)
+            {
+                got += result;
+                continue;
+            }
+        }
+        if (false == m_info->tcp_client.connected() || (fnSystem.millis() - ms_start) >= TNFS_TCP_TIMEOUT)
+            return false;
+
+        fnSystem.yield();
+    }
+    return true;
+}
+
+/*
+ Reads a zero-terminated string from our TCP connection into pkt at offset *len,
+ moving *len past the terminator
+*/
+bool _tnfs_tcp_read_string(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t *len, uint32_t ms_start)
+{
+    do
+    {
+        if (*len >= sizeof(pkt.rawData))
+            return false;
+        if (false == _tnfs_tcp_read(m_info, pkt.rawData + *len, 1, ms_start))
+            return false;
+    } while (pkt.rawData[(*len)++] != '\0');
+
+    return true;
+}
+
+/*
+ Reads the rest of a response from our TCP connection, pkt already holding its
+ header and result code.
+ TCP doesn't keep message boundaries, so how much is left to read depends on the
+ command and result code, and every variable length field has to be read to find
+ where the next response starts.
+ Newer servers follow a successful LSEEK result with the new position, older ones
+ don't, and nothing in MOUNT tells them apart. We don't use it (see tnfs_lseek), so
+ it isn't read here; if it was sent, it's thrown away by the flush before our next request.
+ Returns the total response length or -1 if the connection failed or timed out
+*/
+int _tnfs_tcp_read_response(tnfsMountInfo *m_info, tnfsPacket &pkt, uint32_t ms_start)
+{
+    uint16_t len = TNFS_HEADER_SIZE + 1;
+    uint8_t result = pkt.payload[0];
+
+    // Number of bytes that always follow the result code
+    uint16_t fixed = 0;
+    if (pkt.command == TNFS_CMD_MOUNT)
+        fixed = result == TNFS_RESULT_SUCCESS ? 4 : 2; // Server version (and minimum retry time)
+    else if (result == TNFS_RESULT_SUCCESS)
+    {
+        switch (pkt.command)
+        {
+        case TNFS_CMD_OPEN:
+        case TNFS_CMD_OPENDIR:
+            fixed = 1;
+            break;
+        case TNFS_CMD_READ:
+        case TNFS_CMD_WRITE:
+            fixed = 2;
+            break;
+        case TNFS_CMD_OPENDIRX:
+            fixed = 3;
+            break;
+        case TNFS_CMD_READDIRX:
+        case TNFS_CMD_TELLDIR:
+        case TNFS_CMD_SIZE:
+        case TNFS_CMD_FREE:
+            fixed = 4;
+            break;
+        case TNFS_CMD_STAT:
+            fixed = 22;
+            break;
+        }
+    }
+
+    if (fixed > 0 && false == _tnfs_tcp_read(m_info, pkt.rawData + len, fixed, ms_start))
+        return -1;
+    len += fixed;
+
+    if (result != TNFS_RESULT_SUCCESS)
+        return len;
+
+    switch (pkt.command)
+    {
+    case TNFS_CMD_READ:
+    {
+        uint16_t data_len = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
+        if (data_len > TNFS_MAX_READWRITE_PAYLOAD || false == _tnfs_tcp_read(m_info, pkt.rawData + len, data_len, ms_start))
+            return -1;
+        len += data_len;
+        break;
+    }
+    case TNFS_CMD_READDIR:
+        if (false == _tnfs_tcp_read_string(m_info, pkt, &len, ms_start))
+            return -1;
+        break;
+    case TNFS_CMD_STAT:
+        // User and group names follow the fixed fields
+        if (false == _tnfs_tcp_read_string(m_info, pkt, &len, ms_start) ||
+            false == _tnfs_tcp_read_string(m_info, pkt, &len, ms_start))
+            return -1;
+        break;
+    case TNFS_CMD_READDIRX:
+        // Each entry is flags (1) + size (4) + mtime (4) + ctime (4) followed by its name
+        for (int i = 0; i < pkt.payload[1]; i++)
+        {
+            if (len + 13 > sizeof(pkt.rawData) || false == _tnfs_tcp_read(m_info, pkt.rawData + len, 13, ms_start))
+                return -1;
+            len += 13;
+            if (false == _tnfs_tcp_read_string(m_info, pkt, &len, ms_start))
+                return -1;
+        }
+        break;
+    }
+
+    return len;
+}
+
+/*
+ _tnfs_transaction over TCP.
+ The connection takes care of lost and out of order packets, so we only retry
+ (after reconnecting) if the connection fails or the server doesn't answer within
+ TNFS_TCP_TIMEOUT. Sequence numbers still work the same way as over UDP.
+*/
+bool _tnfs_tcp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    int retry = 0;
+    while (retry < m_info->max_retries)
+    {
+        bool try_again = false;
+
+        if (_tnfs_tcp_connect(m_info))
+        {
+            // Nothing should be waiting (except maybe an LSEEK position), but make sure stray bytes
+            // can't be taken for our response
+            m_info->tcp_client.flush();
+
+#ifdef DEBUG
+            _tnfs_debug_packet(pkt, payload_size);
+#endif
+            uint16_t len = payload_size + TNFS_HEADER_SIZE;
+            uint32_t ms_start = fnSystem.millis();
+
+            // Only look at the header and result code until we know this is our response,
+            // so pkt still holds our request in case we need to send it again
+            uint8_t header[TNFS_HEADER_SIZE + 1];
+            if (m_info->tcp_client.write(pkt.rawData, len) != len)
+                Debug_println("TNFS failed to send TCP request");
+            else if (false == _tnfs_tcp_read(m_info, header, sizeof(header), ms_start))
+                Debug_printf("TNFS no TCP response after %u milliseconds\n", fnSystem.millis() - ms_start);
+            else if (header[2] != pkt.sequence_num || header[3] != pkt.command)
+                Debug_println("TNFS unexpected TCP response");
+            else if (header[TNFS_HEADER_SIZE] == TNFS_RESULT_TRY_AGAIN)
+            {
+                uint8_t backoff[2] = {0, 0};
+                if (_tnfs_tcp_read(m_info, backoff, sizeof(backoff), ms_start))
+                {
+                    uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(backoff);
+                    Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+                    if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                        backoffms = TNFS_MAX_BACKOFF_DELAY;
+                    m_info->transport_stats.try_again++;
+                    vTaskDelay(backoffms / portTICK_PERIOD_MS);
+
+                    // The server didn't carry out the request, so it needs a new sequence number
+                    pkt.sequence_num = m_info->current_sequence_num++;
+                    try_again = true;
+                }
+            }
+            else
+            {
+                m_info->record_rtt(fnSystem.millis() - ms_start);
+
+                memcpy(pkt.rawData, header, sizeof(header));
+                int l = _tnfs_tcp_read_response(m_info, pkt, ms_start);
+                if (l < 0)
+                {
+                    // Our request is gone and the server has already acted on it, so there's no retrying now
+                    Debug_println("TNFS incomplete TCP response");
+                    m_info->tcp_client.stop();
+                    m_info->transport_stats.timeouts++;
+                    return false;
+                }
+#ifdef DEBUG
+                _tnfs_debug_packet(pkt, l, true);
+#endif
+                m_info->transport_stats.transactions++;
+                return true;
+            }
+
+            // We can't be sure where we are in the stream any more, so start over with a new connection
+            if (try_again == false)
+                m_info->tcp_client.stop();
+        }
+        else
+            vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
+
+        retry++;
+        if (retry < m_info->max_retries)
+            m_info->transport_stats.retries++;
+    }
+
+    Debug_println("Retry attempts failed");
+    m_info->transport_stats.timeouts++;
+
+    return false;
+}
+
 /*
   Send constructed TNFS packet and check for reply
   The send/receive loop will be attempted tnfsPacket.max_retries times (default: TNFS_RETRIES)
-  Each retry attempt is limited to tnfsPacket.timeout_ms (default: TNFS_TIMEOUT)
+  Each attempt waits for tnfsMountInfo.retransmit_timeout(), which is based on the round trip
+  times we've measured so far and doubles with each retry (up to tnfsMountInfo.max_timeout_ms)
 
   Only the command (tnfsPacket.command) and payload contents need to be set on the packet.
   Current session ID will be copied from tnfsMountInfo and retryCount is always reset to zero.
+  Retries reuse the same sequence number so the server can tell they're retries and
+  resend its last response instead of carrying out the command a second time.
   
   If successful, server's response code will be the first byte of of tnfsPacket.data
   
@@ -1190,17 +2101,25 @@ bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_
     pkt.session_idl = TNFS_LOBYTE_FROM_UINT16(m_info->session);
     pkt.session_idh = TNFS_HIBYTE_FROM_UINT16(m_info->session);
 
+    // Set the sequence number
+    pkt.sequence_num = m_info->current_sequence_num++;
+
+    if (m_info->protocol == TNFS_PROTOCOL_TCP)
+        return _tnfs_tcp_transaction(m_info, pkt, payload_size);
+
+    int sends = 0; // Number of times we've sent this sequence number
+
     // Start a new retry sequence
     int retry = 0;
+    int busy = 0; // Retries caused by TRY_AGAIN, which don't mean a packet was lost
     while (retry < m_info->max_retries)
     {
-        // Set the sequence number
-        pkt.sequence_num = m_info->current_sequence_num++;
-
 #ifdef DEBUG
         _tnfs_debug_packet(pkt, payload_size);
 #endif
 
+        uint32_t timeout = m_info->retransmit_timeout(retry - busy);
+
         // Send packet
         bool sent = false;
         // Use the IP address if we have it
@@ -1218,57 +2137,80 @@ bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_
         if (!sent)
         {
             Debug_println("Failed to send packet - retrying");
+            vTaskDelay(timeout / portTICK_PERIOD_MS);
         }
         else
         {
-            // Wait for a response at most TNFS_TIMEOUT milliseconds
-            int ms_start = fnSystem.millis();
-            uint8_t current_sequence_num = pkt.sequence_num;
+            sends++;
+
+            // Wait for a response at most timeout milliseconds
+            uint32_t ms_start = fnSystem.millis();
+            bool try_again = false;
             do
             {
                 if (udp.parsePacket())
                 {
-                    unsigned short l = udp.read(pkt.rawData, sizeof(pkt.rawData));
-                    __IGNORE_UNUSED_VAR(l);
-#ifdef DEBUG
-                    _tnfs_debug_packet(pkt, l, true);
-#endif
+                    // Only look at the header and result code until we know this is our response,
+                    // so pkt still holds our request in case we need to send it again
+                    uint8_t header[TNFS_HEADER_SIZE + 1];
+                    unsigned short l = udp.read(header, sizeof(header));
 
-                    // Out of order packet received.
-                    if (pkt.sequence_num != current_sequence_num)
+                    if (l < sizeof(header) || header[2] != pkt.sequence_num)
                     {
-                        Debug_println("TNFS OUT OF ORDER SEQUENCE! RETRYING");
-                        // Fall through and let retry logic handle it.
+                        Debug_println("TNFS OUT OF ORDER SEQUENCE! IGNORING");
+                        udp.flush();
+                    }
+                    else if (header[TNFS_HEADER_SIZE] == TNFS_RESULT_TRY_AGAIN)
+                    {
+                        // Server should tell us how long it wants us to wait
+                        uint8_t backoff[2] = {0, 0};
+                        udp.read(backoff, sizeof(backoff));
+                        udp.flush();
+                        uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(backoff);
+                        Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+                        if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                            backoffms = TNFS_MAX_BACKOFF_DELAY;
+                        m_info->transport_stats.try_again++;
+                        vTaskDelay(backoffms / portTICK_PERIOD_MS);
+
+                        // The server didn't carry out the request, so it needs a new sequence number
+                        pkt.sequence_num = m_info->current_sequence_num++;
+                        sends = 0;
+                        busy++;
+                        try_again = true;
+                        break;
                     }
                     else
                     {
-                        // Check in case the server asks us to wait and try again
-                        if (pkt.payload[0] != TNFS_RESULT_TRY_AGAIN)
-                            return true;
-                        else
-                        {
-                            // Server should tell us how long it wants us to wait
-                            uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
-                            Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
-                            if (backoffms > TNFS_MAX_BACKOFF_DELAY)
-                                backoffms = TNFS_MAX_BACKOFF_DELAY;
-                            vTaskDelay(backoffms / portTICK_PERIOD_MS);
-                        }
+                        // Only time replies to requests we sent once, since we can't tell which copy a retry's reply belongs to
+                        if (sends == 1)
+                            m_info->record_rtt(fnSystem.millis() - ms_start);
+
+                        memcpy(pkt.rawData, header, sizeof(header));
+                        l += udp.read(pkt.rawData + sizeof(header), sizeof(pkt.rawData) - sizeof(header));
+                        __IGNORE_UNUSED_VAR(l);
+#ifdef DEBUG
+                        _tnfs_debug_packet(pkt, l, true);
+#endif
+                        m_info->transport_stats.transactions++;
+                        return true;
                     }
                 }
                 fnSystem.yield();
 
-            } while ((fnSystem.millis() - ms_start) < m_info->timeout_ms);
+            } while ((fnSystem.millis() - ms_start) < timeout);
 
-            Debug_printf("Timeout after %d milliseconds. Retrying\n", m_info->timeout_ms);
+            if (try_again == false)
+                Debug_printf("Timeout after %u milliseconds. Retrying\n", timeout);
         }
 
-        // Make sure we wait before retrying
-        vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
         retry++;
+        if (retry < m_info->max_retries)
+            m_info->transport_stats.retries++;
     }
 
     Debug_println("Retry attempts failed");
+    m_info->transport_stats.timeouts++;
 
     return false;
 }
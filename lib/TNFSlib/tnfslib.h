@@ -139,15 +139,6 @@ union tnfsPacket {
     uint8_t rawData[TNFS_HEADER_SIZE + TNFS_PAYLOAD_SIZE];
 };
 
-struct tnfsStat
-{
-    bool isDir;
-    uint32_t filesize;
-    uint32_t a_time;
-    uint32_t m_time;
-    uint32_t c_time;
-};
-
 // Retruns a uint16 value given two bytes in high-low order
 #define TNFS_UINT16_FROM_HILOBYTES(high, low) ((uint16_t)high << 8 | low)
 
@@ -196,6 +187,7 @@ int tnfs_read(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint1
 int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint16_t bufflen, uint16_t *resultlen);
 int tnfs_close(tnfsMountInfo *m_info, int16_t file_handle);
 int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath);
+int tnfs_stat_cached(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath);
 int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uint8_t type, uint32_t *new_position = nullptr, bool skip_cache = false);
 int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath);
 int tnfs_chmod(tnfsMountInfo *m_info, const char *filepath, uint16_t mode);
@@ -204,6 +196,7 @@ int tnfs_rename(tnfsMountInfo *m_info, const char *old_filepath, const char *new
 int tnfs_chdir(tnfsMountInfo *m_info, const char *dirpath);
 const char *tnfs_getcwd(tnfsMountInfo *m_info);
 const char *tnfs_filepath(tnfsMountInfo *m_info, int16_t file_handle);
+int tnfs_fullpath(tnfsMountInfo *m_info, const char *filepath, char *buffer, int bufflen);
 
 int tnfs_code_to_errno(int tnfs_code);
 
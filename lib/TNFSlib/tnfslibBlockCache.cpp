@@ -0,0 +1,282 @@
+#include <cstring>
+#include <esp_heap_caps.h>
+
+#include "tnfslibBlockCache.h"
+#include "../../include/debug.h"
+
+void tnfs_set_path(char **dest, const char *src)
+{
+    if (*dest != nullptr)
+        free(*dest);
+    *dest = nullptr;
+    if (src == nullptr)
+        return;
+
+    size_t len = strlen(src) + 1;
+    *dest = (char *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (*dest == nullptr)
+        *dest = (char *)malloc(len);
+    if (*dest != nullptr)
+        memcpy(*dest, src, len);
+}
+
+tnfsBlockCache::~tnfsBlockCache()
+{
+    end();
+}
+
+/*
+ Allocates space for block_count blocks in PSRAM.
+ Calling this on a cache that's already been set up does nothing.
+ Returns false if the cache is disabled or we couldn't get the memory.
+*/
+bool tnfsBlockCache::begin(uint16_t block_count)
+{
+    if (_entries != nullptr)
+        return true;
+
+    if (block_count == 0)
+        return false;
+
+    _data = (uint8_t *)heap_caps_malloc(block_count * TNFS_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _staging = (uint8_t *)heap_caps_malloc(TNFS_READAHEAD_BLOCKS * TNFS_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _entries = new tnfsBlockCacheEntry[block_count];
+
+    if (_data == nullptr || _staging == nullptr || _entries == nullptr)
+    {
+        Debug_printf("tnfsBlockCache failed to allocate %u blocks\n", block_count);
+        end();
+        return false;
+    }
+
+    _block_count = block_count;
+    Debug_printf("tnfsBlockCache allocated %u blocks (%u bytes)\n", _block_count, _block_count * TNFS_BLOCK_SIZE);
+    return true;
+}
+
+// Frees all cache memory and forgets about every file
+void tnfsBlockCache::end()
+{
+    if (_data != nullptr)
+        free(_data);
+    if (_staging != nullptr)
+        free(_staging);
+    if (_entries != nullptr)
+        delete[] _entries;
+
+    _data = nullptr;
+    _staging = nullptr;
+    _entries = nullptr;
+    _block_count = 0;
+
+    for (int i = 0; i < TNFS_BLOCK_CACHE_FILES; i++)
+        _free_file(i);
+}
+
+// Throws out every cached block and file but keeps the memory
+void tnfsBlockCache::clear()
+{
+    for (int i = 0; i < _block_count; i++)
+        _entries[i] = tnfsBlockCacheEntry();
+    for (int i = 0; i < TNFS_BLOCK_CACHE_FILES; i++)
+        _free_file(i);
+}
+
+void tnfsBlockCache::_free_file(int file_id)
+{
+    tnfs_set_path(&_files[file_id].path, nullptr);
+    _files[file_id] = tnfsBlockCacheFile();
+}
+
+int tnfsBlockCache::_find_block(int file_id, uint32_t offset)
+{
+    for (int i = 0; i < _block_count; i++)
+        if (_entries[i].file_id == file_id && _entries[i].offset == offset)
+            return i;
+    return -1;
+}
+
+void tnfsBlockCache::_drop_file_blocks(int file_id)
+{
+    for (int i = 0; i < _block_count; i++)
+    {
+        if (_entries[i].file_id == file_id)
+        {
+            _entries[i] = tnfsBlockCacheEntry();
+            _stats.invalidations++;
+        }
+    }
+}
+
+/*
+ Registers an open handle on the file at path and returns the ID used to key its blocks.
+ If we already hold blocks for that path but the size or modification time the server
+ reports has changed, or the file is being truncated, those blocks are thrown out.
+ Returns TNFS_BLOCK_CACHE_NO_FILE if the cache isn't set up or every slot is in use.
+*/
+int tnfsBlockCache::open_file(const char *path, uint32_t filesize, uint32_t m_time, bool truncate)
+{
+    if (_entries == nullptr || path == nullptr)
+        return TNFS_BLOCK_CACHE_NO_FILE;
+
+    _clock++;
+
+    int file_id = TNFS_BLOCK_CACHE_NO_FILE;
+    int free_slot = TNFS_BLOCK_CACHE_NO_FILE;
+    for (int i = 0; i < TNFS_BLOCK_CACHE_FILES; i++)
+    {
+        if (_files[i].in_use == false)
+        {
+            if (free_slot == TNFS_BLOCK_CACHE_NO_FILE)
+                free_slot = i;
+        }
+        else if (strcmp(_files[i].path, path) == 0)
+        {
+            file_id = i;
+            break;
+        }
+    }
+
+    if (file_id != TNFS_BLOCK_CACHE_NO_FILE)
+    {
+        tnfsBlockCacheFile &f = _files[file_id];
+        if (truncate || f.filesize != filesize || f.m_time != m_time)
+        {
+            Debug_printf("tnfsBlockCache \"%s\" changed on server - dropping cached blocks\n", path);
+            _drop_file_blocks(file_id);
+        }
+    }
+    else
+    {
+        // Recycle the least recently used file nobody has open if the table is full
+        if (free_slot == TNFS_BLOCK_CACHE_NO_FILE)
+        {
+            for (int i = 0; i < TNFS_BLOCK_CACHE_FILES; i++)
+            {
+                if (_files[i].open_count == 0 &&
+                    (free_slot == TNFS_BLOCK_CACHE_NO_FILE || _files[i].last_used < _files[free_slot].last_used))
+                    free_slot = i;
+            }
+            if (free_slot == TNFS_BLOCK_CACHE_NO_FILE)
+                return TNFS_BLOCK_CACHE_NO_FILE;
+            _drop_file_blocks(free_slot);
+        }
+        file_id = free_slot;
+        tnfs_set_path(&_files[file_id].path, path);
+        if (_files[file_id].path == nullptr)
+        {
+            _files[file_id].in_use = false;
+            return TNFS_BLOCK_CACHE_NO_FILE;
+        }
+        _files[file_id].in_use = true;
+        _files[file_id].open_count = 0;
+    }
+
+    tnfsBlockCacheFile &f = _files[file_id];
+    f.open_count++;
+    f.filesize = filesize;
+    f.m_time = m_time;
+    f.last_used = _clock;
+
+    return file_id;
+}
+
+// Notes that a handle using file_id was closed. Its blocks stay cached for the next open.
+void tnfsBlockCache::close_file(int file_id)
+{
+    if (file_id < 0 || file_id >= TNFS_BLOCK_CACHE_FILES)
+        return;
+    if (_files[file_id].open_count > 0)
+        _files[file_id].open_count--;
+}
+
+// Drops everything we know about path (used when a file is deleted or renamed)
+void tnfsBlockCache::forget_file(const char *path)
+{
+    if (_entries == nullptr || path == nullptr)
+        return;
+
+    for (int i = 0; i < TNFS_BLOCK_CACHE_FILES; i++)
+    {
+        if (_files[i].in_use && strcmp(_files[i].path, path) == 0)
+        {
+            _drop_file_blocks(i);
+            // Keep the slot if someone still has the file open so their ID stays valid
+            if (_files[i].open_count == 0)
+                _free_file(i);
+        }
+    }
+}
+
+/*
+ Copies the cached block at offset (a multiple of TNFS_BLOCK_SIZE) into dest,
+ which must hold TNFS_BLOCK_SIZE bytes. Length of the block is stored in length.
+ Returns true on a cache hit.
+*/
+bool tnfsBlockCache::get(int file_id, uint32_t offset, uint8_t *dest, uint16_t *length)
+{
+    if (_entries == nullptr || file_id == TNFS_BLOCK_CACHE_NO_FILE)
+        return false;
+
+    int i = _find_block(file_id, offset);
+    if (i < 0)
+    {
+        _stats.misses++;
+        return false;
+    }
+
+    _stats.hits++;
+    _entries[i].last_used = ++_clock;
+    _files[file_id].last_used = _clock;
+    memcpy(dest, _data + i * TNFS_BLOCK_SIZE, _entries[i].length);
+    *length = _entries[i].length;
+    return true;
+}
+
+// Stores a block, replacing any existing copy or the least recently used block
+void tnfsBlockCache::put(int file_id, uint32_t offset, const uint8_t *src, uint16_t length)
+{
+    if (_entries == nullptr || file_id == TNFS_BLOCK_CACHE_NO_FILE || length > TNFS_BLOCK_SIZE)
+        return;
+
+    int slot = _find_block(file_id, offset);
+    if (slot < 0)
+    {
+        for (int i = 0; i < _block_count; i++)
+        {
+            if (_entries[i].file_id == TNFS_BLOCK_CACHE_NO_FILE)
+            {
+                slot = i;
+                break;
+            }
+            if (slot < 0 || _entries[i].last_used < _entries[slot].last_used)
+                slot = i;
+        }
+        if (_entries[slot].file_id != TNFS_BLOCK_CACHE_NO_FILE)
+            _stats.evictions++;
+    }
+
+    _entries[slot].file_id = file_id;
+    _entries[slot].offset = offset;
+    _entries[slot].length = length;
+    _entries[slot].last_used = ++_clock;
+    memcpy(_data + slot * TNFS_BLOCK_SIZE, src, length);
+}
+
+// Throws out any blocks of file_id overlapping the given byte range
+void tnfsBlockCache::invalidate(int file_id, uint32_t start, uint32_t length)
+{
+    if (_entries == nullptr || file_id == TNFS_BLOCK_CACHE_NO_FILE || length == 0)
+        return;
+
+    uint32_t end = start + length;
+    for (int i = 0; i < _block_count; i++)
+    {
+        if (_entries[i].file_id == file_id &&
+            _entries[i].offset < end && _entries[i].offset + TNFS_BLOCK_SIZE > start)
+        {
+            _entries[i] = tnfsBlockCacheEntry();
+            _stats.invalidations++;
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef _TNFSLIB_BLOCKCACHE_H
+#define _TNFSLIB_BLOCKCACHE_H
+
+#include <cstdint>
+
+#define TNFS_BLOCK_SIZE 512 // Matches TNFS_FILE_CACHE_SIZE so a block can be copied straight into a file handle's cache
+#define TNFS_BLOCK_CACHE_BLOCKS 128 // Default number of blocks (64KB) kept in PSRAM per mount; 0 disables the cache
+#define TNFS_BLOCK_CACHE_FILES 16 // Max number of distinct files we'll hold blocks for
+#define TNFS_READAHEAD_BLOCKS 4 // Blocks loaded at once when sequential access is detected
+#define TNFS_READAHEAD_TRIGGER 2 // Number of back-to-back sequential block loads before we start reading ahead
+
+#define TNFS_BLOCK_CACHE_NO_FILE -1
+
+// Replaces *dest with a copy of src in PSRAM (or frees it if src is nullptr)
+void tnfs_set_path(char **dest, const char *src);
+
+struct tnfsBlockCacheStats
+{
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t readahead_blocks = 0; // Extra blocks loaded because we detected sequential access
+    uint32_t evictions = 0;
+    uint32_t invalidations = 0; // Blocks thrown out because of a write, truncate or change on the server
+};
+
+// A file we're holding blocks for
+struct tnfsBlockCacheFile
+{
+    bool in_use = false;
+    uint8_t open_count = 0;
+    uint32_t filesize = 0;
+    uint32_t m_time = 0;
+    uint32_t last_used = 0;
+    char *path = nullptr; // Allocated by tnfs_set_path
+};
+
+// One cached block of a file
+struct tnfsBlockCacheEntry
+{
+    int8_t file_id = TNFS_BLOCK_CACHE_NO_FILE;
+    uint16_t length = 0;
+    uint32_t offset = 0; // Always a multiple of TNFS_BLOCK_SIZE
+    uint32_t last_used = 0;
+};
+
+/*
+ Mount-wide LRU cache of fixed-size file blocks, keyed by file path and block offset.
+ Block data lives in PSRAM and is only allocated on the first call to begin().
+*/
+class tnfsBlockCache
+{
+private:
+    tnfsBlockCacheFile _files[TNFS_BLOCK_CACHE_FILES];
+    tnfsBlockCacheEntry *_entries = nullptr;
+    uint8_t *_data = nullptr;
+    uint8_t *_staging = nullptr;
+    uint16_t _block_count = 0;
+    uint32_t _clock = 0;
+
+    tnfsBlockCacheStats _stats;
+
+    int _find_block(int file_id, uint32_t offset);
+    void _free_file(int file_id);
+    void _drop_file_blocks(int file_id);
+
+public:
+    ~tnfsBlockCache();
+
+    bool begin(uint16_t block_count);
+    void end();
+    bool ready() { return _entries != nullptr; };
+    uint16_t block_count() { return _block_count; };
+
+    int open_file(const char *path, uint32_t filesize, uint32_t m_time, bool truncate);
+    void close_file(int file_id);
+    void forget_file(const char *path);
+
+    bool get(int file_id, uint32_t offset, uint8_t *dest, uint16_t *length);
+    void put(int file_id, uint32_t offset, const uint8_t *src, uint16_t length);
+    void invalidate(int file_id, uint32_t start, uint32_t length);
+    void clear();
+
+    // Scratch space big enough for TNFS_READAHEAD_BLOCKS blocks
+    uint8_t *staging() { return _staging; };
+
+    void note_readahead(uint16_t blocks) { _stats.readahead_blocks += blocks; };
+    const tnfsBlockCacheStats &stats() { return _stats; };
+};
+
+#endif // _TNFSLIB_BLOCKCACHE_H
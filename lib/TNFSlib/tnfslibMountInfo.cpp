@@ -1,4 +1,5 @@
 #include <cstring>
+#include <esp_heap_caps.h>
 
 #include "tnfslibMountInfo.h"
 
@@ -23,63 +24,226 @@ tnfsMountInfo::~tnfsMountInfo()
         if (_file_handles[i] != nullptr)
             delete _file_handles[i];
     }
-    // Delete any remaining directory cache entries
-    empty_dircache();
+
+    for (int i = 0; i < TNFS_STATCACHE_ENTRIES; i++)
+        tnfs_set_path(&stat_cache[i].path, nullptr);
+}
+
+tnfsDirCache::~tnfsDirCache()
+{
+    for (int i = 0; i < TNFS_DIRCACHE_LISTINGS; i++)
+        _free_listing(_listings[i]);
 }
 
-// Empty the current contents of the directory cache
-void tnfsMountInfo::empty_dircache()
+void tnfsDirCache::_free_listing(tnfsDirListing &l)
 {
-    for (int i = 0; i < TNFS_MAX_DIRCACHE_ENTRIES; i++)
+    if (l.offsets != nullptr)
+        free(l.offsets);
+    if (l.data != nullptr)
+        free(l.data);
+    tnfs_set_path(&l.path, nullptr);
+    tnfs_set_path(&l.pattern, nullptr);
+    l = tnfsDirListing();
+}
+
+/*
+ Looks for a listing of path loaded with the same options and makes it the current one.
+ The caller is responsible for deciding whether the listing is still fresh.
+*/
+bool tnfsDirCache::find(const char *path, const char *pattern, uint8_t sortopts, uint8_t diropts, uint16_t maxresults)
+{
+    _current = -1;
+    _cursor = 0;
+
+    for (int i = 0; i < TNFS_DIRCACHE_LISTINGS; i++)
     {
-        if (_dir_cache[i] != nullptr)
+        tnfsDirListing &l = _listings[i];
+        if (l.in_use && l.paged == false && l.stale == false && l.sortopts == sortopts && l.diropts == diropts && l.maxresults == maxresults &&
+            strcmp(l.path, path) == 0 && strcmp(l.pattern, pattern) == 0)
         {
-            delete _dir_cache[i];
-            _dir_cache[i] = nullptr;
+            l.last_used = ++_clock;
+            _current = i;
+            return true;
         }
     }
-    _dir_cache_current = 0;
-    _dir_cache_count = 0;
-    _dir_cache_eof = false;
+    return false;
 }
 
 /*
- Add a new entry to the directory cache and return a pointer to it
- Null is returned if we've reached TNFS_MAX_DIRCACHE_ENTRIES
+ Starts a new, empty listing (replacing the least recently used one) and makes it the current one.
+ Returns false if there was no memory for its path.
 */
-tnfsDirCacheEntry * tnfsMountInfo::new_dircache_entry()
+bool tnfsDirCache::create(const char *path, const char *pattern, uint8_t sortopts, uint8_t diropts, uint16_t maxresults, uint32_t dir_mtime)
+{
+    int slot = 0;
+    for (int i = 0; i < TNFS_DIRCACHE_LISTINGS; i++)
+    {
+        if (_listings[i].in_use == false || _listings[i].stale)
+        {
+            slot = i;
+            break;
+        }
+        if (_listings[i].last_used < _listings[slot].last_used)
+            slot = i;
+    }
+
+    tnfsDirListing &l = _listings[slot];
+    _free_listing(l);
+
+    tnfs_set_path(&l.path, path);
+    tnfs_set_path(&l.pattern, pattern);
+    if (l.path == nullptr || l.pattern == nullptr)
+    {
+        _free_listing(l);
+        return false;
+    }
+
+    l.in_use = true;
+    l.sortopts = sortopts;
+    l.diropts = diropts;
+    l.maxresults = maxresults;
+    l.dir_mtime = dir_mtime;
+    l.last_used = ++_clock;
+
+    _current = slot;
+    _cursor = 0;
+    return true;
+}
+
+// Throws out the current listing
+void tnfsDirCache::drop_current()
+{
+    if (_current >= 0)
+        _free_listing(_listings[_current]);
+    close();
+}
+
+// Empties the current listing so the next page of the directory can be loaded into it
+void tnfsDirCache::clear_current()
+{
+    if (_current < 0)
+        return;
+
+    tnfsDirListing &l = _listings[_current];
+    l.count = 0;
+    l.data_used = 0;
+    _cursor = 0;
+}
+
+// Throws out every listing (used when we change something on the server)
+void tnfsDirCache::invalidate()
 {
-    if(_dir_cache_count >= TNFS_MAX_DIRCACHE_ENTRIES)
+    for (int i = 0; i < TNFS_DIRCACHE_LISTINGS; i++)
+    {
+        // Someone's still reading the current listing, so just make sure it won't be found again
+        if (i == _current)
+            _listings[i].stale = true;
+        else
+            _free_listing(_listings[i]);
+    }
+}
+
+/*
+ Add a new entry to the end of the current listing and return a pointer to it
+ Null is returned if we've reached TNFS_MAX_DIRCACHE_ENTRIES or are out of memory
+*/
+tnfsDirCacheEntry *tnfsDirCache::add_entry(uint16_t dirpos, uint8_t flags, uint32_t filesize, uint32_t m_time, uint32_t c_time, const char *name)
+{
+    if (_current < 0)
         return nullptr;
 
-    _dir_cache[_dir_cache_count] = new tnfsDirCacheEntry();
-    _dir_cache_count ++;
-    return _dir_cache[_dir_cache_count - 1];
+    tnfsDirListing &l = _listings[_current];
+    if (l.count >= TNFS_MAX_DIRCACHE_ENTRIES)
+        return nullptr;
+
+    // Grow the offset table if needed
+    if (l.count >= l.offsets_size)
+    {
+        uint16_t new_size = l.offsets_size + 128;
+        uint32_t *p = (uint32_t *)heap_caps_realloc(l.offsets, new_size * sizeof(uint32_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (p == nullptr)
+            return nullptr;
+        l.offsets = p;
+        l.offsets_size = new_size;
+    }
+
+    // Keep every entry 4-byte aligned
+    uint32_t entry_size = sizeof(tnfsDirCacheEntry) + strlen(name) + 1;
+    entry_size = (entry_size + 3) & ~3;
+
+    if (l.data_used + entry_size > l.data_size)
+    {
+        uint32_t new_size = l.data_size + (entry_size > TNFS_DIRCACHE_CHUNK ? entry_size : TNFS_DIRCACHE_CHUNK);
+        uint8_t *p = (uint8_t *)heap_caps_realloc(l.data, new_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (p == nullptr)
+            return nullptr;
+        l.data = p;
+        l.data_size = new_size;
+    }
+
+    tnfsDirCacheEntry *pEntry = (tnfsDirCacheEntry *)(l.data + l.data_used);
+    pEntry->dirpos = dirpos;
+    pEntry->flags = flags;
+    pEntry->filesize = filesize;
+    pEntry->m_time = m_time;
+    pEntry->c_time = c_time;
+    strcpy(pEntry->entryname, name);
+
+    l.offsets[l.count++] = l.data_used;
+    l.data_used += entry_size;
+
+    return pEntry;
 }
 
 /*
- Return a pointer to the next unread directory cache entry
- Returns null if there are no cache entries left to read
+ Return a pointer to the next unread entry in the current listing
+ Returns null if there are no entries left to read
 */
-tnfsDirCacheEntry * tnfsMountInfo::next_dircache_entry()
+tnfsDirCacheEntry *tnfsDirCache::next_entry()
 {
-    if(_dir_cache_current >= _dir_cache_count)
+    if (_current < 0 || _cursor >= _listings[_current].count)
         return nullptr;
 
-    _dir_cache_current++;
-    return _dir_cache[_dir_cache_current - 1];
+    tnfsDirListing &l = _listings[_current];
+    return (tnfsDirCacheEntry *)(l.data + l.offsets[_cursor++]);
 }
 
 /*
- Returns the directory position of the currently cached directory
- entry as provided by the server.
- Returns -1 if there is no currently cached entry.
+ Returns the server's directory position for the next unread entry,
+ one past the last entry if we've read them all, or -1 if no directory is open
 */
-int tnfsMountInfo::tell_dircache_entry()
+int tnfsDirCache::tell()
 {
-    if(_dir_cache_current >= _dir_cache_count)
+    if (_current < 0)
         return -1;
-    return _dir_cache[_dir_cache_current]->dirpos;
+
+    tnfsDirListing &l = _listings[_current];
+    if (_cursor < l.count)
+        return ((tnfsDirCacheEntry *)(l.data + l.offsets[_cursor]))->dirpos;
+    if (l.count > 0)
+        return ((tnfsDirCacheEntry *)(l.data + l.offsets[l.count - 1]))->dirpos + 1;
+    return 0;
+}
+
+/*
+ Moves to the entry with the given server directory position.
+ Seeking past the last entry leaves us at the end of the listing.
+*/
+void tnfsDirCache::seek(uint16_t position)
+{
+    if (_current < 0)
+        return;
+
+    tnfsDirListing &l = _listings[_current];
+    _cursor = l.count;
+    for (uint16_t i = 0; i < l.count; i++)
+    {
+        if (((tnfsDirCacheEntry *)(l.data + l.offsets[i]))->dirpos >= position)
+        {
+            _cursor = i;
+            break;
+        }
+    }
 }
 
 /*
@@ -121,6 +285,16 @@ tnfsFileHandleInfo *tnfsMountInfo::new_filehandleinfo()
     return nullptr;
 }
 
+// Returns the number of handles we have open on the server
+int tnfsMountInfo::filehandle_count()
+{
+    int count = 0;
+    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
+        if (_file_handles[i] != nullptr)
+            count++;
+    return count;
+}
+
 /*
  Removes any existing tnfsFileHandleInfo with a matching file handle
 */
@@ -155,3 +329,140 @@ void tnfsMountInfo::delete_filehandleinfo(tnfsFileHandleInfo *pFilehandle)
         }
     }
 }
+
+/*
+ Throws out the internal cache of any open handle on the same file (as identified by
+ its tnfsBlockCache ID) that overlaps the given byte range
+*/
+void tnfsMountInfo::invalidate_filehandle_caches(int cache_file_id, uint32_t start, uint32_t length)
+{
+    if (cache_file_id == TNFS_BLOCK_CACHE_NO_FILE)
+        return;
+
+    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
+    {
+        tnfsFileHandleInfo *p = _file_handles[i];
+        if (p != nullptr && p->cache_file_id == cache_file_id && p->cache_available > 0 &&
+            p->cache_start < start + length && p->cache_start + p->cache_available > start)
+            p->cache_available = 0;
+    }
+}
+
+// Returns our remembered STAT result for path if it's younger than TNFS_STATCACHE_TTL
+tnfsStatCacheEntry *tnfsMountInfo::find_stat(const char *path, uint32_t now)
+{
+    for (int i = 0; i < TNFS_STATCACHE_ENTRIES; i++)
+    {
+        tnfsStatCacheEntry &e = stat_cache[i];
+        if (e.in_use && (now - e.fetched_ms) < TNFS_STATCACHE_TTL && strcmp(e.path, path) == 0)
+            return &e;
+    }
+    return nullptr;
+}
+
+// Remembers a STAT result for path, replacing any older result for it or the oldest entry we have
+void tnfsMountInfo::store_stat(const char *path, int result, const tnfsStat *filestat, uint32_t now)
+{
+    int slot = 0;
+    for (int i = 0; i < TNFS_STATCACHE_ENTRIES; i++)
+    {
+        if (stat_cache[i].in_use && strcmp(stat_cache[i].path, path) == 0)
+        {
+            slot = i;
+            break;
+        }
+        if (stat_cache[i].in_use == false || stat_cache[i].fetched_ms < stat_cache[slot].fetched_ms)
+            slot = i;
+    }
+
+    tnfsStatCacheEntry &e = stat_cache[slot];
+    if (e.path == nullptr || strcmp(e.path, path) != 0)
+        tnfs_set_path(&e.path, path);
+    e.in_use = e.path != nullptr;
+    e.result = result;
+    if (filestat != nullptr)
+        e.filestat = *filestat;
+    e.fetched_ms = now;
+}
+
+// Called when we change something on the server so nothing we remember about it is trusted
+void tnfsMountInfo::note_change()
+{
+    change_count++;
+    for (int i = 0; i < TNFS_STATCACHE_ENTRIES; i++)
+        stat_cache[i].in_use = false;
+}
+
+/*
+ Updates our smoothed round trip time and variance with a new measurement
+ (Jacobson/Karels, with the same gains as TCP) and counts it in our RTT histogram
+*/
+void tnfsMountInfo::record_rtt(uint32_t rtt_ms)
+{
+    if (_rtt_valid == false)
+    {
+        _srtt_x8 = rtt_ms << 3;
+        _rttvar_x4 = rtt_ms << 1;
+        _rtt_valid = true;
+    }
+    else
+    {
+        int32_t delta = (int32_t)rtt_ms - (int32_t)(_srtt_x8 >> 3);
+        _srtt_x8 += delta; // srtt += delta / 8
+        if (delta < 0)
+            delta = -delta;
+        _rttvar_x4 += delta - (_rttvar_x4 >> 2); // rttvar += (|delta| - rttvar) / 4
+    }
+
+    int bucket = 0;
+    while (bucket < TNFS_RTT_BUCKETS - 1 && rtt_ms > (1U << bucket))
+        bucket++;
+    transport_stats.rtt_buckets[bucket]++;
+}
+
+/*
+ Returns how long to wait for a reply before sending a request again.
+ This is srtt + 4 * rttvar, doubled for each retry, never less than TNFS_MIN_TIMEOUT
+ or the minimum retry time the server gave us at mount, and never more than max_timeout_ms.
+*/
+uint32_t tnfsMountInfo::retransmit_timeout(int retry)
+{
+    uint32_t rto = timeout_ms;
+    if (_rtt_valid)
+        rto = (_srtt_x8 >> 3) + (_rttvar_x4 > 1 ? _rttvar_x4 : 1);
+
+    uint32_t floor = min_retry_ms > TNFS_MIN_TIMEOUT ? min_retry_ms : TNFS_MIN_TIMEOUT;
+    if (rto < floor)
+        rto = floor;
+
+    for (int i = 0; i < retry && rto < (uint32_t)max_timeout_ms; i++)
+        rto <<= 1;
+
+    if (rto > (uint32_t)max_timeout_ms)
+        rto = max_timeout_ms;
+
+    return rto;
+}
+
+/*
+ Returns the upper bound (in milliseconds) of the RTT bucket containing the
+ given percentile of all recorded round trips, or 0 if we haven't recorded any
+*/
+uint32_t tnfsMountInfo::rtt_percentile(uint8_t percentile)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < TNFS_RTT_BUCKETS; i++)
+        total += transport_stats.rtt_buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint32_t target = (total * percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < TNFS_RTT_BUCKETS; i++)
+    {
+        seen += transport_stats.rtt_buckets[i];
+        if (seen >= target)
+            return 1U << i;
+    }
+    return 1U << (TNFS_RTT_BUCKETS - 1);
+}
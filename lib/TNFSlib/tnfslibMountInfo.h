@@ -4,10 +4,17 @@
 #include <cstdint>
 #include <lwip/netdb.h>
 
+#include "tnfslibBlockCache.h"
+#include "../tcpip/fnTcpClient.h"
 
 #define TNFS_DEFAULT_PORT 16384
+#define TNFS_PROTOCOL_UDP 0
+#define TNFS_PROTOCOL_TCP 1
+#define TNFS_TCP_TIMEOUT 5000 // How long we wait to connect or for a complete reply over TCP before reconnecting
 #define TNFS_RETRIES 5 // Number of times to retry if we fail to send/receive a packet
-#define TNFS_TIMEOUT 2000 // This is how long we wait for a reply packet from the server before trying again
+#define TNFS_TIMEOUT 2000 // How long we wait for a reply packet before trying again until we've measured the server's round trip time
+#define TNFS_MAX_TIMEOUT 4000 // Longest we'll wait for a reply packet after backing off
+#define TNFS_MIN_TIMEOUT 50 // Shortest retransmission timeout we'll ever use
 #define TNFS_RETRY_DELAY 1000 // Default delay before retrying. Server will provide a minimum during TNFS_CMD_MOUNT
 #define TNFS_MAX_BACKOFF_DELAY 3000 // Longest we'll wait if server sends us a EAGAIN error
 #define TNFS_MAX_FILE_HANDLES 8 // Max number of file handles we'll open to the server
@@ -15,15 +22,76 @@
 
 #define TNFS_FILE_CACHE_SIZE 512 // 4 * 128 fits in a single packet when TNFS_MAX_READWRITE_PAYLOAD is 512
 
+#define TNFS_READ_WINDOW 4 // Default number of READ requests we'll keep in flight for large reads
+#define TNFS_MAX_READ_WINDOW 6 // Upper limit for read_window (lwIP only queues CONFIG_LWIP_UDP_RECVMBOX_SIZE datagrams)
+
 #define TNFS_INVALID_HANDLE -1
 #define TNFS_INVALID_SESSION 0 // We're assuming a '0' is never a valid session ID
 
-#define TNFS_MAX_DIRCACHE_ENTRIES 32 // Max number of directory cache entries we'll store
+#define TNFS_MAX_DIRCACHE_ENTRIES 2048 // Max number of entries we'll cache for a single directory listing (bigger ones are read in pages)
+#define TNFS_DIRCACHE_LISTINGS 4 // Number of directory listings we keep per mount
+#define TNFS_DIRCACHE_TTL 30000 // How long (ms) we trust a cached listing before checking the directory's modified time
+#define TNFS_DIRCACHE_CHUNK 4096 // Listing storage grows by this many bytes at a time
+#define TNFS_READDIRX_COUNT 255 // Entries we ask for in each READDIRX (the server sends as many as fit in a packet)
+
+#define TNFS_STATCACHE_ENTRIES 16 // Number of STAT results (including "not found") we remember per mount
+#define TNFS_STATCACHE_TTL 2000 // How long (ms) we trust a remembered STAT result
+#define TNFS_IDLE_HANDLES 2 // Read-only files closed through the VFS that we keep open on the server for quick reopening
+#define TNFS_IDLE_HANDLE_MAX_OPEN 4 // We don't keep a closed file open if we'd have more than this many handles open on the server
+#define TNFS_IDLE_HANDLE_TTL 10000 // How long (ms) we keep a closed file open on the server
+
+#define TNFS_RTT_BUCKETS 14 // Round trip times are counted in power-of-two buckets from <=1ms to >4096ms
+
+// Counters kept for every transaction with the server
+struct tnfsTransportStats
+{
+    uint32_t transactions = 0; // Requests that got a reply
+    uint32_t retries = 0; // Requests we had to send again
+    uint32_t timeouts = 0; // Requests that failed after all retries
+    uint32_t try_again = 0; // Times the server asked us to back off
+    uint32_t connects = 0; // TCP connections opened to the server
+    uint32_t rtt_buckets[TNFS_RTT_BUCKETS] = { 0 };
+};
+
+struct tnfsStat
+{
+    bool isDir;
+    uint32_t filesize;
+    uint32_t a_time;
+    uint32_t m_time;
+    uint32_t c_time;
+};
+
+// A remembered response to TNFS_STAT
+struct tnfsStatCacheEntry
+{
+    bool in_use = false;
+    int result = 0; // TNFS_RESULT_SUCCESS or TNFS_RESULT_FILE_NOT_FOUND
+    tnfsStat filestat;
+    uint32_t fetched_ms = 0;
+    char *path = nullptr; // Allocated by tnfs_set_path
+};
+
+// A file closed through the VFS that we've left open on the server
+struct tnfsIdleHandle
+{
+    int16_t handle_id = TNFS_INVALID_HANDLE;
+    uint32_t change_count = 0; // tnfsMountInfo.change_count when the file was closed
+    uint32_t closed_ms = 0;
+};
+
+struct tnfsMetadataStats
+{
+    uint32_t stat_hits = 0;
+    uint32_t stat_misses = 0;
+    uint32_t reopens = 0; // Opens answered with an idle handle
+};
 
 // Some things we need to keep track of for every file we open
 struct tnfsFileHandleInfo
 {
     uint8_t handle_id = 0;
+    uint16_t open_mode = 0; // TNFS_OPENMODE_* flags the file was opened with
 
     uint32_t file_position = 0; // Current actual file position
     uint32_t file_size = 0;
@@ -33,6 +101,10 @@ struct tnfsFileHandleInfo
 
     bool cache_modified = false; // Notes if we've written to the cache
 
+    int8_t cache_file_id = TNFS_BLOCK_CACHE_NO_FILE; // ID of this file in the mount's tnfsBlockCache
+    uint32_t last_block = UINT32_MAX; // Offset of the last block loaded into the cache
+    uint8_t sequential_blocks = 0; // Number of back-to-back sequential block loads
+
     uint8_t cache[TNFS_FILE_CACHE_SIZE];
     char filename[TNFS_MAX_FILELEN];
 };
@@ -45,7 +117,79 @@ struct tnfsDirCacheEntry
     uint32_t filesize;
     uint32_t m_time;
     uint32_t c_time;
-    char entryname[TNFS_MAX_FILELEN];
+    char entryname[]; // Entries are packed back to back, each only as long as its name
+};
+
+// A complete directory listing as returned by OPENDIRX/READDIRX
+struct tnfsDirListing
+{
+    bool in_use = false;
+    bool stale = false; // Set if we changed something on the server while the listing was open
+    bool paged = false; // Set if the directory didn't fit, in which case this is just one page of it
+    bool last_page = false; // Set if a paged listing holds the end of the directory
+    uint16_t next_dirpos = 0; // Server position of the first entry after this page
+    uint8_t sortopts = 0;
+    uint8_t diropts = 0;
+    uint16_t maxresults = 0;
+    uint32_t dir_mtime = 0; // Directory's modified time when we loaded the listing
+    uint32_t validated_ms = 0; // When we last loaded or validated the listing
+    uint32_t last_used = 0;
+
+    uint16_t count = 0;
+    uint32_t *offsets = nullptr; // Offset of each entry in data
+    uint16_t offsets_size = 0;
+    uint8_t *data = nullptr;
+    uint32_t data_used = 0;
+    uint32_t data_size = 0;
+
+    char *path = nullptr; // Allocated by tnfs_set_path
+    char *pattern = nullptr;
+};
+
+struct tnfsDirCacheStats
+{
+    uint32_t hits = 0; // Directory opens served without loading the listing from the server
+    uint32_t misses = 0;
+    uint32_t revalidations = 0; // Hits that needed a STAT to confirm the directory hadn't changed
+};
+
+/*
+ Keeps the last few full directory listings we loaded (in PSRAM) so that
+ re-opening, seeking and paging through a directory needs no network traffic
+*/
+class tnfsDirCache
+{
+private:
+    tnfsDirListing _listings[TNFS_DIRCACHE_LISTINGS];
+    int _current = -1; // Listing used by the currently open directory
+    uint16_t _cursor = 0; // Index of the next entry to return
+    uint32_t _clock = 0;
+
+    tnfsDirCacheStats _stats;
+
+    void _free_listing(tnfsDirListing &l);
+
+public:
+    ~tnfsDirCache();
+
+    bool find(const char *path, const char *pattern, uint8_t sortopts, uint8_t diropts, uint16_t maxresults);
+    bool create(const char *path, const char *pattern, uint8_t sortopts, uint8_t diropts, uint16_t maxresults, uint32_t dir_mtime);
+    tnfsDirListing *current() { return _current < 0 ? nullptr : &_listings[_current]; };
+    void validated(uint32_t now_ms) { if (_current >= 0) _listings[_current].validated_ms = now_ms; };
+    void drop_current();
+    void clear_current();
+    void close() { _current = -1; _cursor = 0; };
+    bool is_open() { return _current >= 0; };
+    void invalidate();
+
+    tnfsDirCacheEntry *add_entry(uint16_t dirpos, uint8_t flags, uint32_t filesize, uint32_t m_time, uint32_t c_time, const char *name);
+    tnfsDirCacheEntry *next_entry();
+    int tell();
+    void seek(uint16_t position);
+
+    void note_hit(bool revalidated) { _stats.hits++; if (revalidated) _stats.revalidations++; };
+    void note_miss() { _stats.misses++; };
+    const tnfsDirCacheStats &stats() { return _stats; };
 };
 
 // Everything we need to know about and keep track of for the server we're talking to
@@ -53,10 +197,11 @@ class tnfsMountInfo
 {
 private:
     tnfsFileHandleInfo * _file_handles[TNFS_MAX_FILE_HANDLES] = { nullptr }; // Stored from server's responses to TNFS_OPEN
-    tnfsDirCacheEntry * _dir_cache[TNFS_MAX_DIRCACHE_ENTRIES] = { nullptr };
-    uint16_t _dir_cache_current = 0;
-    uint16_t _dir_cache_count = 0;
-    bool _dir_cache_eof = false;
+
+    // Smoothed round trip time and its variance (scaled by 8 and 4, as in RFC 6298 implementations)
+    bool _rtt_valid = false;
+    uint32_t _srtt_x8 = 0;
+    uint32_t _rttvar_x4 = 0;
 
 public:
     ~tnfsMountInfo();
@@ -67,22 +212,23 @@ public:
 
     tnfsFileHandleInfo * new_filehandleinfo();
     tnfsFileHandleInfo * get_filehandleinfo(uint8_t filehandle);
+    int filehandle_count();
     void delete_filehandleinfo(uint8_t filehandle);
     void delete_filehandleinfo(tnfsFileHandleInfo * pFilehandle);
+    void invalidate_filehandle_caches(int cache_file_id, uint32_t start, uint32_t length);
 
-    tnfsDirCacheEntry * new_dircache_entry();
-    tnfsDirCacheEntry * next_dircache_entry();
-
-    int tell_dircache_entry();
-    void empty_dircache();
-    uint16_t count_dircache() { return _dir_cache_count; };
-    void set_dircache_eof() { _dir_cache_eof = true; };
-    bool get_dircache_eof() { return _dir_cache_eof; };
+    void record_rtt(uint32_t rtt_ms);
+    uint32_t retransmit_timeout(int retry);
+    uint32_t rtt_percentile(uint8_t percentile);
+    void reset_rtt() { _rtt_valid = false; };
+    tnfsTransportStats transport_stats;
 
     // These char[] sizes are abitrary...
     char hostname[64] = { '\0' };
     in_addr_t host_ip = IPADDR_NONE;
     uint16_t port = TNFS_DEFAULT_PORT;
+    uint8_t protocol = TNFS_PROTOCOL_UDP; // Set before calling tnfs_mount
+    fnTcpClient tcp_client; // Our connection to the server when protocol is TNFS_PROTOCOL_TCP
     char mountpath[64] = { '\0' };
     char user[12] = { '\0' };
     char password[12] = { '\0' };
@@ -91,11 +237,26 @@ public:
     uint16_t min_retry_ms = TNFS_RETRY_DELAY; // Updated from server's response to TNFS_MOUNT
     uint16_t server_version = 0;  // Stored from server's response to TNFS_MOUNT
     uint8_t max_retries = TNFS_RETRIES;
-    int timeout_ms = TNFS_TIMEOUT;
+    int timeout_ms = TNFS_TIMEOUT; // Used until we've got a round trip time measurement
+    int max_timeout_ms = TNFS_MAX_TIMEOUT;
+    uint8_t read_window = TNFS_READ_WINDOW; // Set to 1 to disable pipelined reads
     uint8_t current_sequence_num = 0; // Updated with each transaction to the server
 
-    int16_t dir_handle = TNFS_INVALID_HANDLE; // Stored from server's response to TNFS_OPENDIR
-    uint16_t dir_entries = 0; // Stored from server's response to TNFS_OPENDIRX
+    uint16_t block_cache_blocks = TNFS_BLOCK_CACHE_BLOCKS; // Set to 0 before opening any files to disable the block cache
+    tnfsBlockCache block_cache; // Shared by all files opened on this mount
+
+    tnfsDirCache dir_cache; // Listings of directories we've opened recently
+
+    tnfsStatCacheEntry * find_stat(const char *path, uint32_t now);
+    void store_stat(const char *path, int result, const tnfsStat *filestat, uint32_t now);
+    void note_change();
+    tnfsStatCacheEntry stat_cache[TNFS_STATCACHE_ENTRIES];
+    tnfsIdleHandle idle_handles[TNFS_IDLE_HANDLES]; // Managed by the VFS layer
+    uint32_t change_count = 0; // Bumped every time we change something on the server
+    tnfsMetadataStats metadata_stats;
+
+    int16_t dir_handle = TNFS_INVALID_HANDLE; // Stored from server's response to TNFS_OPENDIR while we load the listing
+    uint16_t dir_entries = 0; // Number of entries in the currently open directory
 };
 
 #endif // _TNFSLIB_MOUNTINFO_H
@@ -1323,4 +1323,49 @@ void esp_http_client_add_auth(esp_http_client_handle_t client)
     }
 }
 
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *data)
+{
+    if (client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    client->user_data = data;
+    return ESP_OK;
+}
+
+bool esp_http_client_is_connected(esp_http_client_handle_t client)
+{
+    return client != NULL && client->state >= HTTP_STATE_CONNECTED;
+}
+
+esp_err_t esp_http_client_reset_request(esp_http_client_handle_t client)
+{
+    if (client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    http_header_clean(client->request->headers);
+    if (esp_http_client_set_header(client, "User-Agent", DEFAULT_HTTP_USER_AGENT) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (client->connection_info.host &&
+        esp_http_client_set_header(client, "Host", client->connection_info.host) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Credentials come from the next URL, if it has any
+    free(client->connection_info.username);
+    client->connection_info.username = NULL;
+    free(client->connection_info.password);
+    client->connection_info.password = NULL;
+    client->connection_info.auth_type = HTTP_AUTH_TYPE_NONE;
+    _clear_auth_data(client);
+
+    client->connection_info.method = HTTP_METHOD_GET;
+    client->post_data = NULL;
+    client->post_len = 0;
+    client->redirect_counter = 0;
+    client->process_again = 0;
+    return ESP_OK;
+}
+
 } // namespace esp1541
@@ -481,6 +481,41 @@ esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t client);
  */
 void esp_http_client_add_auth(esp_http_client_handle_t client);
 
+/**
+ * @brief      Set the user_data passed to the event handler
+ *
+ * @param[in]  client  The esp_http_client handle
+ * @param[in]  data    The new user_data
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_ARG
+ */
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *data);
+
+/**
+ * @brief      Check whether the client is holding an open connection to the server
+ *
+ * @param[in]  client  The esp_http_client handle
+ *
+ * @return     true if the connection is open (it may still have been dropped by the server)
+ */
+bool esp_http_client_is_connected(esp_http_client_handle_t client);
+
+/**
+ * @brief      Forget everything set up for the last request (headers, method, post data, credentials
+ *             and redirect count) without closing the connection, so the handle can be reused for an
+ *             unrelated request to the same server. Follow this with esp_http_client_set_url().
+ *
+ * @param[in]  client  The esp_http_client handle
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_ARG
+ *     - ESP_ERR_NO_MEM
+ */
+esp_err_t esp_http_client_reset_request(esp_http_client_handle_t client);
+
 } // namespace esp1541
 
 #endif
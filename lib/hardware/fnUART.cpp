@@ -15,6 +15,10 @@
 #define MAX_WRITE_BYTE_TICKS 100
 #define MAX_WRITE_BUFFER_TICKS 1000
 
+// The SIO port gets bigger buffers so a whole frame can be handed to (or taken from) the driver at once
+#define UART_SIO_RX_BUFFER_SIZE 1024
+#define UART_SIO_TX_BUFFER_SIZE 1024
+
 #define UART0_RX 3
 #define UART0_TX 1
 #define UART1_RX 9
@@ -78,12 +82,20 @@ void UARTManager::begin(int baud)
 
     // Arduino default buffer size is 256
     int uart_buffer_size = 256;
+    int uart_tx_buffer_size = 0; // Writes block until the data's in the FIFO
     int uart_queue_size = 10;
     int intr_alloc_flags = 0;
 
+    // With a TX buffer, writes return as soon as the data is copied and the driver feeds the FIFO from its interrupt
+    if (_uart_num == UART_SIO)
+    {
+        uart_buffer_size = UART_SIO_RX_BUFFER_SIZE;
+        uart_tx_buffer_size = UART_SIO_TX_BUFFER_SIZE;
+    }
+
     // Install UART driver using an event queue here
     //uart_driver_install(_uart_num, uart_buffer_size, uart_buffer_size, uart_queue_size, &_uart_q, intr_alloc_flags);
-    uart_driver_install(_uart_num, uart_buffer_size, 0, uart_queue_size, NULL, intr_alloc_flags);
+    uart_driver_install(_uart_num, uart_buffer_size, uart_tx_buffer_size, uart_queue_size, NULL, intr_alloc_flags);
 
     // Set initialized.
     _initialized=true;
@@ -14,6 +14,8 @@
 #include "fnWiFi.h"
 #include "fnSystem.h"
 #include "../config/fnConfig.h"
+#include "../tcpip/fnDNS.h"
+#include "../sio/sio.h"
 
 #include "httpService.h"
 #include "led.h"
@@ -435,6 +437,16 @@ void WiFiManager::_wifi_event_handler(void *arg, esp_event_base_t event_base,
             fnLedManager.set(eLed::LED_WIFI, true);
             fnSystem.Net.start_sntp_client();
             fnHTTPD.start();
+            // Answers from the last network may not hold on this one
+            dns_cache_flush();
+            // The host slots belong to the SIO task, so have it do the prefetch
+            if (SIO.qSioMessages != nullptr)
+            {
+                sio_message_t msg;
+                msg.message_id = SIOMSG_DNS_PREFETCH;
+                xQueueSend(SIO.qSioMessages, &msg, 0);
+                SIO.wake();
+            }
             break;
         case IP_EVENT_STA_LOST_IP:
             Debug_println("IP_EVENT_STA_LOST_IP");
@@ -198,6 +198,7 @@ void KeyManager::_keystate_task(void *param)
                 sio_message_t msg;
                 msg.message_id = SIOMSG_DISKSWAP;
                 xQueueSend(SIO.qSioMessages, &msg, 0);
+                SIO.wake();
             }
             break;
 
@@ -233,6 +234,7 @@ void KeyManager::_keystate_task(void *param)
             sio_message_t msg;
             msg.message_id = SIOMSG_DEBUG_TAPE;
             xQueueSend(SIO.qSioMessages, &msg, 0);
+            SIO.wake();
             break;
 
         case eKeyStatus::DOUBLE_TAP:
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <string.h>
 //#include <FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "../../include/debug.h"
 #include "fnSystem.h"
 #include "fnHttpClient.h"
@@ -12,9 +13,131 @@ using namespace esp1541;
 
 #define HTTPCLIENT_WAIT_FOR_CONSUMER_TASK 20000 // 20s
 #define HTTPCLIENT_WAIT_FOR_HTTP_TASK 20000     // 20s
+#define HTTPCLIENT_POOL_SIZE 4                  // Most idle connections we keep open
+#define HTTPCLIENT_POOL_IDLE_TIMEOUT 15000      // Servers drop idle keep-alive connections, so don't trust them after this long
 
 const char *webdav_depths[] = {"0", "1", "infinity"};
 
+TaskHandle_t fnHttpClient::_taskh_worker = nullptr;
+fnHttpClient * volatile fnHttpClient::_worker_client = nullptr;
+SemaphoreHandle_t fnHttpClient::_worker_free = nullptr;
+
+/*
+ Handles released by fnHttpClient objects that finished with a server, still holding
+ a keep-alive (possibly TLS) connection to it. The next client to begin() on the same
+ scheme://host:port takes the handle over and skips the connect and handshake.
+
+ Only live connections are kept. Resuming a TLS session over a new connection would
+ need esp-tls session tickets, and the esp_transport_ssl layer under our HTTP client
+ doesn't give us any way to fetch or hand back a session, so a connection the server
+ has dropped costs a full handshake.
+*/
+struct pooled_connection
+{
+    std::string key;
+    esp_http_client_handle_t handle = nullptr;
+    unsigned long released = 0;
+};
+
+static pooled_connection _pool[HTTPCLIENT_POOL_SIZE];
+static SemaphoreHandle_t _pool_mutex = nullptr;
+
+static void _pool_lock()
+{
+    if (_pool_mutex == nullptr)
+        _pool_mutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+}
+
+// Returns "scheme://host:port" for the given URL, which is what a connection can be shared by
+static std::string _connection_key(const std::string &url)
+{
+    std::string scheme = "http";
+    size_t start = url.find("://");
+    if (start != std::string::npos)
+    {
+        scheme = url.substr(0, start);
+        start += 3;
+    }
+    else
+        start = 0;
+
+    size_t end = url.find_first_of("/?#", start);
+    std::string authority = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+    // Drop any credentials
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos)
+        authority = authority.substr(at + 1);
+
+    util_string_tolower(scheme);
+    util_string_tolower(authority);
+
+    if (authority.find(':') == std::string::npos)
+        authority += scheme == "https" ? ":443" : ":80";
+
+    return scheme + "://" + authority;
+}
+
+// Takes a pooled handle for the given server, or returns nullptr if we don't have one
+static esp_http_client_handle_t _pool_acquire(const std::string &key)
+{
+    esp_http_client_handle_t handle = nullptr;
+    unsigned long now = fnSystem.millis();
+
+    _pool_lock();
+    for (int i = 0; i < HTTPCLIENT_POOL_SIZE; i++)
+    {
+        if (_pool[i].handle == nullptr)
+            continue;
+
+        if (now - _pool[i].released > HTTPCLIENT_POOL_IDLE_TIMEOUT)
+        {
+            esp_http_client_cleanup(_pool[i].handle);
+            _pool[i] = pooled_connection();
+        }
+        else if (handle == nullptr && _pool[i].key == key)
+        {
+            handle = _pool[i].handle;
+            _pool[i] = pooled_connection();
+        }
+    }
+    xSemaphoreGive(_pool_mutex);
+
+    return handle;
+}
+
+// Keeps a handle that's still connected for reuse, replacing the oldest one if the pool is full
+static void _pool_release(const std::string &key, esp_http_client_handle_t handle)
+{
+    if (esp_http_client_is_connected(handle) == false)
+    {
+        esp_http_client_cleanup(handle);
+        return;
+    }
+
+    _pool_lock();
+    int slot = 0;
+    for (int i = 0; i < HTTPCLIENT_POOL_SIZE; i++)
+    {
+        if (_pool[i].handle == nullptr)
+        {
+            slot = i;
+            break;
+        }
+        if (_pool[i].released < _pool[slot].released)
+            slot = i;
+    }
+
+    if (_pool[slot].handle != nullptr)
+        esp_http_client_cleanup(_pool[slot].handle);
+
+    _pool[slot].key = key;
+    _pool[slot].handle = handle;
+    _pool[slot].released = fnSystem.millis();
+    xSemaphoreGive(_pool_mutex);
+}
+
 fnHttpClient::fnHttpClient()
 {
     _buffer = (char *)malloc(DEFAULT_HTTP_BUF_SIZE);
@@ -25,8 +148,9 @@ fnHttpClient::~fnHttpClient()
 {
     close();
 
+    // Let someone else use the connection
     if (_handle != nullptr)
-        esp_http_client_cleanup(_handle);
+        _pool_release(_handle_key, _handle);
 
     free(_buffer);
 }
@@ -36,6 +160,9 @@ bool fnHttpClient::begin(std::string url)
 {
     Debug_printf("fnHttpClient::begin \"%s\"\n", url.c_str());
 
+    // Whatever the last request was doing, we're done with it
+    _end_transaction();
+
     esp_http_client_config_t cfg;
     memset(&cfg, 0, sizeof(cfg));
     cfg.url = url.c_str();
@@ -48,9 +175,35 @@ bool fnHttpClient::begin(std::string url)
     // Keep track of the auth type set
     _auth_type = cfg.auth_type;
 
+    std::string key = _connection_key(url);
+
+    // Hang on to our handle if it's for the same server, otherwise swap it for a pooled one
+    if (_handle != nullptr && key != _handle_key)
+    {
+        _pool_release(_handle_key, _handle);
+        _handle = nullptr;
+    }
+    if (_handle == nullptr)
+        _handle = _pool_acquire(key);
+
+    if (_handle != nullptr)
+    {
+        _handle_key = key;
+        esp_http_client_reset_request(_handle);
+        esp_http_client_set_user_data(_handle, this);
+        if (esp_http_client_set_url(_handle, url.c_str()) == ESP_OK)
+            return true;
+
+        esp_http_client_cleanup(_handle);
+        _handle = nullptr;
+        return false;
+    }
+
+    // Nothing to reuse
     _handle = esp_http_client_init(&cfg);
     if (_handle == nullptr)
         return false;
+    _handle_key = key;
     return true;
 }
 
@@ -113,21 +266,28 @@ int fnHttpClient::read(uint8_t *dest_buffer, int dest_bufflen)
     // Make sure store our current task handle to respond to
     _taskh_consumer = xTaskGetCurrentTaskHandle();
 
-    // Our HTTP subtask is gone - say there's nothing left to read...
-    if (_taskh_subtask == nullptr)
+    // The worker isn't running our transaction any more - say there's nothing left to read...
+    if (_worker_client != this)
     {
-        Debug_println("::read subtask gone");
+        Debug_println("::read worker gone");
         return bytes_copied;
     }
 
     while (bytes_copied < dest_bufflen)
     {
+        // Have the worker put data straight into dest_buffer
+        _read_room = dest_bufflen - bytes_copied;
+        _read_direct = 0;
+        _read_dest = dest_buffer + bytes_copied;
+
         // Let the HTTP process task know to fill the buffer
         //Debug_println("::read notifyGive");
-        xTaskNotifyGive(_taskh_subtask);
+        xTaskNotifyGive(_taskh_worker);
         // Wait till the HTTP task lets us know it's filled the buffer
         //Debug_println("::read notifyTake...");
-        if(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK)) != 1)
+        bool timed_out = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK)) != 1;
+        _read_dest = nullptr;
+        if (timed_out)
         {
             // Abort if we timed-out receiving the data
             Debug_println("::read time-out");
@@ -140,13 +300,19 @@ int fnHttpClient::read(uint8_t *dest_buffer, int dest_bufflen)
             return bytes_copied;
         }
 
+        // What the worker already copied over
+        _buffer_pos = _read_direct;
+        _buffer_total_read += _read_direct;
+        bytes_copied += _read_direct;
+
         int dest_size = dest_bufflen - bytes_copied;
-        bytes_to_copy = dest_size > _buffer_len ? _buffer_len : dest_size;
+        bytes_left = _buffer_len - _buffer_pos;
+        bytes_to_copy = dest_size > bytes_left ? bytes_left : dest_size;
 
         //Debug_printf("dest_size=%d, dest_bufflen=%d, bytes_copied=%d, bytes_to_copy=%d\n",
                      //dest_size, dest_bufflen, bytes_copied, bytes_to_copy);
 
-        memcpy(dest_buffer + bytes_copied, _buffer, bytes_to_copy);
+        memcpy(dest_buffer + bytes_copied, _buffer + _buffer_pos, bytes_to_copy);
         _buffer_pos += bytes_to_copy;
         _buffer_total_read += bytes_to_copy;
         bytes_copied += bytes_to_copy;
@@ -165,38 +331,72 @@ void fnHttpClient::_flush_response()
     _buffer_len = 0;
     esp_http_client_set_post_field(_handle, nullptr, 0);
 
-    // Nothing left to read
-    if (_transaction_done)
-        return;
-
-    // Our HTTP subtask is gone - nothing to do
-    if (_taskh_subtask == nullptr)
+    // The worker isn't running our transaction - nothing to do
+    if (_worker_client != this || _worker_idle)
         return;
 
     // Make sure store our current task handle to respond to
     _taskh_consumer = xTaskGetCurrentTaskHandle();
-    do
+    /*
+     Keep taking data until the worker has finished the transaction and gone idle. Even once
+     the transaction is done it's waiting for one last notification from us.
+    */
+    while (!_worker_idle)
     {
         // Let the HTTP process task know to fill the buffer
         //Debug_println("::flush_response notifyGive");
-        xTaskNotifyGive(_taskh_subtask);
+        xTaskNotifyGive(_taskh_worker);
         // Wait till the HTTP task lets us know it's filled the buffer
         //Debug_println("::flush_response notifyTake...");
-        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK));
-
-    } while (!_transaction_done);
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK)) == 0)
+            break;
+    }
     //Debug_println("fnHttpClient::flush_response done");
 }
 
-// Close connection, but keep request resources
-void fnHttpClient::close()
+/*
+ Stops a transaction that's still going by killing the worker and dropping the connection,
+ since there's no telling how much of the response is left on it.
+ A finished transaction leaves the connection open for the next request.
+*/
+void fnHttpClient::_abort_transaction()
 {
-    //Debug_println("::close");
-    _delete_subtask_if_running();
+    if (_worker_idle)
+        return;
+
+    Debug_println("fnHttpClient aborting unfinished transaction");
+    if (_worker_client == this)
+        _delete_worker();
 
     if (_handle != nullptr)
         esp_http_client_close(_handle);
 
+    _transaction_done = true;
+    _worker_idle = true;
+}
+
+/*
+ Wraps up the current transaction. If the whole response has been read we just wait for
+ the worker to finish so the connection can be kept for the next request; otherwise the
+ transaction is aborted.
+*/
+void fnHttpClient::_end_transaction()
+{
+    if (_worker_idle)
+        return;
+
+    if (_transaction_done || (esp_http_client_get_content_length(_handle) > 0 && available() == 0))
+        _flush_response();
+
+    _abort_transaction();
+}
+
+// Close request, keeping the connection open if the server allows it
+void fnHttpClient::close()
+{
+    //Debug_println("::close");
+    _end_transaction();
+
     _stored_headers.clear();
 }
 
@@ -236,12 +436,14 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
         if (client->_stored_headers.size() <= 0)
             break;
 
-        std::string hkey(evt->header_key);
-        header_map_t::iterator it = client->_stored_headers.find(hkey);
-        if (it != client->_stored_headers.end())
+        // Header names aren't case sensitive, and plenty of servers send them in lowercase
+        for (header_map_t::iterator it = client->_stored_headers.begin(); it != client->_stored_headers.end(); ++it)
         {
-            std::string hval(evt->header_value);
-            it->second = hval;
+            if (strcasecmp(it->first.c_str(), evt->header_key) == 0)
+            {
+                it->second = evt->header_value;
+                break;
+            }
         }
         break;
     }
@@ -285,9 +487,25 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
 
         //Debug_printf("HTTP_EVENT_ON_DATA Data: %p, Datalen: %d\n", evt->data, evt->data_len);
 
-        client->_buffer_pos = 0;
-        client->_buffer_len = (evt->data_len > DEFAULT_HTTP_BUF_SIZE) ? DEFAULT_HTTP_BUF_SIZE : evt->data_len;
-        memcpy(client->_buffer, evt->data, client->_buffer_len);
+        {
+            int data_len = (evt->data_len > DEFAULT_HTTP_BUF_SIZE) ? DEFAULT_HTTP_BUF_SIZE : evt->data_len;
+
+            // Give the reader as much as it asked for directly, keeping the rest in our buffer.
+            // _buffer stays laid out as if it held everything so read() can pick up at _read_direct.
+            uint8_t *dest = client->_read_dest;
+            int direct = 0;
+            if (dest != nullptr)
+            {
+                direct = data_len > client->_read_room ? client->_read_room : data_len;
+                memcpy(dest, evt->data, direct);
+            }
+            client->_read_direct = direct;
+
+            client->_buffer_pos = 0;
+            client->_buffer_len = data_len;
+            if (data_len > direct)
+                memcpy(client->_buffer + direct, (uint8_t *)evt->data + direct, data_len - direct);
+        }
 
         // Now let the reader know there's data in the buffer
         xTaskNotifyGive(client->_taskh_consumer);
@@ -310,57 +528,129 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
+/*
+ Worker task that runs esp_http_client_perform() for whichever client has claimed it.
+ There's just the one, created with the first request and kept for the life of the
+ program, so opening a connection doesn't cost us a new task.
+*/
 void fnHttpClient::_perform_subtask(void *param)
 {
-    fnHttpClient *parent = (fnHttpClient *)param;
+    while (true)
+    {
+        // Wait for _perform() to give us a request
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Ignore any notification left over from read() or _flush_response()
+        fnHttpClient *parent = _worker_client;
+        if (parent == nullptr || parent->_worker_idle)
+            continue;
 
-    // Reset our transaction state markers
-    parent->_transaction_begin = true;
-    parent->_transaction_done = false;
-    parent->_redirect_count = 0;
-    parent->_buffer_len = 0;
+        // Reset our transaction state markers
+        parent->_transaction_begin = true;
+        parent->_redirect_count = 0;
+        parent->_buffer_len = 0;
 
-    //Debug_printf("esp_http_client_perform start\n");
+        //Debug_printf("esp_http_client_perform start\n");
 
-    esp_err_t e = esp_http_client_perform(parent->_handle);
-    __IGNORE_UNUSED_VAR(e);
+        esp_err_t e = esp_http_client_perform(parent->_handle);
 
-    //Debug_printf("esp_http_client_perform returned %d, stack HWM %u\n", e, uxTaskGetStackHighWaterMark(nullptr));
+        /*
+         The server may have closed a kept-alive connection while it sat idle, which we only
+         find out about when we try to use it. Try again once over a new connection.
+        */
+        if (e != ESP_OK && parent->_reused_connection && parent->_transaction_begin)
+        {
+            Debug_printf("Kept-alive connection failed (%d), reconnecting\n", e);
+            esp_http_client_close(parent->_handle);
+            parent->_reused_connection = false;
+            parent->_redirect_count = 0;
+            e = esp_http_client_perform(parent->_handle);
+        }
+        __IGNORE_UNUSED_VAR(e);
 
-    // Indicate there's nothing else to read
-    parent->_transaction_done = true;
+        //Debug_printf("esp_http_client_perform returned %d, stack HWM %u\n", e, uxTaskGetStackHighWaterMark(nullptr));
+
+        // Indicate there's nothing else to read
+        parent->_buffer_len = 0;
+        parent->_transaction_done = true;
 
-    // Don't send notifications if we're ignoring the response body
-    if (false == parent->_ignore_response_body)
-    {
         /*
          If _transaction_begin is false, then we handled the HTTP_EVENT_ON_DATA event, and 
          read() has sent us a notification we need to accept before continuing.
         */
-        if (false == parent->_transaction_begin)
+        if (false == parent->_ignore_response_body && false == parent->_transaction_begin)
             ulTaskNotifyTake(1, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_CONSUMER_TASK));
 
+        // Free ourselves up for the next client before waking this one, which may be the next client
+        TaskHandle_t consumer = parent->_taskh_consumer;
+        bool notify = false == parent->_ignore_response_body;
+        _worker_client = nullptr;
+        parent->_worker_idle = true;
+        xSemaphoreGive(_worker_free);
+
         /*
          If we handled the HTTP_EVENT_ON_DATA event, then read() is waiting for a notification.
          If we didn't handle that event, then _perform() is waiting for a notification.
          Notify whichever of the two that they can continue.
+         Don't send notifications if we're ignoring the response body.
         */
-        xTaskNotifyGive(parent->_taskh_consumer);
+        if (notify)
+            xTaskNotifyGive(consumer);
+
+        //Debug_println("_perform_subtask waiting");
     }
+}
 
-    //Debug_println("_perform_subtask_exiting");
-    TaskHandle_t tmp = parent->_taskh_subtask;
-    parent->_taskh_subtask = nullptr;
-    vTaskDelete(tmp);
+// Kills a worker that's stuck in a transaction. The next request starts a new one.
+void fnHttpClient::_delete_worker()
+{
+    if (_taskh_worker != nullptr)
+    {
+        vTaskDelete(_taskh_worker);
+        _taskh_worker = nullptr;
+    }
+    _worker_client = nullptr;
+    xSemaphoreGive(_worker_free);
 }
 
-void fnHttpClient::_delete_subtask_if_running()
+/*
+ Waits for the worker to finish with any other client and claims it for ours, starting it
+ if it isn't running yet.
+ A client left mid-response by code on our own task would never be read to the end while we
+ wait, so its transaction is aborted straight away. One on another task gets
+ HTTPCLIENT_WAIT_FOR_HTTP_TASK to finish before it's aborted the same way.
+*/
+void fnHttpClient::_claim_worker()
 {
-    if (_taskh_subtask != nullptr)
+    if (_worker_free == nullptr)
+    {
+        _worker_free = xSemaphoreCreateBinary();
+        xSemaphoreGive(_worker_free);
+    }
+
+    if (xSemaphoreTake(_worker_free, 0) != pdTRUE)
     {
-        vTaskDelete(_taskh_subtask);
-        _taskh_subtask = nullptr;
+        fnHttpClient *owner = _worker_client;
+        bool same_task = owner != nullptr && owner->_taskh_consumer == xTaskGetCurrentTaskHandle();
+
+        if (same_task || xSemaphoreTake(_worker_free, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK)) != pdTRUE)
+        {
+            owner = _worker_client;
+            if (owner != nullptr)
+            {
+                Debug_println("fnHttpClient worker busy, taking it over");
+                owner->_abort_transaction();
+            }
+            xSemaphoreTake(_worker_free, portMAX_DELAY);
+        }
     }
+
+    if (_taskh_worker == nullptr)
+    {
+        xTaskCreate(_perform_subtask, "http_worker", 4096, nullptr, 5, &_taskh_worker);
+        //Debug_printf("%08lx _perform worker created\n", fnSystem.millis());
+    }
+
+    _worker_client = this;
 }
 
 /*
@@ -371,7 +661,8 @@ void fnHttpClient::_delete_subtask_if_running()
 */
 int fnHttpClient::_perform()
 {
-    Debug_printf("%08lx _perform\n", fnSystem.millis());
+    unsigned long started = fnSystem.millis();
+    Debug_printf("%08lx _perform\n", started);
 
     _buffer_total_read = 0;
 
@@ -381,16 +672,23 @@ int fnHttpClient::_perform()
     // Handle the that HTTP task will use to notify us
     _taskh_consumer = xTaskGetCurrentTaskHandle();
 
-    // Start a new task to perform the http client work
-    _delete_subtask_if_running();
-    xTaskCreate(_perform_subtask, "perform_subtask", 4096, this, 5, &_taskh_subtask);
-    //Debug_printf("%08lx _perform subtask created\n", fnSystem.millis());
+    // A worker that's still busy with an earlier request is stuck, so start over
+    _abort_transaction();
+
+    // Get the worker to ourselves
+    _claim_worker();
+
+    _reused_connection = esp_http_client_is_connected(_handle);
+
+    // Hand the request to the worker
+    _transaction_done = false;
+    _worker_idle = false;
+    xTaskNotifyGive(_taskh_worker);
 
     // Wait until we have headers returned
     if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTPCLIENT_WAIT_FOR_HTTP_TASK)) == 0)
     {
         Debug_printf("Timed-out waiting for headers to load\n");
-        //_delete_subtask_if_running();
         return -1;
     }
     //Debug_printf("%08lx _perform notified\n", fnSystem.millis());
@@ -400,7 +698,8 @@ int fnHttpClient::_perform()
     int status = esp_http_client_get_status_code(_handle);
     int length = esp_http_client_get_content_length(_handle);
 
-    Debug_printf("%08lx _perform status = %d, length = %d, chunked = %d\n", fnSystem.millis(), status, length, chunked ? 1 : 0);
+    Debug_printf("%08lx _perform status = %d, length = %d, chunked = %d, %lu ms%s\n", fnSystem.millis(), status, length, chunked ? 1 : 0,
+                 fnSystem.millis() - started, _reused_connection ? " (reused connection)" : "");
     return status;
 }
 
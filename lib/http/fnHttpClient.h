@@ -4,6 +4,7 @@
 #include <string>
 #include <map>
 #include "../fn_esp_http_client/fn_esp_http_client.h"
+#include <freertos/semphr.h>
 
 using namespace esp1541;
 
@@ -14,16 +15,27 @@ private:
     typedef std::pair<std::string,std::string> header_entry_t;
 
     char *_buffer; // Will be allocated to DEFAULT_HTTP_BUF_SIZE
-    int _buffer_pos;
-    int _buffer_len;
-    int _buffer_total_read;
+    int _buffer_pos = 0;
+    int _buffer_len = 0;
+    int _buffer_total_read = 0;
+
+    // Where read() wants data: the worker copies straight there and only buffers what doesn't fit
+    uint8_t * volatile _read_dest = nullptr;
+    int _read_room = 0;
+    int _read_direct = 0; // Bytes the worker put in _read_dest
 
     TaskHandle_t _taskh_consumer = nullptr;
-    TaskHandle_t _taskh_subtask = nullptr;
+
+    // One worker task serves every client, one transaction at a time
+    static TaskHandle_t _taskh_worker;
+    static fnHttpClient * volatile _worker_client; // Client whose transaction the worker is running
+    static SemaphoreHandle_t _worker_free;         // Given back when the worker goes idle
 
     bool _ignore_response_body = false;
-    bool _transaction_begin;
-    bool _transaction_done;
+    bool _transaction_begin = false;
+    volatile bool _transaction_done = true;
+    volatile bool _worker_idle = true; // Worker is waiting for the next request
+    bool _reused_connection = false; // Request went out over a kept-alive connection
     int _redirect_count;
     int _max_redirects;
     esp_http_client_auth_type_t _auth_type;
@@ -32,11 +44,15 @@ private:
     header_map_t _stored_headers;
 
     esp_http_client_handle_t _handle = nullptr;
+    std::string _handle_key; // Pool key (scheme://host:port) of the server _handle talks to
 
     static void _perform_subtask(void *param);
     static esp_err_t _httpevent_handler(esp_http_client_event_t *evt);
 
-    void _delete_subtask_if_running();
+    static void _delete_worker();
+    void _claim_worker();
+    void _abort_transaction();
+    void _end_transaction();
 
     void _flush_response();
 
@@ -326,7 +326,7 @@ esp_err_t fnHttpService::get_handler_print(httpd_req_t *req)
     set_file_content_type(req, filename.c_str());
 
     // Tell printer to finish its output and get a read handle to the file
-    FILE *poutput = currentPrinter->closeOutputAndProvideReadHandle();
+    FILE *poutput = printer->closeOutputAndProvideReadHandle();
 
     char hdrval1[60];
     if (sendAsAttachment)
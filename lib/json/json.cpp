@@ -6,8 +6,13 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <sstream>
 #include "json.h"
+#include "jsonStream.h"
+#include "fnSystem.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "../../include/debug.h"
 
 /**
@@ -27,6 +32,8 @@ JSON::~JSON()
 {
     Debug_printf("JSON::dtor()\n");
     _protocol = nullptr;
+    if (_json != nullptr)
+        cJSON_Delete(_json);
     _json = nullptr;
 }
 
@@ -37,6 +44,8 @@ void JSON::setProtocol(networkProtocol *newProtocol)
 {
     Debug_printf("JSON::setProtocol()\n");
     _protocol = newProtocol;
+    _queryString.clear();
+    _keptKey.clear();
 }
 
 /**
@@ -56,6 +65,13 @@ cJSON *JSON::resolveQuery()
     if (_queryString.empty())
         return _json;
 
+    // parse() only kept one member, and the rest of the document's gone
+    if (_keptKey.empty() == false && strcasecmp(_keptKey.c_str(), _queryString.c_str()) != 0)
+    {
+        Debug_printf("JSON::resolveQuery() - \"%s\" wasn't kept, only \"%s\"\n", _queryString.c_str(), _keptKey.c_str());
+        return nullptr;
+    }
+
     return cJSON_GetObjectItem(_json, _queryString.c_str());
 }
 
@@ -85,24 +101,17 @@ string JSON::getValue(cJSON *item)
     {
         string ret="";
 
-        item=item->child;
-
-        do
-        {
+        for (item = item->child; item != NULL; item = item->next)
             ret += string(item->string) + "\x9b" + getValue(item);
-        } while ((item=item->next) != NULL);
         
         return ret;
     }
     else if (cJSON_IsArray(item))
     {
-        cJSON *child=item->child;
         string ret;
 
-        do
-        {
+        for (cJSON *child = item->child; child != NULL; child = child->next)
             ret += getValue(child);
-        } while ((child=child->next) != NULL);
         
         return ret;
     }
@@ -141,12 +150,17 @@ int JSON::readValueLen()
 }
 
 /**
- * Parse data from protocol
+ * Parse data from protocol.
+ * The document is parsed as it's read, a chunk at a time, so it never has to fit in memory
+ * as text. If a query has been set, only the top level member it names is kept, and we stop
+ * reading as soon as its value is complete; a query set after parse() sees the whole tree.
+ * A top level number or literal has nothing after it to end it, so it's taken as complete
+ * once no more data turns up within JSON_READ_POLL ms.
  */
 bool JSON::parse()
 {
-    char *buf;
-    int available = 0;
+    char buf[JSON_READ_CHUNK];
+    unsigned long last_data;
 
     if (_protocol == nullptr)
     {
@@ -154,34 +168,57 @@ bool JSON::parse()
         return false;
     }
 
-    //while (available==0)
-    available = _protocol->available();
-
-    Debug_printf("JSON::parse() - %d bytes now available\n", available);
-
-    buf = (char *)heap_caps_malloc(available, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    if (buf == nullptr)
+    if (_json != nullptr)
     {
-        Debug_printf("JSON::parse() - could not allocate JSON buffer of %d bytes", available);
-        return false;
+        cJSON_Delete(_json);
+        _json = nullptr;
     }
 
-    if (_protocol->read((uint8_t *)buf, available) == true)
+    _keptKey = _queryString;
+    JSONStream stream(_keptKey);
+
+    last_data = fnSystem.millis();
+    while (stream.done() == false && stream.matched() == false)
     {
-        Debug_printf("JSON::parse() - Could not read %d bytes from protocol adapter.\n", available);
-        return false;
-    }
+        int available = _protocol->available();
+
+        if (available <= 0)
+        {
+            if (fnSystem.millis() - last_data > JSON_READ_TIMEOUT)
+                break;
+            if (stream.scalarPending() && fnSystem.millis() - last_data >= JSON_READ_POLL)
+                break;
+            vTaskDelay(JSON_READ_POLL / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        if (available > JSON_READ_CHUNK)
+            available = JSON_READ_CHUNK;
+
+        if (_protocol->read((uint8_t *)buf, available) == true)
+        {
+            Debug_printf("JSON::parse() - Could not read %d bytes from protocol adapter.\n", available);
+            return false;
+        }
 
-    _json = cJSON_Parse(buf);
+        if (stream.feed(buf, available) == false)
+        {
+            Debug_printf("JSON::parse() - Could not parse JSON\n");
+            return false;
+        }
+
+        last_data = fnSystem.millis();
+    }
 
-    if (_json == nullptr)
+    if (stream.matched() == false && stream.finish() == false)
     {
-        Debug_printf("JSON::parse() - Could not parse JSON\n");
+        Debug_printf("JSON::parse() - Incomplete JSON after %u bytes\n", stream.bytesParsed());
         return false;
     }
 
-    Debug_printf("Parsed JSON: %s\n", cJSON_Print(_json));
+    _json = stream.detach();
+
+    Debug_printf("JSON::parse() - parsed %u bytes%s\n", stream.bytesParsed(), _keptKey.empty() ? "" : ", kept query result only");
 
-    free(buf);
     return true;
-}
\ No newline at end of file
+}
@@ -11,6 +11,10 @@
 #include <networkProtocol.h>
 #include <cJSON.h>
 
+#define JSON_READ_CHUNK 512 // Bytes read from the protocol per pass through the parser
+#define JSON_READ_POLL 10 // ms to wait when the protocol has nothing for us yet
+#define JSON_READ_TIMEOUT 2000 // Give up on an incomplete document after this many ms without data
+
 class JSON
 {
 public:
@@ -21,7 +25,8 @@ public:
     void setReadQuery(string queryString);
     cJSON *resolveQuery();
     
-    bool parse();
+    bool parse(); // Set the query first to keep just that top level member
+
     int readValueLen();
     bool readValue(uint8_t *buf, unsigned short len);
 
@@ -29,6 +34,7 @@ private:
     cJSON *_json;
     networkProtocol *_protocol;
     string _queryString;
+    string _keptKey; // Query the last parse() kept, or empty if it kept the whole document
 
     string getValue(cJSON *item);
     
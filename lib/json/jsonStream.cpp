@@ -0,0 +1,380 @@
+/**
+ * Incremental JSON parser for #FujiNet
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include "jsonStream.h"
+#include "../../include/debug.h"
+
+JSONStream::JSONStream(const string &keepKey)
+{
+    _keepKey = keepKey;
+}
+
+JSONStream::~JSONStream()
+{
+    if (_root != nullptr)
+        cJSON_Delete(_root);
+}
+
+/**
+ * Hand over the tree we built
+ */
+cJSON *JSONStream::detach()
+{
+    cJSON *root = _root;
+    _root = nullptr;
+    return root;
+}
+
+/**
+ * Would a value starting now be kept?
+ */
+bool JSONStream::keeping()
+{
+    if (_stack.empty())
+        return true;
+
+    container &parent = _stack.back();
+    if (parent.node == nullptr)
+        return false;
+
+    // Only filter members of the top level object
+    if (_stack.size() == 1 && parent.object && !_keepKey.empty())
+        return strcasecmp(_key.c_str(), _keepKey.c_str()) == 0;
+
+    return true;
+}
+
+/**
+ * Attach a new item to whatever contains it
+ */
+void JSONStream::addItem(cJSON *item)
+{
+    if (_stack.empty())
+    {
+        _root = item;
+        return;
+    }
+
+    container &parent = _stack.back();
+    if (parent.object)
+        cJSON_AddItemToObject(parent.node, _key.c_str(), item);
+    else
+        cJSON_AddItemToArray(parent.node, item);
+}
+
+/**
+ * Is the current value the top level member we're keeping?
+ */
+bool JSONStream::keptMember()
+{
+    return _stack.size() == 1 && _stack.back().object && !_keepKey.empty() &&
+           strcasecmp(_key.c_str(), _keepKey.c_str()) == 0;
+}
+
+/**
+ * A value (scalar or container) just finished
+ */
+void JSONStream::valueDone()
+{
+    if (_stack.empty())
+    {
+        _state = DONE;
+        return;
+    }
+
+    _state = EXPECT_COMMA_OR_END;
+}
+
+void JSONStream::beginContainer(bool object)
+{
+    cJSON *node = nullptr;
+    if (keeping())
+    {
+        node = object ? cJSON_CreateObject() : cJSON_CreateArray();
+        addItem(node);
+    }
+
+    _stack.push_back({node, object, keptMember()});
+    _state = object ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+}
+
+void JSONStream::endContainer()
+{
+    // _key has been overwritten by any keys inside the container, so remember this now
+    bool member = _stack.back().member;
+    _stack.pop_back();
+    if (member)
+        _matched = true;
+    valueDone();
+}
+
+void JSONStream::stringDone()
+{
+    if (_stringIsKey)
+    {
+        _key = _token;
+        _state = EXPECT_COLON;
+        return;
+    }
+
+    if (keeping())
+        addItem(cJSON_CreateString(_token.c_str()));
+    if (keptMember())
+        _matched = true;
+    valueDone();
+}
+
+void JSONStream::numberDone()
+{
+    if (keeping())
+        addItem(cJSON_CreateNumber(strtod(_token.c_str(), nullptr)));
+    if (keptMember())
+        _matched = true;
+    valueDone();
+}
+
+bool JSONStream::literalDone()
+{
+    cJSON *item;
+    if (_token == "true")
+        item = cJSON_CreateTrue();
+    else if (_token == "false")
+        item = cJSON_CreateFalse();
+    else if (_token == "null")
+        item = cJSON_CreateNull();
+    else
+        return false;
+
+    if (keeping())
+        addItem(item);
+    else
+        cJSON_Delete(item);
+
+    if (keptMember())
+        _matched = true;
+    valueDone();
+    return true;
+}
+
+void JSONStream::appendUTF8(uint32_t cp)
+{
+    if (cp < 0x80)
+        _token += (char)cp;
+    else if (cp < 0x800)
+    {
+        _token += (char)(0xC0 | (cp >> 6));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        _token += (char)(0xE0 | (cp >> 12));
+        _token += (char)(0x80 | ((cp >> 6) & 0x3F));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        _token += (char)(0xF0 | (cp >> 18));
+        _token += (char)(0x80 | ((cp >> 12) & 0x3F));
+        _token += (char)(0x80 | ((cp >> 6) & 0x3F));
+        _token += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+/**
+ * Process one character. Returns false if it has to be looked at again
+ * (it ended a number or literal and starts whatever's next).
+ */
+bool JSONStream::step(char c)
+{
+    switch (_state)
+    {
+    case EXPECT_VALUE:
+    case EXPECT_VALUE_OR_END:
+        if (isspace((unsigned char)c))
+            break;
+        if (c == ']' && _state == EXPECT_VALUE_OR_END)
+            endContainer();
+        else if (c == '{')
+            beginContainer(true);
+        else if (c == '[')
+            beginContainer(false);
+        else if (c == '"')
+        {
+            _token.clear();
+            _stringIsKey = false;
+            _state = IN_STRING;
+        }
+        else if (c == '-' || isdigit((unsigned char)c))
+        {
+            _token = c;
+            _state = IN_NUMBER;
+        }
+        else if (c == 't' || c == 'f' || c == 'n')
+        {
+            _token = c;
+            _state = IN_LITERAL;
+        }
+        else
+            _state = FAILED;
+        break;
+
+    case EXPECT_KEY:
+    case EXPECT_KEY_OR_END:
+        if (isspace((unsigned char)c))
+            break;
+        if (c == '}' && _state == EXPECT_KEY_OR_END)
+            endContainer();
+        else if (c == '"')
+        {
+            _token.clear();
+            _stringIsKey = true;
+            _state = IN_STRING;
+        }
+        else
+            _state = FAILED;
+        break;
+
+    case EXPECT_COLON:
+        if (isspace((unsigned char)c))
+            break;
+        _state = c == ':' ? EXPECT_VALUE : FAILED;
+        break;
+
+    case EXPECT_COMMA_OR_END:
+        if (isspace((unsigned char)c))
+            break;
+        if (c == ',')
+            _state = _stack.back().object ? EXPECT_KEY : EXPECT_VALUE;
+        else if ((c == '}' && _stack.back().object) || (c == ']' && !_stack.back().object))
+            endContainer();
+        else
+            _state = FAILED;
+        break;
+
+    case IN_STRING:
+        if (c == '"')
+            stringDone();
+        else if (c == '\\')
+            _state = IN_STRING_ESCAPE;
+        else if (_stringIsKey || keeping())
+            _token += c;
+        break;
+
+    case IN_STRING_ESCAPE:
+        _state = IN_STRING;
+        switch (c)
+        {
+        case 'b':
+            c = '\b';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 't':
+            c = '\t';
+            break;
+        case 'u':
+            _unicode = 0;
+            _unicodeDigits = 0;
+            _state = IN_STRING_UNICODE;
+            return true;
+        }
+        if (_stringIsKey || keeping())
+            _token += c;
+        break;
+
+    case IN_STRING_UNICODE:
+        if (!isxdigit((unsigned char)c))
+        {
+            _state = FAILED;
+            break;
+        }
+        _unicode = (_unicode << 4) | (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+        if (++_unicodeDigits < 4)
+            break;
+
+        _state = IN_STRING;
+        if (_unicode >= 0xD800 && _unicode <= 0xDBFF)
+            _highSurrogate = _unicode;
+        else
+        {
+            uint32_t cp = _unicode;
+            if (_unicode >= 0xDC00 && _unicode <= 0xDFFF && _highSurrogate != 0)
+                cp = 0x10000 + ((_highSurrogate - 0xD800) << 10) + (_unicode - 0xDC00);
+            _highSurrogate = 0;
+            if (_stringIsKey || keeping())
+                appendUTF8(cp);
+        }
+        break;
+
+    case IN_NUMBER:
+        if (isdigit((unsigned char)c) || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        {
+            _token += c;
+            break;
+        }
+        numberDone();
+        return false;
+
+    case IN_LITERAL:
+        if (isalpha((unsigned char)c))
+        {
+            _token += c;
+            break;
+        }
+        if (!literalDone())
+            _state = FAILED;
+        return _state == FAILED;
+
+    case DONE:
+    case FAILED:
+        break;
+    }
+
+    return true;
+}
+
+/**
+ * Parse the next piece of the document
+ */
+bool JSONStream::feed(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && _state != FAILED && _state != DONE)
+    {
+        if (step(data[i]))
+            i++;
+    }
+    _bytes += i;
+
+    if (_state == FAILED)
+        Debug_printf("JSONStream - syntax error near byte %u\n", _bytes);
+
+    return _state != FAILED;
+}
+
+/**
+ * No more input: finish off a top level number or literal
+ */
+bool JSONStream::finish()
+{
+    if (_stack.empty())
+    {
+        if (_state == IN_NUMBER)
+            numberDone();
+        else if (_state == IN_LITERAL && !literalDone())
+            _state = FAILED;
+    }
+
+    return _state == DONE;
+}
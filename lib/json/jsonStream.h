@@ -0,0 +1,91 @@
+/**
+ * Incremental JSON parser for #FujiNet
+ */
+
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <string>
+#include <vector>
+#include <cJSON.h>
+
+using namespace std;
+
+/**
+ * Builds a cJSON tree from a document fed to it a piece at a time, so the
+ * document text never has to be held in memory.
+ * If keepKey isn't empty and the document is an object, only the top level
+ * member with that name (compared ignoring case, like cJSON_GetObjectItem())
+ * is kept; everything else is parsed and thrown away.
+ */
+class JSONStream
+{
+public:
+    JSONStream(const string &keepKey);
+    ~JSONStream();
+
+    bool feed(const char *data, size_t len); // Returns false on a syntax error
+    bool finish(); // Call at end of input. Returns true if we got a complete document.
+
+    bool done() { return _state == DONE; };
+    bool matched() { return _matched; }; // The kept member is complete, so the rest doesn't matter
+    bool failed() { return _state == FAILED; };
+    bool scalarPending() { return _stack.empty() && (_state == IN_NUMBER || _state == IN_LITERAL); }; // Only finish() can end it
+    size_t bytesParsed() { return _bytes; };
+
+    cJSON *detach(); // Hands over the tree we built; caller must cJSON_Delete() it
+
+private:
+    enum state_t
+    {
+        EXPECT_VALUE,
+        EXPECT_VALUE_OR_END, // Just after '['
+        EXPECT_KEY,
+        EXPECT_KEY_OR_END, // Just after '{'
+        EXPECT_COLON,
+        EXPECT_COMMA_OR_END,
+        IN_STRING,
+        IN_STRING_ESCAPE,
+        IN_STRING_UNICODE,
+        IN_NUMBER,
+        IN_LITERAL,
+        DONE,
+        FAILED
+    };
+
+    struct container
+    {
+        cJSON *node; // nullptr if we're skipping this container
+        bool object;
+        bool member; // This is the top level member we're keeping
+    };
+
+    string _keepKey;
+    state_t _state = EXPECT_VALUE;
+    vector<container> _stack;
+    cJSON *_root = nullptr;
+
+    string _token;
+    string _key;
+    bool _stringIsKey = false;
+    uint32_t _unicode = 0;
+    int _unicodeDigits = 0;
+    uint32_t _highSurrogate = 0;
+
+    bool _matched = false;
+    size_t _bytes = 0;
+
+    bool keeping();
+    bool keptMember();
+    void addItem(cJSON *item);
+    void valueDone();
+    void beginContainer(bool object);
+    void endContainer();
+    void stringDone();
+    void numberDone();
+    bool literalDone();
+    void appendUTF8(uint32_t codepoint);
+    bool step(char c);
+};
+
+#endif /* JSON_STREAM_H */
@@ -295,30 +295,16 @@ void xmm801::pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2)
                 default:
                     charWidth = 1.2;
                 }
-                fprintf(_file, ")]TJ /F%d 9 Tf 100 Tz [(", NUMFONTS); // set font to GFX mode
-                fontUsed[NUMFONTS - 1] = true;
+                pdf_image_begin(charWidth, 1.0, 8, -1.5); // same pins as the Epson
             }
 
             if (epson_cmd.ctr > 2)
             {
                 print_8bit_gfx(c);
-                switch (epson_cmd.cmd)
-                {
-                case 'K':
-                    break;
-                //case 'L': // Sets dot graphics mode to 960 dots per 8" line
-                //case 'Y': // on FX-80 this is double speed but with gotcha
-                case 'V': // XMM
-                    fprintf(_file, ")66.5(");
-                    break;
-                    //case 'Z': // on FX-80 this is double speed but with gotcha
-                    //    fprintf(_file, ")99.75(");
-                    //    break;
-                }
-                //fprintf(_file, "]TJ [(");
                 if (epson_cmd.ctr == (epson_cmd.N + 2))
                 {
-                    // reset font
+                    // draw the image and reset font
+                    pdf_image_end();
                     epson_set_font(1, 7.2);
                     textMode = true;
                     reset_cmd();
@@ -37,15 +37,9 @@ void epson80::clear_mode(uint16_t m)
 
 void epson80::print_8bit_gfx(uint8_t c)
 {
-    // e.g., [(0)100(1)100(4)100(50)]TJ
-    // lead with '0' to enter a space
-    // then shift back with 133 and print each pin
-    fprintf(_file, "0");
-    for (int i = 0; i < 8; i++)
-    {
-        if ((c >> i) & 0x01)
-            fprintf(_file, ")133(%u", i + 1);
-    }
+    // the top pin is the most significant bit
+    pdf_image_column(c);
+    pdf_X += charWidth;
 }
 
 void epson80::pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2)
@@ -257,29 +251,17 @@ void epson80::pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2)
                     charWidth = 0.3;
                     break;
                 }
-                fprintf(_file, ")]TJ /F%d 9 Tf 100 Tz [(", NUMFONTS); // set font to GFX mode
-                fontUsed[NUMFONTS - 1] = true;
+                // the dots go into an image; the 8 pins are 1/72" apart and start 1.5 pt below the baseline
+                pdf_image_begin(charWidth, 1.0, 8, -1.5);
             }
 
             if (epson_cmd.ctr > 2)
             {
                 print_8bit_gfx(c);
-                switch (epson_cmd.cmd)
-                {
-                case 'K':
-                    break;
-                case 'L': // Sets dot graphics mode to 960 dots per 8" line
-                case 'Y': // on FX-80 this is double speed but with gotcha
-                    fprintf(_file, ")66.5(");
-                    break;
-                case 'Z': // on FX-80 this is double speed but with gotcha
-                    fprintf(_file, ")99.75(");
-                    break;
-                }
-                //fprintf(_file, "]TJ [(");
                 if (epson_cmd.ctr == (epson_cmd.N + 2))
                 {
-                    // reset font
+                    // draw the image and reset font
+                    pdf_image_end();
                     epson_set_font(1, 7.2);
                     textMode = true;
                     reset_cmd();
@@ -100,6 +100,8 @@ void okimate10::okimate_handle_font()
  * finally check if inverse mode
  * 
  * */
+    pdf_image_end(); // draw any graphics before changing font
+
     bool fnt_is_invalid = (okimate_current_fnt_mask == invalid_font);
     bool need_to_change = (okimate_current_fnt_mask != okimate_new_fnt_mask) || fnt_is_invalid;
     bool change_font = fnt_is_invalid || ((okimate_current_fnt_mask & 0x0f) != (okimate_new_fnt_mask & 0x0f));
@@ -175,6 +177,19 @@ void okimate10::print_7bit_gfx(uint8_t c)
     }
 }
 
+// Black and white dot graphics go into an image instead of the GFX font
+void okimate10::print_7bit_image(uint8_t c)
+{
+    if (!imageMode)
+        pdf_image_begin(charWidth, 1.0, 7, 0.);
+
+    // the top pin is the least significant bit, so turn it around
+    uint8_t dots = 0;
+    for (int i = 0; i < 7; i++)
+        dots |= ((c >> i) & 0x01) << (6 - i);
+    pdf_image_column(dots);
+}
+
 void okimate10::pdf_clear_modes()
 {
     clear_mode(fnt_inverse); // implied by Atari manual page 28. Explicit in Commod'e manual page 26.
@@ -219,6 +234,7 @@ void okimate10::okimate_next_color()
 void okimate10::okimate_output_color_line()
 {
     uint16_t i = 0;
+    pdf_image_end();
     okimate_current_fnt_mask = invalid_font; //invalidate font
     // Debug_printf("Color buffer element 0: %02x\n", color_buffer[0][0]);
     for (i = 0; i < 480; i++) //while (color_buffer[i][0] != invalid_font && i < 480)
@@ -349,7 +365,8 @@ void okimate10::okimate_output_color_line()
     fprintf(_file, ")]TJ\n"); // close the line
     pdf_X = 0;                // CR
     pdf_clear_modes();
-    fprintf(_file, "0 0 Td [(");
+    fprintf(_file, "%g 0 Td [(", 0. - pdf_line_X);
+    pdf_line_X = 0;
     BOLflag = false;
     //pdf_end_line();
     //pdf_new_line();
@@ -519,7 +536,10 @@ void okimate10::pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2)
                     break;
                 default:
                     if (colorMode == colorMode_t::off)
-                        print_7bit_gfx(c);
+                    {
+                        print_7bit_image(c);
+                        pdf_X += charWidth;
+                    }
                     else
                     {
                         if ((color_buffer[color_counter][0] & fnt_gfx) || (color_buffer[color_counter][1] == 0x20) || (color_buffer[color_counter][2] == 0x20)) // either gfx or invalid but not skip_me) // either gfx or invalid but not skip_me
@@ -712,7 +732,7 @@ void okimate10::pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2)
                 {
                     if (colorMode == colorMode_t::off)
                     {
-                        print_7bit_gfx(okimate_cmd.data);
+                        print_7bit_image(okimate_cmd.data);
                         pdf_X += charWidth;
                     }
                     else
@@ -47,6 +47,7 @@ protected:
     void cmd_not_implemented(uint8_t c);
     void reset_cmd();
     void print_7bit_gfx(uint8_t c);
+    void print_7bit_image(uint8_t c);
     uint16_t okimate_cmd_ascii_to_int(uint8_t c);
     void set_mode(uint8_t m);
     void clear_mode(uint8_t m);
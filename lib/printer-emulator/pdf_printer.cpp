@@ -2,6 +2,19 @@
 #include "../utils/utils.h"
 #include "../../include/debug.h"
 #include "fnFsSPIF.h"
+#include "../hardware/fnSystem.h"
+
+pdfPrinter::~pdfPrinter()
+{
+    // Leave _file pointing at the real output file for printer_emu to close
+    if (pdf_stream != nullptr)
+    {
+        if (_file == pdf_stream)
+            _file = pdf_outfile;
+        fclose(pdf_stream);
+        pdf_stream = nullptr;
+    }
+}
 
 void pdfPrinter::pdf_header()
 {
@@ -11,6 +24,9 @@ void pdfPrinter::pdf_header()
     pdf_Y = 0;
     pdf_X = 0;
     pdf_pageCounter = 0;
+    pdf_raw_bytes = 0;
+    pdf_flate_bytes = 0;
+    pdf_render_us = 0;
     fprintf(_file, "%%PDF-1.4\n");
     // first object: catalog of pages
     pdf_objCtr = 1;
@@ -194,12 +210,14 @@ void pdfPrinter::pdf_new_page()
     fprintf(_file, "%d 0 R ", pdf_objCtr);
     fprintf(_file, "]>>\nendobj\n");
 
-    // open content stream
+    // open content stream, compressed if we can get the buffers for it
+    bool compressed = pdf_stream_open();
     objLocations[pdf_objCtr] = ftell(_file);
     fprintf(_file, "%d 0 obj\n<</Length ", pdf_objCtr);
     idx_stream_length = ftell(_file);
-    fprintf(_file, "0000000000 >>\nstream\n");
+    fprintf(_file, "0000000000 %s>>\nstream\n", compressed ? "/Filter /FlateDecode " : "");
     idx_stream_start = ftell(_file);
+    pdf_stream_resume();
 
     // open new text object
     pdf_begin_text(pageHeight - topMargin);
@@ -217,6 +235,7 @@ void pdfPrinter::pdf_begin_text(double Y)
     fprintf(_file, "%g %g Td\n", leftMargin, Y);
     pdf_Y = Y; // reset print roller to top of page
     pdf_X = 0; // set carriage to LHS
+    pdf_line_X = 0;
     BOLflag = true;
 }
 
@@ -226,11 +245,14 @@ void pdfPrinter::pdf_new_line()
     Debug_println("pdf new line");
 #endif
 
+    pdf_image_end();
+
     // position new line and start text string array
     if (pdf_dY != 0)
         fprintf(_file, "0 Ts ");
     pdf_dY -= lineHeight;
-    fprintf(_file, "0 %g Td [(", pdf_dY);
+    fprintf(_file, "%g %g Td [(", 0. - pdf_line_X, pdf_dY);
+    pdf_line_X = 0;
     pdf_Y += pdf_dY; // line feed
     pdf_dY = 0;
     // pdf_X = 0;              // CR over in end line()
@@ -242,6 +264,7 @@ void pdfPrinter::pdf_end_line()
 #ifdef DEBUG
     Debug_println("pdf end line");
 #endif
+    pdf_image_end();
     fprintf(_file, ")]TJ\n"); // close the line
     // pdf_Y -= lineHeight; // line feed - moved to new line()
     pdf_X = 0; // CR
@@ -252,6 +275,7 @@ void pdfPrinter::pdf_end_line()
 
 void pdfPrinter::pdf_set_rise()
 {
+    pdf_image_end();
     fprintf(_file, ")]TJ %g Ts [(", pdf_dY);
 }
 
@@ -261,11 +285,13 @@ void pdfPrinter::pdf_end_page()
     Debug_println("pdf end page");
 #endif
     // close text object & stream
+    pdf_image_end();
     if (!BOLflag)
         pdf_end_line();
     fprintf(_file, "ET\n");
+    pdf_stream_close();
     idx_stream_stop = ftell(_file);
-    fprintf(_file, "endstream\nendobj\n");
+    fprintf(_file, "\nendstream\nendobj\n");
     size_t idx_temp = ftell(_file);
     fflush(_file);
     fseek(_file, idx_stream_length, SEEK_SET);
@@ -342,11 +368,15 @@ bool pdfPrinter::process_buffer(uint8_t n, uint8_t aux1, uint8_t aux2)
     int i = 0;
     uint8_t c;
     uint8_t cc;
+    unsigned long started = fnSystem.micros();
 
 #ifdef DEBUG
     Debug_printf("Processing %d chars\n", n);
 #endif
 
+    // Page content goes back through the compressor (the output file may have been reopened since last time)
+    pdf_stream_resume();
+
     // algorithm for graphics:
     // if textMode, then can do the regular stuff
     // if !textMode, then don't deal with BOL, EOL.
@@ -403,11 +433,16 @@ bool pdfPrinter::process_buffer(uint8_t n, uint8_t aux1, uint8_t aux2)
     if (pdf_Y < bottomMargin) // lineHeight + bottomMargin
         pdf_end_page();
 
+    // Hand the real file back so it can be flushed and closed between calls
+    pdf_stream_suspend();
+    pdf_render_us += fnSystem.micros() - started;
+
     return true;
 }
 
 void pdfPrinter::pre_close_file()
 {
+    pdf_stream_resume();
     if (TOPflag && pdf_pageCounter == 0)
         pdf_new_page(); // make a blank page
     if (!BOLflag)
@@ -420,5 +455,164 @@ void pdfPrinter::pre_close_file()
     pdf_page_resource();
     pdf_xref();
 
+#ifdef DEBUG
+    Debug_printf("PDF done: %d pages, %ld bytes; content %u bytes compressed to %u; rendered in %u ms\n",
+                 pdf_pageCounter, ftell(_file), pdf_raw_bytes, pdf_flate_bytes, pdf_render_us / 1000);
+#endif
+
     //printer_emu::pageEject();
 }
+
+// Called by the compressing FILE with whatever content stream text it has buffered
+ssize_t pdfPrinter::pdf_stream_write(void *cookie, const char *buf, size_t size)
+{
+    pdfPrinter *pdf = (pdfPrinter *)cookie;
+    pdf->pdf_deflate.write((const uint8_t *)buf, size);
+    return size;
+}
+
+// Called by the compressor with each block of compressed content stream
+void pdfPrinter::pdf_stream_output(void *context, const uint8_t *data, size_t len)
+{
+    pdfPrinter *pdf = (pdfPrinter *)context;
+    fwrite(data, 1, len, pdf->pdf_outfile);
+}
+
+/*
+ Sets up compression for the next page's content stream.
+ Returns false if we couldn't, in which case the stream is written uncompressed.
+*/
+bool pdfPrinter::pdf_stream_open()
+{
+    if (pdf_stream != nullptr)
+        return true;
+
+    if (!pdf_deflate.begin(pdf_stream_output, this))
+    {
+        Debug_println("PDF printer couldn't allocate compression buffers");
+        return false;
+    }
+
+    cookie_io_functions_t io = {nullptr, pdf_stream_write, nullptr, nullptr};
+    pdf_stream = fopencookie(this, "w", io);
+    if (pdf_stream == nullptr)
+    {
+        pdf_deflate.end();
+        return false;
+    }
+    return true;
+}
+
+// Points _file at the compressing stream if a page is open
+void pdfPrinter::pdf_stream_resume()
+{
+    if (pdf_stream == nullptr || _file == pdf_stream)
+        return;
+    pdf_outfile = _file;
+    _file = pdf_stream;
+}
+
+// Pushes everything written so far into the compressor and points _file back at the real file
+void pdfPrinter::pdf_stream_suspend()
+{
+    if (pdf_stream == nullptr || _file != pdf_stream)
+        return;
+    fflush(pdf_stream);
+    _file = pdf_outfile;
+}
+
+// Ends the compressed stream for the current page
+void pdfPrinter::pdf_stream_close()
+{
+    if (pdf_stream == nullptr)
+        return;
+
+    pdf_stream_suspend();
+    fclose(pdf_stream);
+    pdf_stream = nullptr;
+
+    pdf_deflate.finish();
+    pdf_raw_bytes += pdf_deflate.bytes_in();
+    pdf_flate_bytes += pdf_deflate.bytes_out();
+    pdf_deflate.end();
+}
+
+/*
+ Starts collecting dot graphics columns. Each column holds up to PDF_IMAGE_MAX_ROWS dots,
+ the most significant of the given rows at the top. The image is drawn with its bottom
+ edge at baseline relative to the current text baseline.
+*/
+void pdfPrinter::pdf_image_begin(double dotWidth, double dotHeight, uint8_t rows, double baseline)
+{
+    pdf_image_end();
+
+    imageMode = true;
+    imageColumns = 0;
+    imageRows = rows > PDF_IMAGE_MAX_ROWS ? PDF_IMAGE_MAX_ROWS : rows;
+    imageDotWidth = dotWidth;
+    imageDotHeight = dotHeight;
+    imageBaseline = baseline;
+}
+
+// Adds a column of dots at the current carriage position; the caller moves pdf_X on
+void pdfPrinter::pdf_image_column(uint8_t dots)
+{
+    if (!imageMode)
+        return;
+
+    if (imageColumns == PDF_IMAGE_MAX_COLUMNS)
+    {
+        pdf_image_end();
+        imageMode = true;
+    }
+
+    if (imageColumns == 0)
+    {
+        image_X = pdf_X;
+        image_Y = pdf_Y + pdf_dY + imageBaseline;
+    }
+
+    uint16_t byte = imageColumns / 8;
+    uint8_t mask = 0x80 >> (imageColumns % 8);
+    for (int r = 0; r < imageRows; r++)
+    {
+        if (mask == 0x80)
+            imageDots[r][byte] = 0;
+        if ((dots >> (imageRows - 1 - r)) & 0x01)
+            imageDots[r][byte] |= mask;
+    }
+    imageColumns++;
+}
+
+/*
+ Draws the collected columns as an inline image mask, which paints in the current fill
+ colour. Images aren't allowed inside a text object, so the text object is ended and a
+ new one started with its line origin just after the image; pdf_line_X remembers how far
+ that is from the left margin so the next line can move back.
+*/
+void pdfPrinter::pdf_image_end()
+{
+    if (!imageMode)
+        return;
+    imageMode = false;
+
+    if (imageColumns == 0)
+        return;
+
+    double w = imageColumns * imageDotWidth;
+    if (!BOLflag)
+        fprintf(_file, ")]TJ\n");
+    fprintf(_file, "ET\nq %g 0 0 %g %g %g cm\n", w, imageRows * imageDotHeight, leftMargin + image_X, image_Y);
+    fprintf(_file, "BI /IM true /W %u /H %u /D [1 0] ID ", imageColumns, imageRows);
+    size_t rowBytes = (imageColumns + 7) / 8;
+    for (int r = 0; r < imageRows; r++)
+        fwrite(imageDots[r], 1, rowBytes, _file);
+    fprintf(_file, "\nEI Q\n");
+
+    pdf_line_X = image_X + w;
+    fprintf(_file, "BT %g %g Td ", leftMargin + pdf_line_X, pdf_Y);
+    if (!BOLflag)
+        fprintf(_file, "[(");
+
+    imageColumns = 0;
+}
@@ -8,9 +8,13 @@
 
 #include "printer_emulator.h"
 #include "../../include/atascii.h"
+#include "../utils/deflate.h"
 
 #define MAXFONTS 33 // maximum number of fonts can use
 
+#define PDF_IMAGE_MAX_ROWS 8       // dots in one column of printer graphics
+#define PDF_IMAGE_MAX_COLUMNS 2048 // widest run of dot graphics put in one inline image
+
 enum class colorMode_t
 {
     off = 0,
@@ -48,6 +52,7 @@ protected:
     bool TOPflag = true;
     bool textMode = true;
     colorMode_t colorMode = colorMode_t::off;
+    double pdf_line_X = 0.; // offset of the text line origin from leftMargin after an image moved it
 
     int pageObjects[256];
     int pdf_pageCounter = 0.;
@@ -70,6 +75,36 @@ protected:
     size_t idx_stream_start;  // file location of start of stream
     size_t idx_stream_stop;   // file location of end of stream
 
+    // Page content streams are written through a FILE that compresses into the real output file
+    FILE *pdf_stream = nullptr;  // compressing FILE, _file while the page is being written
+    FILE *pdf_outfile = nullptr; // the real output file while _file is pdf_stream
+    deflateStream pdf_deflate;
+    uint32_t pdf_raw_bytes = 0;  // content stream bytes before and after compression, for the whole document
+    uint32_t pdf_flate_bytes = 0;
+    uint32_t pdf_render_us = 0; // time spent in process_buffer for the whole document
+
+    static ssize_t pdf_stream_write(void *cookie, const char *buf, size_t size);
+    static void pdf_stream_output(void *context, const uint8_t *data, size_t len);
+    bool pdf_stream_open();
+    void pdf_stream_resume();
+    void pdf_stream_suspend();
+    void pdf_stream_close();
+
+    // Dot graphics are collected into 1-bit image masks instead of being drawn as font glyphs
+    bool imageMode = false;
+    uint8_t imageDots[PDF_IMAGE_MAX_ROWS][PDF_IMAGE_MAX_COLUMNS / 8]; // one bit per dot, a row at a time
+    uint16_t imageColumns = 0;
+    uint8_t imageRows = 0;
+    double imageDotWidth = 0.;
+    double imageDotHeight = 0.;
+    double imageBaseline = 0.; // bottom of the image relative to the text baseline
+    double image_X = 0.;
+    double image_Y = 0.;
+
+    void pdf_image_begin(double dotWidth, double dotHeight, uint8_t rows, double baseline);
+    void pdf_image_column(uint8_t dots);
+    void pdf_image_end();
+
     virtual void pdf_clear_modes() = 0;
     virtual void pdf_handle_char(uint8_t c, uint8_t aux1, uint8_t aux2) = 0;
     virtual bool process_buffer(uint8_t linelen, uint8_t aux1, uint8_t aux2) override;
@@ -78,6 +113,7 @@ protected:
 
 public:
     pdfPrinter() { _paper_type = PDF; };
+    virtual ~pdfPrinter();
 };
 
 #endif // guard
@@ -1,10 +1,9 @@
 #include "png_printer.h"
 #include "../../include/debug.h"
+#include "../hardware/fnSystem.h"
 
 // rewrite of TinyPngOut https://www.nayuki.io/page/tiny-png-output
 
-#define DEFLATE_MAX_BLOCK_SIZE 0xFFFF
-
 void pngPrinter::uint32_to_array(uint32_t src, uint8_t dest[4])
 {
     dest[0] = (uint8_t)((src >> 24) & 0xff);
@@ -13,69 +12,6 @@ void pngPrinter::uint32_to_array(uint32_t src, uint8_t dest[4])
     dest[3] = (uint8_t)(src & 0xff);
 }
 
-uint32_t pngPrinter::update_adler32(uint32_t adler, uint8_t data)
-{
-    // https://gist.github.com/kornelski/710db9d30a64db0807c5bfbdbdecf85e
-    unsigned s1 = adler & 0xffff;
-    unsigned s2 = (adler >> 16) & 0xffff;
-
-    s1 += data;
-    s1 %= 65521;
-
-    s2 += s1;
-    s2 %= 65521;
-
-    return (s2 << 16) | s1;
-}
-
-uint32_t pngPrinter::rc_crc32(uint32_t crc, const uint8_t *buf, size_t len)
-// https://rosettacode.org/wiki/CRC-32#Implementation_2
-{
-    static uint32_t table[256];
-    static int have_table = 0;
-    uint32_t rem;
-    uint8_t octet;
-    int i, j;
-    const uint8_t *p, *q;
-
-    /* This check is not thread safe; there is no mutex. */
-    if (have_table == 0)
-    {
-        /* Calculate CRC table. */
-        for (i = 0; i < 256; i++)
-        {
-            rem = i; /* remainder from polynomial division */
-            for (j = 0; j < 8; j++)
-            {
-                if (rem & 1)
-                {
-                    rem >>= 1;
-                    rem ^= 0xedb88320;
-                }
-                else
-                    rem >>= 1;
-            }
-            table[i] = rem;
-        }
-        have_table = 1;
-    }
-
-    crc = ~crc;
-    q = buf + len;
-    for (p = buf; p < q; p++)
-    {
-        octet = *p; /* Cast to unsigned octet. */
-        crc = (crc >> 8) ^ table[(crc & 0xff) ^ octet];
-    }
-    return ~crc;
-}
-
-// uint32_t pngPrinter::rc_crc32(uint32_t crc, uint8_t c)
-// // pass a single character
-// {
-//     rc_crc32(crc, &c, 1);
-// }
-
 void pngPrinter::png_signature()
 {
 #ifdef DEBUG
@@ -113,7 +49,7 @@ void pngPrinter::png_header()
         0x08,                   // 16       1 byte depth
         0x03,                   // 17       0x03 color with palette
         0x00,                   // 18       compression method always 0
-        0x00,                   // 19       no filter
+        0x00,                   // 19       filter method 0 (filter type chosen per line)
         0x00,                   // 20       no interlace
         0, 0, 0, 0,             // 21-24    IHDR CRC-32 placeholder
     };
@@ -128,8 +64,7 @@ void pngPrinter::png_header()
         chunk type code and chunk data fields, but 
         not including the length field.
     */
-    crc_value = rc_crc32(0, &header[4], 17);
-    uint32_to_array(crc_value, &header[21]);
+    uint32_to_array(crc32_update(0, &header[4], 17), &header[21]);
     fwrite(header, 1, 25, _file);
 }
 
@@ -193,8 +128,7 @@ void pngPrinter::png_palette()
     uint8_t ccc[] = {0, 0, 0, 0}; // crc placeholder
 
     uint32_to_array(768, &len[0]);
-    crc_value = rc_crc32(0, &data[0], 4 + 768);
-    uint32_to_array(crc_value, &ccc[0]);
+    uint32_to_array(crc32_update(0, &data[0], 4 + 768), &ccc[0]);
 
     fwrite(len, 1, 4, _file);
     fwrite(data, 1, 4 + 768, _file);
@@ -225,151 +159,109 @@ void pngPrinter::png_data()
 #ifdef DEBUG
     Debug_println("Starting PNG Image Data...");
 #endif
-    uint8_t data[] = {
-        // IDAT chunk
-        0x00, 0x00, 0x00, 0x00, // 0-3      size placeholder
-        'I', 'D', 'A', 'T',     // 4-7      IDAT
-    };
-    crc_value = rc_crc32(0, &data[4], 4); // begin CRC calculation
+    Ypos = 0;
+    encode_us = 0;
+    memset(prior_line, 0, sizeof(prior_line));
+
+    if (!zlib.begin(png_write_idat, this))
+        Debug_println("PNG printer couldn't allocate compression buffers");
+}
 
-    // Compute data size
-    // imgSize = (width + 1) * height; // +1 per line for filter 0's
-    uint32_t numBlocks = imgSize / DEFLATE_MAX_BLOCK_SIZE;
-    if (imgSize % DEFLATE_MAX_BLOCK_SIZE != 0)
-        numBlocks++; // Round up
+// Writes a block of the zlib stream as an IDAT chunk. Chunk boundaries don't matter to decoders.
+void pngPrinter::png_write_idat(void *context, const uint8_t *data, size_t len)
+{
+    pngPrinter *png = (pngPrinter *)context;
 
-    dataSize += numBlocks * 5; // 5 bytes per DEFLATE uncompressed block header
-    dataSize += 2;             // 2 bytes for zlib header
-    dataSize += 4;             // 4 bytes for zlib Adler-32 checksum
-    dataSize += imgSize;       // plus the image data
+    uint8_t header[8] = {0, 0, 0, 0, 'I', 'D', 'A', 'T'};
+    uint8_t ccc[4];
 
-    uint32_to_array(dataSize, &data[0]); // store the computed size
+    png->uint32_to_array(len, &header[0]);
+    uint32_t crc = crc32_update(0, &header[4], 4);
+    png->uint32_to_array(crc32_update(crc, data, len), &ccc[0]);
 
-    fwrite(data, 1, 8, _file); // write out the IDAT header
+    fwrite(header, 1, 8, png->_file);
+    fwrite(data, 1, len, png->_file);
+    fwrite(ccc, 1, 4, png->_file);
 }
 
-void pngPrinter::png_add_data(uint8_t *buf, uint32_t n)
+/*
+ Filters one image line and adds it to the zlib stream. Each of the five PNG filter
+ types is tried and the one with the smallest sum of absolute (signed) values is used,
+ the usual heuristic for picking the most compressible.
+*/
+void pngPrinter::png_add_line(const uint8_t *line)
 {
-    uint8_t c = 0;
-    // Deflate-compressed datastreams within PNG are stored in the “zlib” format
-    // https://tools.ietf.org/html/rfc1950#page-4
+    if (Ypos >= height)
+        return;
 
-    if (img_pos == 0)
-    {
-#ifdef DEBUG
-        Debug_println("Writing ZLIB header.");
-#endif
-        // write out a ZLIB header
-        // Compression method/flags code: 1 byte (For PNG compression method 0, the zlib compression method/flags code must specify method code 8 (“deflate” compression))
-        c = 0x08; // ZLIB "Deflate" compression scheme
-        crc_value = rc_crc32(crc_value, c);
-        fputc(c, _file);
-        //  Additional flags/check bits: 1 byte (must be such that method + flags, when viewed as a 16-bit unsigned integer stored in MSB order (CMF*256 + FLG), is a multiple of 31.)
-        c = 0x1D; // precompute so that 0x081D is divisible by 31 [ (0x800 / 31 + 1) * 31 - 0x800 ]
-        crc_value = rc_crc32(crc_value, c);
-        fputc(c, _file);
-
-        //printf("new image\n");
-    }
+    unsigned long started = fnSystem.micros();
 
-    uint32_t idx = 0;
-    while (idx < n)
+    uint32_t best_sum = UINT32_MAX;
+    int best = 0;
+
+    for (int f = 0; f < 5; f++)
     {
-        // at beginning of block?
-        if (blk_pos == 0)
+        uint8_t *out = &filtered[f][1];
+        filtered[f][0] = f;
+        uint32_t sum = 0;
+
+        for (int x = 0; x < width; x++)
         {
-            blkSize = DEFLATE_MAX_BLOCK_SIZE;
-            uint8_t c = 0;
-            if (imgSize - img_pos <= (uint32_t)blkSize)
+            // a = left, b = above, c = above left (one byte per pixel)
+            uint8_t a = x > 0 ? line[x - 1] : 0;
+            uint8_t b = prior_line[x];
+            uint8_t c = x > 0 ? prior_line[x - 1] : 0;
+            uint8_t v = line[x];
+
+            switch (f)
             {
-                c = 1; // final block
-                blkSize = (uint16_t)(imgSize - img_pos);
+            case 1: // Sub
+                v -= a;
+                break;
+            case 2: // Up
+                v -= b;
+                break;
+            case 3: // Average
+                v -= (a + b) / 2;
+                break;
+            case 4: // Paeth
+            {
+                int p = a + b - c;
+                int pa = abs(p - a);
+                int pb = abs(p - b);
+                int pc = abs(p - c);
+                v -= (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                break;
+            }
             }
 
-#ifdef DEBUG
-            Debug_println("Writing ZLIB block header.");
-#endif
-            // write out block header
-            crc_value = rc_crc32(crc_value, c);
-            fputc(c, _file);
-
-            // write out block size
-            c = (uint8_t)(blkSize >> 0);
-            crc_value = rc_crc32(crc_value, c);
-            fputc(c, _file);
-            c = (uint8_t)(blkSize >> 8);
-            crc_value = rc_crc32(crc_value, c);
-            fputc(c, _file);
-            c = (uint8_t)((blkSize >> 0) ^ 0xFF);
-            crc_value = rc_crc32(crc_value, c);
-            fputc(c, _file);
-            c = (uint8_t)((blkSize >> 8) ^ 0xFF);
-            crc_value = rc_crc32(crc_value, c);
-            fputc(c, _file);
-
-            //printf("new block\n");
+            out[x] = v;
+            sum += v < 128 ? v : 256 - v;
         }
 
-        //at beginning of a line?
-        if (Xpos == 0)
+        if (sum < best_sum)
         {
-#ifdef DEBUG
-            Debug_printf("Starting PNG line %d ... ",Ypos);
-#endif
-            c = 0;
-            crc_value = rc_crc32(crc_value, c);
-            adler_value = update_adler32(adler_value, c);
-            fputc(c, _file);
-            //printf("\nnew line %d ", c);
-
-            img_pos++;
-            blk_pos++;
+            best_sum = sum;
+            best = f;
         }
+    }
 
-        // put byte from buffer
-        c = buf[idx];
-        crc_value = rc_crc32(crc_value, c);
-        adler_value = update_adler32(adler_value, c);
-        fputc(c, _file);
-        //printf("%d ", c);
-
-        Xpos++;
-        idx++;
-        img_pos++;
-        blk_pos++;
+    zlib.write(filtered[best], width + 1);
+    memcpy(prior_line, line, width);
+    Ypos++;
 
-        // check for end of's
-        if (Xpos == width)
-        {
-#ifdef DEBUG
-            Debug_println("Finished PNG line.");
-#endif
-            Xpos = 0;
-            Ypos++;
-        }
-        if (blk_pos == blkSize)
-        {
-#ifdef DEBUG
-            Debug_println("End of ZLIB block.");
-#endif
-            blk_pos = 0;
-        }
-    };
+    encode_us += fnSystem.micros() - started;
 
-    if (img_pos == imgSize)
+    if (Ypos == height)
     {
+        started = fnSystem.micros();
+        zlib.finish();
+        encode_us += fnSystem.micros() - started;
 #ifdef DEBUG
-        Debug_println("Writing ZLIB Adler checksum and PNG data CRC.");
+        Debug_printf("PNG image done: %u bytes compressed to %u in %u ms\n",
+                     zlib.bytes_in(), zlib.bytes_out(), encode_us / 1000);
 #endif
-        uint8_t data[] = {
-            0, 0, 0, 0, // Adler32 Check value: 4 bytes
-            0, 0, 0, 0  // CRC32: 4 bytes
-        };
-        uint32_to_array(adler_value, &data[0]);
-        for (int i = 0; i < 4; i++)
-            crc_value = rc_crc32(crc_value, data[i]); // crc_value = rc_crc32(crc_value, data[0],4); ?????????
-        uint32_to_array(crc_value, &data[4]);
-        fwrite(data, 1, 8, _file);
+        zlib.end();
         png_end();
     }
 }
@@ -386,14 +278,22 @@ void pngPrinter::png_end()
     fwrite(end, 1, 12, _file);
 }
 
-// TODO: Anything here?
+// Pads out an unfinished image with blank lines so the file is still a valid PNG
 void pngPrinter::pre_close_file()
 {
+    if (Ypos >= height)
+        return;
 
+    memset(line_buffer, 0, sizeof(line_buffer));
+    while (Ypos < height)
+        png_add_line(line_buffer);
 }
 
 void pngPrinter::post_new_file()
 {
+    BOLflag = true;
+    line_index = 0;
+
     // call PNG header routines
     png_signature();
     png_header();
@@ -409,7 +309,7 @@ bool pngPrinter::process_buffer(uint8_t n, uint8_t aux1, uint8_t aux2)
     Debug_printf("%d bytes rx'd by PNG printer\n", n);
 #endif
     uint16_t i = 0;
-    while (i < n && img_pos < imgSize)
+    while (i < n && Ypos < height)
     {
         //Debug_println("processing buffer.");
         if (BOLflag)
@@ -431,7 +331,7 @@ bool pngPrinter::process_buffer(uint8_t n, uint8_t aux1, uint8_t aux2)
 #ifdef DEBUG
                 Debug_printf("Adding line %d\n", rep_code);
 #endif
-                png_add_data(&line_buffer[0], 320);
+                png_add_line(&line_buffer[0]);
             }
             BOLflag = true;
             line_index = 0;
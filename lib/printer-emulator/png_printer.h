@@ -2,8 +2,7 @@
 #define PNG_PRINTER_H
 
 #include "printer_emulator.h"
-
-#define DEFLATE_MAX_BLOCK_SIZE 0xFFFF
+#include "../utils/deflate.h"
 
 class pngPrinter : public printer_emu
 {
@@ -12,32 +11,27 @@ protected:
     const uint32_t width = 320;
     const uint32_t height = 192;
 
-    const uint32_t imgSize = (width + 1) * height; // size of image including BOL filter p's for IDAT chunk
-    uint32_t img_pos = 0;                    // serial position within image data including BOL filter p's
-    uint16_t Xpos = 0;                       // current position within image line
     uint16_t Ypos = 0;                       // current image line number
-    uint32_t dataSize = 0;                   // size of data for IDAT chunk
-    uint16_t blkSize = 0;                    // size of zlib block
-    uint16_t blk_pos = 0;                    // serial position within zlib block
-    uint32_t crc_value = 0;                  // running crc32 value
-    uint32_t adler_value = 1;                // running checksum (initilize to 1 https://en.wikipedia.org/wiki/Adler-32)
+    uint32_t encode_us = 0;                  // time spent filtering and compressing this image
 
     uint8_t line_buffer[320];
+    uint8_t prior_line[320];                 // previous image line, for the Up/Average/Paeth filters
+    uint8_t filtered[5][320 + 1];            // current line with each filter applied, led by its filter type
+
+    deflateStream zlib;                      // IDAT data, written out as an IDAT chunk per buffer full
 
     bool BOLflag = true;
     uint16_t line_index = 0;
     uint8_t rep_code = 0;
 
     void uint32_to_array(uint32_t src, uint8_t dest[4]);
-    uint32_t update_adler32(uint32_t adler, uint8_t data);
-    uint32_t rc_crc32(uint32_t crc, const uint8_t *buf, size_t len);
-    uint32_t rc_crc32(uint32_t crc, uint8_t c) { return rc_crc32(crc, &c, 1); }
+    static void png_write_idat(void *context, const uint8_t *data, size_t len);
 
     void png_signature();
     void png_header();
     void png_palette();
     void png_data();
-    void png_add_data(uint8_t *buf, uint32_t n);
+    void png_add_line(const uint8_t *line);
     void png_end();
 
     virtual void post_new_file() override;
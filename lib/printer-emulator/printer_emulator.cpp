@@ -1,3 +1,5 @@
+#include <esp_heap_caps.h>
+
 #include "../../include/debug.h"
 #include "printer_emulator.h"
 
@@ -23,9 +25,34 @@ printer_emu::~printer_emu()
         fclose(_file);
         _file = nullptr;
     }
+    free(_output_buffer);
 }
 
-// virtual void flushOutput(); // do this in pageEject
+// Opens the output file, giving it our big write buffer
+void printer_emu::open_output(const char *mode)
+{
+    if (_file != nullptr)
+        fclose(_file);
+
+    _file = _FS->file_open(PRINTER_OUTFILE, mode);
+    if (_file == nullptr)
+        return;
+
+    if (_output_buffer == nullptr)
+        _output_buffer = (uint8_t *)heap_caps_malloc(PRINTER_OUTPUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_output_buffer != nullptr)
+        setvbuf(_file, (char *)_output_buffer, _IOFBF, PRINTER_OUTPUT_BUFFER_SIZE);
+}
+
+void printer_emu::flushOutput()
+{
+    if (_file == nullptr)
+        return;
+
+    fflush(_file);
+    fclose(_file);
+    _file = nullptr;
+}
 
 // Copy contents of given file to the current printer output file
 // Assumes source file is in SPIFFS
@@ -69,7 +96,7 @@ size_t printer_emu::getOutputSize()
     return result == -1 ? 0 : result;
 }
 
-// All the work is done here in the derived classes. Open and close the output file before proceeding
+// All the work is done here in the derived classes. Open the output file before proceeding
 bool printer_emu::process(uint8_t linelen, uint8_t aux1, uint8_t aux2)
 {
     // Make sure the file has been initialized
@@ -81,17 +108,17 @@ bool printer_emu::process(uint8_t linelen, uint8_t aux1, uint8_t aux2)
             return false;
     }
 
-    // Open output file for appending
-    _file = _FS->file_open(PRINTER_OUTFILE, "r+"); // This is supposed to open the file for writing at the end, but reading at the beginnig
-    fseek(_file, 0, SEEK_END); // Make sure we're at the end of the file for reading in case the emaulator code expects that
-
-    bool result = process_buffer(linelen, aux1, aux2);
-
-    fflush(_file);
-    fclose(_file);
-    _file = nullptr;
+    // Open output file for appending, unless it's still open from the last call
+    if (_file == nullptr)
+    {
+        open_output("r+"); // This is supposed to open the file for writing at the end, but reading at the beginnig
+        if (_file == nullptr)
+            return false;
+        fseek(_file, 0, SEEK_END); // Make sure we're at the end of the file for reading in case the emaulator code expects that
+    }
 
-    return result;
+    // The file's left open (and buffered) until flushOutput() or closeOutput()
+    return process_buffer(linelen, aux1, aux2);
 }
 
 // Closes the output file and provides an open read handle to it afterwards
@@ -111,7 +138,9 @@ void printer_emu::closeOutput()
     // Give printer emulator chance to finish output
     if(_file == nullptr)
     {
-        _file = _FS->file_open(PRINTER_OUTFILE, "r+"); // Seeks don't work right if we use "append" mode - use "r+"
+        open_output("r+"); // Seeks don't work right if we use "append" mode - use "r+"
+        if (_file == nullptr)
+            return;
         fseek(_file, 0, SEEK_END);
     }
 
@@ -127,9 +156,7 @@ void printer_emu::closeOutput()
 void printer_emu::restart_output()
 {
     _output_started = false;
-    if(_file != nullptr)
-        fclose(_file);
-    _file = _FS->file_open(PRINTER_OUTFILE, "w"); // This should create/truncate the file
+    open_output("w"); // This should create/truncate the file
 #ifdef DEBUG
     if (_file != nullptr)
     {
@@ -6,6 +6,8 @@
 #include "fnFsSD.h"
 #include "fnFsSPIF.h"
 
+#define PRINTER_OUTPUT_BUFFER_SIZE 16384 // stdio buffer for the output file so the emulators' small writes reach storage in large blocks
+
 // TODO: Combine html_printer.cpp/h and file_printer.cpp/h
 
 // I think the way we're using this value is as a switch to tell the printer
@@ -33,6 +35,7 @@ protected:
     FileSystem *_FS = nullptr;
     FILE * _file = nullptr;
     paper_t _paper_type = RAW;
+    uint8_t * _output_buffer = nullptr;
 
     uint8_t buffer[40];
 
@@ -47,6 +50,7 @@ protected:
 
     size_t copy_file_to_output(const char *filename);
     void restart_output();
+    void open_output(const char *mode);
     
 public:
     // Destructor must be virtual to allow for proper cleanup of derived classes
@@ -58,6 +62,8 @@ public:
     FILE * closeOutputAndProvideReadHandle();
 
     bool process(uint8_t linelen, uint8_t aux1, uint8_t aux2);
+    // Writes out anything buffered and closes the output file until the next process()
+    void flushOutput();
 
     paper_t getPaperType() { return _paper_type; };
 
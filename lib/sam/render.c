@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "render.h"
+#include "sam.h"
 #include "RenderTabs.h"
 
 #include "samdebug.h"
@@ -48,6 +49,18 @@ unsigned char trans(unsigned char mem39212, unsigned char mem39213);
 extern int bufferpos;
 extern char *buffer;
 
+extern SamOutputCallback outputCallback;
+extern int outputReported;
+
+// Samples before bufferpos / 50 are never written again, so they can be played
+void OutputProgress()
+{
+    if (outputCallback == NULL || bufferpos / 50 < outputReported + SAM_OUTPUT_CHUNK)
+        return;
+    outputReported = bufferpos / 50;
+    outputCallback(buffer, outputReported);
+}
+
 //timetable for more accurate c64 simulation
 int timetable[5][5] =
     {
@@ -70,6 +83,7 @@ void Output8BitAry(int index, unsigned char ary[5])
         // printf("%d %d\n", bufferpos,k);
         buffer[bufferpos / 50 + k] = ary[k];
     }
+    OutputProgress();
 }
 void Output8Bit(int index, unsigned char A)
 {
@@ -976,6 +990,7 @@ void Render()
                 // mem[54296] = X;
                 bufferpos += 150;
                 buffer[bufferpos / 50] = (X & 15) * 16;
+                OutputProgress();
             }
             else
             {
@@ -983,6 +998,7 @@ void Render()
                 X = 6;
                 bufferpos += 150;
                 buffer[bufferpos / 50] = (X & 15) * 16;
+                OutputProgress();
             }
 
             for (X = wait2; X > 0; X--)
@@ -44,6 +44,10 @@ unsigned char phonemeLengthOutput[60]; //tab47416
 int bufferpos = 0;
 char *buffer = NULL;
 
+// told about finished samples while rendering
+SamOutputCallback outputCallback = NULL;
+int outputReported = 0;
+
 void SetInput(char *_input)
 {
     int i, l;
@@ -60,9 +64,15 @@ void SetPitch(unsigned char _pitch) { pitch = _pitch; }
 void SetMouth(unsigned char _mouth) { mouth = _mouth; }
 void SetThroat(unsigned char _throat) { throat = _throat; }
 void EnableSingmode() { singmode = 1; }
+unsigned char GetSpeed() { return speed; }
+unsigned char GetPitch() { return pitch; }
+unsigned char GetMouth() { return mouth; }
+unsigned char GetThroat() { return throat; }
+int GetSingmode() { return singmode; }
 char *GetBuffer() { return buffer; }
 int GetBufferLength() { return bufferpos; }
 void FreeBuffer() { free(buffer); }
+void SetOutputCallback(SamOutputCallback callback) { outputCallback = callback; }
 
 void Init();
 int Parser1();
@@ -94,6 +104,7 @@ void Init()
     SetMouthThroat(mouth, throat);
 
     bufferpos = 0;
+    outputReported = 0;
     // TODO, check for free the memory, 10 seconds of output should be more than enough
     //buffer = (char*)ps_malloc(22050 * 5);
     // switch to ESP-IDF equivalent
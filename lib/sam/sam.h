@@ -14,11 +14,23 @@ extern "C"
     void EnableSingmode();
     void EnableDebug();
 
+    unsigned char GetSpeed();
+    unsigned char GetPitch();
+    unsigned char GetMouth();
+    unsigned char GetThroat();
+    int GetSingmode();
+
     int SAMMain();
 
     char *GetBuffer();
     int GetBufferLength();
     void FreeBuffer();
+
+    // While rendering, the output callback is given the number of samples at the start of the
+    // buffer that are finished, every SAM_OUTPUT_CHUNK samples, so playback can start early
+#define SAM_OUTPUT_CHUNK 512
+    typedef void (*SamOutputCallback)(char *buffer, int length);
+    void SetOutputCallback(SamOutputCallback callback);
     
     //char input[]={"/HAALAOAO MAYN NAAMAEAE IHSTT SAEBAASTTIHAAN \x9b\x9b\0"};
     //unsigned char input[]={"/HAALAOAO \x9b\0"};
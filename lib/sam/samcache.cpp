@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <esp_heap_caps.h>
+
+#include "sam.h"
+#include "samcache.h"
+#include "../../include/debug.h"
+
+#define SAM_CACHE_PLAY_CHUNK 256 // samples decoded at a time for playback (SAM_CACHE_ADPCM)
+
+struct samCacheEntry
+{
+    char key[SAM_CACHE_KEY_LEN];
+    uint8_t *data = nullptr; // one sample a byte, or with SAM_CACHE_ADPCM two, first in the low nibble
+    int samples = 0;
+    uint32_t last_used = 0;
+};
+
+static samCacheEntry _cache[SAM_CACHE_ENTRIES];
+static size_t _cache_bytes = 0;
+static uint32_t _cache_clock = 0; // bumped on every use, for picking the least recently used
+static uint32_t _cache_hits = 0;
+static uint32_t _cache_misses = 0;
+static uint32_t _cache_evictions = 0;
+
+#ifdef SAM_CACHE_ADPCM
+static const int16_t _ima_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767};
+
+static const int8_t _ima_index_adjust[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+struct imaState
+{
+    int predicted = 0;
+    int index = 0;
+};
+
+// Applies a 4-bit code to the decoder state and returns the new sample (shared by encoder and decoder)
+static int _ima_step(imaState *st, uint8_t code)
+{
+    int step = _ima_steps[st->index];
+    int diff = step >> 3;
+    if (code & 4)
+        diff += step;
+    if (code & 2)
+        diff += step >> 1;
+    if (code & 1)
+        diff += step >> 2;
+
+    st->predicted += (code & 8) ? -diff : diff;
+    if (st->predicted > 32767)
+        st->predicted = 32767;
+    else if (st->predicted < -32768)
+        st->predicted = -32768;
+
+    st->index += _ima_index_adjust[code & 7];
+    if (st->index < 0)
+        st->index = 0;
+    else if (st->index > 88)
+        st->index = 88;
+
+    return st->predicted;
+}
+
+static uint8_t _ima_encode(imaState *st, int sample)
+{
+    int step = _ima_steps[st->index];
+    int diff = sample - st->predicted;
+    uint8_t code = 0;
+    if (diff < 0)
+    {
+        code = 8;
+        diff = -diff;
+    }
+    if (diff >= step)
+    {
+        code |= 4;
+        diff -= step;
+    }
+    if (diff >= step >> 1)
+    {
+        code |= 2;
+        diff -= step >> 1;
+    }
+    if (diff >= step >> 2)
+        code |= 1;
+
+    _ima_step(st, code);
+    return code;
+}
+#endif
+
+// Bytes needed to hold count samples
+static size_t _cache_len(int count)
+{
+#ifdef SAM_CACHE_ADPCM
+    return (count + 1) / 2;
+#else
+    return count;
+#endif
+}
+
+void SamCacheKey(char *key, const char *text, int phonetic)
+{
+    snprintf(key, SAM_CACHE_KEY_LEN, "%c%u,%u,%u,%u,%d:%s", phonetic ? 'P' : 'T',
+             GetSpeed(), GetPitch(), GetMouth(), GetThroat(), GetSingmode(), text);
+}
+
+static void _cache_free(samCacheEntry *e)
+{
+    if (e->data != nullptr)
+    {
+        free(e->data);
+        _cache_bytes -= _cache_len(e->samples);
+    }
+    e->data = nullptr;
+    e->samples = 0;
+    e->key[0] = '\0';
+}
+
+static samCacheEntry *_cache_find(const char *key)
+{
+    for (int i = 0; i < SAM_CACHE_ENTRIES; i++)
+        if (_cache[i].data != nullptr && strcmp(_cache[i].key, key) == 0)
+            return &_cache[i];
+    return nullptr;
+}
+
+// Returns the least recently used entry that's holding something
+static samCacheEntry *_cache_lru()
+{
+    samCacheEntry *oldest = nullptr;
+    for (int i = 0; i < SAM_CACHE_ENTRIES; i++)
+        if (_cache[i].data != nullptr && (oldest == nullptr || _cache[i].last_used < oldest->last_used))
+            oldest = &_cache[i];
+    return oldest;
+}
+
+// Drops whatever's in an entry to make room
+static void _cache_evict(samCacheEntry *e)
+{
+    _cache_free(e);
+    _cache_evictions++;
+}
+
+bool SamCachePlay(const char *key, SamCachePlayFn play)
+{
+    samCacheEntry *e = _cache_find(key);
+    if (e == nullptr)
+    {
+        _cache_misses++;
+        Debug_printf("SAM cache miss (%u hits, %u misses)\n", _cache_hits, _cache_misses);
+        return false;
+    }
+
+    _cache_hits++;
+    e->last_used = ++_cache_clock;
+    Debug_printf("SAM cache hit, %d samples (%u hits, %u misses)\n", e->samples, _cache_hits, _cache_misses);
+
+#ifdef SAM_CACHE_ADPCM
+    char pcm[SAM_CACHE_PLAY_CHUNK];
+    imaState st;
+    int done = 0;
+    while (done < e->samples)
+    {
+        int n = e->samples - done;
+        if (n > SAM_CACHE_PLAY_CHUNK)
+            n = SAM_CACHE_PLAY_CHUNK;
+        for (int i = 0; i < n; i++, done++)
+        {
+            uint8_t code = (e->data[done / 2] >> ((done & 1) * 4)) & 0x0f;
+            pcm[i] = (char)((_ima_step(&st, code) >> 8) + 128);
+        }
+        play(pcm, n);
+    }
+#else
+    play((const char *)e->data, e->samples);
+#endif
+    return true;
+}
+
+void SamCacheStore(const char *key, const char *samples, int count)
+{
+    size_t len = _cache_len(count);
+    if (count <= 0 || len > SAM_CACHE_BYTES || strlen(key) >= SAM_CACHE_KEY_LEN - 1)
+        return;
+
+    samCacheEntry *e = _cache_find(key);
+    if (e != nullptr)
+        _cache_free(e);
+
+    // Make room, then find an empty entry
+    while (_cache_bytes + len > SAM_CACHE_BYTES)
+        _cache_evict(_cache_lru());
+    e = nullptr;
+    for (int i = 0; i < SAM_CACHE_ENTRIES && e == nullptr; i++)
+        if (_cache[i].data == nullptr)
+            e = &_cache[i];
+    if (e == nullptr)
+    {
+        e = _cache_lru();
+        _cache_evict(e);
+    }
+
+    e->data = (uint8_t *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (e->data == nullptr)
+        return;
+
+#ifdef SAM_CACHE_ADPCM
+    memset(e->data, 0, len);
+    imaState st;
+    for (int i = 0; i < count; i++)
+    {
+        int sample = ((int)(uint8_t)samples[i] - 128) << 8;
+        e->data[i / 2] |= _ima_encode(&st, sample) << ((i & 1) * 4);
+    }
+#else
+    memcpy(e->data, samples, len);
+#endif
+
+    strlcpy(e->key, key, sizeof(e->key));
+    e->samples = count;
+    e->last_used = ++_cache_clock;
+    _cache_bytes += len;
+
+    Debug_printf("SAM cache stored %d samples in %u bytes (%u bytes used, %u evicted so far)\n",
+                 count, (unsigned)len, (unsigned)_cache_bytes, _cache_evictions);
+}
@@ -0,0 +1,25 @@
+#ifndef SAM_CACHE_H
+#define SAM_CACHE_H
+
+/*
+ Keeps recently spoken utterances so repeated phrases don't have to go through the
+ reciter and renderer again. Samples are kept in PSRAM exactly as SAM rendered them
+ (8 bits a sample) and the least recently used are dropped to make room.
+ Define SAM_CACHE_ADPCM (e.g. in PLATFORMIO.INI) to store them as 4-bit IMA ADPCM
+ instead, which holds twice as much speech but doesn't sound as good as the original.
+*/
+
+#define SAM_CACHE_ENTRIES 32
+#define SAM_CACHE_BYTES (512 * 1024) // PSRAM for cached speech, about 23 seconds at 8 bits a sample (47 with ADPCM)
+#define SAM_CACHE_KEY_LEN 288        // text plus the SAM settings it was rendered with
+
+typedef void (*SamCachePlayFn)(const char *samples, int count);
+
+// Builds the key for the current input text and SAM settings
+void SamCacheKey(char *key, const char *text, int phonetic);
+// Returns true after playing the utterance through play() if we have it
+bool SamCachePlay(const char *key, SamCachePlayFn play);
+// Keeps a copy of a rendered utterance
+void SamCacheStore(const char *key, const char *samples, int count);
+
+#endif // SAM_CACHE_H
@@ -2,10 +2,15 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
 #include <driver/gpio.h>
 #include <driver/dac.h>
+#include <driver/i2s.h>
 
 #include "fnSystem.h"
+#include "samcache.h"
+#include "../../include/debug.h"
 
 #ifdef __cplusplus
 extern char input[256];
@@ -151,26 +156,205 @@ void OutputSound()
 
 #else
 
-void OutputSound()
-{
 #ifdef ESP_PLATFORM
-    int n = GetBufferLength() / 50;
-    char *s = GetBuffer();
 
-    //fnSystem.dac_output_enable(SystemManager::dac_channel_t::DAC_CHANNEL_1);
-    //fnSystem.dac_output_voltage(SystemManager::dac_channel_t::DAC_CHANNEL_1, 100);
+static bool _i2s_streaming = false;
+static int _i2s_played = 0; // samples of SAM's buffer handed to the feed task so far
+static uint16_t _i2s_frames[SAM_I2S_DMA_BUFFER_LEN * 2];
+static StreamBufferHandle_t _i2s_samples = nullptr; // SAM's output on its way to the feed task
+static TaskHandle_t volatile _i2s_feed_task = nullptr; // Cleared by the task itself when it exits
+static volatile bool _i2s_stop_feed = false;
+static char _cache_key[SAM_CACHE_KEY_LEN]; // what's being spoken, for the utterance cache
 
-    dac_output_enable(DAC_CHANNEL_1);
+// Hands samples to the DMA ring, waiting (not spinning) while it's full
+static void _i2s_write(const uint8_t *samples, int count)
+{
+    // The built-in DAC takes the top 8 bits of each 16 bit sample; we send both channels
+    for (int i = 0; i < count; i++)
+        _i2s_frames[i * 2] = _i2s_frames[i * 2 + 1] = (uint16_t)samples[i] << 8;
+
+    size_t written;
+    i2s_write(SAM_I2S_PORT, _i2s_frames, count * 2 * sizeof(uint16_t), &written, portMAX_DELAY);
+}
+
+/*
+ Keeps the DMA ring full: whatever SAM has handed over, or midpoint silence whenever
+ rendering has fallen behind. The DAC never runs off the end of what we've written, so
+ it doesn't replay old buffers or drop to a cleared (0, bottom rail) one and click.
+*/
+static void _i2s_feed_task_loop(void *param)
+{
+    uint8_t samples[SAM_I2S_DMA_BUFFER_LEN];
+
+    while (_i2s_stop_feed == false)
+    {
+        size_t count = xStreamBufferReceive(_i2s_samples, samples, sizeof(samples), 0);
+        if (count == 0)
+        {
+            memset(samples, 0x80, SAM_I2S_UNDERRUN_FILL);
+            count = SAM_I2S_UNDERRUN_FILL;
+        }
+        _i2s_write(samples, count);
+    }
+
+    // StopSoundStream() is waiting for this
+    _i2s_feed_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+// Queues samples for the feed task, waiting (not spinning) while it's behind
+static void _i2s_play(const char *samples, int count)
+{
+    while (count > 0)
+    {
+        size_t sent = xStreamBufferSend(_i2s_samples, samples, count, portMAX_DELAY);
+        samples += sent;
+        count -= sent;
+    }
+}
+
+// Render callback: plays whatever SAM has finished since last time
+static void _i2s_stream(char *buffer, int length)
+{
+    if (length > _i2s_played)
+    {
+        _i2s_play(buffer + _i2s_played, length - _i2s_played);
+        _i2s_played = length;
+    }
+}
 
-    for (int i = 0; i < n; i++)
+/*
+ Sets up the I2S peripheral to feed DAC1 by DMA and has SAM hand us audio as it's rendered,
+ so speech starts while the rest of the phrase is still being worked out. If I2S can't be
+ started, OutputSound() falls back to writing the DAC directly once rendering is done.
+*/
+void StartSoundStream()
+{
+    i2s_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX | I2S_MODE_DAC_BUILT_IN);
+    config.sample_rate = SAM_SAMPLE_RATE;
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
+    config.communication_format = I2S_COMM_FORMAT_I2S_MSB;
+    config.intr_alloc_flags = 0;
+    config.dma_buf_count = SAM_I2S_DMA_BUFFERS;
+    config.dma_buf_len = SAM_I2S_DMA_BUFFER_LEN;
+    config.use_apll = false;
+    config.tx_desc_auto_clear = false; // Cleared buffers are the DAC's bottom rail; the feed task keeps the ring full instead
+
+    _i2s_played = 0;
+    _i2s_streaming = false;
+
+    if (_i2s_samples == nullptr)
+        _i2s_samples = xStreamBufferCreate(SAM_I2S_STREAM_BUFFER, 1);
+    if (_i2s_samples == nullptr)
+    {
+        Debug_println("SAM couldn't allocate I2S stream buffer, will play through the DAC directly");
+        return;
+    }
+    xStreamBufferReset(_i2s_samples);
+
+    if (i2s_driver_install(SAM_I2S_PORT, &config, 0, nullptr) != ESP_OK)
+    {
+        Debug_println("SAM couldn't start I2S, will play through the DAC directly");
+        return;
+    }
+
+    // Prime the ring with the DAC's midpoint before turning the DAC on. Zeroed buffers would
+    // pull it to the bottom rail and click.
+    uint8_t silence[SAM_I2S_DMA_BUFFER_LEN];
+    memset(silence, 0x80, sizeof(silence));
+    for (int i = 0; i < SAM_I2S_DMA_BUFFERS; i++)
+        _i2s_write(silence, SAM_I2S_DMA_BUFFER_LEN);
+
+    TaskHandle_t task = nullptr;
+    _i2s_stop_feed = false;
+    if (xTaskCreate(_i2s_feed_task_loop, "samfeed", SAM_I2S_FEED_STACKSIZE, nullptr, SAM_I2S_FEED_PRIORITY, &task) != pdPASS)
+    {
+        Debug_println("SAM couldn't start I2S feed task, will play through the DAC directly");
+        i2s_driver_uninstall(SAM_I2S_PORT);
+        return;
+    }
+    _i2s_feed_task = task;
+
+    i2s_set_dac_mode(I2S_DAC_CHANNEL_RIGHT_EN); // DAC1 on GPIO25 is the right channel
+
+    _i2s_streaming = true;
+    SetOutputCallback(_i2s_stream);
+}
+
+// Writes samples straight to the DAC, timed with a busy-wait (the DAC has to be enabled)
+static void _dac_play(const char *samples, int count)
+{
+    for (int i = 0; i < count; i++)
     {
         //dacWrite(DAC1, s[i]);
         // fnSystem.dac_write(PIN_DAC1, s[i]);
-        dac_output_voltage(DAC_CHANNEL_1, s[i]);
+        dac_output_voltage(DAC_CHANNEL_1, samples[i]);
         //delayMicroseconds(40);
         fnSystem.delay_microseconds(40);
     }
+}
+
+// Plays samples from the utterance cache
+static void _play_cached(const char *samples, int count)
+{
+    if (_i2s_streaming)
+    {
+        _i2s_play(samples, count);
+        return;
+    }
+    dac_output_enable(DAC_CHANNEL_1);
+    _dac_play(samples, count);
+}
+
+// Plays out what's left in the DMA ring and releases I2S
+void StopSoundStream()
+{
+    SetOutputCallback(nullptr);
+    if (!_i2s_streaming)
+        return;
+    _i2s_streaming = false;
 
+    // Let the feed task take everything, then give the ring time to play it; the task
+    // follows it with silence, so that's what the DAC is sitting on when we turn it off
+    while (xStreamBufferIsEmpty(_i2s_samples) == pdFALSE)
+        vTaskDelay(1);
+    vTaskDelay(pdMS_TO_TICKS(SAM_I2S_DMA_BUFFERS * SAM_I2S_DMA_BUFFER_LEN * 1000 / SAM_SAMPLE_RATE + 1));
+
+    _i2s_stop_feed = true;
+    while (_i2s_feed_task != nullptr)
+        vTaskDelay(1);
+
+    i2s_set_dac_mode(I2S_DAC_CHANNEL_DISABLE);
+    i2s_driver_uninstall(SAM_I2S_PORT);
+}
+
+#endif // ESP_PLATFORM
+
+void OutputSound()
+{
+#ifdef ESP_PLATFORM
+    int n = GetBufferLength() / 50;
+    char *s = GetBuffer();
+
+    SamCacheStore(_cache_key, s, n);
+
+    if (_i2s_streaming)
+    {
+        // Most of it has already been played while rendering
+        _i2s_stream(s, n);
+        StopSoundStream();
+        FreeBuffer();
+        return;
+    }
+
+    //fnSystem.dac_output_enable(SystemManager::dac_channel_t::DAC_CHANNEL_1);
+    //fnSystem.dac_output_voltage(SystemManager::dac_channel_t::DAC_CHANNEL_1, 100);
+
+    dac_output_enable(DAC_CHANNEL_1);
+    _dac_play(s, n);
     //fnSystem.dac_output_disable(SystemManager::dac_channel_t::DAC_CHANNEL_1);
     dac_output_disable(DAC_CHANNEL_1);
 
@@ -273,12 +457,31 @@ int sam(int argc, char **argv)
             printf("text input: %s\n", input);
     }
 
+#ifdef ESP_PLATFORM
+    StartSoundStream();
+
+    // Repeated phrases with the same settings come straight from the cache
+    SamCacheKey(_cache_key, input, phonetic);
+    if (SamCachePlay(_cache_key, _play_cached))
+    {
+        if (!_i2s_streaming)
+            dac_output_disable(DAC_CHANNEL_1);
+        StopSoundStream();
+        return 0;
+    }
+#endif
+
     if (!phonetic)
     {
         strlcat(input, "[", sizeof(input) - strlen(input));
         // printf("TextToPhonemes\n");
         if (!TextToPhonemes((unsigned char *)input))
+        {
+#ifdef ESP_PLATFORM
+            StopSoundStream();
+#endif
             return 1;
+        }
         if (debug)
             printf("phonetic input: %s\n", input);
     }
@@ -304,6 +507,9 @@ int sam(int argc, char **argv)
 
     if (!SAMMain())
     {
+#ifdef ESP_PLATFORM
+        StopSoundStream();
+#endif
         PrintUsage();
         return 1;
     }
@@ -14,6 +14,18 @@
 
 #ifdef ESP_PLATFORM
 #define PIN_DAC1 25
+
+#define SAM_SAMPLE_RATE 22050
+#define SAM_I2S_PORT I2S_NUM_0
+#define SAM_I2S_DMA_BUFFERS 8      // DMA ring of 8 x 256 samples, about 90ms of sound
+#define SAM_I2S_DMA_BUFFER_LEN 256 // samples per DMA buffer
+#define SAM_I2S_STREAM_BUFFER 2048 // samples SAM can get ahead of the DMA ring
+#define SAM_I2S_UNDERRUN_FILL 32   // samples of silence played at a time while SAM's behind
+#define SAM_I2S_FEED_STACKSIZE 2048
+#define SAM_I2S_FEED_PRIORITY 11   // Above the SIO task, which does the rendering
+
+void StartSoundStream();
+void StopSoundStream();
 #endif
 
 #ifdef __cplusplus
@@ -43,9 +43,18 @@ void sioDisk::sio_read()
         return;
     }
 
+    uint16_t sectorNum = UINT16_FROM_HILOBYTES(cmdFrame.aux2, cmdFrame.aux1);
     uint16_t readcount;
+    bool err;
 
-    bool err = _disk->read(UINT16_FROM_HILOBYTES(cmdFrame.aux2, cmdFrame.aux1), &readcount);
+    // Sectors the computer has written since we started an overlay come from there instead of the image
+    if (_overlay.read(sectorNum, _disk->_disk_sectorbuff, _disk->sector_size(sectorNum)))
+    {
+        readcount = _disk->sector_size(sectorNum);
+        err = false;
+    }
+    else
+        err = _disk->read(sectorNum, &readcount);
 
     // Send result to Atari
     sio_to_computer(_disk->_disk_sectorbuff, readcount, err);
@@ -63,11 +72,22 @@ void sioDisk::sio_write(bool verify)
 
         memset(_disk->_disk_sectorbuff, 0, DISK_SECTORBUF_SIZE);
 
-        uint8_t ck = sio_to_peripheral(_disk->_disk_sectorbuff, sectorSize);
+        bool bad_frame = sio_to_peripheral(_disk->_disk_sectorbuff, sectorSize);
 
-        if (ck == sio_checksum(_disk->_disk_sectorbuff, sectorSize))
+        if (!bad_frame)
         {
-            if (_disk->write(sectorNum, verify) == false)
+            if (_overlay.active())
+            {
+                // Same range the image types accept, so the overlay can always be committed
+                if (sectorNum == 0 || sectorNum > _disk->num_sectors())
+                    Debug_printf("overlay write sector %u out of range (%u)\n", sectorNum, _disk->num_sectors());
+                else if (_overlay.write(sectorNum, _disk->_disk_sectorbuff, sectorSize) == false)
+                {
+                    sio_complete();
+                    return;
+                }
+            }
+            else if (_disk->write(sectorNum, verify) == false)
             {
                 sio_complete();
                 return;
@@ -191,13 +211,14 @@ void sioDisk::sio_write_percom_block()
    then we assume it's DISKTYPE_ATR.
    Return value is DISKTYPE_UNKNOWN in case of failure.
 */
-disktype_t sioDisk::mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type)
+disktype_t sioDisk::mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type, bool allow_preload, bool allow_background)
 {
     // TAPE or CASSETTE: use this function to send file info to cassette device
     //  DiskType::discover_disktype(filename) can detect CAS and WAV files
     Debug_print("disk MOUNT\n");
 
-    // Destroy any existing DiskType
+    // Destroy any existing DiskType and anything written over it
+    _overlay.end();
     if (_disk != nullptr)
     {
         delete _disk;
@@ -220,16 +241,20 @@ disktype_t sioDisk::mount(FILE *f, const char *filename, uint32_t disksize, disk
         break;
     case DISKTYPE_XEX:
         _disk = new DiskTypeXEX();
-        return _disk->mount(f, disksize);
+        break;
     case DISKTYPE_ATX:
         _disk = new DiskTypeATX();
-        return _disk->mount(f, disksize);
+        break;
     case DISKTYPE_ATR:
     case DISKTYPE_UNKNOWN:
     default:
         _disk = new DiskTypeATR();
-        return _disk->mount(f, disksize);
+        break;
     }
+
+    _disk->_allow_preload = allow_preload;
+    _disk->_allow_background = allow_background;
+    return _disk->mount(f, disksize);
 }
 
 // Destructor
@@ -244,10 +269,75 @@ void sioDisk::unmount()
 {
     Debug_print("disk UNMOUNT\n");
 
+    // Sectors kept in PSRAM are lost; a sidecar file is kept for the next mount
+    _overlay.end();
+
     if (_disk != nullptr)
         _disk->unmount();
 }
 
+/*
+ Starts an overlay on the mounted disk. Written sectors are stored in the
+ sidecar file at sidecar_path on fs if given, otherwise in PSRAM, and read back
+ from there until overlay_commit() or overlay_discard().
+ Returns false if there's no disk mounted or we couldn't start the overlay.
+*/
+bool sioDisk::overlay_begin(FileSystem *fs, const char *sidecar_path)
+{
+    if (_disk == nullptr || _disk->_disktype == DISKTYPE_UNKNOWN)
+        return false;
+
+    uint32_t image_size, image_mtime;
+    _disk->image_signature(&image_size, &image_mtime);
+
+    return _overlay.begin(fs, sidecar_path, image_size, image_mtime);
+}
+
+/*
+ Writes every overlay sector to the disk image, then empties the overlay.
+ The image must have been opened for writing.
+ Returns TRUE if an error condition occurred, in which case the overlay is left alone.
+*/
+bool sioDisk::overlay_commit()
+{
+    if (_disk == nullptr || _overlay.active() == false)
+        return true;
+
+    Debug_printf("disk COMMIT OVERLAY (%u sectors)\n", _overlay.sector_count());
+
+    for (uint16_t i = 0; i < _overlay.sector_count(); i++)
+    {
+        uint16_t sectorNum = _overlay.sector_at(i);
+        memset(_disk->_disk_sectorbuff, 0, DISK_SECTORBUF_SIZE);
+
+        if (_overlay.read(sectorNum, _disk->_disk_sectorbuff, _disk->sector_size(sectorNum)) == false ||
+            _disk->write(sectorNum, false))
+        {
+            Debug_printf("failed committing sector %u\n", sectorNum);
+            return true;
+        }
+        _overlay.note_committed();
+    }
+
+    // The sidecar is the only other copy, so don't let it go until the image really has it
+    if (_disk->flush())
+    {
+        Debug_println("failed writing committed sectors to the image");
+        return true;
+    }
+
+    _overlay.clear();
+    return false;
+}
+
+// Throws away every sector written since the overlay started
+void sioDisk::overlay_discard()
+{
+    Debug_printf("disk DISCARD OVERLAY (%u sectors)\n", _overlay.sector_count());
+
+    _overlay.clear();
+}
+
 // Create blank disk
 bool sioDisk::write_blank(FILE *f, uint16_t sectorSize, uint16_t numSectors)
 {
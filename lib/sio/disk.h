@@ -3,11 +3,13 @@
 
 #include "sio.h"
 #include "diskType.h"
+#include "diskOverlay.h"
 
 class sioDisk : public sioDevice
 {
 private:
     DiskType *_disk = nullptr;
+    DiskOverlay _overlay;
 
     void sio_read();
     void sio_write(bool verify);
@@ -21,10 +23,18 @@ private:
     void dump_percom_block();
 
 public:
-    disktype_t mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type = DISKTYPE_UNKNOWN);
+    disktype_t mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type = DISKTYPE_UNKNOWN, bool allow_preload = true,
+                     bool allow_background = false);
     void unmount();
     bool write_blank(FILE *f, uint16_t sectorSize, uint16_t numSectors);
 
+    // Keeps sectors the computer writes in PSRAM or a sidecar file instead of the image
+    bool overlay_begin(FileSystem *fs = nullptr, const char *sidecar_path = nullptr);
+    // Returns TRUE if an error condition occurred
+    bool overlay_commit();
+    void overlay_discard();
+    bool overlay_active() { return _overlay.active(); };
+
     disktype_t disktype() { return _disk == nullptr ? DISKTYPE_UNKNOWN : _disk->_disktype; };
 
     ~sioDisk();
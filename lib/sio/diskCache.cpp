@@ -0,0 +1,518 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <esp_heap_caps.h>
+
+#include "../../include/debug.h"
+
+#include "fnSystem.h"
+
+#include "diskCache.h"
+
+DiskCache::~DiskCache()
+{
+    end();
+    if (_mutex != nullptr)
+        vSemaphoreDelete(_mutex);
+}
+
+/*
+ Starts caching the image in f.
+ block_size should be the number of bytes in one track of the disk, which is how
+ much we'll read at once. Nothing is read here, so mounting stays quick even over
+ a slow network. See the class comment for background.
+*/
+void DiskCache::begin(FILE *f, uint32_t image_size, uint16_t block_size, uint32_t preload_max, bool background)
+{
+    end();
+
+    if (_mutex == nullptr)
+        _mutex = xSemaphoreCreateMutex();
+
+    _file = f;
+    _image_size = image_size;
+    _background = background;
+    _stats = DiskCacheStats();
+
+    if (f == nullptr || image_size == 0)
+        return;
+
+    if (block_size < DISK_CACHE_MIN_BLOCK_SIZE)
+        block_size = DISK_CACHE_MIN_BLOCK_SIZE;
+    else if (block_size > DISK_CACHE_MAX_BLOCK_SIZE)
+        block_size = DISK_CACHE_MAX_BLOCK_SIZE;
+
+    if (image_size <= preload_max)
+    {
+        uint32_t chunks = (image_size + DISK_CACHE_DIRTY_CHUNK - 1) / DISK_CACHE_DIRTY_CHUNK;
+        uint32_t blocks = (image_size + block_size - 1) / block_size;
+        _image = (uint8_t *)heap_caps_malloc(image_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        _dirty_chunks = (uint8_t *)heap_caps_calloc(chunks, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        _loaded_blocks = (uint8_t *)heap_caps_calloc(blocks, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+        if (_image != nullptr && _dirty_chunks != nullptr && _loaded_blocks != nullptr)
+        {
+            _block_size = block_size;
+
+            TaskHandle_t task = nullptr;
+            if (_background == false)
+                Debug_println("DiskCache loading tracks as they're read");
+            else if (xTaskCreate(_load_task_loop, "diskload", DISK_CACHE_TASK_STACKSIZE, this, DISK_CACHE_LOAD_TASK_PRIORITY, &task) == pdPASS)
+                _load_task = task;
+            else
+                Debug_println("DiskCache couldn't start load task - loading tracks as they're read");
+
+            Debug_printf("DiskCache preloading %u bytes\n", _image_size);
+            return;
+        }
+
+        free(_image);
+        free(_dirty_chunks);
+        free(_loaded_blocks);
+        _image = nullptr;
+        _dirty_chunks = nullptr;
+        _loaded_blocks = nullptr;
+    }
+
+    // Too big (or we couldn't get the memory), so cache it a track at a time
+
+    _block_data = (uint8_t *)heap_caps_malloc(DISK_CACHE_BLOCKS * block_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_block_data == nullptr)
+    {
+        Debug_println("DiskCache not enough memory - using image file directly");
+        return;
+    }
+    _block_size = block_size;
+
+    Debug_printf("DiskCache caching %u blocks of %u bytes\n", DISK_CACHE_BLOCKS, _block_size);
+}
+
+// Writes back anything still dirty and frees the cache
+void DiskCache::end()
+{
+    // Let the flush and load tasks finish what they're doing and exit
+    if (_flush_task != nullptr || _load_task != nullptr)
+    {
+        _stop_task = true;
+        if (_flush_task != nullptr)
+            xTaskNotifyGive(_flush_task);
+        while (_flush_task != nullptr || _load_task != nullptr)
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        _stop_task = false;
+    }
+
+    if (_file != nullptr)
+    {
+        flush();
+        Debug_printf("DiskCache stats: hits=%u, misses=%u, preload_blocks=%u, writes=%u, flushes=%u, runs=%u\n",
+                     _stats.hits, _stats.misses, _stats.preload_blocks, _stats.writes, _stats.flushes, _stats.flushed_runs);
+    }
+
+    free(_image);
+    free(_dirty_chunks);
+    free(_loaded_blocks);
+    free(_block_data);
+    _image = nullptr;
+    _dirty_chunks = nullptr;
+    _loaded_blocks = nullptr;
+    _block_data = nullptr;
+    _block_size = 0;
+
+    for (int i = 0; i < DISK_CACHE_BLOCKS; i++)
+        _blocks[i] = DiskCacheBlock();
+
+    _file = nullptr;
+    _dirty = false;
+    _background = false;
+    _write_checked = false;
+}
+
+/*
+ Returns the index of the block starting at offset, loading it from the file
+ (and writing back whatever it replaces) if we don't have it. Caller holds _mutex.
+ Returns -1 on error.
+*/
+int DiskCache::_load_block(uint32_t offset)
+{
+    int slot = 0;
+    for (int i = 0; i < DISK_CACHE_BLOCKS; i++)
+    {
+        if (_blocks[i].offset == offset)
+        {
+            _stats.hits++;
+            _blocks[i].last_used = ++_clock;
+            return i;
+        }
+        if (_blocks[slot].offset != UINT32_MAX && (_blocks[i].offset == UINT32_MAX || _blocks[i].last_used < _blocks[slot].last_used))
+            slot = i;
+    }
+
+    _stats.misses++;
+
+    DiskCacheBlock &block = _blocks[slot];
+    uint8_t *data = _block_data + slot * _block_size;
+
+    if (block.dirty && _write_block(block, data))
+        return -1;
+
+    block = DiskCacheBlock();
+    if (fseek(_file, offset, SEEK_SET) != 0)
+        return -1;
+
+    block.length = fread(data, 1, _block_size, _file);
+    block.offset = offset;
+    block.last_used = ++_clock;
+
+    return slot;
+}
+
+/*
+ Makes sure every track of a preloaded image overlapping len bytes at offset has been
+ read from the file. Caller holds _mutex.
+ Returns the number of tracks we had to read, or -1 on error.
+*/
+int DiskCache::_load_image_range(uint32_t offset, uint32_t len)
+{
+    if (len == 0 || offset >= _image_size)
+        return 0;
+
+    int count = 0;
+    for (uint32_t b = offset / _block_size; b <= (offset + len - 1) / _block_size; b++)
+    {
+        uint32_t start = b * _block_size;
+        if (_loaded_blocks[b] || start >= _image_size)
+            continue;
+
+        uint32_t want = (_image_size - start) < _block_size ? (_image_size - start) : _block_size;
+        size_t got = 0;
+        if (fseek(_file, start, SEEK_SET) == 0)
+            got = fread(_image + start, 1, want, _file);
+
+        if (got < want)
+        {
+            if (got == 0 && start == 0)
+            {
+                Debug_printf("DiskCache failed to load image (%d)\n", errno);
+                return -1;
+            }
+            // The file's shorter than we were told
+            _image_size = start + got;
+        }
+
+        _loaded_blocks[b] = 1;
+        count++;
+    }
+    return count;
+}
+
+// Writes a dirty block back to the file. Caller holds _mutex. Returns TRUE if an error occurred.
+bool DiskCache::_write_block(DiskCacheBlock &block, uint8_t *data)
+{
+    if (fseek(_file, block.offset, SEEK_SET) != 0 || fwrite(data, 1, block.length, _file) != block.length)
+    {
+        Debug_printf("DiskCache failed writing block at %u (%d)\n", block.offset, errno);
+        return true;
+    }
+    block.dirty = false;
+    _stats.flushed_runs++;
+    return false;
+}
+
+/*
+ Copies up to len bytes starting at offset in the image into dest.
+ Returns the number of bytes copied (less than len at the end of the image) or -1 on error.
+*/
+int DiskCache::read(uint32_t offset, uint8_t *dest, uint16_t len)
+{
+    if (_file == nullptr)
+        return -1;
+
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+
+    int result = 0;
+    if (_image != nullptr)
+    {
+        int loaded = _load_image_range(offset, len);
+        if (loaded < 0)
+            result = -1;
+        else
+        {
+            if (loaded > 0)
+                _stats.preload_blocks += loaded;
+            else
+                _stats.hits++;
+            if (offset < _image_size)
+            {
+                result = (_image_size - offset) < len ? (_image_size - offset) : len;
+                memcpy(dest, _image + offset, result);
+            }
+        }
+    }
+    else if (_block_data != nullptr)
+    {
+        while (result < len)
+        {
+            uint32_t pos = offset + result;
+            int b = _load_block(pos - pos % _block_size);
+            if (b < 0)
+            {
+                result = -1;
+                break;
+            }
+
+            DiskCacheBlock &block = _blocks[b];
+            uint32_t in_block = pos - block.offset;
+            // We've hit the end of the image
+            if (in_block >= block.length)
+                break;
+
+            uint16_t count = (block.length - in_block) < (uint32_t)(len - result) ? (block.length - in_block) : (len - result);
+            memcpy(dest + result, _block_data + b * _block_size + in_block, count);
+            result += count;
+        }
+    }
+    else
+    {
+        _stats.misses++;
+        result = -1;
+        if (fseek(_file, offset, SEEK_SET) == 0)
+            result = fread(dest, 1, len, _file);
+    }
+
+    xSemaphoreGive(_mutex);
+
+    return result;
+}
+
+/*
+ Stores len bytes at offset in the image.
+ The data is written back to the file in the background once writes stop for
+ DISK_CACHE_FLUSH_DELAY milliseconds, or right away if we aren't caching the image
+ or can't use background tasks with it.
+ Returns TRUE if an error occurred.
+*/
+bool DiskCache::write(uint32_t offset, const uint8_t *src, uint16_t len)
+{
+    if (_file == nullptr)
+        return true;
+
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+
+    bool err = false;
+    _stats.writes++;
+
+    // Write the first one straight through so an image opened read-only still reports an error
+    if (_write_checked == false && (_image != nullptr || _block_data != nullptr))
+    {
+        if (fseek(_file, offset, SEEK_SET) != 0 || fwrite(src, 1, len, _file) != len)
+        {
+            xSemaphoreGive(_mutex);
+            return true;
+        }
+        _write_checked = true;
+    }
+
+    // Whatever's around the sector has to come from the file before we change it
+    int loaded = 0;
+    if (_image != nullptr && offset + len <= _image_size)
+        loaded = _load_image_range(offset, len);
+    if (loaded < 0)
+        err = true;
+    else if (_image != nullptr && offset + len <= _image_size)
+    {
+        _stats.preload_blocks += loaded;
+        memcpy(_image + offset, src, len);
+        for (uint32_t c = offset / DISK_CACHE_DIRTY_CHUNK; c <= (offset + len - 1) / DISK_CACHE_DIRTY_CHUNK; c++)
+            _dirty_chunks[c] = 1;
+        _dirty = true;
+    }
+    else if (_block_data != nullptr)
+    {
+        uint16_t done = 0;
+        while (done < len)
+        {
+            uint32_t pos = offset + done;
+            int b = _load_block(pos - pos % _block_size);
+            if (b < 0)
+            {
+                err = true;
+                break;
+            }
+
+            DiskCacheBlock &block = _blocks[b];
+            uint8_t *data = _block_data + b * _block_size;
+            uint32_t in_block = pos - block.offset;
+            uint16_t count = (_block_size - in_block) < (uint32_t)(len - done) ? (_block_size - in_block) : (len - done);
+
+            // Don't leave garbage between the old end of the file and what we're writing
+            if (in_block > block.length)
+                memset(data + block.length, 0, in_block - block.length);
+
+            memcpy(data + in_block, src + done, count);
+            if (in_block + count > block.length)
+                block.length = in_block + count;
+
+            block.dirty = true;
+            _dirty = true;
+            done += count;
+        }
+    }
+    else
+    {
+        // Nothing cached, so write straight through
+        err = fseek(_file, offset, SEEK_SET) != 0 || fwrite(src, 1, len, _file) != len;
+        if (err == false)
+        {
+            fflush(_file);
+            fsync(fileno(_file));
+        }
+    }
+
+    // Without a flush task the cache is write-through
+    if (_dirty && _background == false && _flush())
+        err = true;
+
+    xSemaphoreGive(_mutex);
+
+    if (_dirty && _background)
+        _start_flush_task();
+
+    return err;
+}
+
+// Writes everything dirty back to the file. Caller holds _mutex. Returns TRUE if an error occurred.
+bool DiskCache::_flush()
+{
+    if (_dirty == false)
+        return false;
+
+    bool err = false;
+
+    // Write each run of dirty chunks with a single fwrite
+    if (_image != nullptr)
+    {
+        uint32_t chunks = (_image_size + DISK_CACHE_DIRTY_CHUNK - 1) / DISK_CACHE_DIRTY_CHUNK;
+        uint32_t c = 0;
+        while (c < chunks)
+        {
+            if (_dirty_chunks[c] == 0)
+            {
+                c++;
+                continue;
+            }
+
+            uint32_t first = c;
+            while (c < chunks && _dirty_chunks[c] != 0)
+                _dirty_chunks[c++] = 0;
+
+            uint32_t start = first * DISK_CACHE_DIRTY_CHUNK;
+            uint32_t end = c * DISK_CACHE_DIRTY_CHUNK;
+            if (end > _image_size)
+                end = _image_size;
+
+            if (fseek(_file, start, SEEK_SET) != 0 || fwrite(_image + start, 1, end - start, _file) != end - start)
+            {
+                Debug_printf("DiskCache failed writing %u bytes at %u (%d)\n", end - start, start, errno);
+                // Try again next time
+                for (uint32_t i = first; i < c; i++)
+                    _dirty_chunks[i] = 1;
+                err = true;
+            }
+            _stats.flushed_runs++;
+        }
+    }
+
+    for (int i = 0; i < DISK_CACHE_BLOCKS; i++)
+    {
+        if (_blocks[i].dirty && _write_block(_blocks[i], _block_data + i * _block_size))
+            err = true;
+    }
+
+    fflush(_file);
+    fsync(fileno(_file));
+
+    _stats.flushes++;
+    _dirty = err;
+
+    return err;
+}
+
+// Writes everything dirty back to the file now. Returns TRUE if an error occurred.
+bool DiskCache::flush()
+{
+    if (_file == nullptr || _mutex == nullptr)
+        return false;
+
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    bool err = _flush();
+    xSemaphoreGive(_mutex);
+
+    return err;
+}
+
+// Wakes up our flush task, creating it if this is the first write
+void DiskCache::_start_flush_task()
+{
+    if (_flush_task == nullptr)
+    {
+        TaskHandle_t task = nullptr;
+        if (xTaskCreate(_flush_task_loop, "diskflush", DISK_CACHE_TASK_STACKSIZE, this, DISK_CACHE_TASK_PRIORITY, &task) != pdPASS)
+        {
+            Debug_println("DiskCache couldn't start flush task - writing now");
+            flush();
+            return;
+        }
+        _flush_task = task;
+    }
+    xTaskNotifyGive(_flush_task);
+}
+
+/*
+ Waits for a write, then for writes to stop coming for DISK_CACHE_FLUSH_DELAY
+ milliseconds before writing everything back to the file
+*/
+void DiskCache::_flush_task_loop(void *param)
+{
+    DiskCache *cache = (DiskCache *)param;
+
+    while (cache->_stop_task == false)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (cache->_stop_task == false && ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DISK_CACHE_FLUSH_DELAY)) > 0)
+            ;
+
+        if (cache->_stop_task == false)
+            cache->flush();
+    }
+
+    // end() is waiting for this
+    cache->_flush_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+/*
+ Reads a preloaded image into PSRAM a track at a time, letting go of the cache
+ between tracks so the computer's sector requests don't have to wait for all of it
+*/
+void DiskCache::_load_task_loop(void *param)
+{
+    DiskCache *cache = (DiskCache *)param;
+    uint32_t ms_start = fnSystem.millis();
+    bool ok = true;
+
+    for (uint32_t offset = 0; ok && cache->_stop_task == false && offset < cache->_image_size; offset += cache->_block_size)
+    {
+        xSemaphoreTake(cache->_mutex, portMAX_DELAY);
+        ok = cache->_load_image_range(offset, 1) >= 0;
+        xSemaphoreGive(cache->_mutex);
+        vTaskDelay(1);
+    }
+
+    if (ok && cache->_stop_task == false)
+        Debug_printf("DiskCache preloaded %u bytes in %u ms\n", cache->_image_size, (uint32_t)(fnSystem.millis() - ms_start));
+
+    // end() is waiting for this
+    cache->_load_task = nullptr;
+    vTaskDelete(nullptr);
+}
@@ -0,0 +1,103 @@
+#ifndef _DISKCACHE_
+#define _DISKCACHE_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define DISK_CACHE_PRELOAD_MAX (512 * 1024) // Images up to this size are loaded into PSRAM in the background after mount
+#define DISK_CACHE_BLOCKS 16 // Number of track-sized blocks we keep for images too big to preload
+#define DISK_CACHE_MIN_BLOCK_SIZE 256
+#define DISK_CACHE_MAX_BLOCK_SIZE 4608 // One double density track (18 * 256)
+#define DISK_CACHE_DIRTY_CHUNK 128 // Granularity of dirty tracking in a preloaded image
+#define DISK_CACHE_FLUSH_DELAY 500 // How long (ms) writes have to stop before we write them back to the file
+
+#define DISK_CACHE_TASK_STACKSIZE 4096
+#define DISK_CACHE_TASK_PRIORITY 5
+#define DISK_CACHE_LOAD_TASK_PRIORITY 2 // Below the SIO service task so sector requests come first
+
+struct DiskCacheStats
+{
+    uint32_t hits = 0;
+    uint32_t misses = 0; // Reads that had to go to the file
+    uint32_t preload_blocks = 0; // Tracks of a preloaded image we had to load before the background load got to them
+    uint32_t writes = 0;
+    uint32_t flushes = 0; // Times we wrote dirty data back to the file
+    uint32_t flushed_runs = 0; // Contiguous runs written during those flushes
+};
+
+// One track-sized piece of the image
+struct DiskCacheBlock
+{
+    uint32_t offset = UINT32_MAX;
+    uint16_t length = 0;
+    bool dirty = false;
+    uint32_t last_used = 0;
+};
+
+/*
+ Sits between a DiskType and its image file.
+ Images up to preload_max bytes are kept in PSRAM and loaded a track at a time as
+ the computer asks for them. Bigger ones are cached a track at a time with LRU
+ replacement.
+ With background set, a task also loads the rest of a preloaded image after mount,
+ and writes go to the cache and are written back to the file by another task once
+ they've stopped for DISK_CACHE_FLUSH_DELAY milliseconds, so runs of sector writes
+ turn into a few large ones. Those tasks use the file from outside the SIO task, so
+ background is only for files whose mount nothing else is using at the same time
+ (local SD images). TNFS and HTTP mounts keep per-mount state with no locking.
+ Without it, writes are written through to the file before write() returns.
+ If we can't get the memory, reads and writes go straight to the file.
+*/
+class DiskCache
+{
+private:
+    FILE *_file = nullptr;
+    uint32_t _image_size = 0;
+
+    uint8_t *_image = nullptr; // Whole image when preloaded
+    uint8_t *_dirty_chunks = nullptr; // One flag per DISK_CACHE_DIRTY_CHUNK bytes of _image
+    uint8_t *_loaded_blocks = nullptr; // One flag per _block_size bytes of _image that's been read from the file
+
+    uint8_t *_block_data = nullptr;
+    uint16_t _block_size = 0;
+    DiskCacheBlock _blocks[DISK_CACHE_BLOCKS];
+    uint32_t _clock = 0;
+
+    bool _dirty = false;
+    bool _background = false; // Load and flush from our own tasks; only safe if nothing else shares the file's mount
+    bool _write_checked = false; // Set once a write has gone through to the file
+    volatile bool _stop_task = false;
+    SemaphoreHandle_t _mutex = nullptr;
+    TaskHandle_t volatile _flush_task = nullptr; // Cleared by the task itself when it exits
+    TaskHandle_t volatile _load_task = nullptr; // Cleared by the task itself when it exits
+
+    DiskCacheStats _stats;
+
+    int _load_block(uint32_t offset);
+    int _load_image_range(uint32_t offset, uint32_t len);
+    bool _write_block(DiskCacheBlock &block, uint8_t *data);
+    bool _flush();
+    void _start_flush_task();
+
+    static void _flush_task_loop(void *param);
+    static void _load_task_loop(void *param);
+
+public:
+    ~DiskCache();
+
+    void begin(FILE *f, uint32_t image_size, uint16_t block_size, uint32_t preload_max = DISK_CACHE_PRELOAD_MAX, bool background = false);
+    void end();
+
+    int read(uint32_t offset, uint8_t *dest, uint16_t len);
+    bool write(uint32_t offset, const uint8_t *src, uint16_t len);
+    bool flush();
+
+    bool preloaded() { return _image != nullptr; };
+    const DiskCacheStats &stats() { return _stats; };
+};
+
+#endif // _DISKCACHE_
@@ -0,0 +1,344 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <esp_heap_caps.h>
+
+#include "../../include/debug.h"
+#include "../utils/utils.h"
+
+#include "diskOverlay.h"
+
+#define SIDECAR_HEADER_SIZE 4
+#define SIDECAR_FILE_HEADER_SIZE 12
+
+DiskOverlay::~DiskOverlay()
+{
+    end();
+}
+
+/*
+ Starts recording writes.
+ If fs and sidecar_path are given, sectors are stored in that file (and any it
+ already holds are loaded if it was made for an image of the same size and modified
+ time), otherwise they're kept in PSRAM.
+ Returns false if we couldn't get the memory for the sector index.
+*/
+bool DiskOverlay::begin(FileSystem *fs, const char *sidecar_path, uint32_t image_size, uint32_t image_mtime)
+{
+    end();
+
+    _image_size = image_size;
+    _image_mtime = image_mtime;
+
+    _entries = (DiskOverlayEntry *)heap_caps_malloc(DISK_OVERLAY_MAX_SECTORS * sizeof(DiskOverlayEntry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_entries == nullptr)
+    {
+        Debug_println("DiskOverlay failed to allocate sector index");
+        return false;
+    }
+
+    if (fs != nullptr && sidecar_path != nullptr)
+    {
+        _fs = fs;
+        _sidecar_path = strdup(sidecar_path);
+        if (_fs->exists(_sidecar_path) && _open_sidecar(false) && _load_sidecar() == false)
+        {
+            Debug_printf("DiskOverlay sidecar \"%s\" doesn't match the image - discarding it\n", _sidecar_path);
+            clear();
+        }
+    }
+
+    _active = true;
+
+    Debug_printf("DiskOverlay started in %s with %u sectors\n", _fs == nullptr ? "PSRAM" : _sidecar_path, _count);
+    return true;
+}
+
+// Stops recording writes and frees everything. Anything in a sidecar file stays there.
+void DiskOverlay::end()
+{
+    if (_active)
+        Debug_printf("DiskOverlay stats: sectors=%u, reads=%u, hits=%u, writes=%u, rewrites=%u, committed=%u\n",
+                     _count, _stats.reads, _stats.hits, _stats.writes, _stats.rewrites, _stats.committed);
+
+    if (_sidecar != nullptr)
+        fclose(_sidecar);
+    _sidecar = nullptr;
+
+    free(_sidecar_path);
+    _sidecar_path = nullptr;
+    _fs = nullptr;
+
+    free(_entries);
+    _entries = nullptr;
+    _count = 0;
+
+    for (int i = 0; i < DISK_OVERLAY_MAX_SECTORS / DISK_OVERLAY_CHUNK_SECTORS; i++)
+    {
+        free(_chunks[i]);
+        _chunks[i] = nullptr;
+    }
+
+    _stats = DiskOverlayStats();
+    _active = false;
+}
+
+/*
+ Returns the index of sectornum in _entries or -1 if we don't have it.
+ If insert_at isn't null, it's set to where the sector would go.
+*/
+int DiskOverlay::_find(uint16_t sectornum, int *insert_at)
+{
+    int lo = 0;
+    int hi = _count - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (_entries[mid].sectornum == sectornum)
+            return mid;
+        if (_entries[mid].sectornum < sectornum)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    if (insert_at != nullptr)
+        *insert_at = lo;
+    return -1;
+}
+
+void DiskOverlay::_insert(int index, uint16_t sectornum, uint16_t size, uint32_t location)
+{
+    memmove(&_entries[index + 1], &_entries[index], (_count - index) * sizeof(DiskOverlayEntry));
+    _entries[index].sectornum = sectornum;
+    _entries[index].size = size;
+    _entries[index].location = location;
+    _count++;
+}
+
+// Returns the PSRAM for the given slot, allocating its chunk if needed
+uint8_t *DiskOverlay::_slot(uint32_t slot)
+{
+    uint8_t *&chunk = _chunks[slot / DISK_OVERLAY_CHUNK_SECTORS];
+    if (chunk == nullptr)
+        chunk = (uint8_t *)heap_caps_malloc(DISK_OVERLAY_CHUNK_SECTORS * DISK_OVERLAY_SLOT_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+    if (chunk == nullptr)
+        return nullptr;
+
+    return chunk + (slot % DISK_OVERLAY_CHUNK_SECTORS) * DISK_OVERLAY_SLOT_SIZE;
+}
+
+// Fills in the header that starts every sidecar
+void DiskOverlay::_sidecar_header(uint8_t *header)
+{
+    memcpy(header, DISK_OVERLAY_SIDECAR_MAGIC, 4);
+    for (int i = 0; i < 4; i++)
+    {
+        header[4 + i] = (_image_size >> (i * 8)) & 0xFF;
+        header[8 + i] = (_image_mtime >> (i * 8)) & 0xFF;
+    }
+}
+
+// Opens the sidecar, or creates it and writes its header
+bool DiskOverlay::_open_sidecar(bool create)
+{
+    _sidecar = _fs->file_open(_sidecar_path, create ? "w+" : "r+");
+    if (_sidecar == nullptr)
+    {
+        Debug_printf("DiskOverlay failed to open \"%s\" (%d)\n", _sidecar_path, errno);
+        return false;
+    }
+
+    if (create)
+    {
+        uint8_t header[SIDECAR_FILE_HEADER_SIZE];
+        _sidecar_header(header);
+        if (fwrite(header, 1, sizeof(header), _sidecar) != sizeof(header))
+        {
+            Debug_printf("DiskOverlay failed writing \"%s\" (%d)\n", _sidecar_path, errno);
+            fclose(_sidecar);
+            _sidecar = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ Builds our index from the records in the sidecar file. Later records for a sector replace earlier ones.
+ Returns false if the sidecar was made for a different image.
+*/
+bool DiskOverlay::_load_sidecar()
+{
+    long filesize = FileSystem::filesize(_sidecar);
+    uint32_t offset = SIDECAR_FILE_HEADER_SIZE;
+    uint8_t expected[SIDECAR_FILE_HEADER_SIZE];
+    uint8_t header[SIDECAR_FILE_HEADER_SIZE];
+
+    _sidecar_header(expected);
+    if (fseek(_sidecar, 0, SEEK_SET) != 0 || fread(header, 1, SIDECAR_FILE_HEADER_SIZE, _sidecar) != SIDECAR_FILE_HEADER_SIZE ||
+        memcmp(header, expected, SIDECAR_FILE_HEADER_SIZE) != 0)
+        return false;
+
+    while (offset + SIDECAR_HEADER_SIZE <= filesize && fread(header, 1, SIDECAR_HEADER_SIZE, _sidecar) == SIDECAR_HEADER_SIZE)
+    {
+        uint16_t sectornum = UINT16_FROM_HILOBYTES(header[1], header[0]);
+        uint16_t size = UINT16_FROM_HILOBYTES(header[3], header[2]);
+        uint32_t location = offset + SIDECAR_HEADER_SIZE;
+
+        // Stop at anything that looks like a partly written record
+        if (size == 0 || size > DISK_OVERLAY_SLOT_SIZE || location + size > filesize)
+            break;
+
+        int insert_at;
+        int i = _find(sectornum, &insert_at);
+        if (i >= 0)
+        {
+            _entries[i].size = size;
+            _entries[i].location = location;
+        }
+        else
+        {
+            if (_count >= DISK_OVERLAY_MAX_SECTORS)
+                break;
+            _insert(insert_at, sectornum, size, location);
+        }
+
+        offset = location + size;
+        if (fseek(_sidecar, offset, SEEK_SET) != 0)
+            break;
+    }
+
+    return true;
+}
+
+/*
+ Copies sectornum into dest if the computer has written it.
+ Returns false if we don't have the sector, in which case it should be read from the image.
+*/
+bool DiskOverlay::read(uint16_t sectornum, uint8_t *dest, uint16_t size)
+{
+    if (_active == false)
+        return false;
+
+    _stats.reads++;
+
+    int i = _find(sectornum, nullptr);
+    if (i < 0)
+        return false;
+
+    DiskOverlayEntry &entry = _entries[i];
+    uint16_t count = entry.size < size ? entry.size : size;
+    if (count < size)
+        memset(dest + count, 0, size - count);
+
+    if (_sidecar != nullptr)
+    {
+        if (fseek(_sidecar, entry.location, SEEK_SET) != 0 || fread(dest, 1, count, _sidecar) != count)
+        {
+            Debug_printf("DiskOverlay failed reading sector %u from sidecar (%d)\n", sectornum, errno);
+            return false;
+        }
+    }
+    else
+    {
+        memcpy(dest, _slot(entry.location), count);
+    }
+
+    _stats.hits++;
+    return true;
+}
+
+// Stores sectornum in the overlay. Returns TRUE if an error occurred.
+bool DiskOverlay::write(uint16_t sectornum, const uint8_t *src, uint16_t size)
+{
+    if (_active == false || size == 0 || size > DISK_OVERLAY_SLOT_SIZE)
+        return true;
+
+    _stats.writes++;
+
+    int insert_at;
+    int i = _find(sectornum, &insert_at);
+    if (i >= 0)
+        _stats.rewrites++;
+    else if (_count >= DISK_OVERLAY_MAX_SECTORS)
+    {
+        Debug_printf("DiskOverlay is full - can't store sector %u\n", sectornum);
+        return true;
+    }
+
+    uint32_t location;
+    if (_fs != nullptr)
+    {
+        if (_sidecar == nullptr && _open_sidecar(true) == false)
+            return true;
+
+        bool err;
+        // Overwrite the existing record if it's the same size, otherwise append a new one
+        if (i >= 0 && _entries[i].size == size)
+        {
+            location = _entries[i].location;
+            err = fseek(_sidecar, location, SEEK_SET) != 0;
+        }
+        else
+        {
+            uint8_t header[SIDECAR_HEADER_SIZE] = {
+                LOBYTE_FROM_UINT16(sectornum), HIBYTE_FROM_UINT16(sectornum),
+                LOBYTE_FROM_UINT16(size), HIBYTE_FROM_UINT16(size)};
+            err = fseek(_sidecar, 0, SEEK_END) != 0;
+            location = ftell(_sidecar) + SIDECAR_HEADER_SIZE;
+            if (err == false)
+                err = fwrite(header, 1, sizeof(header), _sidecar) != sizeof(header);
+        }
+
+        if (err == false)
+            err = fwrite(src, 1, size, _sidecar) != size;
+
+        if (err)
+        {
+            Debug_printf("DiskOverlay failed writing sector %u to sidecar (%d)\n", sectornum, errno);
+            return true;
+        }
+
+        fflush(_sidecar);
+        fsync(fileno(_sidecar));
+    }
+    else
+    {
+        // New sectors get the next free slot; they're only given back by clear()
+        location = i >= 0 ? _entries[i].location : _count;
+        uint8_t *data = _slot(location);
+        if (data == nullptr)
+        {
+            Debug_printf("DiskOverlay out of memory - can't store sector %u\n", sectornum);
+            return true;
+        }
+        memcpy(data, src, size);
+    }
+
+    if (i >= 0)
+    {
+        _entries[i].size = size;
+        _entries[i].location = location;
+    }
+    else
+        _insert(insert_at, sectornum, size, location);
+
+    return false;
+}
+
+// Forgets every sector and removes the sidecar file, but keeps recording
+void DiskOverlay::clear()
+{
+    _count = 0;
+
+    if (_sidecar != nullptr)
+    {
+        fclose(_sidecar);
+        _sidecar = nullptr;
+    }
+
+    if (_fs != nullptr && _fs->exists(_sidecar_path))
+        _fs->remove(_sidecar_path);
+}
@@ -0,0 +1,85 @@
+#ifndef _DISKOVERLAY_
+#define _DISKOVERLAY_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../FileSystem/fnFS.h"
+
+#define DISK_OVERLAY_MAX_SECTORS 2048 // Most sectors we'll hold (512KB of double density sectors)
+#define DISK_OVERLAY_CHUNK_SECTORS 64 // PSRAM is allocated this many sectors at a time
+#define DISK_OVERLAY_SLOT_SIZE 256 // Largest sector we store
+#define DISK_OVERLAY_SIDECAR_MAGIC "FNOV"
+
+struct DiskOverlayStats
+{
+    uint32_t reads = 0; // Reads checked against the overlay
+    uint32_t hits = 0; // Reads served from the overlay
+    uint32_t writes = 0;
+    uint32_t rewrites = 0; // Writes to a sector already in the overlay
+    uint32_t committed = 0; // Sectors written back to the image
+};
+
+// One sector written by the computer
+struct DiskOverlayEntry
+{
+    uint16_t sectornum;
+    uint16_t size;
+    uint32_t location; // PSRAM slot or offset of the data in the sidecar file
+};
+
+/*
+ Holds sectors written to a disk image without touching the image itself.
+ Sectors are kept in PSRAM, or in a sidecar file (on SD) that survives a reboot
+ and is read back the next time the same image is mounted with an overlay.
+ A sidecar starts with a header holding DISK_OVERLAY_SIDECAR_MAGIC and the size and
+ modified time of the image it was made for (32-bit little-endian), and is thrown
+ away on load if the image doesn't match any more. The records after it are a 2-byte
+ sector number and 2-byte size (both little-endian) followed by the sector data.
+ The owning sioDisk commits the sectors to the image or discards them on request.
+*/
+class DiskOverlay
+{
+private:
+    bool _active = false;
+
+    FileSystem *_fs = nullptr;
+    char *_sidecar_path = nullptr;
+    FILE *_sidecar = nullptr;
+    uint32_t _image_size = 0; // Identify the image a sidecar belongs to
+    uint32_t _image_mtime = 0;
+
+    DiskOverlayEntry *_entries = nullptr; // Sorted by sector number
+    uint16_t _count = 0;
+
+    uint8_t *_chunks[DISK_OVERLAY_MAX_SECTORS / DISK_OVERLAY_CHUNK_SECTORS] = { nullptr };
+
+    DiskOverlayStats _stats;
+
+    int _find(uint16_t sectornum, int *insert_at);
+    void _insert(int index, uint16_t sectornum, uint16_t size, uint32_t location);
+    uint8_t *_slot(uint32_t slot);
+    void _sidecar_header(uint8_t *header);
+    bool _open_sidecar(bool create);
+    bool _load_sidecar();
+
+public:
+    ~DiskOverlay();
+
+    bool begin(FileSystem *fs = nullptr, const char *sidecar_path = nullptr, uint32_t image_size = 0, uint32_t image_mtime = 0);
+    void end();
+
+    bool active() { return _active; };
+
+    bool read(uint16_t sectornum, uint8_t *dest, uint16_t size);
+    bool write(uint16_t sectornum, const uint8_t *src, uint16_t size);
+    void clear();
+
+    uint16_t sector_count() { return _count; };
+    uint16_t sector_at(uint16_t index) { return index < _count ? _entries[index].sectornum : 0; };
+
+    void note_committed() { _stats.committed++; };
+    const DiskOverlayStats &stats() { return _stats; };
+};
+
+#endif // _DISKOVERLAY_
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <sys/stat.h>
 
 #include "../../include/debug.h"
 #include "../utils/utils.h"
@@ -129,6 +130,9 @@ void DiskType::dump_percom_block()
 
 void DiskType::unmount()
 {
+    // Write back anything still waiting in the cache before the file goes away
+    _cache.end();
+
     if (_disk_fileh != nullptr)
     {
         fclose(_disk_fileh);
@@ -136,6 +140,34 @@ void DiskType::unmount()
     }
 }
 
+/*
+ Identifies the image file, so an overlay sidecar made for it isn't laid over a
+ different one. mtime is 0 on file systems that don't report it.
+*/
+void DiskType::image_signature(uint32_t *size, uint32_t *mtime)
+{
+    struct stat st;
+
+    *size = 0;
+    *mtime = 0;
+    if (_disk_fileh == nullptr)
+        return;
+
+    if (fstat(fileno(_disk_fileh), &st) == 0)
+    {
+        *size = st.st_size;
+        *mtime = st.st_mtime;
+    }
+    // The HTTP file system doesn't always know the size until the file's been read
+    if (*size == 0)
+    {
+        long pos = ftell(_disk_fileh);
+        if (fseek(_disk_fileh, 0, SEEK_END) == 0)
+            *size = ftell(_disk_fileh);
+        fseek(_disk_fileh, pos, SEEK_SET);
+    }
+}
+
 disktype_t DiskType::discover_disktype(const char *filename)
 {
     int l = strlen(filename);
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+#include "diskCache.h"
+
 #define INVALID_SECTOR_VALUE 65536
 
 #define DISK_SECTORBUF_SIZE 256
@@ -50,6 +52,8 @@ protected:
     int32_t _disk_last_sector = INVALID_SECTOR_VALUE;
     uint8_t _disk_controller_status = DISK_CTRL_STATUS_CLEAR;
 
+    DiskCache _cache; // Types that use it call _cache.begin() in mount()
+
 public:
     struct
     {
@@ -71,6 +75,8 @@ public:
 
     disktype_t _disktype = DISKTYPE_UNKNOWN;
     bool _allow_hsio = true;
+    bool _allow_preload = true; // False if reading the whole image at mount would cost more than it saves
+    bool _allow_background = false; // True if the cache can use the file from its own tasks (see DiskCache)
 
     virtual disktype_t mount(FILE *f, uint32_t disksize) = 0;
     virtual void unmount();
@@ -85,6 +91,14 @@ public:
 
     // Always returns 128 for the first 3 sectors, otherwise _sectorSize
     virtual uint16_t sector_size(uint16_t sectornum);
+
+    // Number of sectors the image holds (0 for types that can't be written)
+    uint32_t num_sectors() { return _disk_num_sectors; };
+
+    // Writes back anything the cache is holding. Returns TRUE if an error occurred.
+    bool flush() { return _cache.flush(); };
+
+    void image_signature(uint32_t *size, uint32_t *mtime);
     
     virtual void status(uint8_t statusbuff[4]) = 0;
 
@@ -57,16 +57,8 @@ bool DiskTypeATR::read(uint16_t sectornum, uint16_t *readcount)
 
     memset(_disk_sectorbuff, 0, sizeof(_disk_sectorbuff));
 
-    bool err = false;
-    // Perform a seek if we're not reading the sector after the last one we read
-    if (sectornum != _disk_last_sector + 1)
-    {
-        uint32_t offset = _sector_to_offset(sectornum);
-        err = fseek(_disk_fileh, offset, SEEK_SET) != 0;
-    }
-
-    if (err == false)
-        err = fread(_disk_sectorbuff, 1, sectorSize, _disk_fileh) != sectorSize;
+    uint32_t offset = _sector_to_offset(sectornum);
+    bool err = _cache.read(offset, _disk_sectorbuff, sectorSize) != sectorSize;
 
     if (err == false)
         _disk_last_sector = sectornum;
@@ -95,29 +87,13 @@ bool DiskTypeATR::write(uint16_t sectornum, bool verify)
 
     _disk_last_sector = INVALID_SECTOR_VALUE;
 
-    // Perform a seek if we're writing to the sector after the last one
-    int e;
-    if (sectornum != _disk_last_sector + 1)
+    // The cache writes this back to the file (and syncs it) once the computer stops writing for a bit
+    if (_cache.write(offset, _disk_sectorbuff, sectorSize))
     {
-        e = fseek(_disk_fileh, offset, SEEK_SET);
-        if (e != 0)
-        {
-            Debug_printf("::write seek error %d\n", e);
-            return true;
-        }
-    }
-    // Write the data
-    e = fwrite(_disk_sectorbuff, 1, sectorSize, _disk_fileh);
-    if (e != sectorSize)
-    {
-        Debug_printf("::write error %d, %d\n", e, errno);
+        Debug_printf("::write error %d\n", errno);
         return true;
     }
 
-    int ret = fflush(_disk_fileh);    // This doesn't seem to be connected to anything in ESP-IDF VF, so it may not do anything
-    ret = fsync(fileno(_disk_fileh)); // Since we might get reset at any moment, go ahead and sync the file (not clear if fflush does this)
-    Debug_printf("ATR::write fsync:%d\n", ret);
-
     _disk_last_sector = sectornum;
 
     return false;
@@ -220,6 +196,10 @@ disktype_t DiskTypeATR::mount(FILE *f, uint32_t disksize)
     _disk_image_size = disksize;
     _disk_last_sector = INVALID_SECTOR_VALUE;
 
+    // Read ahead a track at a time if the image is too big to preload
+    uint16_t sectors_per_track = UINT16_FROM_HILOBYTES(_percomBlock.sectors_per_trackH, _percomBlock.sectors_per_trackL);
+    _cache.begin(f, disksize, sectors_per_track * _disk_sector_size, _allow_preload ? DISK_CACHE_PRELOAD_MAX : 0, _allow_background);
+
     Debug_printf("mounted ATR: paragraphs=%d, sect_size=%d, sect_count=%d, disk_size=%d\n",
                  num_paragraphs, num_bytes_sector, _disk_num_sectors, disksize);
 
@@ -123,17 +123,10 @@ bool DiskTypeXEX::read(uint16_t sectornum, uint16_t *readcount)
     // This is the number of bytes into the XEX file we should be reading
     int xex_offset = data_bytes * (sectornum - FIRST_XEX_SECTOR);
 
-    // Perform a seek if we're not reading the sector after the last one we read
-    if (sectornum != _disk_last_sector + 1)
-    {
-        Debug_printf("seeking to offset %d in XEX\n", xex_offset);
-        err = fseek(_disk_fileh, xex_offset, SEEK_SET) != 0;
-    }
-
     if (err == false)
     {
-        Debug_printf("requesting %d bytes from XEX\n", data_bytes);
-        int read = fread(_disk_sectorbuff, 1, data_bytes, _disk_fileh);
+        Debug_printf("requesting %d bytes from XEX at offset %d\n", data_bytes, xex_offset);
+        int read = _cache.read(xex_offset, _disk_sectorbuff, data_bytes);
         Debug_printf("received %d bytes\n", read);
 
         // Fill in the sector link data pointing to the next sector
@@ -170,7 +163,10 @@ void DiskTypeXEX::status(uint8_t statusbuff[4])
 void DiskTypeXEX::unmount()
 {
     if (_xex_bootloader != nullptr)
+    {
         free(_xex_bootloader);
+        _xex_bootloader = nullptr;
+    }
 
     // Call the parent unmount
     this->DiskType::unmount();
@@ -201,6 +197,9 @@ disktype_t DiskTypeXEX::mount(FILE *f, uint32_t disksize)
     _disk_last_sector = INVALID_SECTOR_VALUE;
     _disktype = DISKTYPE_XEX;
 
+    // XEX files are read straight through, so cache as much of them at a time as we can
+    _cache.begin(f, disksize, DISK_CACHE_MAX_BLOCK_SIZE, _allow_preload ? DISK_CACHE_PRELOAD_MAX : 0, _allow_background);
+
     Debug_printf("mounted XEX with %d-byte bootloader; XEX size=%d\n", _xex_bootloadersize, _disk_image_size);
 
     return _disktype;
@@ -42,9 +42,13 @@
 #define SIO_FUJICMD_CLOSE_APPKEY 0xDB
 #define SIO_FUJICMD_GET_DEVICE_FULLPATH 0xDA
 #define SIO_FUJICMD_CONFIG_BOOT 0xD9
+#define SIO_FUJICMD_DISK_OVERLAY 0xD8
 #define SIO_FUJICMD_STATUS 0x53
 #define SIO_FUJICMD_HSIO_INDEX 0x3F
 
+#define DISK_OVERLAY_COMMIT 0
+#define DISK_OVERLAY_DISCARD 1
+
 sioFuji theFuji; // global fuji device object
 
 //sioDisk sioDiskDevs[MAX_HOSTS];
@@ -240,9 +244,9 @@ void sioFuji::sio_net_set_ssid()
         char password[MAX_WIFI_PASS_LEN];
     } cfg;
 
-    uint8_t ck = sio_to_peripheral((uint8_t *)&cfg, sizeof(cfg));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&cfg, sizeof(cfg));
 
-    if (sio_checksum((uint8_t *)&cfg, sizeof(cfg)) != ck)
+    if (bad_frame)
         sio_error();
     else
     {
@@ -293,6 +297,24 @@ void sioFuji::sio_mount_host()
         sio_complete();
 }
 
+// Sidecar file for an overlay is named for a hash of the drive slot, host and image path
+char *_generate_overlay_filename(uint8_t deviceSlot, const char *hostname, const char *filename)
+{
+    static char filenamebuf[30];
+
+    // 32-bit FNV-1a, starting with the drive so the same image in two drives gets two overlays
+    uint32_t hash = 2166136261U;
+    hash = (hash ^ deviceSlot) * 16777619U;
+    for (const char *p = hostname; *p != '\0'; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619U;
+    hash = (hash ^ '/') * 16777619U;
+    for (const char *p = filename; *p != '\0'; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619U;
+
+    snprintf(filenamebuf, sizeof(filenamebuf), "/esp1541/%08x.ovl", hash);
+    return filenamebuf;
+}
+
 // Disk Image Mount
 void sioFuji::sio_disk_image_mount()
 {
@@ -309,7 +331,7 @@ void sioFuji::sio_disk_image_mount()
 
     // TODO: Implement FETCH?
     char flag[3] = {'r', 0, 0};
-    if (options == DISK_ACCESS_MODE_WRITE)
+    if (options & DISK_ACCESS_MODE_WRITE)
         flag[1] = '+';
 
     // Make sure we weren't given a bad hostSlot
@@ -326,6 +348,9 @@ void sioFuji::sio_disk_image_mount()
     Debug_printf("Selecting '%s' from host #%u as %s on D%u:\n",
                  disk.filename, disk.host_slot, flag, deviceSlot + 1);
 
+    uint32_t round_trips = host.round_trips();
+    __IGNORE_UNUSED_VAR(round_trips);
+
     disk.fileh = host.file_open(disk.filename, disk.filename, sizeof(disk.filename), flag);
 
     if (disk.fileh == nullptr)
@@ -340,8 +365,66 @@ void sioFuji::sio_disk_image_mount()
     // We need the file size for loading XEX files and for CASSETTE, so get that too
     disk.disk_size = host.file_size(disk.fileh);
 
-    // And now mount it
-    disk.disk_type = disk.disk_dev.mount(disk.fileh, disk.filename, disk.disk_size);
+    // And now mount it, without reading the whole image in up front from an HTTP host.
+    // Only SD images can be loaded and written back by the cache's own tasks; TNFS and HTTP
+    // mounts aren't safe to use from more than one task.
+    disk.disk_type = disk.disk_dev.mount(disk.fileh, disk.filename, disk.disk_size, DISKTYPE_UNKNOWN,
+                                         host.get_type() != HOSTTYPE_HTTP, host.get_type() == HOSTTYPE_LOCAL);
+
+    if (host.get_type() == HOSTTYPE_TNFS || host.get_type() == HOSTTYPE_HTTP)
+        Debug_printf("Image mounted after %u %s requests\n", host.round_trips() - round_trips,
+                     host.get_type() == HOSTTYPE_TNFS ? "TNFS" : "HTTP");
+
+    if (options & DISK_ACCESS_MODE_OVERLAY)
+    {
+        // Keep the overlay on SD if we have one so it survives a reboot
+        if (fnSDFAT.running())
+        {
+            fnSDFAT.create_path("/esp1541");
+            disk.disk_dev.overlay_begin(&fnSDFAT, _generate_overlay_filename(deviceSlot, host.get_hostname(), disk.filename));
+        }
+        else
+            disk.disk_dev.overlay_begin();
+    }
+
+    sio_complete();
+}
+
+/*
+ Commit or discard the overlay on a disk image mounted with DISK_ACCESS_MODE_OVERLAY
+ aux1 = device slot
+ aux2 = DISK_OVERLAY_COMMIT or DISK_OVERLAY_DISCARD
+*/
+void sioFuji::sio_disk_overlay()
+{
+    uint8_t deviceSlot = cmdFrame.aux1;
+
+    Debug_printf("Fuji cmd: DISK OVERLAY 0x%02X, 0x%02X\n", deviceSlot, cmdFrame.aux2);
+
+    if (!_validate_device_slot(deviceSlot) || _fnDisks[deviceSlot].disk_dev.overlay_active() == false)
+    {
+        sio_error();
+        return;
+    }
+
+    sioDisk &disk_dev = _fnDisks[deviceSlot].disk_dev;
+
+    switch (cmdFrame.aux2)
+    {
+    case DISK_OVERLAY_COMMIT:
+        if (disk_dev.overlay_commit())
+        {
+            sio_error();
+            return;
+        }
+        break;
+    case DISK_OVERLAY_DISCARD:
+        disk_dev.overlay_discard();
+        break;
+    default:
+        sio_error();
+        return;
+    }
 
     sio_complete();
 }
@@ -373,9 +456,9 @@ void sioFuji::sio_open_app_key()
     Debug_print("Fuji cmd: OPEN APPKEY\n");
 
     // The data expected for this command
-    uint8_t ck = sio_to_peripheral((uint8_t *)&_current_appkey, sizeof(_current_appkey));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&_current_appkey, sizeof(_current_appkey));
 
-    if (sio_checksum((uint8_t *)&_current_appkey, sizeof(_current_appkey)) != ck)
+    if (bad_frame)
     {
         sio_error();
         return;
@@ -428,9 +511,9 @@ void sioFuji::sio_write_app_key()
     // Data for SIO_FUJICMD_WRITE_APPKEY
     uint8_t value[MAX_APPKEY_LEN];
 
-    uint8_t ck = sio_to_peripheral((uint8_t *)value, sizeof(value));
+    bool bad_frame = sio_to_peripheral((uint8_t *)value, sizeof(value));
 
-    if (sio_checksum((uint8_t *)value, sizeof(value)) != ck)
+    if (bad_frame)
     {
         sio_error();
         return;
@@ -657,9 +740,9 @@ void sioFuji::sio_open_directory()
 
     char dirpath[256];
     uint8_t hostSlot = cmdFrame.aux1;
-    uint8_t ck = sio_to_peripheral((uint8_t *)&dirpath, sizeof(dirpath));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&dirpath, sizeof(dirpath));
 
-    if (sio_checksum((uint8_t *)&dirpath, sizeof(dirpath)) != ck)
+    if (bad_frame)
     {
         sio_error();
         return;
@@ -910,9 +993,9 @@ void sioFuji::sio_new_disk()
     } newDisk;
 
     // Ask for details on the new disk to create
-    uint8_t ck = sio_to_peripheral((uint8_t *)&newDisk, sizeof(newDisk));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&newDisk, sizeof(newDisk));
 
-    if (ck != sio_checksum((uint8_t *)&newDisk, sizeof(newDisk)))
+    if (bad_frame)
     {
         Debug_print("sio_new_disk Bad checksum\n");
         sio_error();
@@ -981,9 +1064,9 @@ void sioFuji::sio_write_host_slots()
     Debug_println("Fuji cmd: WRITE HOST SLOTS");
 
     char hostSlots[MAX_HOSTS][MAX_HOSTNAME_LEN];
-    uint8_t ck = sio_to_peripheral((uint8_t *)&hostSlots, sizeof(hostSlots));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&hostSlots, sizeof(hostSlots));
 
-    if (sio_checksum((uint8_t *)hostSlots, sizeof(hostSlots)) == ck)
+    if (!bad_frame)
     {
         for (int i = 0; i < MAX_HOSTS; i++)
             _fnHosts[i].set_hostname(hostSlots[i]);
@@ -1003,11 +1086,11 @@ void sioFuji::sio_set_host_prefix()
     char prefix[MAX_HOST_PREFIX_LEN];
     uint8_t hostSlot = cmdFrame.aux1;
 
-    uint8_t ck = sio_to_peripheral((uint8_t *)prefix, MAX_FILENAME_LEN);
+    bool bad_frame = sio_to_peripheral((uint8_t *)prefix, MAX_FILENAME_LEN);
 
     Debug_printf("Fuji cmd: SET HOST PREFIX %uh \"%s\"\n", hostSlot, prefix);
 
-    if (sio_checksum((uint8_t *)prefix, sizeof(prefix)) != ck)
+    if (bad_frame)
     {
         sio_error();
         return;
@@ -1103,9 +1186,9 @@ void sioFuji::sio_write_device_slots()
         char filename[MAX_DISPLAY_FILENAME_LEN];
     } diskSlots[MAX_DISK_DEVICES];
 
-    uint8_t ck = sio_to_peripheral((uint8_t *)&diskSlots, sizeof(diskSlots));
+    bool bad_frame = sio_to_peripheral((uint8_t *)&diskSlots, sizeof(diskSlots));
 
-    if (ck == sio_checksum((uint8_t *)&diskSlots, sizeof(diskSlots)))
+    if (!bad_frame)
     {
         // Load the data into our current device array
         for (int i = 0; i < MAX_DISK_DEVICES; i++)
@@ -1166,8 +1249,9 @@ void sioFuji::_populate_config_from_slots()
         }
         else
         {
+            // HTTP hosts are told apart by their URL, so they're stored as network hosts like TNFS
             Config.store_host(i, hname,
-                              htype == HOSTTYPE_TNFS ? fnConfig::host_types::HOSTTYPE_TNFS : fnConfig::host_types::HOSTTYPE_SD);
+                              (htype == HOSTTYPE_TNFS || htype == HOSTTYPE_HTTP) ? fnConfig::host_types::HOSTTYPE_TNFS : fnConfig::host_types::HOSTTYPE_SD);
         }
     }
 
@@ -1177,7 +1261,7 @@ void sioFuji::_populate_config_from_slots()
             Config.clear_mount(i);
         else
             Config.store_mount(i, _fnDisks[i].host_slot, _fnDisks[i].filename,
-                               _fnDisks[i].access_mode == DISK_ACCESS_MODE_WRITE ? fnConfig::mount_modes::MOUNTMODE_WRITE : fnConfig::mount_modes::MOUNTMODE_READ);
+                               (_fnDisks[i].access_mode & DISK_ACCESS_MODE_WRITE) ? fnConfig::mount_modes::MOUNTMODE_WRITE : fnConfig::mount_modes::MOUNTMODE_READ);
     }
 }
 
@@ -1220,11 +1304,11 @@ void sioFuji::sio_set_device_filename()
     uint8_t host = cmdFrame.aux2 >> 4;
     uint8_t mode = cmdFrame.aux2 & 0x0F;
 
-    uint8_t ck = sio_to_peripheral((uint8_t *)tmp, MAX_FILENAME_LEN);
+    bool bad_frame = sio_to_peripheral((uint8_t *)tmp, MAX_FILENAME_LEN);
 
     Debug_printf("Fuji cmd: SET DEVICE SLOT 0x%02X/%02X/%02X FILENAME: %s\n", slot, host, mode, tmp);
 
-    if (sio_checksum((uint8_t *)tmp, MAX_FILENAME_LEN) != ck)
+    if (bad_frame)
     {
         sio_error();
         return;
@@ -1473,6 +1557,10 @@ void sioFuji::sio_process(uint32_t commanddata, uint8_t checksum)
         sio_ack();
         sio_set_boot_config();
         break;
+    case SIO_FUJICMD_DISK_OVERLAY:
+        sio_ack();
+        sio_disk_overlay();
+        break;
     default:
         sio_nak();
     }
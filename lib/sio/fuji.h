@@ -94,6 +94,7 @@ protected:
     void sio_close_app_key();          // 0xDB
     void sio_get_device_filename();    // 0xDA
     void sio_set_boot_config();        // 0xD9
+    void sio_disk_overlay();           // 0xD8
 
     void sio_status() override;
     void sio_process(uint32_t commanddata, uint8_t checksum) override;
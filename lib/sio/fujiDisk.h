@@ -11,6 +11,7 @@
 
 #define DISK_ACCESS_MODE_READ 1
 #define DISK_ACCESS_MODE_WRITE 2
+#define DISK_ACCESS_MODE_OVERLAY 4 // OR with READ or WRITE: keep the computer's writes out of the image until committed
 #define DISK_ACCESS_MODE_FETCH 128
 
 #define INVALID_HOST_SLOT 0xFF
@@ -3,6 +3,7 @@
 #include "../FileSystem/fnFS.h"
 #include "../FileSystem/fnFsSD.h"
 #include "../FileSystem/fnFsTNFS.h"
+#include "../FileSystem/fnFsHTTP.h"
 
 #include "../utils/utils.h"
 
@@ -42,6 +43,7 @@ void fujiHost::set_type(fujiHostType type)
         cleanup();
         break;
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         cleanup();
         break;
     }
@@ -102,6 +104,7 @@ uint16_t fujiHost::dir_tell()
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         result = _fs->dir_tell();
         break;
     case HOSTTYPE_UNINITIALIZED:
@@ -121,6 +124,7 @@ bool fujiHost::dir_seek(uint16_t pos)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         result = _fs->dir_seek(pos);
         break;
     case HOSTTYPE_UNINITIALIZED:
@@ -150,6 +154,7 @@ bool fujiHost::dir_open(const char *path, const char *pattern, uint16_t options)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         result = _fs->dir_open(realpath, pattern, options);
         break;
     case HOSTTYPE_UNINITIALIZED:
@@ -166,6 +171,7 @@ fsdir_entry_t *fujiHost::dir_nextfile()
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         return _fs->dir_read();
     case HOSTTYPE_UNINITIALIZED:
         break;
@@ -203,6 +209,19 @@ long fujiHost::file_size(FILE *filehandle)
     return _fs->FileSystem::filesize(filehandle);
 }
 
+/* Returns the number of requests we've sent to a TNFS or HTTP host so far (0 for other host types)
+*/
+uint32_t fujiHost::round_trips()
+{
+    if (_fs == nullptr)
+        return 0;
+    if (_type == HOSTTYPE_TNFS)
+        return ((FileSystemTNFS *)_fs)->round_trips();
+    if (_type == HOSTTYPE_HTTP)
+        return ((FileSystemHTTP *)_fs)->round_trips();
+    return 0;
+}
+
 /* If fullpath is given, then the function will fail and return nullptr
    if the combined prefix + path is longer than fullpathlen.
    Fullpath may be the same buffer as path.
@@ -330,9 +349,50 @@ int fujiHost::mount_tnfs()
     return -1;
 }
 
+/* Returns:
+    0 on success
+   -1 devicename isn't an HTTP(S) URL, or on failure
+*/
+int fujiHost::mount_http()
+{
+    if (strncasecmp(_hostname, "http://", 7) != 0 && strncasecmp(_hostname, "https://", 8) != 0)
+        return -1;
+
+    Debug_printf("::mount_http {%d:%d} \"%s\"\n", slotid, _type, _hostname);
+
+    // Don't do anything if that's already what's set
+    if (_type == HOSTTYPE_HTTP)
+    {
+        if (_fs != nullptr && _fs->running())
+        {
+            Debug_printf("::mount_http Currently connected to host \"%s\"\n", _hostname);
+            return 0;
+        }
+    }
+    else
+        set_type(HOSTTYPE_HTTP);
+
+    _fs = new FileSystemHTTP;
+
+    if (_fs == nullptr)
+    {
+        Debug_println("Couldn't create a new HTTPFS in fujiHost::mount_http!");
+    }
+    else
+    {
+        if (((FileSystemHTTP *)_fs)->start(_hostname))
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 /* Returns true if successful
 *  We expect a valid devicename, currently:
 *  "SD" = local
+*  "http://..." or "https://..." = HTTP(S) server supporting Range requests
 *  anything else = TNFS
 */
 bool fujiHost::mount()
@@ -343,6 +403,11 @@ bool fujiHost::mount()
     if (0 == mount_local())
         return true;
 
+    if (0 == mount_http())
+        return true;
+    if (_type == HOSTTYPE_HTTP)
+        return false;
+
     // Try mounting TNFS last
     return 0 == mount_tnfs();
 }
@@ -12,7 +12,8 @@ enum fujiHostType
 {
     HOSTTYPE_UNINITIALIZED = 0,
     HOSTTYPE_LOCAL,
-    HOSTTYPE_TNFS
+    HOSTTYPE_TNFS,
+    HOSTTYPE_HTTP
 };
 
 class fujiHost
@@ -29,6 +30,7 @@ private:
 
     int mount_local();
     int mount_tnfs();
+    int mount_http();
 
 public:
     int slotid = -1;
@@ -54,6 +56,7 @@ public:
     bool file_exists(const char *path);
     FILE * file_open(const char *path, char *fullpath, int fullpathlen, const char *mode);
     long file_size(FILE *filehandle);
+    uint32_t round_trips();
 
     // Directory functions
     bool dir_open(const char *path, const char *pattern, uint16_t options = 0);
@@ -27,6 +27,8 @@ void sioMIDIMaze::sio_enable_midimaze()
 
     // Open the UDP connection
     udpMIDI.begin(MIDIMAZE_PORT);
+    // Players' packets come in bursts; let them queue up instead of being lost while we talk to the Atari
+    udpMIDI.startQueue();
 
     // Change baud rate
     fnUartSIO.set_baudrate(MIDI_BAUD);
@@ -45,17 +47,17 @@ void sioMIDIMaze::sio_disable_midimaze()
 
 void sioMIDIMaze::sio_handle_midimaze()
 {
-    // if there’s data available, read a packet
-    int packetSize = udpMIDI.parsePacket();
-    if (packetSize > 0)
+    // Pass on everything that's arrived, straight from the receive queue
+    fnUDPDatagram *packet;
+    while ((packet = udpMIDI.front()) != nullptr)
     {
-        udpMIDI.read(buf_net, MIDIMAZE_BUFFER_SIZE);
         // Send to Atari UART
-        fnUartSIO.write(buf_net, packetSize);
+        fnUartSIO.write(packet->data, packet->len);
 #ifdef DEBUG
         Debug_print("MIDI-IN: ");
-        util_dump_bytes(buf_net, packetSize);
+        util_dump_bytes(packet->data, packet->len);
 #endif
+        udpMIDI.pop();
     }
 
     // Read the data until there's a pause in the incoming stream
@@ -86,9 +88,7 @@ void sioMIDIMaze::sio_handle_midimaze()
             }
 
             // Send what we've collected over WiFi
-            udpMIDI.beginPacket(midimaze_host_ip, MIDIMAZE_PORT); // remote IP and port
-            udpMIDI.write(buf_midi, buf_midi_index);
-            udpMIDI.endPacket();
+            udpMIDI.sendPacket(midimaze_host_ip, MIDIMAZE_PORT, buf_midi, buf_midi_index);
 
 #ifdef DEBUG
             Debug_print("MIDI-OUT: ");
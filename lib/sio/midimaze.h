@@ -18,7 +18,6 @@ class sioMIDIMaze : public sioDevice
 private:
     fnUDP udpMIDI;
 
-    uint8_t buf_net[MIDIMAZE_BUFFER_SIZE];
     uint8_t buf_midi[MIDIMAZE_BUFFER_SIZE];
 
     uint8_t buf_midi_index=0;
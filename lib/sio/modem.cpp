@@ -284,7 +284,7 @@ void sioModem::sio_send_firmware(uint8_t loadcommand)
 // 0x57 / 'W' - WRITE
 void sioModem::sio_write()
 {
-    uint8_t ck;
+    bool bad_frame;
 
     Debug_println("Modem cmd: WRITE");
 
@@ -300,9 +300,9 @@ void sioModem::sio_write()
     {
         memset(txBuf, 0, sizeof(txBuf));
 
-        ck = sio_to_peripheral(txBuf, 64);
+        bad_frame = sio_to_peripheral(txBuf, 64);
 
-        if (ck != sio_checksum(txBuf, 64))
+        if (bad_frame)
         {
             sio_error();
         }
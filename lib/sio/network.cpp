@@ -16,15 +16,17 @@
 volatile bool interruptEnabled = false;
 volatile bool interruptProceed = false;
 esp_timer_handle_t rateTimerHandle = nullptr;
+int rateTimerUsers = 0; // Open N: channels; the timer only runs while there are some
 portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
 
-// Latch the rate limiting flag
+// Latch the rate limiting flag and wake up the SIO task so it can check for data to signal
 // The esp_timer_* functions don't mention requiring the callback being in IRAM, so removing that
 void onTimer(void *info)
 {
     portENTER_CRITICAL_ISR(&timerMux);
     interruptProceed = true;
     portEXIT_CRITICAL_ISR(&timerMux);
+    SIO.wake();
 }
 
 string remove_spaces(const string &s)
@@ -36,19 +38,20 @@ string remove_spaces(const string &s)
 }
 
 /**
- * Allocate input/output buffers
+ * Get input/output buffers from the pool
  */
 bool sioNetwork::allocate_buffers()
 {
-    rx_buf = (uint8_t *)heap_caps_malloc(INPUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    tx_buf = (uint8_t *)heap_caps_malloc(OUTPUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    rx_frame = fnNetworkBuffers.acquire(INITIAL_BUFFER_SIZE, &rx_frame_capacity);
+    rx_buf = rx_frame == nullptr ? nullptr : rx_frame + RX_FRAME_HEADROOM;
+    tx_buf = fnNetworkBuffers.acquire(INITIAL_BUFFER_SIZE, &tx_buf_capacity);
     sp_buf = (uint8_t *)heap_caps_malloc(SPECIAL_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
     if ((rx_buf == nullptr) || (tx_buf == nullptr) || (sp_buf == nullptr))
         return false;
 
-    memset(rx_buf, 0, INPUT_BUFFER_SIZE);
-    memset(tx_buf, 0, OUTPUT_BUFFER_SIZE);
+    // NOTE replies come straight from here, so don't leave an old device's data in it
+    memset(rx_frame, 0, rx_frame_capacity);
     memset(sp_buf, 0, SPECIAL_BUFFER_SIZE);
 
     HEAP_CHECK("sioNetwork::allocate_buffers");
@@ -56,16 +59,44 @@ bool sioNetwork::allocate_buffers()
 }
 
 /**
- * Deallocate input/output buffers
+ * Return input/output buffers to the pool
  */
 void sioNetwork::deallocate_buffers()
 {
-    if (rx_buf != nullptr)
-        free(rx_buf);
-    if (tx_buf != nullptr)
-        free(tx_buf);
+    fnNetworkBuffers.release(rx_frame, rx_frame_capacity);
+    fnNetworkBuffers.release(tx_buf, tx_buf_capacity);
     if (sp_buf != nullptr)
         free(sp_buf);
+
+    rx_frame = nullptr;
+    rx_buf = nullptr;
+    tx_buf = nullptr;
+    sp_buf = nullptr;
+    rx_frame_capacity = 0;
+    tx_buf_capacity = 0;
+
+#ifdef DEBUG
+    networkBufferPoolStats stats = fnNetworkBuffers.stats();
+    Debug_printf("Network buffers: in use=%u, idle=%u, peak=%u, acquires=%u, reuses=%u\n",
+                 stats.in_use_bytes, stats.idle_bytes, stats.peak_bytes, stats.acquires, stats.reuses);
+#endif
+}
+
+// Makes sure rx_buf holds at least size bytes, plus room to frame them. Its contents aren't kept.
+bool sioNetwork::ensure_rx_buffer(uint32_t size)
+{
+    rx_frame = fnNetworkBuffers.resize(rx_frame, &rx_frame_capacity, size + RX_FRAME_HEADROOM + RX_FRAME_TAILROOM);
+    rx_buf = rx_frame == nullptr ? nullptr : rx_frame + RX_FRAME_HEADROOM;
+    if (rx_buf != nullptr && protocol != nullptr)
+        protocol->set_saved_rx_buffer(rx_buf, &rx_buf_len);
+    return rx_buf != nullptr;
+}
+
+// Makes sure tx_buf holds at least size bytes. Its contents aren't kept.
+bool sioNetwork::ensure_tx_buffer(uint32_t size)
+{
+    tx_buf = fnNetworkBuffers.resize(tx_buf, &tx_buf_capacity, size);
+    return tx_buf != nullptr;
 }
 
 bool sioNetwork::open_protocol()
@@ -162,20 +193,55 @@ bool sioNetwork::parseURL()
     return (isValidURL(urlParser));
 }
 
+/**
+ * Start the interrupt rate limiting timer if this is the first open channel
+ */
+void sioNetwork::start_timer()
+{
+    if (timer_held)
+        return;
+    timer_held = true;
+
+    if (rateTimerUsers++ > 0)
+        return;
+
+    Debug_print("Creating new rateTimer\n");
+
+    esp_timer_create_args_t tcfg;
+    tcfg.arg = nullptr;
+    tcfg.callback = onTimer;
+    tcfg.dispatch_method = esp_timer_dispatch_t::ESP_TIMER_TASK;
+    tcfg.name = nullptr;
+    esp_timer_create(&tcfg, &rateTimerHandle);
+    esp_timer_start_periodic(rateTimerHandle, 100000); // 100ms
+}
+
+/**
+ * Stop the interrupt rate limiting timer once no channel is left open, so it doesn't keep waking the SIO task
+ */
+void sioNetwork::stop_timer()
+{
+    if (timer_held == false)
+        return;
+    timer_held = false;
+
+    if (--rateTimerUsers > 0 || rateTimerHandle == nullptr)
+        return;
+
+    Debug_println("Deleting rateTimer");
+    esp_timer_stop(rateTimerHandle);
+    esp_timer_delete(rateTimerHandle);
+    rateTimerHandle = nullptr;
+}
+
 void sioNetwork::sio_open()
 {
     Debug_println("sioNetwork::sio_open()");
 
     read_mode = NORMAL;
 
-    // Delete existing timer
-    if (rateTimerHandle != nullptr)
-    {
-        Debug_println("Deleting existing rateTimer");
-        esp_timer_stop(rateTimerHandle);
-        esp_timer_delete(rateTimerHandle);
-        rateTimerHandle = nullptr;
-    }
+    // Reopening drops whatever this channel had open
+    stop_timer();
     interruptEnabled = true;
 
     sio_ack();
@@ -233,16 +299,8 @@ void sioNetwork::sio_open()
         return;
     }
 
-    Debug_print("Creating new rateTimer\n");
     interruptProceed = true;
-
-    esp_timer_create_args_t tcfg;
-    tcfg.arg = nullptr;
-    tcfg.callback = onTimer;
-    tcfg.dispatch_method = esp_timer_dispatch_t::ESP_TIMER_TASK;
-    tcfg.name = nullptr;
-    esp_timer_create(&tcfg, &rateTimerHandle);
-    esp_timer_start_periodic(rateTimerHandle, 100000); // 100ms
+    start_timer();
 
     // Finally, go ahead and inform the parsers of the active protocol.
     _json.setProtocol(protocol);
@@ -280,6 +338,7 @@ void sioNetwork::sio_close()
     protocol = nullptr;
 
     deallocate_buffers();
+    stop_timer();
 }
 
 void sioNetwork::sio_read()
@@ -293,8 +352,16 @@ void sioNetwork::sio_read()
     }
     sio_ack();
 
-    // Clean out RX buffer.
-    memset(rx_buf, 0, INPUT_BUFFER_SIZE);
+    if (ensure_rx_buffer(sio_get_aux()) == false)
+    {
+        Debug_println("Couldn't grow read buffer!");
+        status_buf.error = 129;
+        sio_error();
+        return;
+    }
+
+    // Whatever the protocol doesn't fill in goes to the computer as zeros
+    memset(rx_buf, 0, sio_get_aux());
 
     Debug_printf("Read %d bytes\n", cmdFrame.aux2 * 256 + cmdFrame.aux1);
 
@@ -318,9 +385,11 @@ void sioNetwork::sio_read()
         }
         // Convert CR and/or LF to ATASCII EOL
         // 1 = CR, 2 = LF, 3 = CR/LF
+        // The checksum is worked out in the same pass so the data's only walked once
         if (aux2 > 0)
         {
             Debug_printf("sio_read conversion rx_buf_len = %hu\n", rx_buf_len);
+            unsigned int chk = 0;
             for (int i = 0; i < rx_buf_len; i++)
             {
                 switch (aux2 & 3)
@@ -342,13 +411,16 @@ void sioNetwork::sio_read()
                 }
 
                 // Translate ASCII TAB to ATASCII TAB.
-                if (aux2 > 0)
-                    if (rx_buf[i] == 0x09)
-                        rx_buf[i] = 0x7f;
+                if (rx_buf[i] == 0x09)
+                    rx_buf[i] = 0x7f;
+
+                chk = sio_checksum_add(chk, rx_buf[i]);
             }
+            sio_to_computer_inplace(rx_buf, rx_buf_len, err, chk);
+            return;
         }
     }
-    sio_to_computer(rx_buf, rx_buf_len, err);
+    sio_to_computer_inplace(rx_buf, rx_buf_len, err);
 }
 
 void sioNetwork::sio_write()
@@ -356,8 +428,6 @@ void sioNetwork::sio_write()
     Debug_printf("sioNetwork::sio_write() %d bytes\n", cmdFrame.aux2 * 256 + cmdFrame.aux1);
     sio_ack();
 
-    memset(tx_buf, 0, OUTPUT_BUFFER_SIZE);
-
     if (protocol == nullptr)
     {
         Debug_printf("Not connected\n");
@@ -365,6 +435,14 @@ void sioNetwork::sio_write()
         status_buf.error = 128;
         sio_error();
     }
+    // CR/LF translation can double the length
+    else if (ensure_tx_buffer(sio_get_aux() * ((aux2 & 3) == 3 ? 2 : 1)) == false)
+    {
+        Debug_println("Couldn't grow write buffer!");
+        err = true;
+        status_buf.error = 129;
+        sio_error();
+    }
     else
     {
         ck = sio_to_peripheral(tx_buf, sio_get_aux());
@@ -390,7 +468,7 @@ void sioNetwork::sio_write()
                 case 3:
                     if (tx_buf[i] == 0x9B)
                     {
-                        memmove(&tx_buf[i + 1], &tx_buf[i], tx_buf_len);
+                        memmove(&tx_buf[i + 1], &tx_buf[i], tx_buf_len - i);
                         tx_buf[i] = 0x0D;
                         tx_buf[i + 1] = 0x0A;
                         tx_buf_len++;
@@ -6,11 +6,15 @@
 #include "networkProtocol.h"
 #include "EdUrlParser.h"
 #include "json.h"
+#include "networkBufferPool.h"
 
 #define NUM_DEVICES 8
 
-#define INPUT_BUFFER_SIZE 65535
+#define INPUT_BUFFER_SIZE 65535 // Most the computer can ask to read at once
 #define OUTPUT_BUFFER_SIZE 65535
+#define INITIAL_BUFFER_SIZE 1024 // rx/tx buffers start this big and grow as reads and writes need
+#define RX_FRAME_HEADROOM 1 // rx_buf keeps room for the SIO status byte before it...
+#define RX_FRAME_TAILROOM 1 // ...and the checksum after it, so reads go to the computer without a copy
 
 #define SPECIAL_BUFFER_SIZE 256
 #define DEVICESPEC_SIZE 256
@@ -32,8 +36,12 @@ class sioNetwork : public sioDevice
 private:
     bool allocate_buffers();
     void deallocate_buffers();
+    bool ensure_rx_buffer(uint32_t size);
+    bool ensure_tx_buffer(uint32_t size);
     bool open_protocol();
     void start_timer();
+    void stop_timer();
+    bool timer_held = false; // Set while this channel counts towards keeping the rate timer running
 
 protected:
     union
@@ -87,9 +95,12 @@ private:
     EdUrlParser *urlParser = nullptr;
     unsigned char err;
     uint8_t ck;
+    uint8_t *rx_frame = nullptr; // Pool buffer rx_buf sits in
     uint8_t *rx_buf = nullptr;
     uint8_t *tx_buf = nullptr;
     uint8_t *sp_buf = nullptr;
+    uint32_t rx_frame_capacity = 0;
+    uint32_t tx_buf_capacity = 0;
     unsigned short rx_buf_len;
     unsigned short tx_buf_len = 256;
     unsigned short sp_buf_len;
@@ -0,0 +1,144 @@
+#include <string.h>
+#include <esp_heap_caps.h>
+
+#include "../../include/debug.h"
+
+#include "networkBufferPool.h"
+
+networkBufferPool fnNetworkBuffers;
+
+void networkBufferPool::_lock()
+{
+    if (_mutex == nullptr)
+        _mutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+}
+
+/*
+ Returns a buffer of at least size bytes (rounded up to NETWORK_BUFFER_CHUNK), preferring
+ the smallest released buffer that's big enough. The buffer's real size is stored in capacity.
+ Contents are whatever was left in it. Returns nullptr if we're out of memory.
+*/
+uint8_t *networkBufferPool::acquire(uint32_t size, uint32_t *capacity)
+{
+    uint32_t wanted = ((size + NETWORK_BUFFER_CHUNK - 1) / NETWORK_BUFFER_CHUNK) * NETWORK_BUFFER_CHUNK;
+    if (wanted == 0)
+        wanted = NETWORK_BUFFER_CHUNK;
+
+    _lock();
+
+    _stats.acquires++;
+
+    int best = -1;
+    for (int i = 0; i < NETWORK_BUFFER_IDLE_SLOTS; i++)
+    {
+        if (_idle[i].buffer != nullptr && _idle[i].capacity >= wanted &&
+            (best < 0 || _idle[i].capacity < _idle[best].capacity))
+            best = i;
+    }
+
+    uint8_t *buffer;
+    if (best >= 0)
+    {
+        buffer = _idle[best].buffer;
+        *capacity = _idle[best].capacity;
+        _idle[best] = idle_buffer();
+        _stats.idle_bytes -= *capacity;
+        _stats.reuses++;
+    }
+    else
+    {
+        buffer = (uint8_t *)heap_caps_malloc(wanted, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (buffer == nullptr)
+        {
+            _stats.failures++;
+            _unlock();
+            Debug_printf("networkBufferPool failed to allocate %u bytes\n", wanted);
+            *capacity = 0;
+            return nullptr;
+        }
+        *capacity = wanted;
+        _stats.allocations++;
+    }
+
+    _stats.in_use_bytes += *capacity;
+    if (_stats.in_use_bytes + _stats.idle_bytes > _stats.peak_bytes)
+        _stats.peak_bytes = _stats.in_use_bytes + _stats.idle_bytes;
+
+    _unlock();
+
+    return buffer;
+}
+
+/*
+ Makes sure buffer holds at least size bytes, swapping it for a bigger one if needed.
+ The contents are NOT kept. Returns the (possibly new) buffer, or nullptr if we're out of
+ memory, in which case the old buffer has been released.
+*/
+uint8_t *networkBufferPool::resize(uint8_t *buffer, uint32_t *capacity, uint32_t size)
+{
+    if (buffer != nullptr && *capacity >= size)
+        return buffer;
+
+    release(buffer, *capacity);
+    return acquire(size, capacity);
+}
+
+// Gives a buffer back to the pool, keeping it for reuse if there's room
+void networkBufferPool::release(uint8_t *buffer, uint32_t capacity)
+{
+    if (buffer == nullptr)
+        return;
+
+    _lock();
+
+    _stats.in_use_bytes -= capacity;
+
+    int slot = -1;
+    if (_stats.idle_bytes + capacity <= NETWORK_BUFFER_IDLE_MAX)
+    {
+        for (int i = 0; i < NETWORK_BUFFER_IDLE_SLOTS; i++)
+        {
+            if (_idle[i].buffer == nullptr)
+            {
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    if (slot >= 0)
+    {
+        _idle[slot].buffer = buffer;
+        _idle[slot].capacity = capacity;
+        _stats.idle_bytes += capacity;
+    }
+    else
+        free(buffer);
+
+    _unlock();
+}
+
+// Frees every released buffer we're holding on to
+void networkBufferPool::trim()
+{
+    _lock();
+
+    for (int i = 0; i < NETWORK_BUFFER_IDLE_SLOTS; i++)
+    {
+        if (_idle[i].buffer != nullptr)
+            free(_idle[i].buffer);
+        _idle[i] = idle_buffer();
+    }
+    _stats.idle_bytes = 0;
+
+    _unlock();
+}
+
+networkBufferPoolStats networkBufferPool::stats()
+{
+    _lock();
+    networkBufferPoolStats s = _stats;
+    _unlock();
+    return s;
+}
@@ -0,0 +1,56 @@
+#ifndef NETWORK_BUFFER_POOL_H
+#define NETWORK_BUFFER_POOL_H
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#define NETWORK_BUFFER_CHUNK 1024 // Buffers are sized in multiples of this
+#define NETWORK_BUFFER_IDLE_SLOTS 8 // Most released buffers we hold on to for reuse
+#define NETWORK_BUFFER_IDLE_MAX (64 * 1024) // Most bytes we hold in released buffers
+
+struct networkBufferPoolStats
+{
+    uint32_t acquires = 0;
+    uint32_t reuses = 0; // Acquires satisfied by a released buffer
+    uint32_t allocations = 0;
+    uint32_t failures = 0;
+    uint32_t in_use_bytes = 0;
+    uint32_t idle_bytes = 0;
+    uint32_t peak_bytes = 0; // Highest in_use_bytes + idle_bytes we've seen
+};
+
+/*
+ PSRAM rx/tx buffers shared by the N: devices.
+ A device acquires buffers when it's opened, resizes them (in NETWORK_BUFFER_CHUNK
+ steps) when a read or write needs more room and releases them when it's closed.
+ A few released buffers are kept for the next open; trim() hands that memory back.
+*/
+class networkBufferPool
+{
+private:
+    struct idle_buffer
+    {
+        uint8_t *buffer = nullptr;
+        uint32_t capacity = 0;
+    } _idle[NETWORK_BUFFER_IDLE_SLOTS];
+
+    SemaphoreHandle_t _mutex = nullptr;
+    networkBufferPoolStats _stats;
+
+    void _lock();
+    void _unlock() { xSemaphoreGive(_mutex); };
+
+public:
+    uint8_t *acquire(uint32_t size, uint32_t *capacity);
+    uint8_t *resize(uint8_t *buffer, uint32_t *capacity, uint32_t size);
+    void release(uint8_t *buffer, uint32_t capacity);
+    void trim();
+
+    networkBufferPoolStats stats();
+};
+
+extern networkBufferPool fnNetworkBuffers;
+
+#endif // NETWORK_BUFFER_POOL_H
@@ -3,8 +3,48 @@
 #include "../utils/utils.h"
 #include "../../include/debug.h"
 
+extern "C"
+{
+#include "../ftpparse/ftpparse.h"
+}
+
 #include "networkProtocolFTP.h"
 
+/*
+ Control connections that are logged in and idle, kept so the next open to the same
+ server skips the connect and login. Each may also have an EPSV on the way whose reply
+ we pick up when it's next used. N: devices are only serviced from the SIO task, so
+ this doesn't need a lock.
+*/
+struct ftpSession
+{
+    string key;
+    fnTcpClient control;
+    bool pasvPending = false;
+    unsigned long releasedMs = 0;
+};
+
+static ftpSession _ftp_sessions[FTP_SESSION_POOL_SIZE];
+
+static void _ftp_session_drop(ftpSession &session)
+{
+    if (session.control.connected())
+    {
+        session.control.write("QUIT\r\n");
+        session.control.stop();
+    }
+    session = ftpSession();
+}
+
+// Closes sessions that have sat unused too long
+void ftp_session_expire()
+{
+    unsigned long now = fnSystem.millis();
+    for (int i = 0; i < FTP_SESSION_POOL_SIZE; i++)
+        if (_ftp_sessions[i].key.empty() == false && now - _ftp_sessions[i].releasedMs > FTP_SESSION_IDLE_TIMEOUT)
+            _ftp_session_drop(_ftp_sessions[i]);
+}
+
 networkProtocolFTP::networkProtocolFTP()
 {
 }
@@ -13,37 +53,64 @@ networkProtocolFTP::~networkProtocolFTP()
 {
 }
 
-string networkProtocolFTP::ftpResult()
+/*
+ Reads a reply from the control connection and returns its code, or "" if none came.
+ Multi-line replies ("123-...") are read through to their last line ("123 ...").
+*/
+string networkProtocolFTP::ftpResult(unsigned long timeout)
 {
-    char buf[512];
-    long tstart=fnSystem.millis();
-    long tdur=0;
-
-    memset(buf, 0, sizeof(buf));
+    unsigned long tstart = fnSystem.millis();
+    string code;
+    string line;
 
+    controlResponse.clear();
     if (!control.connected())
         return "";
 
-    while (tdur < 10000)
+    while (fnSystem.millis() - tstart < timeout)
     {
-        if (control.available() > 0)
-            break;
+        int c = control.read();
+        if (c < 0)
+        {
+            fnSystem.delay(1);
+            continue;
+        }
+        if (c == '\r')
+            continue;
+        if (c != '\n')
+        {
+            if (line.length() < FTP_LIST_LINE_MAX)
+                line += (char)c;
+            continue;
+        }
 
-        tdur = fnSystem.millis() - tstart;
-    }
+        if (line.length() >= 4)
+        {
+            if (code.empty())
+            {
+                code = line.substr(0, 3);
+                if (line[3] != '-')
+                    break;
+            }
+            else if (line.compare(0, 3, code) == 0 && line[3] == ' ')
+                break;
+        }
+        else if (code.empty())
+            return "";
 
-    int l = control.read_until('\n', buf, sizeof(buf));
-    Debug_printf("We got %d bytes back\n", l);
+        line.clear();
+    }
 
-    if (l < 4)
+    if (code.empty())
+    {
+        Debug_println("FTP no reply");
         return "";
+    }
 
-    string sbuf = string(buf);
-    controlResponse = sbuf.substr(4);
+    controlResponse = line.length() > 4 ? line.substr(4) : "";
+    Debug_printf("FTP Result: %s - %s\n", code.c_str(), line.c_str());
 
-    Debug_printf("FTP Result: %s -  %s\n",sbuf.substr(0,3).c_str(),sbuf.c_str());
-    
-    return sbuf.substr(0,3);
+    return code;
 }
 
 unsigned short networkProtocolFTP::parsePort(string response)
@@ -67,9 +134,50 @@ unsigned short networkProtocolFTP::parsePort(string response)
     return port;
 }
 
-bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
+/*
+ Gets us a logged in control connection: one left in the pool by an earlier open
+ to this server if there is one, otherwise a new one.
+*/
+bool networkProtocolFTP::ftpConnect(EdUrlParser *urlParser)
 {
-    string tmpPath;
+    sessionKey = urlParser->hostName + ":" + urlParser->port;
+    primedPort = 0;
+
+    ftp_session_expire();
+    for (int i = 0; i < FTP_SESSION_POOL_SIZE; i++)
+    {
+        ftpSession &session = _ftp_sessions[i];
+        if (session.key != sessionKey)
+            continue;
+
+        control = session.control;
+        bool pasvPending = session.pasvPending;
+        unsigned long age = fnSystem.millis() - session.releasedMs;
+        session = ftpSession();
+
+        if (!control.connected())
+            break;
+
+        // Pick up the reply to the EPSV we sent when this was put back
+        if (pasvPending)
+        {
+            string r = ftpResult(FTP_ABORT_TIMEOUT);
+            if (r.empty())
+            {
+                control.stop();
+                break;
+            }
+            if (r == "229" && age < FTP_PASV_MAX_AGE)
+                primedPort = parsePort(controlResponse);
+        }
+
+        // Throw out anything else the server said while we weren't listening
+        while (control.available() > 0)
+            ftpResult(FTP_ABORT_TIMEOUT);
+
+        Debug_printf("Reusing FTP control connection to %s\n", sessionKey.c_str());
+        return true;
+    }
 
     if (!control.connect(urlParser->hostName.c_str(), atoi(urlParser->port.c_str())))
         return false; // Error
@@ -95,18 +203,26 @@ bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
     if (ftpResult()!="200")
         return false;
 
-    tmpPath = urlParser->path.substr(0, urlParser->path.find("*") - 1);
+    return true;
+}
+
+bool networkProtocolFTP::ftpChangeDir(EdUrlParser *urlParser)
+{
+    string tmpPath = urlParser->path.substr(0, urlParser->path.find("*") - 1);
 
     if (tmpPath.empty())
         tmpPath = "/";
 
-    Debug_printf("Type I OK.\nAttempting to CWD to \"%s\"\n", tmpPath.c_str());
+    Debug_printf("Attempting to CWD to \"%s\"\n", tmpPath.c_str());
 
     control.write("CWD ");
     control.write(tmpPath.c_str());
     control.write("\r\n");
 
-    if (ftpResult()!="250")
+    string r = ftpResult();
+    if (r.empty())
+        return false;
+    if (r != "250")
     {
         // Trim off last part of filename, hopefully to just a dir path
         string tmp = tmpPath;
@@ -129,92 +245,325 @@ bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
     return true;
 }
 
+bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
+{
+    if (ftpConnect(urlParser) == false)
+        return false;
+
+    if (ftpChangeDir(urlParser))
+        return true;
+
+    // A pooled connection may have died on us; start over with a fresh one if so
+    if (control.connected() == false || controlResponse.empty())
+    {
+        control.stop();
+        return ftpConnect(urlParser) && ftpChangeDir(urlParser);
+    }
+
+    return false;
+}
+
+/*
+ Opens the data connection, using a passive port we asked for ahead of time if we have one.
+ Returns TRUE if an error condition occurred.
+*/
+bool networkProtocolFTP::ftpPassive()
+{
+    if (primedPort != 0)
+    {
+        dataPort = primedPort;
+        primedPort = 0;
+        if (data.connect(hostName.c_str(), dataPort))
+        {
+            Debug_printf("Connected to passive port %d we asked for earlier\n", dataPort);
+            return false;
+        }
+        Debug_println("Early passive port failed, asking again");
+    }
+
+    Debug_printf("Attempting to get passive port\n");
+    control.write("EPSV\r\n");
+
+    if (ftpResult()!="229")
+        return true;
+
+    dataPort = parsePort(controlResponse);
+    Debug_printf("Received EPSV response. Port %d\n", dataPort);
+
+    if (!data.connect(hostName.c_str(), dataPort))
+        return true;
+
+    Debug_printf("%s Connected to data port: %d\n", fnSystem.get_uptime_str(), dataPort);
+    return false;
+}
+
+/*
+ Connects the data channel and sends a transfer command, checking the server took it.
+ Returns TRUE if an error condition occurred.
+*/
+bool networkProtocolFTP::ftpTransfer(const string &command)
+{
+    if (ftpPassive())
+        return true;
+
+    Debug_printf("Sending %s\n", command.c_str());
+    control.write(command.c_str());
+    control.write("\r\n");
+
+    string r = ftpResult();
+    if (r != "150" && r != "125")
+    {
+        Debug_printf("Transfer refused: %s %s\n", r.c_str(), controlResponse.c_str());
+        data.stop();
+        return true;
+    }
+
+    transferActive = true;
+    transferDone = false;
+    listLine.clear();
+    listOutput.clear();
+    return false;
+}
+
+// Checks for the server saying the transfer's finished. Returns TRUE once it has.
+bool networkProtocolFTP::ftpCheckDone()
+{
+    if (transferActive && !transferDone && control.available() > 0)
+    {
+        string r = ftpResult(FTP_ABORT_TIMEOUT);
+        if (r.empty() == false && r[0] != '1')
+            transferDone = true;
+    }
+    return transferDone;
+}
+
+/*
+ Waits for the first data to arrive before letting the Atari cut loose.
+ Returns TRUE if an error condition occurred.
+*/
+bool networkProtocolFTP::ftpWaitForData()
+{
+    unsigned long started = fnSystem.millis();
+
+    while (true)
+    {
+        if (aux1 == 6)
+        {
+            listPump();
+            if (listOutput.empty() == false)
+                return false;
+        }
+        else if (data.available() > 0)
+            return false;
+
+        // Empty file or listing
+        if (ftpCheckDone() && data.available() == 0)
+        {
+            listPump();
+            return false;
+        }
+
+        if (fnSystem.millis() - started >= FTP_DATA_WAIT_TIMEOUT)
+        {
+            Debug_println("Timed out waiting for data on DATA channel");
+            return true;
+        }
+
+        fnSystem.delay(FTP_DATA_POLL);
+    }
+}
+
+/*
+ Finishes any transfer in progress so the control connection is ready for another command,
+ aborting it if the server's still sending.
+ Returns TRUE if an error condition occurred (the control connection can't be trusted).
+*/
+bool networkProtocolFTP::ftpEndTransfer()
+{
+    if (!transferActive)
+        return false;
+
+    ftpCheckDone();
+    transferActive = false;
+    data.stop();
+
+    if (transferDone)
+        return false;
+
+    // Closing the data connection is all a STOR needs; anything else has to be stopped
+    if (aux1 != 8)
+        control.write("ABOR\r\n");
+
+    // An aborted transfer usually gets a 426 before the 225/226
+    for (int i = 0; i < 2; i++)
+    {
+        string r = ftpResult(FTP_ABORT_TIMEOUT);
+        if (r.empty())
+            return true;
+        if (r[0] == '2')
+        {
+            fnSystem.delay(FTP_DATA_POLL);
+            while (control.available() > 0)
+                ftpResult(FTP_ABORT_TIMEOUT);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses whatever LIST output has arrived into entries for the Atari
+void networkProtocolFTP::listPump()
+{
+    uint8_t buf[256];
+
+    while (data.available() > 0)
+    {
+        int n = data.read(buf, sizeof(buf));
+        if (n <= 0)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (buf[i] == '\n')
+            {
+                listEntry(listLine);
+                listLine.clear();
+            }
+            else if (buf[i] != '\r' && listLine.length() < FTP_LIST_LINE_MAX)
+                listLine += (char)buf[i];
+        }
+    }
+
+    // Last line may not have had an end
+    if (ftpCheckDone() && data.available() <= 0 && listLine.empty() == false)
+    {
+        listEntry(listLine);
+        listLine.clear();
+    }
+}
+
+void networkProtocolFTP::listEntry(string &line)
+{
+    if (line.empty())
+        return;
+
+    struct ftpparse fp;
+    if (ftpparse(&fp, &line[0], line.length()) == 1)
+    {
+        string name(fp.name, fp.namelen);
+        if (name == "." || name == "..")
+            return;
+        listOutput += name;
+        // Mark directories so they can be told apart from files
+        if (fp.flagtrycwd && !fp.flagtryretr)
+            listOutput += '/';
+    }
+    else
+    {
+        // Skip the "total" line ls puts first, pass on anything else ftpparse doesn't know
+        if (line.compare(0, 6, "total ") == 0)
+            return;
+        listOutput += line;
+    }
+    listOutput += '\x9b';
+}
+
 bool networkProtocolFTP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enable_interrupt_t enable_interrupt)
 {
     string tmpPath;
+    string command;
     Debug_println("networkProtocolFTP::open()");
 
+    unsigned long started = fnSystem.millis();
+
     if (urlParser->port.empty())
         urlParser->port = "21";
 
     hostName = urlParser->hostName;
     aux1 = cmdFrame->aux1;
+    filePath = urlParser->path;
+    position = 0;
 
     if (ftpLogin(urlParser) == false)
         return false;
 
-    Debug_printf("Attempting to get passive port\n");
-    control.write("EPSV\r\n");
-
-    if (ftpResult()!="229")
-        return false;
-
-    dataPort = parsePort(controlResponse);
-    Debug_printf("Received EPSV response. Port %d\n", dataPort);
-
     switch (cmdFrame->aux1)
     {
     case 4:
         Debug_printf("Attempting to open RETR. to %s\n", urlParser->path.c_str());
-
-        control.write("RETR ");
-        control.write(urlParser->path.c_str());
-        control.write("\r\n");
+        command = "RETR " + urlParser->path;
         break;
     case 6:
+        // LIST instead of NLST so we know which entries are directories
         tmpPath = urlParser->path.substr(urlParser->path.find_last_of("/") + 1);
-        Debug_printf("Attempting NLST to %s\n", tmpPath.c_str());
-        control.write("NLST");
+        Debug_printf("Attempting LIST to %s\n", tmpPath.c_str());
+        command = "LIST";
         if ((tmpPath != "*.*") && (tmpPath != "*") && (tmpPath != "**.*") && (tmpPath != "**") && (tmpPath != "-"))
-        {
-            control.write(" ");
-            control.write(tmpPath.c_str());
-        }
-        control.write("\r\n");
+            command += " " + tmpPath;
         break;
     case 8:
         Debug_printf("Storing file %s\n", urlParser->path.c_str());
-        control.write("STOR ");
-        control.write(urlParser->path.c_str());
-        control.write("\r\n");
+        command = "STOR " + urlParser->path;
         break;
     default:
         Debug_printf("Unimplemented aux1 = %d\n", cmdFrame->aux1);
         return false;
     }
 
-    if (!data.connect(hostName.c_str(), dataPort))
+    if (ftpTransfer(command))
         return false;
 
-    Debug_printf("%s Connected to data port: %d\n", fnSystem.get_uptime_str(), dataPort);
-
-    if (cmdFrame->aux1 != 8) // do not do this for write!
+    if (cmdFrame->aux1 != 8 && ftpWaitForData()) // do not do this for write!
     {
-        // Wait for data to become available before letting the Atari cut loose...
-        int delaymax = 0;
-        while (data.available() == 0)
-        {
-            if (delaymax >= 8000)
-            {
-                Debug_println("Timed out waiting for data on DATA channel");
-                data.stop();
-                return false;
-            }
-
-            Debug_println("Waiting for data on DATA channel");
-            fnSystem.delay(250);
-            delaymax += 250;
-        }
+        data.stop();
+        return false;
     }
+
+    Debug_printf("FTP open took %lu ms\n", fnSystem.millis() - started);
     return true;
 }
 
+/*
+ Puts the control connection back in the pool if it's in a good state, with an EPSV
+ already sent so the next open doesn't have to wait for one.
+*/
 bool networkProtocolFTP::close(enable_interrupt_t enable_interrupt)
 {
     Debug_println("networkProtocolFTP::close()");
+
+    bool reusable = control.connected() && sessionKey.empty() == false && ftpEndTransfer() == false;
     if (data.connected())
         data.stop();
 
+    if (reusable)
+    {
+        ftp_session_expire();
+
+        // Take a free slot, or the one that's been idle longest
+        int slot = 0;
+        for (int i = 0; i < FTP_SESSION_POOL_SIZE; i++)
+        {
+            if (_ftp_sessions[i].key.empty())
+            {
+                slot = i;
+                break;
+            }
+            if (_ftp_sessions[i].releasedMs < _ftp_sessions[slot].releasedMs)
+                slot = i;
+        }
+        _ftp_session_drop(_ftp_sessions[slot]);
+
+        control.write("EPSV\r\n");
+        _ftp_sessions[slot].key = sessionKey;
+        _ftp_sessions[slot].control = control;
+        _ftp_sessions[slot].pasvPending = true;
+        _ftp_sessions[slot].releasedMs = fnSystem.millis();
+        control = fnTcpClient();
+
+        Debug_printf("Keeping FTP control connection to %s\n", sessionKey.c_str());
+        return true;
+    }
+
     if (control.connected())
     {
         Debug_printf("Connected to data port, closing it.\n");
@@ -228,24 +577,26 @@ bool networkProtocolFTP::close(enable_interrupt_t enable_interrupt)
 bool networkProtocolFTP::read(uint8_t *rx_buf, unsigned short len)
 {
     Debug_print("networkProtocolFTP::read()... ");
+
+    // Listings come from what we've parsed
+    if (aux1 == 6)
+    {
+        listPump();
+        size_t z = listOutput.length() < len ? listOutput.length() : len;
+        memcpy(rx_buf, listOutput.data(), z);
+        listOutput.erase(0, z);
+        Debug_printf("%u of %hu bytes\n", z, len);
+        return z != len;
+    }
+
     size_t z = data.read(rx_buf, len);
     Debug_printf("%u of %hu bytes\n", z, len);
 
     if (z != len)
         return true;
-    else
-        dataSize -= len;
 
-    if (aux1 == 6)
-    {
-        for (int i = 0; i < len; i++)
-        {
-            if (rx_buf[i] == 0x0D)
-                rx_buf[i] = 0x20;
-            else if (rx_buf[i] == 0x0A)
-                rx_buf[i] = 0x9B;
-        }
-    }
+    dataSize -= len;
+    position += len;
     return false;
 }
 
@@ -263,8 +614,7 @@ bool networkProtocolFTP::write(uint8_t *tx_buf, unsigned short len)
 
 bool networkProtocolFTP::status(uint8_t *status_buf)
 {
-    int a = data.available();
-    __IGNORE_UNUSED_VAR(a);
+    int a = available();
     status_buf[0] = a & 0xFF;
     status_buf[1] = a >> 8;
     status_buf[2] = 0;
@@ -272,6 +622,45 @@ bool networkProtocolFTP::status(uint8_t *status_buf)
     return false;
 }
 
+// Reports how far into the file we've read
+bool networkProtocolFTP::note(uint8_t *rx_buf)
+{
+    if (aux1 != 4)
+        return false;
+
+    uint32_t pos = position & 0xFFFFFF; // 24 bit value.
+    memcpy(rx_buf, &pos, 3);
+    return true;
+}
+
+/*
+ Restarts the file being read at the given offset with REST, so the Atari can seek
+ without reading its way there. Returns non-zero on error.
+*/
+bool networkProtocolFTP::point(uint8_t *tx_buf)
+{
+    if (aux1 != 4 || !control.connected())
+        return true;
+
+    uint32_t pos = 0;
+    memcpy(&pos, tx_buf, 3);
+
+    if (ftpEndTransfer())
+        return true;
+
+    char rest[24];
+    snprintf(rest, sizeof(rest), "REST %u\r\n", pos);
+    control.write(rest);
+    if (ftpResult() != "350")
+        return true;
+
+    if (ftpTransfer("RETR " + filePath))
+        return true;
+
+    position = pos;
+    return ftpWaitForData();
+}
+
 bool networkProtocolFTP::del(EdUrlParser *urlParser, cmdFrame_t *cmdFrame)
 {
     if (urlParser->port.empty())
@@ -382,5 +771,11 @@ bool networkProtocolFTP::special_supported_00_command(unsigned char comnd)
 
 int networkProtocolFTP::available()
 {
+    if (aux1 == 6)
+    {
+        listPump();
+        return listOutput.length();
+    }
+
     return data.available();
-}
\ No newline at end of file
+}
@@ -6,6 +6,15 @@
 #include "sio.h"
 #include "EdUrlParser.h"
 
+#define FTP_SESSION_POOL_SIZE 2 // Logged in control connections kept between opens
+#define FTP_SESSION_IDLE_TIMEOUT 60000 // ms we'll hold on to an unused control connection
+#define FTP_PASV_MAX_AGE 15000 // ms we trust a passive port asked for ahead of time
+#define FTP_REPLY_TIMEOUT 10000
+#define FTP_ABORT_TIMEOUT 2000
+#define FTP_DATA_WAIT_TIMEOUT 8000
+#define FTP_DATA_POLL 10 // ms between checks while waiting for data
+#define FTP_LIST_LINE_MAX 512
+
 class networkProtocolFTP : public networkProtocol
 {
 public:
@@ -22,22 +31,48 @@ public:
     virtual bool rename(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
     virtual bool mkdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
     virtual bool rmdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame);
+    virtual bool note(uint8_t *rx_buf);
+    virtual bool point(uint8_t *tx_buf);
     virtual int available();
     
     virtual bool special_supported_00_command(unsigned char comnd);
 
 private:
     string hostName;
+    string sessionKey; // host:port, what pooled control connections are shared by
     fnTcpClient control;
     fnTcpClient data;
     string controlResponse;
     long dataSize;
     unsigned short dataPort;
+    unsigned short primedPort = 0; // Passive port asked for before we needed it
     unsigned char aux1;
 
+    string filePath; // File being read, so we can restart it somewhere else
+    uint32_t position = 0;
+    bool transferActive = false;
+    bool transferDone = false; // The server has said the transfer is finished
+
+    string listLine; // LIST line still coming in
+    string listOutput; // Parsed entries waiting to be read
+
     bool ftpLogin(EdUrlParser *urlParser);
-    string ftpResult();
+    bool ftpConnect(EdUrlParser *urlParser);
+    bool ftpChangeDir(EdUrlParser *urlParser);
+    bool ftpPassive();
+    bool ftpTransfer(const string &command);
+    bool ftpWaitForData();
+    bool ftpCheckDone();
+    bool ftpEndTransfer();
+    string ftpResult(unsigned long timeout = FTP_REPLY_TIMEOUT);
     unsigned short parsePort(string response);
+
+    void listPump();
+    void listEntry(string &line);
 };
 
+// QUITs pooled control connections that have been idle longer than FTP_SESSION_IDLE_TIMEOUT.
+// Called from the SIO service loop, the same task that services N: devices.
+void ftp_session_expire();
+
 #endif /* NETWORKPROTOCOLFTP */
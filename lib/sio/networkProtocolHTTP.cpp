@@ -4,23 +4,36 @@
 #include "utils.h"
 #include "../../include/debug.h"
 
+/*
+ Collects entries from a PROPFIND response as expat hands it to us. The caller takes the
+ entries after each piece of the response is parsed and clears them, so only the entries
+ from one piece are held at a time.
+*/
 class DAVHandler
 {
 public:
     vector<DAVEntry> entries;
     DAVEntry currentEntry;
-    bool insideResponse;
-    bool insideDisplayName;
-    bool insideGetContentLength;
+    string contentLength;
+    bool insideResponse = false;
+    bool insideDisplayName = false;
+    bool insideGetContentLength = false;
 
     void Start(const XML_Char *el, const XML_Char **attr)
     {
         if (strcmp(el, "D:response") == 0)
+        {
             insideResponse = true;
+            currentEntry = DAVEntry();
+            currentEntry.filesize = 0;
+        }
         else if (strcmp(el, "D:displayname") == 0)
             insideDisplayName = true;
         else if (strcmp(el, "D:getcontentlength") == 0)
+        {
             insideGetContentLength = true;
+            contentLength.clear();
+        }
     }
     void End(const XML_Char *el)
     {
@@ -32,51 +45,24 @@ public:
         }
         else if (strcmp(el, "D:displayname") == 0)
             insideDisplayName = false;
-        else if (strcmp(el, "D:getcontentlength"))
+        else if (strcmp(el, "D:getcontentlength") == 0)
+        {
             insideGetContentLength = false;
+            stringstream ss(contentLength);
+            ss >> currentEntry.filesize;
+        }
     }
 
+    // Text may arrive in several pieces, especially when it straddles two reads
     void Char(const XML_Char *s, int len)
     {
         if (insideResponse == true)
         {
             if (insideDisplayName == true)
-            {
-                currentEntry.filename = string(s, len);
-            }
+                currentEntry.filename.append(s, len);
             else if (insideGetContentLength == true)
-            {
-                stringstream ss(string(s, len));
-                ss >> currentEntry.filesize;
-            }
-        }
-    }
-
-    string ToString()
-    {
-        string output;
-        for (vector<DAVEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
-        {
-            output += util_entry(util_crunch(it->filename), it->filesize) + "\x9b";
-        }
-        output += "999+FREE SECTORS\x9b";
-        return output;
-    }
-
-    string ToLongString()
-    {
-        string output;
-        for (vector<DAVEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
-        {
-            output += util_long_entry(it->filename, it->filesize);
+                contentLength.append(s, len);
         }
-        output += "999+FREE SECTORS\x9b";
-        return output;
-    }
-
-    vector<DAVEntry> ToEntries()
-    {
-        return entries;
     }
 };
 
@@ -112,45 +98,136 @@ networkProtocolHTTP::~networkProtocolHTTP()
     for (int i = 0; i < headerCollectionIndex; i++)
         free(headerCollection[i]);
 
+    davEnd();
+
     // client.end();
     client.close();
 }
 
-void networkProtocolHTTP::parseDir()
+/*
+ Gets ready to parse the PROPFIND response the client has waiting.
+ Returns TRUE if an error condition occurred.
+*/
+bool networkProtocolHTTP::davBegin()
+{
+    davEnd();
+
+    davBuf = (uint8_t *)heap_caps_malloc(DAV_READ_CHUNK, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (davBuf == nullptr)
+        return true;
+
+    davHandler = new DAVHandler();
+    davParser = XML_ParserCreate(NULL);
+
+    XML_SetUserData(davParser, davHandler);
+    XML_SetElementHandler(davParser, Start<DAVHandler>, End<DAVHandler>);
+    XML_SetCharacterDataHandler(davParser, Char<DAVHandler>);
+
+    return false;
+}
+
+/*
+ Reads and parses the next piece of the PROPFIND response, leaving whatever entries it
+ finished in davHandler->entries. Returns false once there's nothing more to parse.
+*/
+bool networkProtocolHTTP::davParseMore()
+{
+    if (davParser == nullptr)
+        return false;
+
+    int len = client.read(davBuf, DAV_READ_CHUNK);
+    if (len < 0)
+        len = 0;
+
+    // A short read means we've got the rest of the response
+    int done = len < DAV_READ_CHUNK;
+    XML_Status status = XML_Parse(davParser, (const char *)davBuf, len, done);
+    if (status == XML_STATUS_ERROR)
+    {
+        Debug_printf("DAV response XML Parse Error! msg: %s line: %lu\n", XML_ErrorString(XML_GetErrorCode(davParser)), XML_GetCurrentLineNumber(davParser));
+        return false;
+    }
+
+    if (done)
+        Debug_printf("DAV Response Parsed.\n");
+
+    return done == 0;
+}
+
+void networkProtocolHTTP::davEnd()
 {
-    DAVHandler handler;
-    XML_Parser parser = XML_ParserCreate(NULL);
-    uint8_t *buf;
+    if (davParser != nullptr)
+        XML_ParserFree(davParser);
+    davParser = nullptr;
 
-    buf = (uint8_t *)heap_caps_malloc(16384, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (davHandler != nullptr)
+        delete davHandler;
+    davHandler = nullptr;
 
-    XML_SetUserData(parser, &handler);
-    XML_SetElementHandler(parser, Start<DAVHandler>, End<DAVHandler>);
-    XML_SetCharacterDataHandler(parser, Char<DAVHandler>);
+    if (davBuf != nullptr)
+        free(davBuf);
+    davBuf = nullptr;
+}
 
-    while (int len = client.read(buf, client.available()))
+/*
+ Tops up dirString from the PROPFIND response until it holds at least want bytes
+ of the listing or the listing is complete.
+*/
+void networkProtocolHTTP::dirFill(size_t want)
+{
+    while (dirString.size() < want && davParser != nullptr)
     {
-        int done = len < 16384;
-        XML_Status status = XML_Parse(parser, (const char *)buf, len, done);
-        if (status == XML_STATUS_ERROR)
+        bool more = davParseMore();
+
+        for (vector<DAVEntry>::iterator it = davHandler->entries.begin(); it != davHandler->entries.end(); ++it)
         {
-            Debug_printf("DAV response XML Parse Error! msg: %s line: %lu\n", XML_ErrorString(XML_GetErrorCode(parser)), XML_GetCurrentLineNumber(parser));
-            XML_ParserFree(parser);
-            free(buf);
-            return;
+            if (aux2 == 128)
+                dirString += util_long_entry(it->filename, it->filesize);
+            else
+                dirString += util_entry(util_crunch(it->filename), it->filesize) + "\x9b";
+        }
+        davHandler->entries.clear();
+
+        if (more == false)
+        {
+            dirString += "999+FREE SECTORS\x9b";
+            davEnd();
         }
     }
-    Debug_printf("DAV Response Parsed.\n");
+}
+
+/*
+ Looks through the PROPFIND response for an entry that crunches to the same name as filename,
+ stopping as soon as we find one. Returns true and sets resolved to its real name if we did.
+*/
+bool networkProtocolHTTP::davResolve(string filename, string &resolved)
+{
+    bool found = false;
+    bool more = true;
+
+    if (davBegin())
+        return false;
 
-    dirEntries = handler.ToEntries();
+    filename = util_crunch(filename);
 
-    if (aux2 == 128)
-        dirString = handler.ToLongString();
-    else
-        dirString = handler.ToString();
-    Debug_printf("DAV Response serialized.\n");
-    XML_ParserFree(parser);
-    free(buf);
+    while (more && !found)
+    {
+        more = davParseMore();
+
+        for (vector<DAVEntry>::iterator it = davHandler->entries.begin(); it != davHandler->entries.end(); ++it)
+        {
+            if (util_crunch(it->filename) == filename)
+            {
+                resolved = it->filename;
+                found = true;
+                break;
+            }
+        }
+        davHandler->entries.clear();
+    }
+
+    davEnd();
+    return found;
 }
 
 bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
@@ -167,8 +244,9 @@ bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
     {
     case DIR:
         resultCode = client.PROPFIND(fnHttpClient::webdav_depth::DEPTH_1, "<?xml version=\"1.0\"?>\r\n<D:propfind xmlns:D=\"DAV:\">\r\n<D:prop>\r\n<D:displayname />\r\n<D:getcontentlength /></D:prop>\r\n</D:propfind>\r\n");
-        if (resultCode == 207)
-            parseDir();
+        dirString.clear();
+        if (resultCode == 207 && davBegin() == false)
+            dirFill(DIR_BUFFER_LOW);
         ret = true;
         break;
     case GET:
@@ -185,20 +263,14 @@ bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
                 return false; // error
 
             resultCode = client.PROPFIND(fnHttpClient::webdav_depth::DEPTH_1, "<?xml version=\"1.0\"?>\r\n<D:propfind xmlns:D=\"DAV:\">\r\n<D:prop>\r\n<D:displayname />\r\n<D:getcontentlength /></D:prop>\r\n</D:propfind>\r\n");
-            if (resultCode == 207)
+            string resolved;
+            if (resultCode == 207 && davResolve(filename, resolved))
             {
-                parseDir();
-                for (vector<DAVEntry>::iterator it = dirEntries.begin(); it != dirEntries.end(); ++it)
-                {
-                    if (util_crunch(it->filename) == util_crunch(filename))
-                    {
-                        client.close();
-                        if (client.begin(baseurl + "/" + it->filename) == false)
-                            return false; // Error
-
-                        resultCode = client.GET();
-                    }
-                }
+                client.close();
+                if (client.begin(baseurl + "/" + resolved) == false)
+                    return false; // Error
+
+                resultCode = client.GET();
             }
         }
 
@@ -305,23 +377,16 @@ bool networkProtocolHTTP::close(enable_interrupt_t enable_interrupt)
             resultCode = client.PROPFIND(fnHttpClient::webdav_depth::DEPTH_1, "<?xml version=\"1.0\"?>\r\n<D:propfind xmlns:D=\"DAV:\">\r\n<D:prop>\r\n<D:displayname />\r\n<D:getcontentlength /></D:prop>\r\n</D:propfind>\r\n");
             if (resultCode == 207)
             {
-                bool resolved = false;
-                
-                parseDir();
-                
-                for (vector<DAVEntry>::iterator it = dirEntries.begin(); it != dirEntries.end(); ++it)
+                string resolved;
+
+                if (davResolve(filename, resolved))
                 {
-                    if (util_crunch(it->filename) == util_crunch(filename))
-                    {
-                        client.close();
-
-                        if (client.begin(baseurl + it->filename) == false)
-                            return false; // Error
-                        resolved = true;
-                    }
-                }
+                    client.close();
 
-                if (resolved==false)
+                    if (client.begin(baseurl + resolved) == false)
+                        return false; // Error
+                }
+                else
                 {
                     client.close();
                     client.begin(openedUrl); // nothing resolved, open with original URL.
@@ -341,6 +406,9 @@ bool networkProtocolHTTP::close(enable_interrupt_t enable_interrupt)
         free(putBuf);
     }
 
+    davEnd();
+    dirString.clear();
+
     //client.end();
     client.close();
     
@@ -363,9 +431,11 @@ bool networkProtocolHTTP::read(uint8_t *rx_buf, unsigned short len)
     case DATA:
         if (openMode == DIR)
         {
+            dirFill(len);
             string fragment = dirString.substr(0, len);
             memcpy(rx_buf, fragment.data(), fragment.size());
             dirString.erase(0, len);
+            dirFill(DIR_BUFFER_LOW);
             return false;
         }
         else
@@ -508,6 +578,8 @@ bool networkProtocolHTTP::status(uint8_t *status_buf)
                 if (!startConnection(status_buf, 4))
                     return true;
 
+            dirFill(DIR_BUFFER_LOW);
+
             status_buf[0] = dirString.size() & 0xFF;
             status_buf[1] = dirString.size() >> 8;
             status_buf[2] = (dirString.size() > 0 ? 1 : 0);
@@ -8,6 +8,11 @@
 #include "EdUrlParser.h"
 #include "sio.h"
 
+#include <expat.h>
+
+#define DAV_READ_CHUNK 1024 // PROPFIND response bytes we read and parse at a time
+#define DIR_BUFFER_LOW 512  // Keep at least this much of a directory listing ready for the Atari
+
 class DAVEntry
 {
 public:
@@ -15,6 +20,8 @@ public:
     size_t filesize;
 };
 
+class DAVHandler;
+
 class networkProtocolHTTP : public networkProtocol
 {
 public:
@@ -43,7 +50,11 @@ public:
 
 private:
     virtual bool startConnection(uint8_t *buf, unsigned short len);
-    void parseDir();
+    bool davBegin();
+    bool davParseMore();
+    void davEnd();
+    bool davResolve(string filename, string &resolved);
+    void dirFill(size_t want);
 
     //HTTPClient client;
     fnHttpClient client;
@@ -85,8 +96,10 @@ private:
     size_t comma_pos;
     unsigned char aux1;
     unsigned char aux2;
-    string dirString;
-    vector<DAVEntry> dirEntries;
+    string dirString; // The part of the directory listing that's ready for the Atari
+    XML_Parser davParser = nullptr;
+    DAVHandler *davHandler = nullptr;
+    uint8_t *davBuf = nullptr;
     string postData;
 };
 
@@ -1,5 +1,7 @@
 #include <string.h>
+#include <lwip/sockets.h>
 #include "networkProtocolTCP.h"
+#include "../hardware/fnSystem.h"
 
 networkProtocolTCP::networkProtocolTCP()
 {
@@ -16,6 +18,9 @@ networkProtocolTCP::~networkProtocolTCP()
         if (client.connected())
             client.stop();
 
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+            server_drop(i);
+
         server->stop();
         delete server;
         server = nullptr;
@@ -38,7 +43,7 @@ bool networkProtocolTCP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
 #ifdef DEBUG
         Debug_printf("Creating server object on port %s\n", urlParser->port.c_str());
 #endif
-        server = new fnTcpServer(atoi(urlParser->port.c_str()));
+        server = new fnTcpServer(atoi(urlParser->port.c_str()), TCP_SERVER_MAX_CLIENTS);
         server->begin(atoi(urlParser->port.c_str()));
         connectionIsServer = true;
     }
@@ -86,6 +91,9 @@ bool networkProtocolTCP::close(enable_interrupt_t enable_interrupt)
         if (client.connected())
             client.stop();
 
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+            server_drop(i);
+
         server->stop();
     }
     return true;
@@ -95,6 +103,9 @@ bool networkProtocolTCP::read(uint8_t *rx_buf, unsigned short len)
 {
     Debug_printf("TCP read %d bytes\n", len);
 
+    if (server != nullptr)
+        return server_read(rx_buf, len);
+
     if (!client.connected())
     {
         client_error_code = 128;
@@ -107,6 +118,9 @@ bool networkProtocolTCP::write(uint8_t *tx_buf, unsigned short len)
 {
     Debug_printf("TCP write %d bytes\n", len);
 
+    if (server != nullptr)
+        return server_write(tx_buf, len);
+
     if (!client.connected())
     {
         client_error_code = 128;
@@ -119,6 +133,9 @@ bool networkProtocolTCP::status(uint8_t *status_buf)
 {
     unsigned short available_bytes;
 
+    if (server != nullptr)
+        return server_status(status_buf);
+
     memset(status_buf, 0x00, 4);
     if (client.connected())
     {
@@ -145,10 +162,17 @@ bool networkProtocolTCP::status(uint8_t *status_buf)
 
 bool networkProtocolTCP::special_supported_00_command(unsigned char comnd)
 {
-    if (comnd == 'A')
+    switch (comnd)
+    {
+    case 'A': // Accept connection
         return true;
-    else
+    case 'N': // Select connection (aux1)
+        return true;
+    case 'K': // Close current connection
+        return true;
+    default:
         return false;
+    }
 }
 
 bool networkProtocolTCP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t *cmdFrame)
@@ -160,11 +184,21 @@ bool networkProtocolTCP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t
     case 'A':
         ret = special_accept_connection();
         break;
+    case 'N':
+        ret = special_select_connection(cmdFrame->aux1);
+        break;
+    case 'K':
+        ret = special_close_connection();
+        break;
     }
 
     return ret;
 }
 
+/*
+ Hands the Atari the connection that's been waiting longest and makes it the current one.
+ Connections are taken as soon as they arrive (see server_poll()), so this doesn't touch the socket.
+*/
 bool networkProtocolTCP::special_accept_connection()
 {
     if (server == NULL)
@@ -172,28 +206,323 @@ bool networkProtocolTCP::special_accept_connection()
         Debug_printf("accept connection attempted on non-server scoket.");
         return true; // error
     }
-    else
+
+    Debug_printf("accepting connection.");
+    server_poll();
+
+    int oldest = TCP_SERVER_NO_CONNECTION;
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        if (connections[i].in_use == false || connections[i].accepted)
+            continue;
+        if (oldest == TCP_SERVER_NO_CONNECTION || (int32_t)(connections[i].arrival - connections[oldest].arrival) < 0)
+            oldest = i;
+    }
+
+    if (oldest == TCP_SERVER_NO_CONNECTION)
+        return true; // error.
+
+    connections[oldest].accepted = true;
+    current = oldest;
+    statusShowsMap = false;
+    _isConnected = true;
+    Debug_printf("connection #%d is now current\n", oldest);
+    return false; // no error.
+}
+
+// Makes the given connection current, or switches status to the connection map
+bool networkProtocolTCP::special_select_connection(unsigned char index)
+{
+    if (server == NULL)
+        return true;
+
+    if (index == TCP_SERVER_CONNECTION_MAP)
     {
-        Debug_printf("accepting connection.");
-        if (server->hasClient())
+        statusShowsMap = true;
+        return false;
+    }
+
+    if (index >= TCP_SERVER_MAX_CLIENTS || connections[index].in_use == false)
+        return true;
+
+    connections[index].accepted = true;
+    current = index;
+    statusShowsMap = false;
+    return false;
+}
+
+// Hangs up on the current connection, leaving the server listening
+bool networkProtocolTCP::special_close_connection()
+{
+    if (server == NULL || current == TCP_SERVER_NO_CONNECTION)
+        return true;
+
+    server_drop(current);
+    current = TCP_SERVER_NO_CONNECTION;
+    return false;
+}
+
+/*
+ Gives whatever the Atari wrote to a connection up to TCP_SERVER_DRAIN_TIMEOUT ms to reach
+ the socket before we hang up, since each write was reported done as soon as it was buffered.
+*/
+void networkProtocolTCP::server_drain(int index)
+{
+    tcpServerConnection &c = connections[index];
+    int fd = c.client.fd();
+    char buf[256];
+    unsigned long started = fnSystem.millis();
+
+    while (c.closed == false && fd >= 0 && c.tx->empty() == false)
+    {
+        size_t count = c.tx->peek(buf, sizeof(buf));
+        int result = send(fd, buf, count, MSG_DONTWAIT);
+        if (result > 0)
+            c.tx->remove(result);
+        else if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+
+        if (fnSystem.millis() - started > TCP_SERVER_DRAIN_TIMEOUT)
         {
-            client = server->available();
-            _isConnected=true;
+            Debug_printf("TCP server connection #%d closing with %u bytes unsent\n", index, c.tx->available());
+            break;
         }
-        else
+        if (result <= 0)
+            vTaskDelay(1);
+    }
+}
+
+void networkProtocolTCP::server_drop(int index)
+{
+    tcpServerConnection &c = connections[index];
+    if (c.in_use == false)
+        return;
+
+    Debug_printf("TCP server dropping connection #%d\n", index);
+    server_drain(index);
+    c.client.stop();
+    delete c.rx;
+    delete c.tx;
+    c = tcpServerConnection();
+}
+
+/*
+ Services every connection with a single select(): takes new clients, moves whatever's arrived
+ into each connection's RX buffer and sends what we can from each TX buffer. Never blocks.
+ Runs whenever the Atari asks for status (including the interrupt poll), reads or writes.
+*/
+void networkProtocolTCP::server_poll()
+{
+    if (server == nullptr || !*server)
+        return;
+
+    fd_set readfds;
+    fd_set writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int maxfd = -1;
+
+    // Only listen for new clients if we have somewhere to put them
+    int free_slot = TCP_SERVER_NO_CONNECTION;
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        if (connections[i].in_use == false)
         {
-            return true;    // error.
+            free_slot = i;
+            break;
         }
     }
-    return false; // no error.
+    if (free_slot != TCP_SERVER_NO_CONNECTION)
+    {
+        FD_SET(server->fd(), &readfds);
+        maxfd = server->fd();
+    }
+
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        tcpServerConnection &c = connections[i];
+        if (c.in_use == false || c.closed)
+            continue;
+        int fd = c.client.fd();
+        if (fd < 0)
+            continue;
+        if (c.rx->room() > 0)
+            FD_SET(fd, &readfds);
+        if (c.tx->empty() == false)
+            FD_SET(fd, &writefds);
+        if (fd > maxfd)
+            maxfd = fd;
+    }
+
+    if (maxfd < 0)
+        return;
+
+    struct timeval tv = {0, 0};
+    if (select(maxfd + 1, &readfds, &writefds, nullptr, &tv) <= 0)
+        return;
+
+    if (free_slot != TCP_SERVER_NO_CONNECTION && FD_ISSET(server->fd(), &readfds) && server->hasClient())
+    {
+        tcpServerConnection &c = connections[free_slot];
+        c.client = server->available();
+        if (c.client.connected())
+        {
+            c.rx = new cbuf(TCP_SERVER_RX_BUFFER);
+            c.tx = new cbuf(TCP_SERVER_TX_BUFFER);
+            c.in_use = true;
+            c.arrival = arrivals++;
+            Debug_printf("TCP server connection #%d from %s\n", free_slot, inet_ntoa(c.client.remoteIP()));
+        }
+    }
+
+    char buf[256];
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        tcpServerConnection &c = connections[i];
+        if (c.in_use == false || c.closed)
+            continue;
+        int fd = c.client.fd();
+        if (fd < 0)
+            continue;
+
+        if (FD_ISSET(fd, &readfds))
+        {
+            size_t want = c.rx->room() < sizeof(buf) ? c.rx->room() : sizeof(buf);
+            int result = recv(fd, buf, want, MSG_DONTWAIT);
+            if (result > 0)
+                c.rx->write(buf, result);
+            else if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                Debug_printf("TCP server connection #%d closed by peer\n", i);
+                c.closed = true;
+                c.client.stop();
+                continue;
+            }
+        }
+
+        if (FD_ISSET(fd, &writefds))
+        {
+            size_t count = c.tx->peek(buf, sizeof(buf));
+            int result = send(fd, buf, count, MSG_DONTWAIT);
+            if (result > 0)
+                c.tx->remove(result);
+            else if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                Debug_printf("TCP server connection #%d write failed, errno %d\n", i, errno);
+                c.closed = true;
+                c.client.stop();
+            }
+        }
+    }
+
+    // Let go of hung up connections once there's nothing left to read, unless the Atari's looking at it
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+        if (connections[i].in_use && connections[i].closed && connections[i].rx->empty() && i != current)
+            server_drop(i);
+}
+
+bool networkProtocolTCP::server_read(uint8_t *rx_buf, unsigned short len)
+{
+    server_poll();
+
+    if (current == TCP_SERVER_NO_CONNECTION)
+    {
+        client_error_code = 128;
+        return true;
+    }
+
+    return connections[current].rx->read((char *)rx_buf, len) != len;
+}
+
+bool networkProtocolTCP::server_write(uint8_t *tx_buf, unsigned short len)
+{
+    if (current == TCP_SERVER_NO_CONNECTION || connections[current].closed)
+    {
+        client_error_code = 128;
+        return true;
+    }
+
+    tcpServerConnection &c = connections[current];
+    unsigned short written = 0;
+    unsigned long started = fnSystem.millis();
+    while (true)
+    {
+        written += c.tx->write((const char *)tx_buf + written, len - written);
+        server_poll();
+        if (written == len || c.closed)
+            break;
+
+        // Only this connection waits for room; the others keep being serviced
+        if (fnSystem.millis() - started > TCP_SERVER_WRITE_TIMEOUT)
+            break;
+        vTaskDelay(1);
+    }
+
+    return written != len;
+}
+
+/*
+ Normally describes the current connection. With no current connection, [2] says whether
+ any client is waiting to be accepted. After 'N' with aux1 = TCP_SERVER_CONNECTION_MAP it's a
+ bitmap of connections with data waiting, a bitmap of live connections, a bitmap of
+ connections not yet accepted and the current connection number.
+*/
+bool networkProtocolTCP::server_status(uint8_t *status_buf)
+{
+    server_poll();
+    memset(status_buf, 0x00, 4);
+
+    if (statusShowsMap)
+    {
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+        {
+            tcpServerConnection &c = connections[i];
+            if (c.in_use == false)
+                continue;
+            if (c.rx->empty() == false)
+                status_buf[0] |= 1 << i;
+            if (c.closed == false)
+                status_buf[1] |= 1 << i;
+            if (c.accepted == false)
+                status_buf[2] |= 1 << i;
+        }
+        status_buf[3] = current;
+        return false;
+    }
+
+    if (current == TCP_SERVER_NO_CONNECTION)
+    {
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+            if (connections[i].in_use && connections[i].accepted == false)
+                status_buf[2] = 1;
+        status_buf[3] = (_isConnected == true ? 136 : 1);
+        return false;
+    }
+
+    tcpServerConnection &c = connections[current];
+    unsigned short available_bytes = c.rx->available();
+    status_buf[0] = available_bytes & 0xFF;
+    status_buf[1] = available_bytes >> 8;
+    status_buf[2] = c.closed ? 0 : 1;
+    status_buf[3] = c.closed ? 136 : 1;
+    return false;
 }
 
 bool networkProtocolTCP::isConnected()
 {
+    if (server != nullptr)
+        return current != TCP_SERVER_NO_CONNECTION && connections[current].closed == false;
+
     return client.connected();
 }
 
 int networkProtocolTCP::available()
 {
+    if (server != nullptr)
+    {
+        server_poll();
+        return current == TCP_SERVER_NO_CONNECTION ? 0 : connections[current].rx->available();
+    }
+
     return client.available();
-}
\ No newline at end of file
+}
@@ -4,10 +4,32 @@
 #include "../tcpip/fnTcpClient.h"
 #include "../tcpip/fnTcpServer.h"
 
+#include "../utils/cbuf.h"
+
 #include "sio.h"
 #include "EdUrlParser.h"
 #include "networkProtocol.h"
 
+#define TCP_SERVER_MAX_CLIENTS 4
+#define TCP_SERVER_RX_BUFFER 2048 // Per connection, filled as data arrives whether or not the Atari is reading it
+#define TCP_SERVER_TX_BUFFER 1024 // Per connection, drained as the socket will take it
+#define TCP_SERVER_WRITE_TIMEOUT 2000 // ms a write waits for room in a connection's TX buffer
+#define TCP_SERVER_DRAIN_TIMEOUT 1000 // ms a connection being closed waits for its TX buffer to reach the socket
+#define TCP_SERVER_NO_CONNECTION -1
+#define TCP_SERVER_CONNECTION_MAP 0xFF // 'N' with this in aux1 makes status report every connection
+
+// One client connected to our server
+struct tcpServerConnection
+{
+    fnTcpClient client;
+    cbuf *rx = nullptr;
+    cbuf *tx = nullptr;
+    uint32_t arrival = 0; // Order connections came in, so 'A' takes the one waiting longest
+    bool in_use = false;
+    bool accepted = false; // The Atari has been handed this one with 'A'
+    bool closed = false; // The other end hung up; whatever's left in rx can still be read
+};
+
 class networkProtocolTCP : public networkProtocol
 {
 public:
@@ -31,6 +53,21 @@ private:
 
     bool _isConnected;
     bool special_accept_connection();
+
+    // Server mode: several clients at once, each with its own buffers
+    tcpServerConnection connections[TCP_SERVER_MAX_CLIENTS];
+    int current = TCP_SERVER_NO_CONNECTION; // Connection read/write/status work on
+    bool statusShowsMap = false;
+    uint32_t arrivals = 0; // Connections taken so far
+
+    void server_poll();
+    void server_drain(int index);
+    void server_drop(int index);
+    bool server_read(uint8_t *rx_buf, unsigned short len);
+    bool server_write(uint8_t *tx_buf, unsigned short len);
+    bool server_status(uint8_t *status_buf);
+    bool special_select_connection(unsigned char index);
+    bool special_close_connection();
 };
 
 #endif // NETWORKPROTOCOLTCP
\ No newline at end of file
@@ -253,27 +253,13 @@ bool networkProtocolTNFS::special_supported_80_command(unsigned char comnd)
 
 bool networkProtocolTNFS::block_read(uint8_t *rx_buf, unsigned short len)
 {
-    unsigned short total_len = len;
-    unsigned short block_len = TNFS_MAX_READWRITE_PAYLOAD;
     uint16_t actual_len;
 
-    while (total_len > 0)
+    // tnfs_read splits the request up and keeps several READs in flight for us
+    int result = tnfs_read(&mountInfo, fileHandle, rx_buf, len, &actual_len);
+    if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
     {
-        if (total_len > TNFS_MAX_READWRITE_PAYLOAD)
-            block_len = TNFS_MAX_READWRITE_PAYLOAD;
-        else
-            block_len = total_len;
-
-        int result = tnfs_read(&mountInfo, fileHandle, rx_buf, block_len, &actual_len);
-        if (result != 0 && result != TNFS_RESULT_END_OF_FILE)
-        {
-            return true; // error.
-        }
-        else
-        {
-            rx_buf += block_len;
-            total_len -= block_len;
-        }
+        return true; // error.
     }
     return false; // no error
 }
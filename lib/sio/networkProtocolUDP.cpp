@@ -1,5 +1,6 @@
 #include "networkProtocolUDP.h"
 #include "../../include/debug.h"
+#include "../tcpip/fnDNS.h"
 
 networkProtocolUDP::networkProtocolUDP()
 {
@@ -32,7 +33,14 @@ bool networkProtocolUDP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
 #endif
     }
 
-    return udp.begin(atoi(urlParser->port.c_str()));
+    if (!udp.begin(atoi(urlParser->port.c_str())))
+        return false;
+
+    // Without the queue we'd only see one datagram per SIO service loop
+    if (!udp.startQueue())
+        Debug_println("UDP receive queue unavailable, reading socket directly");
+
+    return true;
 }
 
 bool networkProtocolUDP::close(enable_interrupt_t enable_interrupt)
@@ -47,17 +55,52 @@ bool networkProtocolUDP::read(uint8_t *rx_buf, unsigned short len)
     Debug_printf("networkProtocolUDP::read %d bytes\n", len);
 #endif
 
+    if (len > sizeof(saved_rx_buffer))
+        len = sizeof(saved_rx_buffer);
+
     memcpy(rx_buf, saved_rx_buffer, len);
     memset(saved_rx_buffer, 0, len);
     saved_rx_buffer_len = 0;
     return false;
 }
 
+/*
+ Sends each datagram in a batch, framed the same way as received ones.
+ Returns TRUE if an error condition occurred.
+*/
+bool networkProtocolUDP::write_batch(uint8_t *tx_buf, unsigned short len)
+{
+    in_addr_t addr = get_ip4_addr_by_name(dest);
+    if (addr == IPADDR_NONE)
+        return true;
+
+    unsigned short pos = 0;
+    while (pos + UDP_BATCH_HEADER <= len)
+    {
+        unsigned short dlen = tx_buf[pos] | (tx_buf[pos + 1] << 8);
+        pos += UDP_BATCH_HEADER;
+
+        // A zero length ends the batch early, so the Atari can send a fixed-size buffer
+        if (dlen == 0)
+            return false;
+        if (pos + dlen > len)
+            return true;
+
+        if (!udp.sendPacket(addr, port, tx_buf + pos, dlen))
+            return true;
+        pos += dlen;
+    }
+    return false;
+}
+
 bool networkProtocolUDP::write(uint8_t *tx_buf, unsigned short len)
 {
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::write %d bytes to dest: %s port %d\n", len, dest, port);
 #endif
+    if (batchMode)
+        return write_batch(tx_buf, len);
+
     udp.beginPacket(dest, port);
     int l = udp.write(tx_buf, len);
     udp.endPacket();
@@ -73,21 +116,68 @@ bool networkProtocolUDP::write(uint8_t *tx_buf, unsigned short len)
         return false;
 }
 
-bool networkProtocolUDP::status(uint8_t *status_buf)
+/*
+ Moves received datagrams into the buffer the Atari reads from, but only once it's
+ taken what was there before. In batch mode, as many whole datagrams as fit go in,
+ each with a UDP_BATCH_HEADER length in front.
+*/
+void networkProtocolUDP::fill_rx_buffer()
 {
-    unsigned short len = udp.parsePacket();
+    if (saved_rx_buffer_len > 0)
+        return;
 
-    if (len > 0)
+    // No queue, so fall back to reading the socket ourselves
+    if (udp.queued() == 0)
     {
+        unsigned short len = udp.parsePacket();
+        if (len == 0)
+            return;
+
         // Set destination automatically to remote address.
-        //strcpy(dest, udp.remoteIP().toString().c_str());
         in_addr_t addr = udp.remoteIP();
         strcpy(dest, inet_ntoa(addr));
-        //port = udp.remotePort();
 
-        saved_rx_buffer_len = len;
-        udp.read(saved_rx_buffer, len);
+        if (batchMode)
+        {
+            saved_rx_buffer[0] = len & 0xFF;
+            saved_rx_buffer[1] = len >> 8;
+            saved_rx_buffer_len = UDP_BATCH_HEADER + udp.read(saved_rx_buffer + UDP_BATCH_HEADER, sizeof(saved_rx_buffer) - UDP_BATCH_HEADER);
+        }
+        else
+            saved_rx_buffer_len = udp.read(saved_rx_buffer, sizeof(saved_rx_buffer));
+        udp.flush();
+        return;
+    }
+
+    fnUDPDatagram *d;
+    while ((d = udp.front()) != nullptr)
+    {
+        unsigned short header = batchMode ? UDP_BATCH_HEADER : 0;
+        if (saved_rx_buffer_len > 0 && saved_rx_buffer_len + header + d->len > sizeof(saved_rx_buffer))
+            break;
+
+        if (batchMode)
+        {
+            saved_rx_buffer[saved_rx_buffer_len] = d->len & 0xFF;
+            saved_rx_buffer[saved_rx_buffer_len + 1] = d->len >> 8;
+        }
+        memcpy(saved_rx_buffer + saved_rx_buffer_len + header, d->data, d->len);
+        saved_rx_buffer_len += header + d->len;
+
+        // Set destination automatically to remote address.
+        in_addr_t addr = d->ip;
+        strcpy(dest, inet_ntoa(addr));
+
+        udp.pop();
+
+        if (!batchMode)
+            break;
     }
+}
+
+bool networkProtocolUDP::status(uint8_t *status_buf)
+{
+    fill_rx_buffer();
 
     status_buf[0] = saved_rx_buffer_len & 0xFF;
     status_buf[1] = saved_rx_buffer_len >> 8;
@@ -97,6 +187,14 @@ bool networkProtocolUDP::status(uint8_t *status_buf)
     return false;
 }
 
+bool networkProtocolUDP::special_supported_00_command(unsigned char comnd)
+{
+    if (comnd == 'B') // Set batch mode
+        return true;
+    else
+        return false;
+}
+
 bool networkProtocolUDP::special_supported_80_command(unsigned char comnd)
 {
     if (comnd == 'D') // Set DEST address
@@ -134,6 +232,24 @@ bool networkProtocolUDP::special_set_destination(uint8_t *sp_buf, unsigned short
     return false; // no error.
 }
 
+/*
+ AUX1 = 1 has reads return every queued datagram that fits, each prefixed with its
+ length, and writes take the same framing to send several at once. AUX1 = 0 goes back
+ to one datagram per read or write.
+*/
+bool networkProtocolUDP::special_set_batch_mode(cmdFrame_t *cmdFrame)
+{
+    // Don't change framing in the middle of what the Atari's already been told about
+    if (saved_rx_buffer_len > 0 && batchMode != (cmdFrame->aux1 != 0))
+        return true;
+
+    batchMode = cmdFrame->aux1 != 0;
+#ifdef DEBUG
+    Debug_printf("UDP batch mode %s\n", batchMode ? "on" : "off");
+#endif
+    return false;
+}
+
 bool networkProtocolUDP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t *cmdFrame)
 {
     bool err = false;
@@ -143,11 +259,15 @@ bool networkProtocolUDP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t
     case 'D':
         err = special_set_destination(sp_buf, len);
         break;
+    case 'B':
+        err = special_set_batch_mode(cmdFrame);
+        break;
     }
     return err;
 }
 
 int networkProtocolUDP::available()
 {
+    fill_rx_buffer();
     return saved_rx_buffer_len;
 }
\ No newline at end of file
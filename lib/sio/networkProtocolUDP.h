@@ -6,6 +6,9 @@
 #include "networkProtocol.h"
 #include "EdUrlParser.h"
 
+#define UDP_RX_BUFFER_SIZE 2048 // Room for the largest datagram, or several framed ones in batch mode
+#define UDP_BATCH_HEADER 2 // Little-endian length in front of each datagram in batch mode
+
 class networkProtocolUDP : public networkProtocol 
 {
 public:
@@ -20,6 +23,7 @@ public:
     virtual bool special(uint8_t* sp_buf, unsigned short len, cmdFrame_t* cmdFrame);
     virtual int available();
 
+    virtual bool special_supported_00_command(unsigned char comnd);
     virtual bool special_supported_80_command(unsigned char comnd);
 
 private:
@@ -27,10 +31,14 @@ private:
     fnUDP udp;
     char dest[64];
     unsigned short port;
-    char saved_rx_buffer[512];
+    uint8_t saved_rx_buffer[UDP_RX_BUFFER_SIZE];
     unsigned short saved_rx_buffer_len=0;
+    bool batchMode = false;
 
+    void fill_rx_buffer();
+    bool write_batch(uint8_t* tx_buf, unsigned short len);
     bool special_set_destination(uint8_t* sp_buf, unsigned short len);
+    bool special_set_batch_mode(cmdFrame_t* cmdFrame);
 };
 
 #endif // NETWORKPROTOCOLUDP
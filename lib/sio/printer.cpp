@@ -1,3 +1,5 @@
+#include <esp_heap_caps.h>
+
 #include "../../include/atascii.h"
 #include "printer.h"
 
@@ -23,7 +25,134 @@
 
 sioPrinter::~sioPrinter()
 {
+    _stop_spool_task();
     delete _pptr;
+    free(_spool);
+    if (_pptr_mutex != nullptr)
+        vSemaphoreDelete(_pptr_mutex);
+}
+
+/*
+ Renders spooled lines in the background so the Atari doesn't wait on the emulator
+ or storage. The output file stays open while lines keep coming and is flushed and
+ closed once they've stopped for PRINTER_SPOOL_IDLE_FLUSH ms.
+*/
+void sioPrinter::_spool_task_loop(void *param)
+{
+    sioPrinter *printer = (sioPrinter *)param;
+    bool dirty = false;
+    uint32_t rendered = 0;
+
+    while (printer->_stop_spool == false)
+    {
+        if (printer->_spool_head == printer->_spool_tail)
+        {
+            if (dirty == false)
+            {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PRINTER_SPOOL_IDLE_FLUSH)) == 0 &&
+                printer->_spool_head == printer->_spool_tail)
+            {
+                xSemaphoreTake(printer->_pptr_mutex, portMAX_DELAY);
+                printer->_pptr->flushOutput();
+                xSemaphoreGive(printer->_pptr_mutex);
+                dirty = false;
+
+                Debug_printf("Printer spool idle: %u lines rendered, max depth %u, worst SIO write %u us\n",
+                             rendered, printer->_spool_max_depth, printer->_max_write_us);
+                rendered = 0;
+                printer->_spool_max_depth = 0;
+                printer->_max_write_us = 0;
+            }
+            continue;
+        }
+
+        // The tail only moves under the lock, so _drain_spool() can safely throw lines away
+        xSemaphoreTake(printer->_pptr_mutex, portMAX_DELAY);
+        if (printer->_spool_head == printer->_spool_tail)
+        {
+            xSemaphoreGive(printer->_pptr_mutex);
+            continue;
+        }
+        printerSpoolLine &line = printer->_spool[printer->_spool_tail];
+        memcpy(printer->_pptr->provideBuffer(), line.data, line.linelen);
+        if (printer->_pptr->process(line.linelen, line.aux1, line.aux2) == false)
+            printer->_spool_error = true;
+        printer->_spool_tail = (printer->_spool_tail + 1) % PRINTER_SPOOL_LINES;
+        xSemaphoreGive(printer->_pptr_mutex);
+
+        // Keep the web server from grabbing the output while we're still working on it
+        printer->_last_ms = fnSystem.millis();
+        dirty = true;
+        rendered++;
+    }
+
+    printer->_spool_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+// Returns true if the spool and its task are ready
+bool sioPrinter::_start_spool()
+{
+    if (_spool_task != nullptr)
+        return true;
+
+    if (_spool == nullptr)
+    {
+        _spool = (printerSpoolLine *)heap_caps_malloc(PRINTER_SPOOL_LINES * sizeof(printerSpoolLine), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (_spool == nullptr)
+            return false;
+    }
+    _spool_head = _spool_tail = 0;
+
+    if (xTaskCreate(_spool_task_loop, "printspool", PRINTER_SPOOL_TASK_STACKSIZE, this, PRINTER_SPOOL_TASK_PRIORITY, &_spool_task) != pdPASS)
+    {
+        Debug_println("Printer couldn't start spool task - rendering directly");
+        _spool_task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/*
+ Waits (up to PRINTER_SPOOL_FULL_WAIT ms) for everything spooled to be rendered.
+ If the emulator can't keep up, whatever's left is thrown away (and reported to the Atari
+ as an error) so it isn't rendered later by a different emulator or after the output's closed.
+ Returns false if lines were thrown away.
+*/
+bool sioPrinter::_drain_spool()
+{
+    unsigned long started = fnSystem.millis();
+    while (_spool_task != nullptr && _spool_head != _spool_tail && fnSystem.millis() - started < PRINTER_SPOOL_FULL_WAIT)
+        vTaskDelay(5 / portTICK_PERIOD_MS);
+
+    if (_spool_task == nullptr || _spool_head == _spool_tail)
+        return true;
+
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+    uint16_t dropped = (_spool_head + PRINTER_SPOOL_LINES - _spool_tail) % PRINTER_SPOOL_LINES;
+    _spool_tail = _spool_head;
+    _spool_error = true;
+    xSemaphoreGive(_pptr_mutex);
+
+    Debug_printf("Printer spool didn't drain - discarded %u lines\n", dropped);
+    return false;
+}
+
+void sioPrinter::_stop_spool_task()
+{
+    if (_spool_task == nullptr)
+        return;
+
+    _drain_spool();
+    _stop_spool = true;
+    xTaskNotifyGive(_spool_task);
+    while (_spool_task != nullptr)
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    _stop_spool = false;
 }
 
 // write for W commands
@@ -62,9 +191,9 @@ void sioPrinter::sio_write(uint8_t aux1, uint8_t aux2)
     }
 
     memset(_buffer, 0, sizeof(_buffer)); // clear _buffer
-    uint8_t ck = sio_to_peripheral(_buffer, linelen);
+    bool bad_frame = sio_to_peripheral(_buffer, linelen);
 
-    if (ck == sio_checksum(_buffer, linelen))
+    if (!bad_frame)
     {
         if (linelen == 29)
         {
@@ -78,15 +207,57 @@ void sioPrinter::sio_write(uint8_t aux1, uint8_t aux2)
             }
             _buffer[linelen] = ATASCII_EOL;
         }
-        // Copy the data to the printer emulator's buffer
-        memcpy(_pptr->provideBuffer(), _buffer, linelen);
+        // Tell the Atari about a line we couldn't render after we'd already said OK,
+        // but still print this one
+        bool spool_error = _spool_error;
+        _spool_error = false;
 
-        if (_pptr->process(linelen, aux1, aux2))
-            sio_complete();
-        else
+        if (_start_spool() == false)
         {
-            sio_error();
+            // Copy the data to the printer emulator's buffer
+            xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+            memcpy(_pptr->provideBuffer(), _buffer, linelen);
+            bool ok = _pptr->process(linelen, aux1, aux2);
+            _pptr->flushOutput();
+            xSemaphoreGive(_pptr_mutex);
+
+            if (ok && spool_error == false)
+                sio_complete();
+            else
+                sio_error();
+            return;
+        }
+
+        // Hold the Atari off only while the spool is full
+        uint16_t next = (_spool_head + 1) % PRINTER_SPOOL_LINES;
+        unsigned long wait_started = fnSystem.millis();
+        while (next == _spool_tail)
+        {
+            if (fnSystem.millis() - wait_started >= PRINTER_SPOOL_FULL_WAIT)
+            {
+                Debug_println("Printer spool full");
+                sio_error();
+                return;
+            }
+            vTaskDelay(2 / portTICK_PERIOD_MS);
         }
+
+        printerSpoolLine &line = _spool[_spool_head];
+        line.linelen = linelen;
+        line.aux1 = aux1;
+        line.aux2 = aux2;
+        memcpy(line.data, _buffer, linelen);
+        _spool_head = next;
+
+        uint32_t depth = (_spool_head + PRINTER_SPOOL_LINES - _spool_tail) % PRINTER_SPOOL_LINES;
+        if (depth > _spool_max_depth)
+            _spool_max_depth = depth;
+
+        xTaskNotifyGive(_spool_task);
+        if (spool_error)
+            sio_error();
+        else
+            sio_complete();
     }
     else
     {
@@ -130,11 +301,19 @@ void sioPrinter::sio_status()
     status[2] = 5;
     status[3] = 0;
 
-    sio_to_computer(status, sizeof(status), false);
+    // Tell the Atari about a spooled line we couldn't render, if the next write hasn't already
+    bool spool_error = _spool_error;
+    _spool_error = false;
+
+    sio_to_computer(status, sizeof(status), spool_error);
 }
 
 void sioPrinter::set_printer_type(sioPrinter::printer_type printer_type)
 {
+    // Let the current emulator finish what's been spooled for it
+    _drain_spool();
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+
     // Destroy any current printer emu object
     delete _pptr;
 
@@ -202,19 +381,38 @@ void sioPrinter::set_printer_type(sioPrinter::printer_type printer_type)
     }
 
     _pptr->initPrinter(_storage);
+
+    xSemaphoreGive(_pptr_mutex);
 }
 
 // Constructor just sets a default printer type
 sioPrinter::sioPrinter(FileSystem *filesystem, printer_type print_type)
 {
     _storage = filesystem;
+    _pptr_mutex = xSemaphoreCreateMutex();
     set_printer_type(print_type);
 }
 
+/*
+ Lets the spool task finish what it has, then closes the output and reopens it for reading
+ while holding the emulator, so the task can't be writing to the file as it's closed.
+*/
+FILE *sioPrinter::closeOutputAndProvideReadHandle()
+{
+    _drain_spool();
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+    FILE *f = _pptr->closeOutputAndProvideReadHandle();
+    xSemaphoreGive(_pptr_mutex);
+    return f;
+}
+
 void sioPrinter::shutdown()
 {
+    _drain_spool();
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
     if (_pptr != nullptr)
         _pptr->closeOutput();
+    xSemaphoreGive(_pptr_mutex);
 }
 /* Returns a printer type given a string model name
 */
@@ -258,12 +456,18 @@ void sioPrinter::sio_process(uint32_t commanddata, uint8_t checksum)
     {
     case SIO_PRINTERCMD_PUT: // Needed by A822 for graphics mode printing
     case SIO_PRINTERCMD_WRITE:
+    {
+        unsigned long started = fnSystem.micros();
         _lastaux1 = cmdFrame.aux1;
         _lastaux2 = cmdFrame.aux2;
         _last_ms = fnSystem.millis();
         sio_ack();
         sio_write(_lastaux1, _lastaux2);
+        uint32_t took = fnSystem.micros() - started;
+        if (took > _max_write_us)
+            _max_write_us = took;
         break;
+    }
     case SIO_PRINTERCMD_STATUS:
         _last_ms = fnSystem.millis();
         sio_ack();
@@ -3,10 +3,29 @@
 
 #include <string.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
 #include "sio.h"
 #include "../printer-emulator/printer_emulator.h"
 #include "fnFS.h"
 
+#define PRINTER_SPOOL_LINES 256 // Lines from the Atari we'll hold while the emulator catches up
+#define PRINTER_SPOOL_FULL_WAIT 3000 // Longest (ms) we'll hold the Atari waiting for room in a full spool
+#define PRINTER_SPOOL_IDLE_FLUSH 500 // Time (ms) without new lines before the output file is flushed and closed
+#define PRINTER_SPOOL_TASK_STACKSIZE 4096
+#define PRINTER_SPOOL_TASK_PRIORITY 5
+
+// One line from the Atari, exactly as it'll be given to the printer emulator
+struct printerSpoolLine
+{
+    uint8_t linelen;
+    uint8_t aux1;
+    uint8_t aux2;
+    uint8_t data[40];
+};
+
 class sioPrinter : public sioDevice
 {
 protected:
@@ -24,6 +43,22 @@ protected:
     uint8_t _lastaux1;
     uint8_t _lastaux2;
 
+    // Lines waiting to be rendered, filled by the SIO task and emptied by _spool_task
+    printerSpoolLine *_spool = nullptr;
+    volatile uint16_t _spool_head = 0;
+    volatile uint16_t _spool_tail = 0;
+    TaskHandle_t _spool_task = nullptr;
+    SemaphoreHandle_t _pptr_mutex = nullptr; // Held while using _pptr
+    volatile bool _stop_spool = false;
+    volatile bool _spool_error = false; // An emulator failed on a line we'd already acknowledged. Reported by the next write or status.
+    uint32_t _spool_max_depth = 0;
+    uint32_t _max_write_us = 0; // Longest sio_write() has taken since the spool last emptied
+
+    bool _start_spool();
+    void _stop_spool_task();
+    bool _drain_spool();
+    static void _spool_task_loop(void *param);
+
 public:
     // todo: reconcile printer_type with paper_t
     enum printer_type
@@ -58,6 +93,7 @@ public:
     time_t lastPrintTime() { return _last_ms; };
 
     printer_emu *getPrinterPtr() { return _pptr; };
+    FILE *closeOutputAndProvideReadHandle(); // Renders whatever's spooled first
 
 
 private:
@@ -3,7 +3,9 @@
 #include "fuji.h"
 #include "led.h"
 #include "network.h"
+#include "networkProtocolFTP.h"
 #include "fnSystem.h"
+#include "fnWiFi.h"
 #include "fnConfig.h"
 #include "fnDNS.h"
 #include "utils.h"
@@ -30,6 +32,20 @@ uint8_t sio_checksum(uint8_t *buf, unsigned short len)
     return chk;
 }
 
+// Frames are staged here so each goes to (or comes from) the UART driver in one call
+static uint8_t _sio_frame_buffer[SIO_FRAME_BUFFER_SIZE + 2];
+
+// Copies len bytes from src to dest, adding them to the running checksum chk
+static unsigned int _sio_copy_checksum(uint8_t *dest, const uint8_t *src, uint16_t len, unsigned int chk)
+{
+    for (int i = 0; i < len; i++)
+    {
+        dest[i] = src[i];
+        chk = ((chk + src[i]) >> 8) + ((chk + src[i]) & 0xff);
+    }
+    return chk;
+}
+
 /*
    SIO WRITE to ATARI from DEVICE
    buf = buffer to send to Atari
@@ -47,16 +63,59 @@ void sioDevice::sio_to_computer(uint8_t *buf, uint16_t len, bool err)
     Debug_print("\n");
 #endif
 
-    // Write ERROR or COMPLETE status
-    if (err == true)
-        sio_error();
-    else
-        sio_complete();
+    // The ERROR or COMPLETE status, data and checksum are staged together, computing the
+    // checksum as we copy, so the whole frame is handed to the UART driver in one write
+    fnSystem.delay_microseconds(DELAY_T5);
+    Debug_println(err ? "ERROR!" : "COMPLETE!");
 
-    // Write data frame
-    fnUartSIO.write(buf, len);
-    // Write checksum
-    fnUartSIO.write(sio_checksum(buf, len));
+    uint16_t staged = 0;
+    _sio_frame_buffer[staged++] = err ? 'E' : 'C';
+
+    unsigned int chk = 0;
+    uint16_t sent = 0;
+    do
+    {
+        uint16_t count = len - sent;
+        if (count > SIO_FRAME_BUFFER_SIZE + 1 - staged)
+            count = SIO_FRAME_BUFFER_SIZE + 1 - staged;
+
+        chk = _sio_copy_checksum(_sio_frame_buffer + staged, buf + sent, count, chk);
+        staged += count;
+        sent += count;
+
+        if (sent == len)
+            _sio_frame_buffer[staged++] = chk;
+
+        fnUartSIO.write(_sio_frame_buffer, staged);
+        staged = 0;
+    } while (sent < len);
+
+    fnUartSIO.flush();
+}
+
+/*
+   SIO WRITE to ATARI from DEVICE, sending buf where it is
+   buf[-1] and buf[len] are overwritten with the status and checksum bytes
+*/
+void sioDevice::sio_to_computer_inplace(uint8_t *buf, uint16_t len, bool err, int chk)
+{
+    Debug_printf("->SIO write %hu bytes\n", len);
+#ifdef VERBOSE_SIO
+    Debug_printf("SEND <%u> BYTES\n\t", len);
+    for (int i = 0; i < len; i++)
+        Debug_printf("%02x ", buf[i]);
+    Debug_print("\n");
+#endif
+
+    if (chk < 0)
+        chk = sio_checksum(buf, len);
+
+    fnSystem.delay_microseconds(DELAY_T5);
+    Debug_println(err ? "ERROR!" : "COMPLETE!");
+
+    buf[-1] = err ? 'E' : 'C';
+    buf[len] = chk;
+    fnUartSIO.write(buf - 1, len + 2);
 
     fnUartSIO.flush();
 }
@@ -65,26 +124,36 @@ void sioDevice::sio_to_computer(uint8_t *buf, uint16_t len, bool err)
    SIO READ from ATARI by DEVICE
    buf = buffer from atari to esp1541
    len = length
-   Returns checksum
+   Returns TRUE if the frame timed-out or had a bad checksum (and has been NAKed)
 */
-uint8_t sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
+bool sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
 {
     // Retrieve data frame from computer
     Debug_printf("<-SIO read %hu bytes\n", len);
 
-    __BEGIN_IGNORE_UNUSEDVARS
-    size_t l = fnUartSIO.readBytes(buf, len);
-    __END_IGNORE_UNUSEDVARS
-
-    // Wait for checksum
-    while (0 == fnUartSIO.available())
-        fnSystem.yield();
-    uint8_t ck_rcv = fnUartSIO.read();
+    size_t l;
+    int ck_rcv;
+    uint8_t ck_tst;
+    bool timed_out;
 
-    uint8_t ck_tst = sio_checksum(buf, len);
+    // Read the data and checksum together if they fit, computing our checksum as we copy the data out
+    if (len < SIO_FRAME_BUFFER_SIZE)
+    {
+        l = fnUartSIO.readBytes(_sio_frame_buffer, len + 1);
+        ck_tst = _sio_copy_checksum(buf, _sio_frame_buffer, len, 0);
+        timed_out = (int)l <= len; // readBytes() returns -1 on error
+        ck_rcv = timed_out ? 0 : _sio_frame_buffer[len];
+    }
+    else
+    {
+        l = fnUartSIO.readBytes(buf, len);
+        ck_rcv = fnUartSIO.read();
+        ck_tst = sio_checksum(buf, len);
+        timed_out = (int)l < len || ck_rcv < 0;
+    }
 
 #ifdef VERBOSE_SIO
-    Debug_printf("RECV <%u> BYTES, checksum: %hu\n\t", l, ck_rcv);
+    Debug_printf("RECV <%u> BYTES, checksum: %d\n\t", l, ck_rcv);
     for (int i = 0; i < len; i++)
         Debug_printf("%02x ", buf[i]);
     Debug_print("\n");
@@ -92,15 +161,22 @@ uint8_t sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
 
     fnSystem.delay_microseconds(DELAY_T4);
 
+    if (timed_out)
+    {
+        Debug_printf("Timed-out after %d of %hu bytes\n", (int)l, len);
+        sio_nak();
+        return true;
+    }
+
     if (ck_rcv != ck_tst)
     {
+        Debug_printf("Checksum mismatch: got %02x, expected %02x\n", ck_rcv, ck_tst);
         sio_nak();
-        return false;
+        return true;
     }
-    else
-        sio_ack();
 
-    return ck_rcv;
+    sio_ack();
+    return false;
 }
 
 // SIO NAK
@@ -246,10 +322,58 @@ void sioBus::_sio_process_queue()
             if (_fujiDev != nullptr)
                 _fujiDev->debug_tape();
             break;
+        case SIOMSG_DNS_PREFETCH:
+            dns_cache_prefetch();
+            break;
         }
     }
 }
 
+// Wakes up the SIO service task when the CMD line is asserted
+void IRAM_ATTR sioBus::_sio_cmd_isr(void *arg)
+{
+    sioBus *bus = (sioBus *)arg;
+    if (bus->_cmd_wake == nullptr)
+        return;
+
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(bus->_cmd_wake, &woken);
+    if (woken == pdTRUE)
+        portYIELD_FROM_ISR();
+}
+
+// Wakes up the SIO service task from another task (queued messages, network interrupt timer)
+void sioBus::wake()
+{
+    if (_cmd_wake != nullptr)
+        xSemaphoreGive(_cmd_wake);
+}
+
+/*
+ Blocks until the CMD line is asserted or someone calls wake().
+ The cassette motor line still needs checking every SIO_POLL_INTERVAL ms;
+ otherwise we sleep up to SIO_IDLE_INTERVAL ms.
+*/
+void sioBus::_sio_wait_for_command()
+{
+    if (_cmd_wake == nullptr)
+    {
+        fnSystem.yield();
+        return;
+    }
+
+    // A command frame may already have started
+    if (fnSystem.digital_read(PIN_CMD) == DIGI_LOW)
+        return;
+
+    uint32_t wait = SIO_IDLE_INTERVAL;
+
+    if (_fujiDev != nullptr && _fujiDev->cassette()->is_mounted() && _fujiDev->cassette()->has_pulldown())
+        wait = SIO_POLL_INTERVAL;
+
+    xSemaphoreTake(_cmd_wake, pdMS_TO_TICKS(wait));
+}
+
 /*
  Primary SIO serivce loop:
  * If MOTOR line asserted, hand SIO processing over to the TAPE device
@@ -264,6 +388,9 @@ void sioBus::service()
     // modes disrupt normal SIO handling - should probably make a separate task for this)
     _sio_process_queue();
 
+    // Hang up on FTP servers we've kept logged in but haven't used in a while
+    ftp_session_expire();
+
     // Handle MIDIMaze if enabled and do not process SIO commands
     if (_midiDev != nullptr && _midiDev->midimazeActive)
     {
@@ -312,9 +439,10 @@ void sioBus::service()
         _modemDev->sio_handle_modem();
     }
     else
-    // Neither CMD nor active modem, so throw out any stray input data
+    // Neither CMD nor active modem, so throw out any stray input data and sleep until there's something to do
     {
         fnUartSIO.flush_input();
+        _sio_wait_for_command();
     }
 
     // Handle interrupts from network protocols
@@ -352,9 +480,23 @@ void sioBus::setup()
     // CKO PIN
     fnSystem.set_pin_mode(PIN_CKO, gpio_mode_t::GPIO_MODE_INPUT);
 
+    // Wake up the service task when CMD is asserted rather than polling it
+    _cmd_wake = xSemaphoreCreateBinary();
+    gpio_set_intr_type((gpio_num_t)PIN_CMD, GPIO_INTR_NEGEDGE);
+    gpio_install_isr_service(0); // Fails harmlessly if someone already installed it
+    gpio_isr_handler_add((gpio_num_t)PIN_CMD, _sio_cmd_isr, this);
+
     // Create a message queue
     qSioMessages = xQueueCreate(4, sizeof(sio_message_t));
 
+    // WiFi may have come up before we had a queue to ask for the prefetch on
+    if (fnWiFi.connected())
+    {
+        sio_message_t msg;
+        msg.message_id = SIOMSG_DNS_PREFETCH;
+        xQueueSend(qSioMessages, &msg, 0);
+    }
+
     // Set the initial HSIO index
     // First see if Config has read a value
     int i = Config.get_general_hsioindex();
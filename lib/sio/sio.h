@@ -2,6 +2,8 @@
 #define SIO_H
 
 #include <forward_list>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "fnSystem.h"
 
 // Pin configurations
@@ -15,6 +17,11 @@
 #define DELAY_T4 850
 #define DELAY_T5 250
 
+#define SIO_FRAME_BUFFER_SIZE 1024 // Largest piece of a data frame staged for a single UART write/read
+
+#define SIO_POLL_INTERVAL 5 // ms between cassette motor line checks while waiting for a command
+#define SIO_IDLE_INTERVAL 1000 // Longest (ms) service() sleeps waiting for a command or wake()
+
 
 /*
 Examples of values that can be defined in PLATFORMIO.INI
@@ -106,6 +113,12 @@ union cmdFrame_t {
 //helper functions
 uint8_t sio_checksum(uint8_t *buf, unsigned short len);
 
+// Adds one byte to a running SIO checksum, for callers that are already walking the data
+inline unsigned int sio_checksum_add(unsigned int chk, uint8_t b)
+{
+    return ((chk + b) >> 8) + ((chk + b) & 0xff);
+}
+
 // class def'ns
 class sioModem;   // declare here so can reference it, but define in modem.h
 class sioFuji;    // declare here so can reference it, but define in fuji.h
@@ -133,13 +146,22 @@ protected:
      */
     void sio_to_computer(uint8_t *buff, uint16_t len, bool err);
 
+    /**
+     * @brief Send the desired buffer to the Atari without copying it first. The status byte is
+     * written to buff[-1] and the checksum to buff[len], so both must be writable.
+     * @param buff The byte buffer to send to the Atari
+     * @param len The length of the buffer to send to the Atari.
+     * @param chk Checksum of buff if the caller already has it (see sio_checksum_add()), or -1
+     */
+    void sio_to_computer_inplace(uint8_t *buff, uint16_t len, bool err, int chk = -1);
+
     /**
      * @brief Receive data from the Atari.
      * @param buff The byte buffer provided for data from the Atari.
      * @param len The length of the amount of data to receive from the Atari.
-     * @return An 8-bit wrap-around checksum calculated by the Atari, which should be checked with sio_checksum()
+     * @return TRUE if the frame timed-out or its checksum didn't match, in which case it has already been NAKed
      */
-    uint8_t sio_to_peripheral(uint8_t *buff, uint16_t len);
+    bool sio_to_peripheral(uint8_t *buff, uint16_t len);
 
     /**
      * @brief Send an acknowledgement byte to the Atari 'A'
@@ -225,7 +247,8 @@ public:
 enum sio_message : uint16_t
 {
     SIOMSG_DISKSWAP,            // Rotate disk
-    SIOMSG_DEBUG_TAPE           // Tape debug msg
+    SIOMSG_DEBUG_TAPE,          // Tape debug msg
+    SIOMSG_DNS_PREFETCH         // Look up the configured host names
 };
 
 struct sio_message_t
@@ -256,14 +279,22 @@ private:
 
     bool useUltraHigh=false; // Use esp1541 derived clock.
 
+    // Given by the CMD line interrupt and wake(), taken by service() while it waits.
+    // A semaphore rather than a task notification, since code run from service() (like fnHttpClient) waits on those.
+    SemaphoreHandle_t _cmd_wake = nullptr;
+
     void _sio_process_cmd();
     void _sio_process_queue();
+    void _sio_wait_for_command();
+
+    static void _sio_cmd_isr(void *arg);
 
 public:
 
     void setup();
     void service();
     void shutdown();
+    void wake(); // Have service() run now instead of waiting for the next command frame
 
     int numDevices();
     void addDevice(sioDevice *pDevice, int device_id);
@@ -111,13 +111,13 @@ void sioVoice::sio_write()
 {
     // act like a printer for POC
     uint8_t n = 40;
-    uint8_t ck;
+    bool bad_frame;
 
     memset(sioBuffer, 0, n); // clear buffer
 
-    ck = sio_to_peripheral(sioBuffer, n);
+    bad_frame = sio_to_peripheral(sioBuffer, n);
 
-    if (ck == sio_checksum(sioBuffer, n))
+    if (!bad_frame)
     {
         // append sioBuffer onto lineBuffer until EOL is reached
         // move this logic to append \0 into sio_write
@@ -1,11 +1,93 @@
 #include <lwip/netdb.h>
+#include <string>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 
-#include "fnDNS.h"
 #include "../../include/debug.h"
+#include "../hardware/fnSystem.h"
+#include "../hardware/fnWiFi.h"
+#include "../config/fnConfig.h"
+#include "fnDNS.h"
 
+/*
+ gethostbyname() doesn't tell us the TTL the server gave, so successful answers are
+ kept for DNS_CACHE_TTL_MS. Failures are kept for a much shorter time, which saves
+ repeating the whole resolver timeout when a program retries a name that's down.
+ A lookup that fails while we don't have an IP address isn't remembered, since
+ it says nothing about the name.
+*/
+struct dnsCacheEntry
+{
+    char hostname[DNS_CACHE_NAME_LEN] = { '\0' };
+    in_addr_t address = IPADDR_NONE; // IPADDR_NONE for a negative entry
+    unsigned long expires_ms = 0;
+    unsigned long last_used_ms = 0;
+};
 
-// Return a single IP4 address given a hostname
-in_addr_t get_ip4_addr_by_name(const char *hostname)
+static dnsCacheEntry _dns_cache[DNS_CACHE_ENTRIES];
+static dnsCacheStats _dns_stats;
+static SemaphoreHandle_t _dns_mutex = nullptr;
+
+static void _dns_lock()
+{
+    if (_dns_mutex == nullptr)
+        _dns_mutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(_dns_mutex, portMAX_DELAY);
+}
+
+static void _dns_unlock()
+{
+    xSemaphoreGive(_dns_mutex);
+}
+
+// Returns the entry for hostname, or nullptr. Expired entries are cleared as we go.
+static dnsCacheEntry *_dns_cache_find(const char *hostname, unsigned long now)
+{
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        dnsCacheEntry &e = _dns_cache[i];
+        if (e.hostname[0] == '\0')
+            continue;
+        if ((long)(now - e.expires_ms) >= 0)
+        {
+            e.hostname[0] = '\0';
+            continue;
+        }
+        if (strcasecmp(e.hostname, hostname) == 0)
+            return &e;
+    }
+    return nullptr;
+}
+
+static void _dns_cache_store(const char *hostname, in_addr_t address, unsigned long now)
+{
+    dnsCacheEntry *slot = _dns_cache_find(hostname, now);
+
+    // Take an empty slot or the one used least recently
+    if (slot == nullptr)
+    {
+        for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+        {
+            if (_dns_cache[i].hostname[0] == '\0')
+            {
+                slot = &_dns_cache[i];
+                break;
+            }
+            if (slot == nullptr || (long)(_dns_cache[i].last_used_ms - slot->last_used_ms) < 0)
+                slot = &_dns_cache[i];
+        }
+    }
+
+    strlcpy(slot->hostname, hostname, sizeof(slot->hostname));
+    slot->address = address;
+    slot->expires_ms = now + (address == IPADDR_NONE ? DNS_CACHE_NEGATIVE_TTL_MS : DNS_CACHE_TTL_MS);
+    slot->last_used_ms = now;
+}
+
+// Ask the resolver
+static in_addr_t _dns_resolve(const char *hostname)
 {
     in_addr_t result = IPADDR_NONE;
 
@@ -31,4 +113,136 @@ in_addr_t get_ip4_addr_by_name(const char *hostname)
         }
     }
     return result;    
-}
\ No newline at end of file
+}
+
+// Return a single IP4 address given a hostname
+in_addr_t get_ip4_addr_by_name(const char *hostname)
+{
+    if (hostname == nullptr || hostname[0] == '\0')
+        return IPADDR_NONE;
+
+    // Nothing to look up if we were given an address
+    struct in_addr literal;
+    if (inet_aton(hostname, &literal) != 0)
+        return literal.s_addr;
+
+    // Too long to cache - just resolve it
+    if (strlen(hostname) >= DNS_CACHE_NAME_LEN)
+        return _dns_resolve(hostname);
+
+    unsigned long now = fnSystem.millis();
+
+    _dns_lock();
+    dnsCacheEntry *e = _dns_cache_find(hostname, now);
+    if (e != nullptr)
+    {
+        in_addr_t address = e->address;
+        e->last_used_ms = now;
+        if (address == IPADDR_NONE)
+            _dns_stats.negative_hits++;
+        else
+            _dns_stats.hits++;
+        _dns_unlock();
+        #ifdef DEBUG
+        Debug_printf("Resolved \"%s\" from cache: %s\n", hostname, address == IPADDR_NONE ? "not found" : inet_ntoa(address));
+        #endif
+        return address;
+    }
+    _dns_stats.misses++;
+    _dns_unlock();
+
+    // Don't hold the lock while we wait on the network
+    in_addr_t result = _dns_resolve(hostname);
+    unsigned long elapsed = fnSystem.millis() - now;
+
+    _dns_lock();
+    _dns_stats.resolve_ms += elapsed;
+    if (result != IPADDR_NONE || fnWiFi.connected())
+        _dns_cache_store(hostname, result, fnSystem.millis());
+    _dns_unlock();
+
+    #ifdef DEBUG
+    uint32_t lookups = _dns_stats.hits + _dns_stats.negative_hits + _dns_stats.misses;
+    Debug_printf("DNS lookup took %lu ms; cache answered %u of %u lookups\n", elapsed,
+                 _dns_stats.hits + _dns_stats.negative_hits, lookups);
+    #endif
+
+    return result;
+}
+
+void dns_cache_flush()
+{
+    _dns_lock();
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+        _dns_cache[i] = dnsCacheEntry();
+    _dns_unlock();
+}
+
+const dnsCacheStats &dns_cache_stats()
+{
+    return _dns_stats;
+}
+
+/*
+ Pulls the name to resolve out of a host slot: "tcp://host" for TNFS over TCP,
+ "http[s]://host[:port][/path]" for HTTP hosts, or just the name for TNFS.
+*/
+static std::string _dns_prefetch_name(std::string host)
+{
+    size_t scheme = host.find("://");
+    if (scheme != std::string::npos)
+        host = host.substr(scheme + 3);
+
+    size_t end = host.find_first_of(":/");
+    if (end != std::string::npos)
+        host = host.substr(0, end);
+
+    return host;
+}
+
+// param is a heap allocated list of names, which we free when we're done
+static void _dns_prefetch_task(void *param)
+{
+    std::vector<std::string> *names = (std::vector<std::string> *)param;
+
+    for (const std::string &name : *names)
+        get_ip4_addr_by_name(name.c_str());
+
+    delete names;
+    vTaskDelete(nullptr);
+}
+
+/*
+ Call this from the SIO task (see SIOMSG_DNS_PREFETCH), which is the one that changes
+ the host slots. The names are copied out of Config here so the prefetch task doesn't
+ read them while a later SIO command is changing them.
+*/
+void dns_cache_prefetch()
+{
+    std::vector<std::string> *names = new std::vector<std::string>;
+
+    for (int i = 0; i < MAX_HOST_SLOTS; i++)
+    {
+        if (Config.get_host_type(i) != fnConfig::host_types::HOSTTYPE_TNFS)
+            continue;
+        std::string name = _dns_prefetch_name(Config.get_host_name(i));
+        if (name.empty() == false)
+            names->push_back(name);
+    }
+
+    std::string midimaze = Config.get_network_midimaze_host();
+    if (midimaze.empty() == false)
+        names->push_back(midimaze);
+
+    if (names->empty())
+    {
+        delete names;
+        return;
+    }
+
+    if (xTaskCreate(_dns_prefetch_task, "dnsprefetch", DNS_PREFETCH_STACKSIZE, names, DNS_PREFETCH_PRIORITY, nullptr) != pdPASS)
+    {
+        Debug_println("Failed to start DNS prefetch task");
+        delete names;
+    }
+}
@@ -2,6 +2,32 @@
 #define _FN_DNS_
 #include <lwip/netdb.h>
 
+#define DNS_CACHE_ENTRIES 16
+#define DNS_CACHE_NAME_LEN 64 // Longer names aren't cached
+#define DNS_CACHE_TTL_MS (5 * 60 * 1000) // How long we trust a successful answer
+#define DNS_CACHE_NEGATIVE_TTL_MS (15 * 1000) // How long we remember that a name didn't resolve
+
+#define DNS_PREFETCH_STACKSIZE 3072
+#define DNS_PREFETCH_PRIORITY 1
+
+struct dnsCacheStats
+{
+    uint32_t hits = 0;
+    uint32_t negative_hits = 0; // Lookups answered by a remembered failure
+    uint32_t misses = 0;
+    uint32_t resolve_ms = 0; // Total time spent waiting on the resolver
+};
+
+// Return a single IP4 address given a hostname, using the cache if we can
 in_addr_t get_ip4_addr_by_name(const char *hostname);
 
-#endif // _FN_DNS_
\ No newline at end of file
+// Forget everything we've resolved (e.g. when we change networks)
+void dns_cache_flush();
+
+// Resolves the configured host slots and MIDIMaze host in the background so they're cached.
+// Only call this from the SIO task.
+void dns_cache_prefetch();
+
+const dnsCacheStats &dns_cache_stats();
+
+#endif // _FN_DNS_
@@ -37,6 +37,8 @@ class fnTcpServer
 
     void stop();
 
+    int fd() const { return _sockfd; }
+
     operator bool(){ return _listening; }
 };
 
@@ -2,13 +2,13 @@
 */
 #include <string.h>
 #include <lwip/netdb.h>
+#include <esp_heap_caps.h>
 
 #include "../../include/debug.h"
+#include "../hardware/fnSystem.h"
 #include "fnUDP.h"
 #include "fnDNS.h"
 
-#define UDP_RXTX_BUFLEN 1460
-
 fnUDP::fnUDP()
 {
 }
@@ -20,6 +20,20 @@ fnUDP::~fnUDP()
 
 void fnUDP::stop()
 {
+    _stop_queue_task();
+
+    if (_queue != nullptr)
+    {
+        if (_queue_stats.received > 0)
+            Debug_printf("fnUDP queue stats: received=%u, dropped=%u, max depth=%u, avg wait=%lluus, max wait=%uus\n",
+                         _queue_stats.received, _queue_stats.dropped, _queue_stats.max_depth,
+                         _queue_stats.total_wait_us / _queue_stats.received, _queue_stats.max_wait_us);
+        free(_queue);
+        _queue = nullptr;
+    }
+    _queue_head = _queue_tail = 0;
+    _queue_stats = fnUDPQueueStats();
+
     if (tx_buffer)
     {
         delete[] tx_buffer;
@@ -209,6 +223,25 @@ int fnUDP::parsePacket()
     if (rx_buffer)
         return 0;
 
+    // Take the next one from the queue if the receive task is running
+    if (_queue != nullptr)
+    {
+        fnUDPDatagram *d = front();
+        if (d == nullptr)
+            return 0;
+
+        int len = d->len;
+        remote_ip = d->ip;
+        remote_port = d->port;
+        if (len > 0)
+        {
+            rx_buffer = new cbuf(len);
+            rx_buffer->write((const char *)d->data, len);
+        }
+        pop();
+        return len;
+    }
+
     struct sockaddr_in si_other;
     int slen = sizeof(si_other);
     int len;
@@ -318,3 +351,160 @@ uint16_t fnUDP::remotePort()
 {
     return remote_port;
 }
+
+bool fnUDP::sendPacket(in_addr_t ip, uint16_t port, const uint8_t *buffer, size_t len)
+{
+    if (udp_server == -1)
+    {
+        if ((udp_server = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1)
+        {
+            Debug_printf("could not create socket: %d", errno);
+            return false;
+        }
+        fcntl(udp_server, F_SETFL, O_NONBLOCK);
+    }
+
+    struct sockaddr_in recipient;
+    recipient.sin_addr.s_addr = ip;
+    recipient.sin_family = AF_INET;
+    recipient.sin_port = htons(port);
+
+    if (sendto(udp_server, buffer, len, 0, (struct sockaddr *)&recipient, sizeof(recipient)) < 0)
+    {
+        Debug_printf("could not send data: %d", errno);
+        return false;
+    }
+    return true;
+}
+
+/*
+ Receives datagrams into the queue as soon as they arrive so they aren't left to
+ overflow the socket while the SIO task is busy. When the queue's full, new datagrams
+ are read and dropped, since only the owner may move the tail.
+*/
+void fnUDP::_queue_task_loop(void *param)
+{
+    fnUDP *udp = (fnUDP *)param;
+
+    while (udp->_stop_queue == false)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(udp->udp_server, &readfds);
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = UDP_QUEUE_POLL_MS * 1000;
+
+        if (select(udp->udp_server + 1, &readfds, nullptr, nullptr, &tv) <= 0)
+            continue;
+
+        // Take everything that's waiting
+        while (udp->_stop_queue == false)
+        {
+            uint16_t head = udp->_queue_head;
+            uint16_t next = (head + 1) % UDP_QUEUE_SLOTS;
+
+            struct sockaddr_in si_other;
+            socklen_t slen = sizeof(si_other);
+
+            if (next == udp->_queue_tail)
+            {
+                uint8_t discard;
+                if (recvfrom(udp->udp_server, &discard, sizeof(discard), MSG_DONTWAIT, (struct sockaddr *)&si_other, &slen) < 0)
+                    break;
+                udp->_queue_stats.dropped++;
+                continue;
+            }
+
+            fnUDPDatagram &d = udp->_queue[head];
+            int len = recvfrom(udp->udp_server, d.data, UDP_RXTX_BUFLEN, MSG_DONTWAIT, (struct sockaddr *)&si_other, &slen);
+            if (len < 0)
+                break;
+
+            d.len = len;
+            d.ip = si_other.sin_addr.s_addr;
+            d.port = ntohs(si_other.sin_port);
+            d.arrived_us = fnSystem.micros();
+            udp->_queue_head = next;
+
+            udp->_queue_stats.received++;
+            uint32_t depth = (next + UDP_QUEUE_SLOTS - udp->_queue_tail) % UDP_QUEUE_SLOTS;
+            if (depth > udp->_queue_stats.max_depth)
+                udp->_queue_stats.max_depth = depth;
+        }
+    }
+
+    udp->_queue_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+void fnUDP::_stop_queue_task()
+{
+    if (_queue_task == nullptr)
+        return;
+
+    _stop_queue = true;
+    while (_queue_task != nullptr)
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    _stop_queue = false;
+}
+
+bool fnUDP::startQueue()
+{
+    if (udp_server == -1)
+        return false;
+    if (_queue_task != nullptr)
+        return true;
+
+    if (_queue == nullptr)
+    {
+        _queue = (fnUDPDatagram *)heap_caps_malloc(UDP_QUEUE_SLOTS * sizeof(fnUDPDatagram), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (_queue == nullptr)
+        {
+            Debug_println("fnUDP couldn't allocate receive queue");
+            return false;
+        }
+    }
+    _queue_head = _queue_tail = 0;
+
+    if (xTaskCreate(_queue_task_loop, "udpqueue", UDP_QUEUE_TASK_STACKSIZE, this, UDP_QUEUE_TASK_PRIORITY, &_queue_task) != pdPASS)
+    {
+        Debug_println("fnUDP couldn't start receive task");
+        free(_queue);
+        _queue = nullptr;
+        _queue_task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Number of datagrams waiting in the queue
+int fnUDP::queued()
+{
+    if (_queue == nullptr)
+        return 0;
+    return (_queue_head + UDP_QUEUE_SLOTS - _queue_tail) % UDP_QUEUE_SLOTS;
+}
+
+// Oldest datagram in the queue, or nullptr if there isn't one. It stays valid until pop().
+fnUDPDatagram *fnUDP::front()
+{
+    if (_queue == nullptr || _queue_head == _queue_tail)
+        return nullptr;
+    return &_queue[_queue_tail];
+}
+
+// Frees the slot of the oldest datagram in the queue for the receive task to use again
+void fnUDP::pop()
+{
+    if (_queue == nullptr || _queue_head == _queue_tail)
+        return;
+
+    uint32_t wait = fnSystem.micros() - _queue[_queue_tail].arrived_us;
+    _queue_stats.total_wait_us += wait;
+    if (wait > _queue_stats.max_wait_us)
+        _queue_stats.max_wait_us = wait;
+
+    _queue_tail = (_queue_tail + 1) % UDP_QUEUE_SLOTS;
+}
@@ -4,8 +4,37 @@
 #define _FN_UDP_
 #include <lwip/netdb.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
 #include "../utils/cbuf.h"
 
+#define UDP_RXTX_BUFLEN 1460
+
+#define UDP_QUEUE_SLOTS 16 // Datagrams the receive task can hold before it has to drop them
+#define UDP_QUEUE_POLL_MS 50 // Longest the receive task blocks before checking whether it should stop
+#define UDP_QUEUE_TASK_STACKSIZE 3072
+#define UDP_QUEUE_TASK_PRIORITY 5
+
+// A received datagram waiting in the queue
+struct fnUDPDatagram
+{
+    uint16_t len;
+    uint16_t port;
+    in_addr_t ip;
+    unsigned long arrived_us; // fnSystem.micros() when the receive task got it
+    uint8_t data[UDP_RXTX_BUFLEN];
+};
+
+struct fnUDPQueueStats
+{
+    uint32_t received = 0;
+    uint32_t dropped = 0; // Arrived while the queue was full
+    uint32_t max_depth = 0;
+    uint64_t total_wait_us = 0; // Time datagrams sat in the queue before being taken
+    uint32_t max_wait_us = 0;
+};
+
 class fnUDP
 {
 private:
@@ -18,6 +47,17 @@ private:
     size_t tx_buffer_len = 0;
     cbuf * rx_buffer = nullptr;
 
+    // Receive queue, filled by _queue_task and emptied by whoever owns us
+    fnUDPDatagram *_queue = nullptr;
+    volatile uint16_t _queue_head = 0; // Next slot the task fills
+    volatile uint16_t _queue_tail = 0; // Next slot to be taken
+    TaskHandle_t _queue_task = nullptr;
+    volatile bool _stop_queue = false;
+    fnUDPQueueStats _queue_stats;
+
+    static void _queue_task_loop(void *param);
+    void _stop_queue_task();
+
 public:
     fnUDP();
     ~fnUDP();
@@ -51,6 +91,20 @@ public:
 
     in_addr_t remoteIP();
     uint16_t remotePort();
+
+    // Sends one datagram straight from the given buffer, without going through beginPacket/write/endPacket
+    bool sendPacket(in_addr_t ip, uint16_t port, const uint8_t *buffer, size_t len);
+
+    /*
+     Starts a task that drains the socket into a ring of UDP_QUEUE_SLOTS datagrams as they arrive.
+     Call after begin(). parsePacket() then takes datagrams from the queue, or use
+     queued()/front()/pop() to work on them in place.
+    */
+    bool startQueue();
+    int queued();
+    fnUDPDatagram *front();
+    void pop();
+    const fnUDPQueueStats &queueStats() { return _queue_stats; };
 };
 
 #endif //_FN_UDP_
@@ -0,0 +1,352 @@
+#include <string.h>
+#include <esp_heap_caps.h>
+
+#include "deflate.h"
+
+#define DEFLATE_NIL 0xFFFF // Marks the end of a hash chain
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552 // Most bytes we can sum before the 32-bit sums could overflow
+
+static uint32_t _crc_table[4][256];
+static bool _crc_table_ready = false;
+
+// Slice-by-4 tables: _crc_table[k][i] is the CRC of byte i followed by k zero bytes
+static void _crc_make_tables()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        _crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 4; k++)
+            _crc_table[k][i] = (_crc_table[k - 1][i] >> 8) ^ _crc_table[0][_crc_table[k - 1][i] & 0xFF];
+
+    _crc_table_ready = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (_crc_table_ready == false)
+        _crc_make_tables();
+
+    crc = ~crc;
+
+    // Four bytes at a time (the ESP32 is little-endian, like the tables)
+    while (len >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, buf, 4);
+        crc ^= word;
+        crc = _crc_table[3][crc & 0xFF] ^ _crc_table[2][(crc >> 8) & 0xFF] ^
+              _crc_table[1][(crc >> 16) & 0xFF] ^ _crc_table[0][crc >> 24];
+        buf += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *buf, size_t len)
+{
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+
+    // Only take the modulus once per ADLER_NMAX bytes
+    while (len > 0)
+    {
+        size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+        len -= n;
+        while (n--)
+        {
+            s1 += *buf++;
+            s2 += s1;
+        }
+        s1 %= ADLER_MOD;
+        s2 %= ADLER_MOD;
+    }
+
+    return (s2 << 16) | s1;
+}
+
+// Length codes 257-285: smallest length each covers and how many extra bits follow
+static const uint16_t _length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t _length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+// Distance codes 0-29
+static const uint16_t _dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t _dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+bool deflateStream::begin(output_fn output, void *context)
+{
+    end();
+
+    _window = (uint8_t *)heap_caps_malloc(2 * DEFLATE_WINDOW_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _prev = (uint16_t *)heap_caps_malloc(2 * DEFLATE_WINDOW_SIZE * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _head = (uint16_t *)heap_caps_malloc(DEFLATE_HASH_SIZE * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _out = (uint8_t *)heap_caps_malloc(DEFLATE_OUT_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_window == nullptr || _prev == nullptr || _head == nullptr || _out == nullptr)
+    {
+        end();
+        return false;
+    }
+
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++)
+        _head[i] = DEFLATE_NIL;
+
+    _output = output;
+    _context = context;
+    _win_len = _win_pos = 0;
+    _out_len = 0;
+    _bits = 0;
+    _bitcount = 0;
+    _adler = 1;
+    _bytes_in = _bytes_out = 0;
+
+    // zlib header: deflate with a 32K window, no dictionary, check bits making it a multiple of 31
+    _put_bits(0x78, 8);
+    _put_bits(0x01, 8);
+
+    // We only ever write one fixed Huffman block until finish()
+    _put_bits(0, 1); // Not the final block
+    _put_bits(1, 2); // Fixed Huffman codes
+
+    return true;
+}
+
+void deflateStream::end()
+{
+    free(_window);
+    free(_prev);
+    free(_head);
+    free(_out);
+    _window = _out = nullptr;
+    _prev = _head = nullptr;
+    _output = nullptr;
+}
+
+void deflateStream::write(const uint8_t *data, size_t len)
+{
+    if (_window == nullptr)
+        return;
+
+    _adler = adler32_update(_adler, data, len);
+    _bytes_in += len;
+
+    while (len > 0)
+    {
+        if (_win_len == 2 * DEFLATE_WINDOW_SIZE)
+        {
+            _compress(false);
+            _slide();
+        }
+
+        size_t n = 2 * DEFLATE_WINDOW_SIZE - _win_len;
+        if (n > len)
+            n = len;
+        memcpy(_window + _win_len, data, n);
+        _win_len += n;
+        data += n;
+        len -= n;
+    }
+
+    _compress(false);
+}
+
+void deflateStream::finish()
+{
+    if (_window == nullptr)
+        return;
+
+    _compress(true);
+
+    _put_symbol(256); // End of block
+    // An empty final block to end the stream
+    _put_bits(1, 1);
+    _put_bits(1, 2);
+    _put_symbol(256);
+    // Pad to a byte boundary
+    if (_bitcount > 0)
+        _put_bits(0, 8 - _bitcount);
+
+    uint8_t check[4] = {(uint8_t)(_adler >> 24), (uint8_t)(_adler >> 16), (uint8_t)(_adler >> 8), (uint8_t)_adler};
+    for (int i = 0; i < 4; i++)
+        _put_bits(check[i], 8);
+
+    _flush_out();
+}
+
+// Adds bits to the output, least significant first
+void deflateStream::_put_bits(uint32_t bits, int count)
+{
+    _bits |= bits << _bitcount;
+    _bitcount += count;
+    while (_bitcount >= 8)
+    {
+        _out[_out_len++] = _bits & 0xFF;
+        if (_out_len == DEFLATE_OUT_BUFFER_SIZE)
+            _flush_out();
+        _bits >>= 8;
+        _bitcount -= 8;
+    }
+}
+
+// Huffman codes go out most significant bit first
+void deflateStream::_put_huffman(uint16_t code, int len)
+{
+    uint16_t reversed = 0;
+    for (int i = 0; i < len; i++)
+    {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    _put_bits(reversed, len);
+}
+
+// Writes a literal/length symbol using the fixed Huffman code
+void deflateStream::_put_symbol(uint16_t symbol)
+{
+    if (symbol < 144)
+        _put_huffman(0x30 + symbol, 8);
+    else if (symbol < 256)
+        _put_huffman(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        _put_huffman(symbol - 256, 7);
+    else
+        _put_huffman(0xC0 + symbol - 280, 8);
+}
+
+void deflateStream::_put_match(int len, int dist)
+{
+    int code = 28;
+    while (_length_base[code] > len)
+        code--;
+    _put_symbol(257 + code);
+    if (_length_extra[code] > 0)
+        _put_bits(len - _length_base[code], _length_extra[code]);
+
+    code = 29;
+    while (_dist_base[code] > dist)
+        code--;
+    _put_huffman(code, 5);
+    if (_dist_extra[code] > 0)
+        _put_bits(dist - _dist_base[code], _dist_extra[code]);
+}
+
+void deflateStream::_flush_out()
+{
+    if (_out_len == 0)
+        return;
+    if (_output != nullptr)
+        _output(_context, _out, _out_len);
+    _bytes_out += _out_len;
+    _out_len = 0;
+}
+
+// Adds the DEFLATE_MIN_MATCH bytes starting at pos to the hash chains
+void deflateStream::_insert(uint32_t pos)
+{
+    uint32_t h = ((_window[pos] << 16) | (_window[pos + 1] << 8) | _window[pos + 2]) * 2654435761u;
+    h >>= 32 - DEFLATE_HASH_BITS;
+    _prev[pos] = _head[h];
+    _head[h] = pos;
+}
+
+// Returns the length of the longest match for the bytes at pos (0 if none worth using) and sets dist
+int deflateStream::_longest_match(uint32_t pos, int *dist)
+{
+    uint32_t avail = _win_len - pos;
+    if (avail < DEFLATE_MIN_MATCH)
+        return 0;
+    int max_len = avail < DEFLATE_MAX_MATCH ? avail : DEFLATE_MAX_MATCH;
+
+    uint32_t h = ((_window[pos] << 16) | (_window[pos + 1] << 8) | _window[pos + 2]) * 2654435761u;
+    h >>= 32 - DEFLATE_HASH_BITS;
+
+    int best = 0;
+    const uint8_t *cur = _window + pos;
+    uint16_t cand = _head[h];
+    for (int chain = 0; chain < DEFLATE_MAX_CHAIN && cand != DEFLATE_NIL; chain++)
+    {
+        if (pos - cand > DEFLATE_WINDOW_SIZE)
+            break;
+
+        const uint8_t *prev = _window + cand;
+        // Can't beat what we have unless the byte at the current best length matches
+        if (prev[best] == cur[best])
+        {
+            int len = 0;
+            while (len < max_len && prev[len] == cur[len])
+                len++;
+            if (len > best)
+            {
+                best = len;
+                *dist = pos - cand;
+                if (len == max_len)
+                    break;
+            }
+        }
+        cand = _prev[cand];
+    }
+
+    return best >= DEFLATE_MIN_MATCH ? best : 0;
+}
+
+/*
+ Encodes what's in the window, stopping DEFLATE_MAX_MATCH bytes short of the end
+ unless this is the final call, so every match gets to see all the data it could use.
+*/
+void deflateStream::_compress(bool final)
+{
+    uint32_t limit = final ? _win_len : (_win_len > DEFLATE_MAX_MATCH ? _win_len - DEFLATE_MAX_MATCH : 0);
+
+    while (_win_pos < limit)
+    {
+        int dist = 0;
+        int len = _longest_match(_win_pos, &dist);
+
+        if (len == 0)
+        {
+            _put_symbol(_window[_win_pos]);
+            if (_win_pos + DEFLATE_MIN_MATCH <= _win_len)
+                _insert(_win_pos);
+            _win_pos++;
+            continue;
+        }
+
+        _put_match(len, dist);
+        for (int i = 0; i < len; i++, _win_pos++)
+            if (_win_pos + DEFLATE_MIN_MATCH <= _win_len)
+                _insert(_win_pos);
+    }
+}
+
+// Moves the newer half of the window down to make room for more data
+void deflateStream::_slide()
+{
+    memmove(_window, _window + DEFLATE_WINDOW_SIZE, DEFLATE_WINDOW_SIZE);
+    _win_len -= DEFLATE_WINDOW_SIZE;
+    _win_pos -= DEFLATE_WINDOW_SIZE;
+
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++)
+        _head[i] = (_head[i] != DEFLATE_NIL && _head[i] >= DEFLATE_WINDOW_SIZE) ? _head[i] - DEFLATE_WINDOW_SIZE : DEFLATE_NIL;
+
+    for (int i = 0; i < DEFLATE_WINDOW_SIZE; i++)
+    {
+        uint16_t p = _prev[i + DEFLATE_WINDOW_SIZE];
+        _prev[i] = (p != DEFLATE_NIL && p >= DEFLATE_WINDOW_SIZE) ? p - DEFLATE_WINDOW_SIZE : DEFLATE_NIL;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef _FN_DEFLATE_H
+#define _FN_DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFLATE_WINDOW_SIZE 8192 // How far back a match may reach (window positions are 16 bits, so 16384 at most)
+#define DEFLATE_HASH_BITS 12
+#define DEFLATE_MAX_CHAIN 32 // Most earlier positions tried when looking for a match
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_OUT_BUFFER_SIZE 8192 // Compressed bytes collected before being handed to the output function
+
+// CRC-32 (as used by PNG and zip) of a whole buffer, continuing from a previous value (start with 0)
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
+// Adler-32 (as used by zlib) of a whole buffer, continuing from a previous value (start with 1)
+uint32_t adler32_update(uint32_t adler, const uint8_t *buf, size_t len);
+
+/*
+ Streaming zlib (RFC 1950) compressor using LZ77 over a DEFLATE_WINDOW_SIZE window
+ and DEFLATE's fixed Huffman codes. Data can be written in pieces of any size; the
+ compressed stream is handed to the output function in blocks of up to
+ DEFLATE_OUT_BUFFER_SIZE bytes. The window and hash tables are allocated in PSRAM
+ between begin() and end().
+*/
+class deflateStream
+{
+public:
+    typedef void (*output_fn)(void *context, const uint8_t *data, size_t len);
+
+    ~deflateStream() { end(); };
+
+    // Returns false if we couldn't allocate our buffers
+    bool begin(output_fn output, void *context);
+    void write(const uint8_t *data, size_t len);
+    // Compresses whatever's left and ends the stream
+    void finish();
+    // Frees our buffers
+    void end();
+
+    uint32_t bytes_in() { return _bytes_in; };
+    uint32_t bytes_out() { return _bytes_out; };
+
+private:
+    output_fn _output = nullptr;
+    void *_context = nullptr;
+
+    uint8_t *_window = nullptr; // 2 * DEFLATE_WINDOW_SIZE so there's always a full window behind what we're encoding
+    uint16_t *_head = nullptr; // Latest window position for each hash
+    uint16_t *_prev = nullptr; // Previous position with the same hash, for each window position
+    uint32_t _win_len = 0; // Bytes in the window
+    uint32_t _win_pos = 0; // Next window position to encode
+
+    uint8_t *_out = nullptr;
+    size_t _out_len = 0;
+    uint32_t _bits = 0;
+    int _bitcount = 0;
+
+    uint32_t _adler = 1;
+    uint32_t _bytes_in = 0;
+    uint32_t _bytes_out = 0;
+
+    void _put_bits(uint32_t bits, int count);
+    void _put_huffman(uint16_t code, int len);
+    void _put_symbol(uint16_t symbol);
+    void _put_match(int len, int dist);
+    void _flush_out();
+
+    void _insert(uint32_t pos);
+    int _longest_match(uint32_t pos, int *dist);
+    void _compress(bool final);
+    void _slide();
+};
+
+#endif // _FN_DEFLATE_H
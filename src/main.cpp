@@ -126,8 +126,8 @@ void fn_service_loop(void *param)
 {
     while (true)
     {
-        // We don't have any delays in this loop, so IDLE threads will be starved
-        // Shouldn't be a problem, but something to keep in mind...
+        // SIO.service() blocks while the bus is idle (until CMD is asserted or SIO.wake() is called),
+        // but the modem, cassette, MIDIMaze and BT modes still poll without delay
         // Go service BT if it's active
     #ifdef BLUETOOTH_SUPPORT
         if (fnBtManager.isActive())